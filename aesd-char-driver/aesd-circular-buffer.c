@@ -10,9 +10,13 @@
 
 #ifdef __KERNEL__
 #include <linux/string.h>
+#include <linux/errno.h>
+#include <linux/slab.h>
 #else
 #include <string.h>
 #include <stdio.h>
+#include <stdlib.h>
+#include <errno.h>
 #endif
 
 #include "aesd-circular-buffer.h"
@@ -30,31 +34,66 @@
 struct aesd_buffer_entry *aesd_circular_buffer_find_entry_offset_for_fpos(struct aesd_circular_buffer *buffer,
             size_t char_offset, size_t *entry_offset_byte_rtn )
 {
-	size_t current_offset = 0;
-	size_t i = buffer->out_offs;
-	size_t count =0;
+	size_t base;
+	uint32_t lo = 0, hi = buffer->count;
+	uint32_t i;
 
-	/* Check if the buffer is empty */
-	if ( buffer->in_offs == buffer->out_offs && buffer->full != true) {
-		return NULL; 	/* Buffer is empty */
+	/* Check if the buffer is empty or char_offset is past the end */
+	if ( buffer->count == 0 || char_offset >= aesd_circular_buffer_size(buffer) ) {
+		return NULL;
 	}
 
-	/* Search for Matching Entry */
+	/*
+	 * Search for the last entry starting at or before char_offset, counting entries from
+	 * the oldest one.  Offsets relative to the oldest entry stay right even after the
+	 * cumulative offsets wrap around.  A scan of the few offsets of a small buffer beats
+	 * the branches of a binary search
+	 */
+	base = buffer->start[buffer->out_offs];
+	if ( hi <= AESD_CIRCULAR_BUFFER_DEFAULT_SLOTS ) {
+		while ( lo + 1 < hi && buffer->start[(buffer->out_offs + lo + 1) & buffer->mask] - base <= char_offset ) {
+			lo++;
+		}
+		hi = lo + 1;
+	}
+	while ( hi - lo > 1 ) {
+		uint32_t mid = lo + (hi - lo) / 2;
 
-	while ( count < AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED && (i != buffer->in_offs || buffer->full)) {
-		if ( char_offset >= current_offset && char_offset < current_offset + buffer->entry[i].size) {
-			/* Found Matching Entry */
-			if ( entry_offset_byte_rtn != NULL ) {
-				*entry_offset_byte_rtn = char_offset - current_offset;
-			}
-			return &buffer->entry[i];
+		if ( buffer->start[(buffer->out_offs + mid) & buffer->mask] - base <= char_offset ) {
+			lo = mid;
+		} else {
+			hi = mid;
 		}
+	}
 
-		current_offset += buffer->entry[i].size;
-		i = (i + 1) % AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED;
-		count++;
+	/* Found Matching Entry */
+	i = (buffer->out_offs + lo) & buffer->mask;
+	if ( entry_offset_byte_rtn != NULL ) {
+		*entry_offset_byte_rtn = char_offset - (buffer->start[i] - base);
 	}
-	return NULL; /* if no match found */
+	return &buffer->entry[i];
+}
+
+/**
+ * @param buffer the buffer to index.  Any necessary locking must be performed by caller.
+ * @param index the zero referenced entry to return, 0 being the oldest entry held
+ * @param char_offset_rtn is a pointer specifying a location to store the char_offset, as used by
+ *      aesd_circular_buffer_find_entry_offset_for_fpos(), of the first byte of the returned entry.
+ *      This value is only set when index is in the buffer.
+ * @return the struct aesd_buffer_entry structure at index, or NULL if fewer entries are held
+ */
+struct aesd_buffer_entry *aesd_circular_buffer_entry_at(struct aesd_circular_buffer *buffer,
+            uint32_t index, size_t *char_offset_rtn)
+{
+	uint32_t i = (buffer->out_offs + index) & buffer->mask;
+
+	if ( index >= buffer->count ) {
+		return NULL;
+	}
+	if ( char_offset_rtn != NULL ) {
+		*char_offset_rtn = buffer->start[i] - buffer->start[buffer->out_offs];
+	}
+	return &buffer->entry[i];
 }
 
 /**
@@ -69,26 +108,115 @@ void aesd_circular_buffer_add_entry(struct aesd_circular_buffer *buffer, const s
 {
 	/* Overwrite the entry at the in_offs */
 	buffer->entry[buffer->in_offs] =  *add_entry;
+	buffer->start[buffer->in_offs] = buffer->next_start;
+	buffer->next_start += add_entry->size;
 
 	/* Advance in_offs */
-	buffer->in_offs = (buffer->in_offs + 1) % AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED;
+	buffer->in_offs = (buffer->in_offs + 1) & buffer->mask;
 
 	/* If the buffer is full, advance out_offs to overwrite the oldest entry */
 	if (buffer->full ) {
-		buffer->out_offs = (buffer->out_offs + 1) % AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED;
+		buffer->out_offs = (buffer->out_offs + 1) & buffer->mask;
+	} else {
+		buffer->count++;
 	}
 
-	/* set the full flag if in_offs catches up with the out_offs */
-	if( buffer->in_offs == buffer->out_offs ) {
+	/* set the full flag once capacity entries are stored */
+	if( buffer->count == buffer->capacity ) {
 		buffer->full = true;
 	}
 
 }
 
 /**
-* Initializes the circular buffer described by @param buffer to an empty struct
+* Removes the oldest entry from @param buffer, advancing buffer->out_offs.
+* Any necessary locking must be handled by the caller
+* @return the removed entry so the caller can release the memory it references, or NULL
+* if the buffer is empty.  The returned entry stays valid until the next add.
+*/
+struct aesd_buffer_entry *aesd_circular_buffer_remove_entry(struct aesd_circular_buffer *buffer)
+{
+	struct aesd_buffer_entry *entry;
+
+	/* Check if the buffer is empty */
+	if ( buffer->count == 0 ) {
+		return NULL;
+	}
+
+	entry = &buffer->entry[buffer->out_offs];
+	buffer->out_offs = (buffer->out_offs + 1) & buffer->mask;
+	buffer->count--;
+	buffer->full = false;
+
+	return entry;
+}
+
+/**
+* Initializes the circular buffer described by @param buffer to an empty struct holding
+* AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED entries, without allocating
 */
 void aesd_circular_buffer_init(struct aesd_circular_buffer *buffer)
 {
     memset(buffer,0,sizeof(struct aesd_circular_buffer));
+    buffer->entry = buffer->default_entry;
+    buffer->start = buffer->default_start;
+    buffer->capacity = AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED;
+    buffer->mask = AESD_CIRCULAR_BUFFER_DEFAULT_SLOTS - 1;
+}
+
+/**
+* Initializes the circular buffer described by @param buffer to an empty struct holding
+* up to @param capacity entries.  The entry array is allocated when capacity does not fit
+* the embedded default slots and must be released with aesd_circular_buffer_destroy().
+* @return 0, -EINVAL if capacity is 0 or above AESD_CIRCULAR_BUFFER_MAX_CAPACITY,
+* or -ENOMEM
+*/
+int aesd_circular_buffer_init_capacity(struct aesd_circular_buffer *buffer, uint32_t capacity)
+{
+    uint32_t slots = 1;
+
+    if ( capacity == 0 || capacity > AESD_CIRCULAR_BUFFER_MAX_CAPACITY ) {
+        return -EINVAL;
+    }
+    aesd_circular_buffer_init(buffer);
+    buffer->capacity = capacity;
+    if ( capacity <= AESD_CIRCULAR_BUFFER_DEFAULT_SLOTS ) {
+        return 0;
+    }
+
+    /* Round up to a power of two so wraparound is a mask */
+    while ( slots < capacity ) {
+        slots <<= 1;
+    }
+#ifdef __KERNEL__
+    buffer->entry = kvcalloc(slots, sizeof(struct aesd_buffer_entry), GFP_KERNEL);
+    buffer->start = kvcalloc(slots, sizeof(size_t), GFP_KERNEL);
+#else
+    buffer->entry = calloc(slots, sizeof(struct aesd_buffer_entry));
+    buffer->start = calloc(slots, sizeof(size_t));
+#endif
+    if ( !buffer->entry || !buffer->start ) {
+        aesd_circular_buffer_destroy(buffer);
+        return -ENOMEM;
+    }
+    buffer->mask = slots - 1;
+    return 0;
+}
+
+/**
+* Releases the entry array of @param buffer, not the memory the entries reference, and
+* leaves it an empty buffer of the default capacity
+*/
+void aesd_circular_buffer_destroy(struct aesd_circular_buffer *buffer)
+{
+    if ( buffer->entry != buffer->default_entry ) {
+#ifdef __KERNEL__
+        kvfree(buffer->entry);
+        kvfree(buffer->start);
+#else
+        free(buffer->entry);
+        free(buffer->start);
+#endif
+    }
+    aesd_circular_buffer_init(buffer);
 }
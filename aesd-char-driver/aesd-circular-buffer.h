@@ -16,7 +16,20 @@
 #include <stdbool.h>
 #endif
 
+/**
+ * Default capacity, used by aesd_circular_buffer_init() and by the driver
+ * unless the capacity module parameter says otherwise
+ */
 #define AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED 10
+/**
+ * Slots embedded in struct aesd_circular_buffer for the default capacity:
+ * the slot count is always a power of two so positions wrap with a mask
+ */
+#define AESD_CIRCULAR_BUFFER_DEFAULT_SLOTS 16
+/**
+ * Largest capacity aesd_circular_buffer_init_capacity() accepts
+ */
+#define AESD_CIRCULAR_BUFFER_MAX_CAPACITY (1u << 24)
 
 struct aesd_buffer_entry
 {
@@ -33,22 +46,54 @@ struct aesd_buffer_entry
 struct aesd_circular_buffer
 {
     /**
-     * An array of pointers to memory allocated for the most recent write operations
+     * An array of pointers to memory allocated for the most recent write operations,
+     * mask + 1 slots long.  Points at default_entry unless allocated by
+     * aesd_circular_buffer_init_capacity()
+     */
+    struct aesd_buffer_entry *entry;
+    /**
+     * Cumulative offset of the entry in the same slot of entry: the number of bytes added
+     * to the buffer before it, since init.  Kept in its own array so that the binary search
+     * in aesd_circular_buffer_find_entry_offset_for_fpos() only touches offsets.  Offsets are
+     * made relative by subtracting the offset of the oldest entry, so evicting never
+     * rewrites them
+     */
+    size_t *start;
+    /**
+     * Cumulative offset the next added entry will start at
+     */
+    size_t next_start;
+    /**
+     * The number of entries kept before the oldest one is overwritten
+     */
+    uint32_t capacity;
+    /**
+     * The number of slots in entry minus one, slots are a power of two >= capacity
      */
-    struct aesd_buffer_entry  entry[AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED];
+    uint32_t mask;
     /**
      * The current location in the entry structure where the next write should
-     * be stored.
+     * be stored, masked with mask.
+     */
+    uint32_t in_offs;
+    /**
+     * The first location in the entry structure to read from, masked with mask
      */
-    uint8_t in_offs;
+    uint32_t out_offs;
     /**
-     * The first location in the entry structure to read from
+     * Number of entries currently stored
      */
-    uint8_t out_offs;
+    uint32_t count;
     /**
-     * set to true when the buffer entry structure is full
+     * set to true when the buffer holds capacity entries
      */
     bool full;
+    /**
+     * Storage for the default capacity, so that aesd_circular_buffer_init()
+     * never allocates
+     */
+    struct aesd_buffer_entry default_entry[AESD_CIRCULAR_BUFFER_DEFAULT_SLOTS];
+    size_t default_start[AESD_CIRCULAR_BUFFER_DEFAULT_SLOTS];
 };
 
 extern struct aesd_buffer_entry *aesd_circular_buffer_find_entry_offset_for_fpos(struct aesd_circular_buffer *buffer,
@@ -56,16 +101,34 @@ extern struct aesd_buffer_entry *aesd_circular_buffer_find_entry_offset_for_fpos
 
 extern void aesd_circular_buffer_add_entry(struct aesd_circular_buffer *buffer, const struct aesd_buffer_entry *add_entry);
 
+extern struct aesd_buffer_entry *aesd_circular_buffer_remove_entry(struct aesd_circular_buffer *buffer);
+
 extern void aesd_circular_buffer_init(struct aesd_circular_buffer *buffer);
 
+extern int aesd_circular_buffer_init_capacity(struct aesd_circular_buffer *buffer, uint32_t capacity);
+
+extern void aesd_circular_buffer_destroy(struct aesd_circular_buffer *buffer);
+
+extern struct aesd_buffer_entry *aesd_circular_buffer_entry_at(struct aesd_circular_buffer *buffer,
+            uint32_t index, size_t *char_offset_rtn);
+
+/**
+ * @return the number of bytes held by @param buffer, all entry sizes added together
+ */
+static inline size_t aesd_circular_buffer_size(const struct aesd_circular_buffer *buffer)
+{
+    return buffer->count ? buffer->next_start - buffer->start[buffer->out_offs] : 0;
+}
+
 /**
  * Create a for loop to iterate over each member of the circular buffer.
  * Useful when you've allocated memory for circular buffer entries and need to free it
  * @param entryptr is a struct aesd_buffer_entry* to set with the current entry
  * @param buffer is the struct aesd_buffer * describing the buffer
- * @param index is a uint8_t stack allocated value used by this macro for an index
+ * @param index is a uint32_t stack allocated value used by this macro for an index
+ * Slots that never held an entry have a NULL buffptr.
  * Example usage:
- * uint8_t index;
+ * uint32_t index;
  * struct aesd_circular_buffer buffer;
  * struct aesd_buffer_entry *entry;
  * AESD_CIRCULAR_BUFFER_FOREACH(entry,&buffer,index) {
@@ -74,7 +137,7 @@ extern void aesd_circular_buffer_init(struct aesd_circular_buffer *buffer);
  */
 #define AESD_CIRCULAR_BUFFER_FOREACH(entryptr,buffer,index) \
     for(index=0, entryptr=&((buffer)->entry[index]); \
-            index<AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED; \
+            index<=(buffer)->mask; \
             index++, entryptr=&((buffer)->entry[index]))
 
 
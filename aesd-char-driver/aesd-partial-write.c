@@ -0,0 +1,165 @@
+/**
+ * @file aesd-partial-write.c
+ * @brief Chunk list accumulating a command until its newline is written
+ *
+ * Appending fills the last chunk and links new ones as needed, so a command
+ * written in n pieces costs O(n) copying in total rather than the O(n^2) of
+ * growing one buffer with krealloc() on every write.
+ */
+
+#ifdef __KERNEL__
+#include <linux/string.h>
+#include <linux/errno.h>
+#include <linux/slab.h>
+#include <linux/kernel.h>
+#else
+#include <string.h>
+#include <stdlib.h>
+#include <errno.h>
+#endif
+
+#include "aesd-partial-write.h"
+
+#ifdef __KERNEL__
+static struct kmem_cache *aesd_partial_chunk_cache;
+
+int aesd_partial_write_cache_init(void)
+{
+    aesd_partial_chunk_cache = kmem_cache_create("aesd_partial_chunk", sizeof(struct aesd_partial_chunk),
+                0, 0, NULL);
+    return aesd_partial_chunk_cache ? 0 : -ENOMEM;
+}
+
+void aesd_partial_write_cache_destroy(void)
+{
+    kmem_cache_destroy(aesd_partial_chunk_cache);
+    aesd_partial_chunk_cache = NULL;
+}
+
+static struct aesd_partial_chunk *aesd_partial_chunk_alloc(void)
+{
+    return kmem_cache_alloc(aesd_partial_chunk_cache, GFP_KERNEL);
+}
+
+static void aesd_partial_chunk_free(struct aesd_partial_chunk *chunk)
+{
+    kmem_cache_free(aesd_partial_chunk_cache, chunk);
+}
+#else
+int aesd_partial_write_cache_init(void)
+{
+    return 0;
+}
+
+void aesd_partial_write_cache_destroy(void)
+{
+}
+
+static struct aesd_partial_chunk *aesd_partial_chunk_alloc(void)
+{
+    return malloc(sizeof(struct aesd_partial_chunk));
+}
+
+static void aesd_partial_chunk_free(struct aesd_partial_chunk *chunk)
+{
+    free(chunk);
+}
+#endif
+
+/**
+ * Initializes @param partial to hold nothing
+ */
+void aesd_partial_write_init(struct aesd_partial_write *partial)
+{
+    memset(partial, 0, sizeof(struct aesd_partial_write));
+}
+
+/**
+ * Appends @param len bytes at @param data to @param partial.  Any necessary locking must be
+ * performed by caller.
+ * @return 0, or -ENOMEM if a chunk could not be allocated, in which case @param partial is
+ * unchanged
+ */
+int aesd_partial_write_append(struct aesd_partial_write *partial, const char *data, size_t len)
+{
+    struct aesd_partial_chunk *first_new = NULL;
+    struct aesd_partial_chunk *last_new = NULL;
+    struct aesd_partial_chunk *chunk;
+    size_t room = partial->tail ? sizeof(partial->tail->data) - partial->tail->used : 0;
+    size_t n;
+
+    /* Allocate every chunk needed before touching the list, so a failure leaves it as it was */
+    while ( room < len ) {
+        chunk = aesd_partial_chunk_alloc();
+        if ( !chunk ) {
+            while ( first_new ) {
+                chunk = first_new->next;
+                aesd_partial_chunk_free(first_new);
+                first_new = chunk;
+            }
+            return -ENOMEM;
+        }
+        chunk->next = NULL;
+        chunk->used = 0;
+        if ( last_new )
+            last_new->next = chunk;
+        else
+            first_new = chunk;
+        last_new = chunk;
+        room += sizeof(chunk->data);
+    }
+
+    if ( partial->tail ) {
+        n = sizeof(partial->tail->data) - partial->tail->used;
+        if ( n > len )
+            n = len;
+        memcpy(partial->tail->data + partial->tail->used, data, n);
+        partial->tail->used += n;
+        data += n;
+        len -= n;
+        partial->len += n;
+        partial->tail->next = first_new;
+    } else {
+        partial->head = first_new;
+    }
+    for ( chunk = first_new; chunk; chunk = chunk->next ) {
+        n = len < sizeof(chunk->data) ? len : sizeof(chunk->data);
+        memcpy(chunk->data, data, n);
+        chunk->used = n;
+        data += n;
+        len -= n;
+        partial->len += n;
+    }
+    if ( last_new )
+        partial->tail = last_new;
+    return 0;
+}
+
+/**
+ * Copies all partial->len bytes held by @param partial, in order, to @param dest
+ */
+void aesd_partial_write_copy(const struct aesd_partial_write *partial, char *dest)
+{
+    const struct aesd_partial_chunk *chunk;
+
+    for ( chunk = partial->head; chunk; chunk = chunk->next ) {
+        memcpy(dest, chunk->data, chunk->used);
+        dest += chunk->used;
+    }
+}
+
+/**
+ * Frees the chunks of @param partial, which then holds nothing
+ */
+void aesd_partial_write_reset(struct aesd_partial_write *partial)
+{
+    struct aesd_partial_chunk *chunk = partial->head;
+    struct aesd_partial_chunk *next;
+
+    while ( chunk ) {
+        next = chunk->next;
+        aesd_partial_chunk_free(chunk);
+        chunk = next;
+    }
+    aesd_partial_write_init(partial);
+}
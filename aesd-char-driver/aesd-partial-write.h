@@ -0,0 +1,67 @@
+/*
+ * aesd-partial-write.h
+ *
+ * Accumulates the pieces of a command written without a newline as a list of
+ * fixed size chunks, so appending never moves the bytes already held.  The
+ * command is copied out in one pass when the newline arrives.
+ */
+
+#ifndef AESD_PARTIAL_WRITE_H
+#define AESD_PARTIAL_WRITE_H
+
+#ifdef __KERNEL__
+#include <linux/types.h>
+#else
+#include <stddef.h> // size_t
+#include <stdint.h> // uintx_t
+#include <stdbool.h>
+#endif
+
+/**
+ * Size of one chunk allocation, header included: chunks come from a dedicated
+ * kmem_cache in the driver, so this is one page in its slab
+ */
+#define AESD_PARTIAL_CHUNK_SIZE 4096
+
+struct aesd_partial_chunk
+{
+    /**
+     * The chunk holding the bytes written after this one, NULL for the last
+     */
+    struct aesd_partial_chunk *next;
+    /**
+     * Bytes of data in use
+     */
+    size_t used;
+    char data[AESD_PARTIAL_CHUNK_SIZE - sizeof(void *) - sizeof(size_t)];
+};
+
+struct aesd_partial_write
+{
+    /**
+     * First and last chunk, both NULL while nothing is held
+     */
+    struct aesd_partial_chunk *head;
+    struct aesd_partial_chunk *tail;
+    /**
+     * Bytes held, all chunks' used added together
+     */
+    size_t len;
+};
+
+/**
+ * Create and destroy the chunk kmem_cache, nothing to do outside the kernel
+ */
+extern int aesd_partial_write_cache_init(void);
+
+extern void aesd_partial_write_cache_destroy(void);
+
+extern void aesd_partial_write_init(struct aesd_partial_write *partial);
+
+extern int aesd_partial_write_append(struct aesd_partial_write *partial, const char *data, size_t len);
+
+extern void aesd_partial_write_copy(const struct aesd_partial_write *partial, char *dest);
+
+extern void aesd_partial_write_reset(struct aesd_partial_write *partial);
+
+#endif /* AESD_PARTIAL_WRITE_H */
@@ -0,0 +1,107 @@
+/*
+ * aesd_mmap.h
+ *
+ * Layout of the read-only mapping of /dev/aesdchar, shared by the driver and userspace
+ *
+ * The first page of the mapping is a struct aesd_mmap_header, the data area
+ * follows from the second page on.  The data area is a byte ring holding a
+ * copy of the most recent commands: the byte at absolute position pos lives at
+ * data[pos & (data_size - 1)].  The header lists the newest commands still held
+ * both by the driver and in full in the data area, up to AESD_MMAP_MAX_ENTRIES.
+ *
+ * The driver bumps seq to an odd value before changing the header or the
+ * data area and back to an even value after, so a reader copies what it needs
+ * between aesd_mmap_read_begin() and aesd_mmap_read_retry() and starts over
+ * when the latter returns true.
+ */
+
+#ifndef AESD_MMAP_H
+#define AESD_MMAP_H
+
+#ifdef __KERNEL__
+#include <linux/types.h>
+#else
+#include <stdint.h>
+#include <stdbool.h>
+#endif
+
+#define AESD_MMAP_MAGIC 0x61657364	/* "aesd" */
+#define AESD_MMAP_VERSION 1
+/**
+ * Size of the header page, the data area starts at this offset into the mapping
+ */
+#define AESD_MMAP_HEADER_SIZE 4096
+
+struct aesd_mmap_entry
+{
+    /**
+     * Absolute position of the first byte of the command in the data ring
+     */
+    uint64_t pos;
+    /**
+     * Number of bytes in the command
+     */
+    uint64_t size;
+};
+
+struct aesd_mmap_header
+{
+    uint32_t magic;
+    uint32_t version;
+    /**
+     * Odd while the driver is updating the mapping
+     */
+    uint32_t seq;
+    /**
+     * Bytes in the data area, a power of two
+     */
+    uint32_t data_size;
+    /**
+     * Absolute position one past the newest byte written to the data ring
+     */
+    uint64_t head;
+    /**
+     * Number of commands ever completed, the newest listed command is number commands - 1
+     */
+    uint64_t commands;
+    /**
+     * Number of commands listed, the oldest is number commands - count
+     */
+    uint32_t count;
+    /**
+     * Slots in entry, a power of two: command number n is described by entry[n & (max_entries - 1)]
+     */
+    uint32_t max_entries;
+    struct aesd_mmap_entry entry[];
+};
+
+/**
+ * Commands listed at most, a power of two that fits the header page
+ */
+#define AESD_MMAP_MAX_ENTRIES 128
+
+#ifndef __KERNEL__
+/**
+ * @return the sequence number to pass to aesd_mmap_read_retry(), after waiting out an update
+ */
+static inline uint32_t aesd_mmap_read_begin(const struct aesd_mmap_header *hdr)
+{
+    uint32_t seq;
+
+    while ( (seq = __atomic_load_n(&hdr->seq, __ATOMIC_ACQUIRE)) & 1 )
+        ;
+    return seq;
+}
+
+/**
+ * @return true if the driver changed the mapping since aesd_mmap_read_begin() returned @param seq,
+ * in which case everything read in between must be discarded
+ */
+static inline bool aesd_mmap_read_retry(const struct aesd_mmap_header *hdr, uint32_t seq)
+{
+    __atomic_thread_fence(__ATOMIC_ACQUIRE);
+    return __atomic_load_n(&hdr->seq, __ATOMIC_RELAXED) != seq;
+}
+#endif
+
+#endif /* AESD_MMAP_H */
@@ -8,6 +8,8 @@
 #ifndef AESD_CHAR_DRIVER_AESDCHAR_H_
 #define AESD_CHAR_DRIVER_AESDCHAR_H_
 #include "aesd-circular-buffer.h"
+#include "aesd_mmap.h"
+#include "aesd-partial-write.h"
 
 #define AESD_DEBUG 1  //Remove comment on this line to enable debug
 
@@ -24,22 +26,70 @@
 #  define PDEBUG(fmt, args...) /* not debugging: nothing */
 #endif
 
+/**
+*	struct aesd_cmd - A committed write command, circ_buf entries point at its data
+* @ref:	One reference held by circ_buf, one by each reader copying from the command
+* @rcu:	The command is freed after a grace period, so a reader that found it through
+*	circ_buf can still try to take a reference
+* @data:	The command bytes, entry->buffptr
+*/
+struct aesd_cmd
+{
+    struct kref ref;
+    struct rcu_head rcu;
+    char data[];
+};
+
 /**
 *	struct aesd_dev - Device Structure for AESD char driver
-* @circ_buf: 	Circular buffer holding the last 10 full write commands
-* @lock:	Mutex to protect concurrent access to the device
-* @partial_write_buf: Buffer accumulating user data until newline
-* @partial_write_len: Length of accumulated partial write
+* @circ_buf: 	Circular buffer holding the last capacity (module parameter) full write commands
+* @lock:	Serializes the commit of whole commands, readers never take it
+* @ring_lock:	Taken by the commit step around ring_seq write sections
+* @ring_seq:	Lets readers snapshot the circ_buf indices and offsets without a lock
 * @cdev: Char device structure
+* @mmap_hdr: Start of the area userspace maps read-only, NULL when mmap is disabled
+* @mmap_data: Data ring mirroring the completed commands, after the header page
+* @mmap_len: Size of the whole mapping area
+* @read_queue: Readers waiting at the end of data, woken by every committed command
+* @ring: Byte ring holding the commands when the ring_size module parameter is set,
+*	NULL when each command is its own struct aesd_cmd
+* @ring_mask: Size of ring minus one, the command at cumulative offset start[i] begins
+*	at ring[start[i] & ring_mask]
 */
 
 struct aesd_dev
 {
     struct aesd_circular_buffer circ_buf; 	/* Circular Buffer Structure */
-    struct mutex lock;				/* Mutex for thread safety */
-    char *partial_write_buf;			/* Pointer to Dynamic Buffer */
-    size_t partial_write_len;			/* Size of Accumulated data */
+    struct mutex lock;				/* Commits only */
+    spinlock_t ring_lock;			/* Commit step */
+    seqcount_spinlock_t ring_seq;		/* Ring indices, read locklessly */
     struct cdev cdev;     			/* Char device structure      */
+    struct aesd_mmap_header *mmap_hdr;		/* vmalloc_user() area, header page first */
+    char *mmap_data;				/* Data ring after the header page */
+    size_t mmap_len;				/* Header page plus data ring */
+    wait_queue_head_t read_queue;		/* Readers tailing the device */
+    char *ring;					/* vmalloc() byte ring, or NULL */
+    size_t ring_mask;				/* Ring size minus one */
+};
+
+/**
+*	struct aesd_file - Per open file state, the file's private_data
+* @dev: The device the file was opened on
+* @lock: Serializes reads and writes through this file, protects f_pos, the EOF state and
+*	partial; aesd_poll() reads the EOF state without it
+* @at_eof: Set when the last read found no data, eof_pos and eof_fpos are valid
+* @eof_pos: Cumulative offset (the scale of circ_buf.start) the read stopped at
+* @eof_fpos: f_pos the read stopped at
+* @partial: Bytes written through this file since its last newline
+*/
+struct aesd_file
+{
+    struct aesd_dev *dev;
+    struct mutex lock;
+    bool at_eof;
+    size_t eof_pos;
+    loff_t eof_fpos;
+    struct aesd_partial_write partial;
 };
 
 
@@ -22,11 +22,47 @@
 #include <linux/string.h>
 #include <linux/mutex.h>
 #include <linux/kernel.h>
+#include <linux/moduleparam.h>
+#include <linux/vmalloc.h>
+#include <linux/mm.h>
+#include <linux/log2.h>
+#include <linux/version.h>
+#include <linux/wait.h>
+#include <linux/poll.h>
+#include <linux/kref.h>
+#include <linux/err.h>
+#include <linux/rcupdate.h>
+#include <linux/spinlock.h>
+#include <linux/seqlock.h>
 #include "aesdchar.h"
 #include "aesd-circular-buffer.h"
+#include "aesd_ioctl.h"
+#include "aesd-partial-write.h"
 int aesd_major =   0; // use dynamic major
 int aesd_minor =   0;
 
+/* Number of write commands kept before the oldest is dropped */
+static uint capacity = AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED;
+module_param(capacity, uint, 0444);
+MODULE_PARM_DESC(capacity, "Write commands kept by the device (default "
+		__stringify(AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED) ")");
+
+/* Size of the data ring exposed through mmap, rounded up to a power of two */
+static uint mmap_size = 256 * 1024;
+module_param(mmap_size, uint, 0444);
+MODULE_PARM_DESC(mmap_size, "Bytes of recent commands readable through mmap, 0 disables mmap (default 262144)");
+
+/* Reads at the end of data wait for the next command instead of returning EOF */
+static bool tail;
+module_param(tail, bool, 0644);
+MODULE_PARM_DESC(tail, "Block reads at the end of data until a command is written, like tail -f (default off)");
+
+/* Size of the byte ring commands are stored in, rounded up to a power of two */
+static uint ring_size;
+module_param(ring_size, uint, 0444);
+MODULE_PARM_DESC(ring_size, "Store commands back to back in one byte ring of this many bytes instead of an "
+		"allocation each, 0 for an allocation each (default 0)");
+
 MODULE_AUTHOR("Sijeo Philip"); /**TODO: fill in your name **/
 MODULE_LICENSE("Dual BSD/GPL");
 
@@ -37,11 +73,18 @@ static int aesd_open(struct inode *inode, struct file *filp)
 	// Approach 1 based on "Device Driver File Operations" lecture video
 	// Handles Multiple device opens
 	struct aesd_dev *aesd_device;
+	struct aesd_file *file;
 
 	PDEBUG("open");
 
 	aesd_device = container_of(inode->i_cdev, struct aesd_dev, cdev);
-	filp->private_data = aesd_device;
+	file = kzalloc(sizeof(*file), GFP_KERNEL);
+	if ( !file )
+		return -ENOMEM;
+	file->dev = aesd_device;
+	mutex_init(&file->lock);
+	aesd_partial_write_init(&file->partial);
+	filp->private_data = file;
 
 	// Approach 2, directly assign the global var device (a single device only)
 	// does not seem to work
@@ -52,121 +95,719 @@ static int aesd_open(struct inode *inode, struct file *filp)
 
 static int aesd_release(struct inode *inode, struct file *filp)
 {
+    struct aesd_file *file = filp->private_data;
+
     PDEBUG("release\n");
-    /**
-     * TODO: handle release
-     */
+    /* A command still missing its newline is dropped with the file */
+    aesd_partial_write_reset(&file->partial);
+    mutex_destroy(&file->lock);
+    kfree(file);
+    filp->private_data = NULL;
     return 0;
 }
 
-static ssize_t aesd_read(struct file *filp, char __user *buf, size_t count,
-                loff_t *f_pos)
+static struct aesd_cmd *aesd_cmd_of(const char *data)
+{
+    return (struct aesd_cmd *)(data - offsetof(struct aesd_cmd, data));
+}
+
+static void aesd_cmd_free(struct kref *ref)
+{
+    struct aesd_cmd *cmd = container_of(ref, struct aesd_cmd, ref);
+
+    /* A reader may have just found it in circ_buf and be about to try kref_get_unless_zero() */
+    kfree_rcu(cmd, rcu);
+}
+
+static void aesd_cmd_put(struct aesd_cmd *cmd)
+{
+    kref_put(&cmd->ref, aesd_cmd_free);
+}
+
+/**
+ * Snapshot the cumulative offsets, on the scale of the circular buffer start[] offsets,
+ * of f_pos 0 (the first byte of the oldest command held) and of the end of data.
+ * Takes no lock, retries while a commit is changing the ring.
+ */
+static void aesd_ring_bounds(struct aesd_dev *dev, size_t *base, size_t *end)
+{
+    unsigned int seq;
+
+    do {
+	    seq = read_seqcount_begin(&dev->ring_seq);
+	    *end = dev->circ_buf.next_start;
+	    *base = *end - aesd_circular_buffer_size(&dev->circ_buf);
+    } while ( read_seqcount_retry(&dev->ring_seq, seq) );
+}
+
+/**
+ * Find the command holding byte pos, a cumulative offset as returned by aesd_ring_bounds(),
+ * and take a reference on it, so the caller can copy from it with no lock held.  The lookup
+ * runs under the ring seqcount, relative to the oldest command at that moment, and RCU keeps
+ * a command evicted meanwhile from being freed before kref_get_unless_zero() sees it is gone.
+ * @return the command with *offset and *size set to the byte within it and its size,
+ * NULL if pos is past the end of data, or ERR_PTR(-ERANGE) if pos was evicted
+ */
+static struct aesd_cmd *aesd_get_cmd(struct aesd_dev *dev, size_t pos, size_t *offset, size_t *size)
 {
-    ssize_t retval = 0;
-    struct aesd_dev *dev = filp->private_data;
     struct aesd_buffer_entry *entry;
+    struct aesd_cmd *cmd;
+    unsigned int seq;
+    size_t base;
+
+    rcu_read_lock();
+    do {
+	    do {
+		    seq = read_seqcount_begin(&dev->ring_seq);
+		    cmd = NULL;
+		    base = dev->circ_buf.next_start - aesd_circular_buffer_size(&dev->circ_buf);
+		    if ( (ssize_t)(pos - base) < 0 ) {
+			    cmd = ERR_PTR(-ERANGE);
+			    continue;
+		    }
+		    entry = aesd_circular_buffer_find_entry_offset_for_fpos(&dev->circ_buf, pos - base, offset);
+		    if ( entry ) {
+			    cmd = aesd_cmd_of(READ_ONCE(entry->buffptr));
+			    *size = entry->size;
+		    }
+	    } while ( read_seqcount_retry(&dev->ring_seq, seq) );
+	    /* Released since the lookup: the ring has moved on, look again */
+    } while ( !IS_ERR_OR_NULL(cmd) && !kref_get_unless_zero(&cmd->ref) );
+    rcu_read_unlock();
+    return cmd;
+}
+
+/**
+ * @return true if a read at f_pos goes through the file position, false for pread().
+ * read() passes a copy of filp->f_pos rather than its address on current kernels, so the
+ * value is compared as well; a pread() at exactly the file position reads the same bytes.
+ */
+static bool aesd_is_file_pos(struct file *filp, loff_t *f_pos)
+{
+    return f_pos == &filp->f_pos || *f_pos == filp->f_pos;
+}
+
+/**
+ * f_pos counts from the oldest command, so every eviction shifts it.  A reader that hit
+ * the end is put back at the same cumulative offset before reading again, unless it
+ * moved f_pos itself since; it restarts from the oldest command if that offset was
+ * evicted meanwhile.  Called with file->lock held.
+ */
+static void aesd_reanchor(struct aesd_file *file, loff_t *f_pos)
+{
+    size_t base, end;
+    ssize_t rel;
+
+    if ( !file->at_eof )
+	    return;
+    WRITE_ONCE(file->at_eof, false);
+    if ( *f_pos != file->eof_fpos )
+	    return;
+    aesd_ring_bounds(file->dev, &base, &end);
+    rel = file->eof_pos - base;
+    *f_pos = rel < 0 ? 0 : rel;
+}
+
+/**
+ * Read from the commands held as struct aesd_cmd, one entry at a time.  No lock is held
+ * between entries, so the position is kept as a cumulative offset: an eviction meanwhile
+ * shifts every f_pos but not the cursor.  As in aesd_read_ring(), a read whose next byte
+ * was evicted starts over from what f_pos now refers to, or stops if it copied some already.
+ * @return the bytes copied, or -EFAULT if none could be
+ */
+static ssize_t aesd_read_cmds(struct aesd_dev *dev, char __user *buf, size_t count, loff_t *f_pos)
+{
+    ssize_t retval = 0;
+    struct aesd_cmd *cmd;
     size_t entry_offset_byte_rtn;
+    size_t entry_size;
     size_t bytes_to_copy;
+    size_t not_copied;
+    size_t copied = 0;
+    size_t base, end, pos;
+
+    aesd_ring_bounds(dev, &base, &end);
+    pos = base + *f_pos;
+
+    /* Keep copying from consecutive entries until count is satisfied or the data runs out */
+    while ( copied < count ) {
+	    /* Find the entry corresponding to the cursor */
+	    cmd = aesd_get_cmd(dev, pos, &entry_offset_byte_rtn, &entry_size);
+	    if ( IS_ERR(cmd) ) {
+		    if ( copied )
+			    break;
+		    aesd_ring_bounds(dev, &base, &end);
+		    pos = base + *f_pos;
+		    continue;
+	    }
+	    if( !cmd ){
+		    PDEBUG("No entry found for offset %lld\n", *f_pos);
+		    break; /* EOF */
+	    }
+
+	    /* Determine How many bytes to copy */
+	    bytes_to_copy = min( count - copied, entry_size - entry_offset_byte_rtn );
+
+	    /* Copy to user space, a fault part way through still returns what was copied.
+	     * The reference keeps the command alive even if a writer evicts it meanwhile. */
+	    not_copied = copy_to_user(buf + copied, cmd->data + entry_offset_byte_rtn, bytes_to_copy);
+	    aesd_cmd_put(cmd);
+	    copied += bytes_to_copy - not_copied;
+	    pos += bytes_to_copy - not_copied;
+	    *f_pos += bytes_to_copy - not_copied;
+	    if ( not_copied ) {
+		    PDEBUG("Error copying data to user space\n");
+		    if ( !copied )
+			    retval = -EFAULT;
+		    break;
+	    }
+    }
+    return retval ? retval : copied;
+}
+
+/**
+ * Read from the byte ring: the commands are back to back, so everything from f_pos to the
+ * end of data is at most two copies, the second when it wraps.  Nothing pins the bytes, so
+ * they are checked once copied, as in a seqcount read: if a writer evicted and overwrote
+ * them meanwhile, the user buffer is copied again from what f_pos now refers to.
+ * @return the bytes copied, or -EFAULT if none could be
+ */
+static ssize_t aesd_read_ring(struct aesd_dev *dev, char __user *buf, size_t count, loff_t *f_pos)
+{
+    size_t base, end;
+    size_t pos, len, at, first;
+    size_t not_copied;
+
+    do {
+	    aesd_ring_bounds(dev, &base, &end);
+	    if ( *f_pos >= end - base )
+		    return 0; /* EOF */
+	    pos = base + *f_pos;
+	    len = min(count, end - pos);
+	    at = pos & dev->ring_mask;
+	    first = min(len, dev->ring_mask + 1 - at);
+
+	    not_copied = copy_to_user(buf, dev->ring + at, first);
+	    if ( not_copied )
+		    not_copied += len - first;
+	    else if ( len > first )
+		    not_copied = copy_to_user(buf + first, dev->ring, len - first);
+	    len -= not_copied;
+
+	    /* Order the copy before reading the oldest offset again: the evicting writer
+	     * publishes the new oldest offset before it reuses the bytes */
+	    smp_rmb();
+	    aesd_ring_bounds(dev, &base, &end);
+    } while ( (ssize_t)(pos - base) < 0 );
+
+    if ( !len && not_copied )
+	    return -EFAULT;
+    *f_pos += len;
+    return len;
+}
+
+static ssize_t aesd_read(struct file *filp, char __user *buf, size_t count,
+                loff_t *f_pos)
+{
+    ssize_t retval = 0;
+    struct aesd_file *file = filp->private_data;
+    struct aesd_dev *dev = file->dev;
+    size_t copied = 0;
+    size_t base, end;
 
     PDEBUG("read %zu bytes with offset %lld", count, *f_pos);
 
-    /*Lock the mutex to ensure safe access to the circular buffer */
-    if ( mutex_lock_interruptible(&dev->lock) )
+    /* Only reads through the same file wait here, readers of other files and writers go on */
+    if ( mutex_lock_interruptible(&file->lock) )
 	    return -ERESTARTSYS;
 
-    /* Find the entry corresponding to the current file position */
-    entry = aesd_circular_buffer_find_entry_offset_for_fpos(&dev->circ_buf, *f_pos, &entry_offset_byte_rtn);
-    if( !entry ){
-	    PDEBUG("No entry found for offset %lld\n", *f_pos);
-	    retval = 0; /* EOF */
+retry:
+    /* Positional reads get exactly the offset asked for */
+    if ( aesd_is_file_pos(filp, f_pos) )
+	    aesd_reanchor(file, f_pos);
+
+    if ( dev->ring )
+	    retval = aesd_read_ring(dev, buf, count, f_pos);
+    else
+	    retval = aesd_read_cmds(dev, buf, count, f_pos);
+    if ( retval < 0 )
 	    goto unlock_and_return;
+    copied = retval;
+    retval = 0;
+
+    if ( copied == 0 && count > 0 ) {
+	    /* Remember where the data ended for aesd_reanchor() and aesd_poll() */
+	    aesd_ring_bounds(dev, &base, &end);
+	    if ( *f_pos < end - base )
+		    goto retry; /* A command was committed since the read found nothing */
+	    if ( aesd_is_file_pos(filp, f_pos) ) {
+		    WRITE_ONCE(file->eof_fpos, *f_pos);
+		    WRITE_ONCE(file->eof_pos, base + *f_pos);
+		    WRITE_ONCE(file->at_eof, true);
+	    }
+
+	    if ( tail ) {
+		    if ( filp->f_flags & O_NONBLOCK ) {
+			    retval = -EAGAIN;
+			    goto unlock_and_return;
+		    }
+
+		    /* Sleep until aesd_write() commits a command past end, then read it */
+		    mutex_unlock(&file->lock);
+		    if ( wait_event_interruptible(dev->read_queue, READ_ONCE(dev->circ_buf.next_start) != end) )
+			    return -ERESTARTSYS;
+		    if ( mutex_lock_interruptible(&file->lock) )
+			    return -ERESTARTSYS;
+		    goto retry;
+	    }
     }
+    if ( retval == 0 )
+	    retval = copied;
 
-    /* Determine How many bytes to copy */
-    bytes_to_copy = min( count, entry->size - entry_offset_byte_rtn );
+    PDEBUG("Read %zu bytes", copied);
 
-    /* Copy to user space */
-    if ( copy_to_user(buf, entry->buffptr + entry_offset_byte_rtn, bytes_to_copy)) {
-	    PDEBUG("Error copying data to user space\n");
-	    retval = -EFAULT;
-	    goto unlock_and_return;
+unlock_and_return:
+    mutex_unlock(&file->lock);
+    return retval;
+
+}
+
+/**
+ * Readable when there is data past f_pos, or, for a reader that hit the end, once a
+ * command was committed since.  Always writable.
+ */
+static __poll_t aesd_poll(struct file *filp, poll_table *wait)
+{
+    struct aesd_file *file = filp->private_data;
+    struct aesd_dev *dev = file->dev;
+    __poll_t mask = EPOLLOUT | EPOLLWRNORM;
+    loff_t f_pos = READ_ONCE(filp->f_pos);
+    size_t base, end;
+
+    poll_wait(filp, &dev->read_queue, wait);
+
+    /* No file->lock: a read holds it across copy_to_user(), and a stale snapshot of the
+     * EOF state is corrected by the wakeup of the next commit or read */
+    aesd_ring_bounds(dev, &base, &end);
+    if ( READ_ONCE(file->at_eof) && f_pos == READ_ONCE(file->eof_fpos) ) {
+	    if ( end != READ_ONCE(file->eof_pos) )
+		    mask |= EPOLLIN | EPOLLRDNORM;
+    } else if ( f_pos < end - base ) {
+	    mask |= EPOLLIN | EPOLLRDNORM;
     }
+    return mask;
+}
 
-    /* Update file position */
-    *f_pos += bytes_to_copy;
-    retval = bytes_to_copy;
+/**
+ * Copy len bytes into the mmap data ring at stream offset head, wrapping at its end
+ */
+static void aesd_mmap_copy(struct aesd_dev *dev, u64 head, const char *data, size_t len)
+{
+    u32 data_mask = dev->mmap_hdr->data_size - 1;
+    size_t first = min_t(size_t, len, dev->mmap_hdr->data_size - (head & data_mask));
 
-    PDEBUG("Read %zu bytes from entry (offset %zu, size %zu)", bytes_to_copy, entry_offset_byte_rtn, entry->size);
+    memcpy(dev->mmap_data + (head & data_mask), data, first);
+    memcpy(dev->mmap_data, data + first, len - first);
+}
 
-unlock_and_return:
-    mutex_unlock(&dev->lock);
-    return retval;
+/**
+ * Copy a completed command into the mmap data ring and list it in the header page, then
+ * drop the oldest listed commands the driver no longer holds or whose bytes were overwritten.
+ * The command is the first_size bytes at data followed by the rest of its size bytes at
+ * data_rest, as it is when it wraps in the byte ring.  Called with dev->lock held, which
+ * keeps other commits out, after the command was added to the circular buffer.
+ */
+static void aesd_mmap_publish(struct aesd_dev *dev, const char *data, size_t first_size,
+		const char *data_rest, size_t size)
+{
+    struct aesd_mmap_header *hdr = dev->mmap_hdr;
+    struct aesd_mmap_entry *entry;
+    u32 slots_mask;
+
+    if ( !hdr )
+	    return;
+    slots_mask = hdr->max_entries - 1;
+
+    /* Readers retry while seq is odd or has changed */
+    WRITE_ONCE(hdr->seq, hdr->seq + 1);
+    smp_wmb();
+
+    if ( size > hdr->data_size ) {
+	    /* Not even this command fits, the whole ring is overwritten and nothing is listed */
+	    hdr->head += size;
+	    hdr->commands++;
+	    hdr->count = 0;
+	    goto done;
+    }
+
+    /* The new command takes the slot of the oldest one when all slots are listed */
+    if ( hdr->count == hdr->max_entries )
+	    hdr->count--;
+
+    aesd_mmap_copy(dev, hdr->head, data, first_size);
+    aesd_mmap_copy(dev, hdr->head + first_size, data_rest, size - first_size);
+
+    entry = &hdr->entry[hdr->commands & slots_mask];
+    entry->pos = hdr->head;
+    entry->size = size;
+    hdr->head += size;
+    hdr->commands++;
+    hdr->count++;
+
+    while ( hdr->count > 0 ) {
+	    entry = &hdr->entry[(hdr->commands - hdr->count) & slots_mask];
+	    if ( hdr->count <= dev->circ_buf.count && entry->pos + hdr->data_size >= hdr->head )
+		    break;
+	    hdr->count--;
+    }
+
+done:
+    smp_wmb();
+    WRITE_ONCE(hdr->seq, hdr->seq + 1);
+}
+
+/**
+ * Copy len bytes to the byte ring at cumulative offset pos, wrapping at its end
+ */
+static void aesd_ring_store(struct aesd_dev *dev, size_t pos, const char *data, size_t len)
+{
+    size_t at = pos & dev->ring_mask;
+    size_t first = min(len, dev->ring_mask + 1 - at);
+
+    memcpy(dev->ring + at, data, first);
+    memcpy(dev->ring, data + first, len - first);
+}
+
+/**
+ * Commit the bytes in partial followed by the count bytes at data as one command in the
+ * byte ring: evict the oldest commands until it fits behind them, copy it in, then add its
+ * offset and size to circ_buf.  partial is left empty.  Called with dev->lock held.
+ * @return 0, or -EFBIG if the command is larger than the whole ring, which drops it
+ */
+static int aesd_commit_ring(struct aesd_dev *dev, struct aesd_partial_write *partial,
+		const char *data, size_t count)
+{
+    struct aesd_circular_buffer *circ_buf = &dev->circ_buf;
+    struct aesd_partial_chunk *chunk;
+    struct aesd_buffer_entry new_entry;
+    size_t ring_bytes = dev->ring_mask + 1;
+    size_t size = partial->len + count;
+    size_t pos = circ_buf->next_start;
+    size_t at, first;
+
+    if ( size > ring_bytes ) {
+	    aesd_partial_write_reset(partial);
+	    return -EFBIG;
+    }
 
+    /* Advance the tail.  write_seqcount_end() orders the new oldest offset before the stores
+     * below that overwrite the evicted bytes, which aesd_read_ring() relies on */
+    spin_lock(&dev->ring_lock);
+    write_seqcount_begin(&dev->ring_seq);
+    while ( circ_buf->count &&
+		    ( circ_buf->full || pos + size - circ_buf->start[circ_buf->out_offs] > ring_bytes ) )
+	    aesd_circular_buffer_remove_entry(circ_buf);
+    write_seqcount_end(&dev->ring_seq);
+    spin_unlock(&dev->ring_lock);
+
+    /* Readers only look below next_start, the bytes can be copied in with no lock held */
+    for ( chunk = partial->head; chunk; chunk = chunk->next ) {
+	    aesd_ring_store(dev, pos, chunk->data, chunk->used);
+	    pos += chunk->used;
+    }
+    aesd_ring_store(dev, pos, data, count);
+    aesd_partial_write_reset(partial);
+
+    new_entry.buffptr = NULL;
+    new_entry.size = size;
+    spin_lock(&dev->ring_lock);
+    write_seqcount_begin(&dev->ring_seq);
+    aesd_circular_buffer_add_entry(circ_buf, &new_entry);
+    write_seqcount_end(&dev->ring_seq);
+    spin_unlock(&dev->ring_lock);
+
+    at = (circ_buf->next_start - size) & dev->ring_mask;
+    first = min(size, ring_bytes - at);
+    aesd_mmap_publish(dev, dev->ring + at, first, dev->ring, size);
+    return 0;
 }
 
+/**
+ * Commit cmd, holding size bytes, to circ_buf and the mmap area, evicting the oldest command
+ * when circ_buf is full.  Called with dev->lock held.
+ * @return the evicted command, whose circ_buf reference the caller puts once it dropped
+ * dev->lock, or NULL
+ */
+static struct aesd_cmd *aesd_commit_cmd(struct aesd_dev *dev, struct aesd_cmd *cmd, size_t size)
+{
+    struct aesd_cmd *evicted = NULL;
+    struct aesd_buffer_entry new_entry;
+
+    /* circ_buf holds the first reference */
+    kref_init(&cmd->ref);
+    new_entry.buffptr = cmd->data;
+    new_entry.size = size;
+
+    /* The commit, the only step readers can observe, is all the ring seqcount covers */
+    spin_lock(&dev->ring_lock);
+    write_seqcount_begin(&dev->ring_seq);
+    if( dev->circ_buf.full ) {
+	    struct aesd_buffer_entry *oldest = aesd_circular_buffer_remove_entry(&dev->circ_buf);
+	    evicted = aesd_cmd_of(oldest->buffptr);
+	    oldest->buffptr = NULL;
+    }
+    aesd_circular_buffer_add_entry(&dev->circ_buf, &new_entry);
+    write_seqcount_end(&dev->ring_seq);
+    spin_unlock(&dev->ring_lock);
+
+    aesd_mmap_publish(dev, new_entry.buffptr, new_entry.size, NULL, new_entry.size);
+    return evicted;
+}
+
+/* Writes up to this size are copied from user space on the stack instead of a fresh allocation */
+#define AESD_WRITE_STACK_BYTES 128
+
+/**
+ * Bytes up to a newline accumulate in the file's own partial write, so writers through
+ * different files never mix their commands and only contend on dev->lock to commit one.
+ */
 static ssize_t aesd_write(struct file *filp, const char __user *buf, size_t count,loff_t *f_pos)
 {
     ssize_t retval = -ENOMEM; /* Default return value for allocation failure */
-    struct aesd_dev *dev = filp->private_data; /* Get the device structure */
-    char *new_buffer = NULL; /* Temporary buffer for reallocations */
+    struct aesd_file *file = filp->private_data;
+    struct aesd_dev *dev = file->dev; /* Get the device structure */
+    struct aesd_cmd *user_cmd = NULL; /* Larger writes, allocated so they can become the command as is */
+    struct aesd_cmd *new_cmd = NULL; /* Command committed by this write */
+    struct aesd_cmd *evicted = NULL; /* Oldest command, dropped by the commit */
     const char *newline_pos = NULL; /* Pointer to newline character in input buffer */
+    size_t size;
+    char stack_data[AESD_WRITE_STACK_BYTES];
+    char *data = stack_data;
     PDEBUG(" write %zu bytes with offset %lld\n",count, *f_pos);
 
-    /* Lock the mutex to protect shared resources */
-    if ( mutex_lock_interruptible(&dev->lock))
-	    return -ERESTARTSYS;
+    /* Copy from user space before taking any lock, faulting in the pages only stalls this writer */
+    if ( count > sizeof(stack_data) ) {
+	    user_cmd = kmalloc(sizeof(*user_cmd) + count, GFP_KERNEL);
+	    if ( !user_cmd )
+		    return -ENOMEM;
+	    data = user_cmd->data;
+    }
+    if ( copy_from_user(data, buf, count) ) {
+	    kfree(user_cmd);
+	    return -EFAULT;
+    }
+    /* The data accumulated before has no newline, only this write needs scanning */
+    newline_pos = memchr( data, '\n', count );
 
-    /* Append new data to the Partial Buffer */
-    new_buffer = krealloc( dev->partial_write_buf, dev->partial_write_len + count, GFP_KERNEL);
-    if( !new_buffer ) {
-	    retval = -ENOMEM;
-	    goto unlock_and_return;
+    /* Lock the file's mutex to protect its partial write */
+    if ( mutex_lock_interruptible(&file->lock)) {
+	    kfree(user_cmd);
+	    return -ERESTARTSYS;
     }
-    dev->partial_write_buf = new_buffer;
 
-    /* Copy data from user space into partial buffer */
-    if ( copy_from_user (dev->partial_write_buf + dev->partial_write_len, buf, count)) {
-	    retval = -EFAULT;
+    if( !newline_pos ) {
+	    /* Append to the chunk list, nothing held so far is moved */
+	    if( !aesd_partial_write_append(&file->partial, data, count) )
+		    retval = count;
 	    goto unlock_and_return;
     }
-    dev->partial_write_len += count;
-
-    /* Check the newline in the write */
-    newline_pos = memchr( dev->partial_write_buf, '\n', dev->partial_write_len );
-    if( newline_pos ) {
-	    /* The write operation ends with newline (take advantage of the newline accumulation requirement ) */
-	    size_t message_size = dev->partial_write_len;	/* Entire buffer size */
 
-	    /* Allocate memory for the new circular buffer entry */
-	    struct aesd_buffer_entry new_entry;
-	    new_entry.buffptr = dev->partial_write_buf;
-	    new_entry.size = message_size;
-
-	    /* Add the entry to the circular buffer */
-	    aesd_circular_buffer_add_entry(&dev->circ_buf, &new_entry);
+    /* The write operation ends with newline (take advantage of the newline accumulation requirement ) */
+    if( dev->ring ) {
+	    /* Stored in the byte ring, no allocation outlives the write */
+	    mutex_lock(&dev->lock);
+	    retval = aesd_commit_ring(dev, &file->partial, data, count);
+	    mutex_unlock(&dev->lock);
+	    if( retval )
+		    goto unlock_and_return;
+    } else {
+	    size = file->partial.len + count;
+	    if( user_cmd && !file->partial.len ) {
+		    /* A whole command in one write, the allocation it was copied into is the command */
+		    new_cmd = user_cmd;
+		    user_cmd = NULL;
+	    } else {
+		    /* Copy the chunks out, the only time the accumulated bytes are moved */
+		    new_cmd = kmalloc(sizeof(*new_cmd) + size, GFP_KERNEL);
+		    if( !new_cmd )
+			    goto unlock_and_return;
+		    aesd_partial_write_copy(&file->partial, new_cmd->data);
+		    memcpy(new_cmd->data + file->partial.len, data, count);
+		    aesd_partial_write_reset(&file->partial);
+	    }
 
-	    /* Reset the partial write buffer */
-	    dev->partial_write_buf = NULL;
-	    dev->partial_write_len = 0;
+	    /* The device is only locked to publish */
+	    mutex_lock(&dev->lock);
+	    evicted = aesd_commit_cmd(dev, new_cmd, size);
+	    mutex_unlock(&dev->lock);
+	    /* Readers still copying from the evicted command hold their own references */
+	    if ( evicted )
+		    aesd_cmd_put(evicted);
     }
+    wake_up_interruptible(&dev->read_queue);
 
     retval = count; 	/* Return the number of bytes written */
 
 unlock_and_return:
-    mutex_unlock(&dev->lock);	/* Unlock the Mutex */
+    mutex_unlock(&file->lock);	/* Unlock the Mutex */
+    kfree(user_cmd);
+    return retval;
+}
+
+/**
+ * Seek over the bytes currently held, SEEK_END being the end of the newest command.
+ * Only the circular buffer offsets are consulted, no data is copied.
+ */
+static loff_t aesd_llseek(struct file *filp, loff_t off, int whence)
+{
+    struct aesd_file *file = filp->private_data;
+    size_t base, end;
+    loff_t retval;
+
+    PDEBUG("llseek %lld whence %d", off, whence);
+
+    aesd_ring_bounds(file->dev, &base, &end);
+    if ( mutex_lock_interruptible(&file->lock) )
+	    return -ERESTARTSYS;
+    retval = fixed_size_llseek(filp, off, whence, end - base);
+    /* An explicit seek is taken as is, even to the offset the last read ended at */
+    if ( retval >= 0 )
+	    WRITE_ONCE(file->at_eof, false);
+    mutex_unlock(&file->lock);
     return retval;
-    	
-		
+}
+
+/**
+ * Move f_pos to byte seekto.write_cmd_offset of command seekto.write_cmd, counting from
+ * the oldest command held.
+ * @return 0, or -EINVAL if the command or the offset within it is not held
+ */
+static long aesd_adjust_file_offset(struct file *filp, uint32_t write_cmd, uint32_t write_cmd_offset)
+{
+    struct aesd_file *file = filp->private_data;
+    struct aesd_dev *dev = file->dev;
+    struct aesd_buffer_entry *entry;
+    size_t cmd_start;
+    size_t cmd_size = 0;
+    unsigned int seq;
+
+    do {
+	    seq = read_seqcount_begin(&dev->ring_seq);
+	    entry = aesd_circular_buffer_entry_at(&dev->circ_buf, write_cmd, &cmd_start);
+	    if ( entry )
+		    cmd_size = entry->size;
+    } while ( read_seqcount_retry(&dev->ring_seq, seq) );
+
+    if ( !entry || write_cmd_offset >= cmd_size )
+	    return -EINVAL;
+
+    if ( mutex_lock_interruptible(&file->lock) )
+	    return -ERESTARTSYS;
+    filp->f_pos = cmd_start + write_cmd_offset;
+    WRITE_ONCE(file->at_eof, false);
+    PDEBUG("Seek to command %u offset %u, f_pos %lld", write_cmd, write_cmd_offset, filp->f_pos);
+    mutex_unlock(&file->lock);
+    return 0;
+}
+
+static long aesd_unlocked_ioctl(struct file *filp, unsigned int cmd, unsigned long arg)
+{
+    struct aesd_seekto seekto;
+
+    if ( _IOC_TYPE(cmd) != AESD_IOC_MAGIC || _IOC_NR(cmd) > AESDCHAR_IOC_MAXNR )
+	    return -ENOTTY;
+
+    switch ( cmd ) {
+    case AESDCHAR_IOCSEEKTO:
+	    if ( copy_from_user(&seekto, (const void __user *)arg, sizeof(seekto)) )
+		    return -EFAULT;
+	    return aesd_adjust_file_offset(filp, seekto.write_cmd, seekto.write_cmd_offset);
+    default:
+	    return -ENOTTY;
+    }
+}
+
+/**
+ * Map the header page and data ring read-only, vm_pgoff selects where in the area the
+ * mapping starts.  The pages are vmalloc_user() memory, so they stay valid until unload
+ * no matter what the driver evicts.
+ */
+static int aesd_mmap(struct file *filp, struct vm_area_struct *vma)
+{
+    struct aesd_file *file = filp->private_data;
+    struct aesd_dev *dev = file->dev;
+
+    PDEBUG("mmap %lu bytes at page %lu", vma->vm_end - vma->vm_start, vma->vm_pgoff);
+
+    if ( !dev->mmap_hdr )
+	    return -ENODEV;
+    if ( vma->vm_flags & VM_WRITE )
+	    return -EPERM;
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6, 3, 0)
+    vm_flags_clear(vma, VM_MAYWRITE);
+#else
+    vma->vm_flags &= ~VM_MAYWRITE;
+#endif
+    return remap_vmalloc_range(vma, dev->mmap_hdr, vma->vm_pgoff);
 }
 
 struct file_operations aesd_fops = {
     .owner =    THIS_MODULE,
+    .llseek =   aesd_llseek,
     .read =     aesd_read,
     .write =    aesd_write,
+    .unlocked_ioctl = aesd_unlocked_ioctl,
+    .mmap =     aesd_mmap,
+    .poll =     aesd_poll,
     .open =     aesd_open,
     .release =  aesd_release,
 };
 
+/**
+ * Allocate the byte ring, ring_size bytes rounded up to a power of two.  Nothing is
+ * allocated when ring_size is 0, commands are then allocated one by one.
+ */
+static int aesd_ring_init(struct aesd_dev *dev)
+{
+    unsigned long bytes;
+
+    if ( ring_size == 0 )
+	    return 0;
+    if ( ring_size > (1U << 30) )
+	    return -EINVAL;
+    bytes = roundup_pow_of_two(max_t(unsigned long, ring_size, PAGE_SIZE));
+    dev->ring = vmalloc(bytes);
+    if ( !dev->ring )
+	    return -ENOMEM;
+    dev->ring_mask = bytes - 1;
+    return 0;
+}
+
+/**
+ * Allocate the area behind mmap: the header page, then mmap_size bytes of data ring
+ * rounded up to a power of two.  Nothing is allocated when mmap_size is 0.
+ */
+static int aesd_mmap_init(struct aesd_dev *dev)
+{
+    unsigned long data_size;
+
+    if ( mmap_size == 0 )
+	    return 0;
+    if ( mmap_size > (1U << 30) )
+	    return -EINVAL;
+    data_size = roundup_pow_of_two(max_t(unsigned long, mmap_size, PAGE_SIZE));
+    dev->mmap_len = PAGE_ALIGN(AESD_MMAP_HEADER_SIZE + data_size);
+    dev->mmap_hdr = vmalloc_user(dev->mmap_len);
+    if ( !dev->mmap_hdr )
+	    return -ENOMEM;
+    dev->mmap_data = (char *)dev->mmap_hdr + AESD_MMAP_HEADER_SIZE;
+    dev->mmap_hdr->magic = AESD_MMAP_MAGIC;
+    dev->mmap_hdr->version = AESD_MMAP_VERSION;
+    dev->mmap_hdr->data_size = data_size;
+    dev->mmap_hdr->max_entries = AESD_MMAP_MAX_ENTRIES;
+    return 0;
+}
+
 static int aesd_setup_cdev(struct aesd_dev *dev)
 {
     int err, devno = MKDEV(aesd_major, aesd_minor);
@@ -197,15 +838,50 @@ static int __init aesd_init_module(void)
     memset(&aesd_device,0,sizeof(struct aesd_dev));
 
     /*Initialize device data */
-    aesd_circular_buffer_init(&aesd_device.circ_buf);
+    result = aesd_circular_buffer_init_capacity(&aesd_device.circ_buf, capacity);
+    if( result ) {
+        printk(KERN_WARNING "Invalid capacity %u, at most %u\n", capacity, AESD_CIRCULAR_BUFFER_MAX_CAPACITY);
+        unregister_chrdev_region(dev, 1);
+        return result;
+    }
     mutex_init(&aesd_device.lock);
-    aesd_device.partial_write_buf = NULL;
-    aesd_device.partial_write_len = 0;
+    spin_lock_init(&aesd_device.ring_lock);
+    seqcount_spinlock_init(&aesd_device.ring_seq, &aesd_device.ring_lock);
+    init_waitqueue_head(&aesd_device.read_queue);
+    result = aesd_partial_write_cache_init();
+    if( result ) {
+        aesd_circular_buffer_destroy(&aesd_device.circ_buf);
+        unregister_chrdev_region(dev, 1);
+        return result;
+    }
+
+    result = aesd_ring_init(&aesd_device);
+    if( result ) {
+        printk(KERN_WARNING "Can't set up a %u byte ring\n", ring_size);
+        aesd_partial_write_cache_destroy();
+        aesd_circular_buffer_destroy(&aesd_device.circ_buf);
+        unregister_chrdev_region(dev, 1);
+        return result;
+    }
+
+    result = aesd_mmap_init(&aesd_device);
+    if( result ) {
+        printk(KERN_WARNING "Can't set up %u bytes for mmap\n", mmap_size);
+        vfree(aesd_device.ring);
+        aesd_partial_write_cache_destroy();
+        aesd_circular_buffer_destroy(&aesd_device.circ_buf);
+        unregister_chrdev_region(dev, 1);
+        return result;
+    }
 	
     /* Register char device */
     result = aesd_setup_cdev(&aesd_device);
 
     if( result ) {
+        vfree(aesd_device.mmap_hdr);
+        vfree(aesd_device.ring);
+        aesd_partial_write_cache_destroy();
+        aesd_circular_buffer_destroy(&aesd_device.circ_buf);
         unregister_chrdev_region(dev, 1);
     }
     return result;
@@ -215,25 +891,30 @@ static int __init aesd_init_module(void)
 static void __exit aesd_cleanup_module(void)
 {
     dev_t devno = MKDEV(aesd_major, aesd_minor);
-    uint8_t index = 0;
+    uint32_t index = 0;
     struct aesd_buffer_entry *entry;
     cdev_del(&aesd_device.cdev);
 
-    /*Free all stored enteries*/
+    /*Free all stored enteries, byte ring entries have no buffptr*/
     AESD_CIRCULAR_BUFFER_FOREACH(entry, &aesd_device.circ_buf, index){
 	    if( entry->buffptr ) {
 		    PDEBUG("Freeing buffer entry at index %u", index);
-		    kfree((char*)entry->buffptr);
+		    aesd_cmd_put(aesd_cmd_of(entry->buffptr));
 		    entry->buffptr = NULL;
 	    }
     }
-
-    /*Free the partial write buffer if it exists */
-    if( aesd_device.partial_write_buf ) {
-	    PDEBUG("Freeing partial write buffer ");
-	    kfree(aesd_device.partial_write_buf);
-	    aesd_device.partial_write_buf = NULL;
-    }
+    aesd_circular_buffer_destroy(&aesd_device.circ_buf);
+    /* Wait for the kfree_rcu() callbacks queued above */
+    rcu_barrier();
+
+    /* A mapping pins its file and so the module, nothing can map the area by now */
+    vfree(aesd_device.mmap_hdr);
+    aesd_device.mmap_hdr = NULL;
+    vfree(aesd_device.ring);
+    aesd_device.ring = NULL;
+
+    /* Every file released its partial write, the chunk cache is empty */
+    aesd_partial_write_cache_destroy();
 
     /*Destroy the mutex */
     mutex_destroy (&aesd_device.lock);
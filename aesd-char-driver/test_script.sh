@@ -28,6 +28,18 @@ echo "Hello, AESD!" | sudo tee /dev/aesdchar
 echo "Testing read operation..."
 sudo cat /dev/aesdchar || echo "Read failed or not implemented yet"
 
+# Count the read() calls needed to read every stored command back: a read
+# used to stop at the end of each command, it now fills the whole buffer
+echo "Measuring read syscalls..."
+for i in $(seq 1 10); do
+    echo "Command $i" | sudo tee /dev/aesdchar > /dev/null
+done
+if command -v strace > /dev/null; then
+    sudo strace -c -e trace=read cat /dev/aesdchar 2>&1 >/dev/null | grep -E "calls|read$"
+else
+    echo "strace not installed, skipping"
+fi
+
 # Check kernel logs for driver output
 echo "Checking kernel logs..."
 dmesg | tail > dmesg_output.log
@@ -0,0 +1,140 @@
+/*
+ * aesd_capture.c - Traffic trace writer
+ *
+ * Events are appended to an in-memory buffer under a mutex and written out
+ * a full buffer at a time, so a capture costs one write() per
+ * CAPTURE_BUFFER_EVENTS events.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <syslog.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdatomic.h>
+#include <time.h>
+#include "aesd_capture.h"
+
+#define CAPTURE_BUFFER_EVENTS	4096
+
+static struct {
+	atomic_bool running;
+	pthread_mutex_t lock;
+	int fd;
+	char *path;
+	uint64_t start_ns;	/* CLOCK_MONOTONIC at event time 0 */
+	struct aesd_capture_event buffer[CAPTURE_BUFFER_EVENTS];
+	size_t buffered;
+	uint64_t events;
+	uint64_t write_errors;
+} capture = {
+	.lock = PTHREAD_MUTEX_INITIALIZER,
+	.fd = -1,
+};
+
+static uint64_t clock_ns( clockid_t clock ) {
+	struct timespec ts;
+	clock_gettime(clock, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static int write_all( int fd, const void *data, size_t length ) {
+	size_t done = 0;
+
+	while( done < length ) {
+		ssize_t rc = write(fd, (const char *)data + done, length - done);
+		if( rc < 0 ) {
+			if( errno == EINTR ) {
+				continue;
+			}
+			return -1;
+		}
+		done += rc;
+	}
+	return 0;
+}
+
+/* Called with the lock held */
+static void capture_flush( void ) {
+	if( capture.buffered > 0 &&
+			write_all(capture.fd, capture.buffer, capture.buffered * sizeof(capture.buffer[0])) < 0 ) {
+		capture.write_errors++;
+	}
+	capture.buffered = 0;
+}
+
+int aesd_capture_start( const char *path ) {
+	struct aesd_capture_header header;
+
+	capture.fd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+	if( capture.fd < 0 ) {
+		return -1;
+	}
+	capture.path = strdup(path);
+	memset(&header, 0, sizeof(header));
+	memcpy(header.magic, AESD_CAPTURE_MAGIC, sizeof(header.magic));
+	header.start_realtime_ns = clock_ns(CLOCK_REALTIME);
+	capture.start_ns = clock_ns(CLOCK_MONOTONIC);
+	if( capture.path == NULL || write_all(capture.fd, &header, sizeof(header)) < 0 ) {
+		int saved_errno = errno;
+		close(capture.fd);
+		capture.fd = -1;
+		free(capture.path);
+		capture.path = NULL;
+		errno = saved_errno;
+		return -1;
+	}
+	atomic_store(&capture.running, true);
+	syslog(LOG_INFO, "Capturing traffic to %s", path);
+	return 0;
+}
+
+void aesd_capture_stop( void ) {
+	if( !atomic_exchange(&capture.running, false) ) {
+		return;
+	}
+	pthread_mutex_lock(&capture.lock);
+	capture_flush();
+	close(capture.fd);
+	capture.fd = -1;
+	syslog(LOG_INFO, "Captured %llu events to %s", (unsigned long long)capture.events, capture.path);
+	free(capture.path);
+	capture.path = NULL;
+	pthread_mutex_unlock(&capture.lock);
+}
+
+void aesd_capture_event( enum aesd_capture_type type, uint32_t conn, size_t length ) {
+	struct aesd_capture_event *event;
+
+	if( !atomic_load_explicit(&capture.running, memory_order_relaxed) ) {
+		return;
+	}
+	if( length > AESD_CAPTURE_LENGTH_MASK ) {
+		length = AESD_CAPTURE_LENGTH_MASK;
+	}
+	pthread_mutex_lock(&capture.lock);
+	if( capture.fd >= 0 ) {
+		event = &capture.buffer[capture.buffered++];
+		event->time_ns = clock_ns(CLOCK_MONOTONIC) - capture.start_ns;
+		event->conn = conn;
+		event->type_length = (uint32_t)type << AESD_CAPTURE_TYPE_SHIFT | (uint32_t)length;
+		capture.events++;
+		if( capture.buffered == CAPTURE_BUFFER_EVENTS ) {
+			capture_flush();
+		}
+	}
+	pthread_mutex_unlock(&capture.lock);
+}
+
+void aesd_capture_dump_stats( FILE *out ) {
+	pthread_mutex_lock(&capture.lock);
+	if( capture.path != NULL ) {
+		fprintf(out, "capture path=%s running=%d events=%llu buffered=%zu write_errors=%llu\n", capture.path,
+			atomic_load(&capture.running), (unsigned long long)capture.events, capture.buffered,
+			(unsigned long long)capture.write_errors);
+	}
+	pthread_mutex_unlock(&capture.lock);
+}
@@ -0,0 +1,52 @@
+/*
+ * aesd_capture.h - Binary traffic trace written by aesdsocket --capture
+ *
+ * The trace records when connections open and close and when and how
+ * large their packets were, never the packet contents. aesdreplay reissues
+ * a trace against a server with synthetic payloads of the same sizes.
+ *
+ * Layout: one struct aesd_capture_header, then struct aesd_capture_event
+ * records in the order they were logged, all in host byte order.
+ */
+
+#ifndef AESD_CAPTURE_H
+#define AESD_CAPTURE_H
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stddef.h>
+
+#define AESD_CAPTURE_MAGIC	"AESDTRC1"
+
+struct aesd_capture_header {
+	char magic[8];
+	uint64_t start_realtime_ns;	/* Wall clock time of event time 0 */
+};
+
+enum aesd_capture_type {
+	AESD_CAPTURE_OPEN = 1,		/* Connection accepted */
+	AESD_CAPTURE_PACKET,		/* Packet to append framed, length is its size */
+	AESD_CAPTURE_COMMAND,		/* Read only packet (empty, stats, search...), length is its size */
+	AESD_CAPTURE_CLOSE,		/* Connection closed by the server */
+};
+
+#define AESD_CAPTURE_LENGTH_MASK	0x0fffffffu
+#define AESD_CAPTURE_TYPE_SHIFT		28
+
+/* 16 bytes per event */
+struct aesd_capture_event {
+	uint64_t time_ns;		/* Since the start of the capture */
+	uint32_t conn;			/* Connection id */
+	uint32_t type_length;		/* Type in the top 4 bits, length in the rest */
+};
+
+/* Start writing a trace to @path, truncating it */
+extern int aesd_capture_start( const char *path );
+extern void aesd_capture_stop( void );
+
+/* Log one event, does nothing unless a capture is running */
+extern void aesd_capture_event( enum aesd_capture_type type, uint32_t conn, size_t length );
+
+extern void aesd_capture_dump_stats( FILE *out );
+
+#endif /* AESD_CAPTURE_H */
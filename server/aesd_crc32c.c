@@ -0,0 +1,136 @@
+/*
+ * aesd_crc32c.c - CRC32C with hardware acceleration and a table fallback
+ */
+
+#include <string.h>
+#include <pthread.h>
+#include "aesd_crc32c.h"
+
+#if defined(__ARM_FEATURE_CRC32)
+#include <arm_acle.h>
+#endif
+
+#define CRC32C_POLY	0x82f63b78	/* Reflected Castagnoli polynomial */
+
+typedef uint32_t (*crc32c_fn)( uint32_t crc, const unsigned char *p, size_t length );
+
+static uint32_t crc32c_table[8][256];
+static crc32c_fn crc32c_update;
+static const char *crc32c_name;
+static pthread_once_t crc32c_once = PTHREAD_ONCE_INIT;
+
+/* Slicing-by-8: eight table lookups per 8 input bytes */
+static uint32_t crc32c_soft( uint32_t crc, const unsigned char *p, size_t length ) {
+	while( length >= 8 ) {
+		uint32_t lo, hi;
+
+		memcpy(&lo, p, 4);
+		memcpy(&hi, p + 4, 4);
+		lo ^= crc;
+		crc = crc32c_table[7][lo & 0xff] ^ crc32c_table[6][(lo >> 8) & 0xff] ^
+			crc32c_table[5][(lo >> 16) & 0xff] ^ crc32c_table[4][lo >> 24] ^
+			crc32c_table[3][hi & 0xff] ^ crc32c_table[2][(hi >> 8) & 0xff] ^
+			crc32c_table[1][(hi >> 16) & 0xff] ^ crc32c_table[0][hi >> 24];
+		p += 8;
+		length -= 8;
+	}
+	while( length-- ) {
+		crc = crc32c_table[0][(crc ^ *p++) & 0xff] ^ (crc >> 8);
+	}
+	return crc;
+}
+
+#if (defined(__x86_64__) || defined(__i386__)) && defined(__GNUC__)
+__attribute__((target("sse4.2")))
+static uint32_t crc32c_sse42( uint32_t crc, const unsigned char *p, size_t length ) {
+	while( length >= 4 ) {
+		uint32_t word;
+
+		memcpy(&word, p, 4);
+		crc = __builtin_ia32_crc32si(crc, word);
+		p += 4;
+		length -= 4;
+	}
+	while( length-- ) {
+		crc = __builtin_ia32_crc32qi(crc, *p++);
+	}
+	return crc;
+}
+
+#if defined(__x86_64__)
+__attribute__((target("sse4.2")))
+static uint32_t crc32c_sse42_64( uint32_t crc, const unsigned char *p, size_t length ) {
+	uint64_t crc64 = crc;
+
+	while( length >= 8 ) {
+		uint64_t word;
+
+		memcpy(&word, p, 8);
+		crc64 = __builtin_ia32_crc32di(crc64, word);
+		p += 8;
+		length -= 8;
+	}
+	return crc32c_sse42(crc64, p, length);
+}
+#endif
+#endif
+
+#if defined(__ARM_FEATURE_CRC32)
+static uint32_t crc32c_armv8( uint32_t crc, const unsigned char *p, size_t length ) {
+	while( length >= 8 ) {
+		uint64_t word;
+
+		memcpy(&word, p, 8);
+		crc = __crc32cd(crc, word);
+		p += 8;
+		length -= 8;
+	}
+	while( length-- ) {
+		crc = __crc32cb(crc, *p++);
+	}
+	return crc;
+}
+#endif
+
+static void crc32c_init( void ) {
+	uint32_t i, j, crc;
+
+	for( i = 0; i < 256; i++ ) {
+		crc = i;
+		for( j = 0; j < 8; j++ ) {
+			crc = (crc >> 1) ^ (crc & 1 ? CRC32C_POLY : 0);
+		}
+		crc32c_table[0][i] = crc;
+	}
+	for( i = 0; i < 256; i++ ) {
+		for( j = 1; j < 8; j++ ) {
+			crc32c_table[j][i] = crc32c_table[0][crc32c_table[j - 1][i] & 0xff] ^ (crc32c_table[j - 1][i] >> 8);
+		}
+	}
+
+	crc32c_update = crc32c_soft;
+	crc32c_name = "soft";
+#if (defined(__x86_64__) || defined(__i386__)) && defined(__GNUC__)
+	if( __builtin_cpu_supports("sse4.2") ) {
+#if defined(__x86_64__)
+		crc32c_update = crc32c_sse42_64;
+#else
+		crc32c_update = crc32c_sse42;
+#endif
+		crc32c_name = "sse4.2";
+	}
+#elif defined(__ARM_FEATURE_CRC32)
+	crc32c_update = crc32c_armv8;
+	crc32c_name = "armv8";
+#endif
+}
+
+uint32_t aesd_crc32c( uint32_t crc, const void *data, size_t length ) {
+	pthread_once(&crc32c_once, crc32c_init);
+	return ~crc32c_update(~crc, data, length);
+}
+
+const char *aesd_crc32c_impl( void ) {
+	pthread_once(&crc32c_once, crc32c_init);
+	return crc32c_name;
+}
@@ -0,0 +1,24 @@
+/*
+ * aesd_crc32c.h - CRC32C (Castagnoli) checksums
+ *
+ * Uses the SSE4.2 crc32 instruction when the CPU has it, the ARMv8 CRC32
+ * extension when the compiler targets it, and a slicing-by-8 table
+ * otherwise. All implementations give the same result.
+ */
+
+#ifndef AESD_CRC32C_H
+#define AESD_CRC32C_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+/**
+ * aesd_crc32c() - Extend @crc over @length bytes of @data
+ * Start with 0; aesd_crc32c(aesd_crc32c(0, a), b) equals the CRC of a then b.
+ */
+extern uint32_t aesd_crc32c( uint32_t crc, const void *data, size_t length );
+
+/* Name of the implementation in use, for the stats */
+extern const char *aesd_crc32c_impl( void );
+
+#endif /* AESD_CRC32C_H */
@@ -0,0 +1,446 @@
+/*
+ * aesd_index.c - Inverted token index over the stored packets
+ *
+ * Terms live in a chained hash table. Each term's posting list and the
+ * list of indexed records are ring buffers that grow by doubling, so
+ * appending at the back and evicting at the front are both O(1).
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#include <errno.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include "aesd_index.h"
+
+#define INDEX_INITIAL_BUCKETS	1024
+#define INDEX_MAX_QUERY_TOKENS	16
+
+struct index_posting {
+	uint64_t offset;
+	uint32_t length;
+};
+
+struct index_term {
+	struct index_term *next;	/* Hash chain */
+	uint32_t hash;
+	struct index_posting *postings;	/* Ring, oldest at @head */
+	size_t head;
+	size_t count;
+	size_t capacity;
+	uint8_t len;
+	char text[];
+};
+
+/* An indexed record and the distinct terms it was added to, kept for eviction */
+struct index_record {
+	uint64_t offset;
+	uint32_t length;
+	uint32_t nterms;
+	struct index_term **terms;
+};
+
+static struct {
+	pthread_rwlock_t lock;
+	bool enabled;
+	struct index_term **buckets;
+	size_t nbuckets;
+	size_t nterms;
+	struct index_record *records;	/* Ring, oldest at @rec_head */
+	size_t rec_head;
+	size_t rec_count;
+	size_t rec_capacity;
+	uint64_t next_offset;		/* Offset just past the newest indexed record */
+	uint64_t postings;
+	uint64_t evicted;
+	uint64_t resets;
+	_Atomic uint64_t lookups;
+	_Atomic uint64_t matches;
+} idx = {
+	.lock = PTHREAD_RWLOCK_INITIALIZER,
+};
+
+static bool is_token_char( unsigned char c ) {
+	return isalnum(c) || c == '_';
+}
+
+/* Find the next token at or after *@pos, false when there is none */
+static bool next_token( const char *data, size_t length, size_t *pos, const char **token, size_t *token_len ) {
+	size_t start = *pos, end;
+
+	while( start < length && !is_token_char(data[start]) ) {
+		start++;
+	}
+	if( start == length ) {
+		*pos = length;
+		return false;
+	}
+	end = start;
+	while( end < length && is_token_char(data[end]) ) {
+		end++;
+	}
+	*pos = end;
+	*token = data + start;
+	*token_len = end - start < AESD_INDEX_MAX_TOKEN ? end - start : AESD_INDEX_MAX_TOKEN;
+	return true;
+}
+
+static uint32_t hash_token( const char *token, size_t len ) {
+	uint32_t hash = 2166136261u;	/* FNV-1a */
+	size_t i;
+
+	for( i = 0; i < len; i++ ) {
+		hash = (hash ^ (unsigned char)token[i]) * 16777619u;
+	}
+	return hash;
+}
+
+static struct index_term *find_term( const char *token, size_t len, uint32_t hash ) {
+	struct index_term *term;
+
+	for( term = idx.buckets[hash & (idx.nbuckets - 1)]; term != NULL; term = term->next ) {
+		if( term->hash == hash && term->len == len && memcmp(term->text, token, len) == 0 ) {
+			return term;
+		}
+	}
+	return NULL;
+}
+
+static void grow_buckets( void ) {
+	size_t nbuckets = idx.nbuckets * 2, i;
+	struct index_term **buckets = calloc(nbuckets, sizeof(*buckets));
+
+	if( buckets == NULL ) {
+		return;	/* Keep the longer chains */
+	}
+	for( i = 0; i < idx.nbuckets; i++ ) {
+		struct index_term *term = idx.buckets[i], *next;
+		for( ; term != NULL; term = next ) {
+			next = term->next;
+			term->next = buckets[term->hash & (nbuckets - 1)];
+			buckets[term->hash & (nbuckets - 1)] = term;
+		}
+	}
+	free(idx.buckets);
+	idx.buckets = buckets;
+	idx.nbuckets = nbuckets;
+}
+
+static struct index_term *get_term( const char *token, size_t len ) {
+	uint32_t hash = hash_token(token, len);
+	struct index_term *term = find_term(token, len, hash);
+	size_t bucket;
+
+	if( term != NULL ) {
+		return term;
+	}
+	term = calloc(1, sizeof(*term) + len);
+	if( term == NULL ) {
+		return NULL;
+	}
+	term->hash = hash;
+	term->len = len;
+	memcpy(term->text, token, len);
+	if( idx.nterms >= idx.nbuckets * 2 ) {
+		grow_buckets();
+	}
+	bucket = hash & (idx.nbuckets - 1);
+	term->next = idx.buckets[bucket];
+	idx.buckets[bucket] = term;
+	idx.nterms++;
+	return term;
+}
+
+static void remove_term( struct index_term *term ) {
+	struct index_term **link = &idx.buckets[term->hash & (idx.nbuckets - 1)];
+
+	while( *link != term ) {
+		link = &(*link)->next;
+	}
+	*link = term->next;
+	idx.nterms--;
+	free(term->postings);
+	free(term);
+}
+
+static struct index_posting *posting_at( struct index_term *term, size_t i ) {
+	return &term->postings[(term->head + i) % term->capacity];
+}
+
+static int push_posting( struct index_term *term, uint64_t offset, uint32_t length ) {
+	if( term->count == term->capacity ) {
+		size_t capacity = term->capacity ? term->capacity * 2 : 4, i;
+		struct index_posting *postings = malloc(capacity * sizeof(*postings));
+		if( postings == NULL ) {
+			return -1;
+		}
+		for( i = 0; i < term->count; i++ ) {
+			postings[i] = *posting_at(term, i);
+		}
+		free(term->postings);
+		term->postings = postings;
+		term->capacity = capacity;
+		term->head = 0;
+	}
+	term->postings[(term->head + term->count) % term->capacity] = (struct index_posting){ offset, length };
+	term->count++;
+	idx.postings++;
+	return 0;
+}
+
+static int push_record( const struct index_record *record ) {
+	if( idx.rec_count == idx.rec_capacity ) {
+		size_t capacity = idx.rec_capacity ? idx.rec_capacity * 2 : 1024, i;
+		struct index_record *records = malloc(capacity * sizeof(*records));
+		if( records == NULL ) {
+			return -1;
+		}
+		for( i = 0; i < idx.rec_count; i++ ) {
+			records[i] = idx.records[(idx.rec_head + i) % idx.rec_capacity];
+		}
+		free(idx.records);
+		idx.records = records;
+		idx.rec_capacity = capacity;
+		idx.rec_head = 0;
+	}
+	idx.records[(idx.rec_head + idx.rec_count) % idx.rec_capacity] = *record;
+	idx.rec_count++;
+	return 0;
+}
+
+/* Drop the oldest record, its postings are at the front of each of its terms */
+static void evict_oldest( void ) {
+	struct index_record *record = &idx.records[idx.rec_head];
+	uint32_t i;
+
+	for( i = 0; i < record->nterms; i++ ) {
+		struct index_term *term = record->terms[i];
+		term->head = (term->head + 1) % term->capacity;
+		term->count--;
+		idx.postings--;
+		if( term->count == 0 ) {
+			remove_term(term);
+		}
+	}
+	free(record->terms);
+	idx.rec_head = (idx.rec_head + 1) % idx.rec_capacity;
+	idx.rec_count--;
+	idx.evicted++;
+}
+
+static void clear_index( void ) {
+	while( idx.rec_count > 0 ) {
+		evict_oldest();
+	}
+	idx.next_offset = 0;
+}
+
+/* Storage commit hook, runs under the storage lock */
+static void index_hook( struct aesd_storage *st, uint64_t offset, const char *data, size_t length, void *arg ) {
+	struct index_term *terms[256], **record_terms = terms;
+	size_t nterms = 0, capacity = sizeof(terms) / sizeof(terms[0]), pos = 0, token_len;
+	struct index_record record;
+	const char *token;
+	uint64_t start;
+	(void)arg;
+
+	if( offset == UINT64_MAX ) {
+		return;
+	}
+	pthread_rwlock_wrlock(&idx.lock);
+
+	/* Offsets going backwards means the storage was reset (replica resync) */
+	if( offset < idx.next_offset ) {
+		clear_index();
+		idx.resets++;
+	}
+	start = st->ops->start(st);
+	while( idx.rec_count > 0 && idx.records[idx.rec_head].offset < start ) {
+		evict_oldest();
+	}
+
+	while( next_token(data, length, &pos, &token, &token_len) ) {
+		struct index_term *term = get_term(token, token_len);
+
+		if( term == NULL ) {
+			continue;
+		}
+		/* Repeated tokens of this record are already posted */
+		if( term->count > 0 && posting_at(term, term->count - 1)->offset == offset ) {
+			continue;
+		}
+		if( nterms == capacity ) {
+			struct index_term **bigger = malloc(capacity * 2 * sizeof(*bigger));
+			if( bigger == NULL ) {
+				break;
+			}
+			memcpy(bigger, record_terms, nterms * sizeof(*bigger));
+			if( record_terms != terms ) {
+				free(record_terms);
+			}
+			record_terms = bigger;
+			capacity *= 2;
+		}
+		if( push_posting(term, offset, length) < 0 ) {
+			if( term->count == 0 ) {
+				remove_term(term);
+			}
+			continue;
+		}
+		record_terms[nterms++] = term;
+	}
+
+	record.offset = offset;
+	record.length = length;
+	record.nterms = nterms;
+	record.terms = malloc(nterms * sizeof(*record.terms));
+	if( record.terms != NULL || nterms == 0 ) {
+		if( nterms > 0 ) {
+			memcpy(record.terms, record_terms, nterms * sizeof(*record.terms));
+		}
+		if( push_record(&record) < 0 ) {
+			free(record.terms);
+			record.terms = NULL;
+		}
+	}
+	if( record.terms == NULL && nterms > 0 ) {
+		/* Could not remember the record, take its postings back out */
+		size_t i;
+		for( i = 0; i < nterms; i++ ) {
+			record_terms[i]->count--;
+			idx.postings--;
+			if( record_terms[i]->count == 0 ) {
+				remove_term(record_terms[i]);
+			}
+		}
+	}
+	if( record_terms != terms ) {
+		free(record_terms);
+	}
+	idx.next_offset = offset + length;
+	pthread_rwlock_unlock(&idx.lock);
+}
+
+int aesd_index_init( struct aesd_storage *st ) {
+	if( aesd_storage_size(st) == UINT64_MAX ) {
+		errno = ENOTSUP;	/* Records cannot be located without offsets */
+		return -1;
+	}
+	idx.buckets = calloc(INDEX_INITIAL_BUCKETS, sizeof(*idx.buckets));
+	if( idx.buckets == NULL ) {
+		return -1;
+	}
+	idx.nbuckets = INDEX_INITIAL_BUCKETS;
+	/* Data already in storage (a kept file) is not indexed, start after it */
+	idx.next_offset = aesd_storage_size(st);
+	if( aesd_storage_add_hook(st, index_hook, NULL) < 0 ) {
+		free(idx.buckets);
+		idx.buckets = NULL;
+		return -1;
+	}
+	idx.enabled = true;
+	return 0;
+}
+
+void aesd_index_destroy( void ) {
+	if( !idx.enabled ) {
+		return;
+	}
+	pthread_rwlock_wrlock(&idx.lock);
+	clear_index();
+	free(idx.records);
+	free(idx.buckets);
+	idx.records = NULL;
+	idx.buckets = NULL;
+	idx.rec_capacity = 0;
+	idx.enabled = false;
+	pthread_rwlock_unlock(&idx.lock);
+}
+
+bool aesd_index_enabled( void ) {
+	return idx.enabled;
+}
+
+/* Whether @term has a posting at @offset, postings are sorted by offset */
+static bool term_contains( struct index_term *term, uint64_t offset ) {
+	size_t low = 0, high = term->count;
+
+	while( low < high ) {
+		size_t mid = low + (high - low) / 2;
+		uint64_t value = posting_at(term, mid)->offset;
+		if( value == offset ) {
+			return true;
+		}
+		if( value < offset ) {
+			low = mid + 1;
+		} else {
+			high = mid;
+		}
+	}
+	return false;
+}
+
+ssize_t aesd_index_lookup( const char *query, size_t query_len, struct aesd_index_match **matches ) {
+	struct index_term *terms[INDEX_MAX_QUERY_TOKENS];
+	struct index_term *shortest = NULL;
+	struct aesd_index_match *result = NULL;
+	size_t nterms = 0, pos = 0, token_len, i, j;
+	const char *token;
+	ssize_t count = 0;
+
+	*matches = NULL;
+	atomic_fetch_add(&idx.lookups, 1);
+	pthread_rwlock_rdlock(&idx.lock);
+	while( nterms < INDEX_MAX_QUERY_TOKENS && next_token(query, query_len, &pos, &token, &token_len) ) {
+		struct index_term *term = find_term(token, token_len, hash_token(token, token_len));
+		if( term == NULL ) {
+			goto out;	/* A token nobody used, nothing can match */
+		}
+		terms[nterms++] = term;
+		if( shortest == NULL || term->count < shortest->count ) {
+			shortest = term;
+		}
+	}
+	if( shortest == NULL ) {
+		goto out;
+	}
+
+	/* Walk the rarest term and check the others for each of its records */
+	result = malloc(shortest->count * sizeof(*result));
+	if( result == NULL ) {
+		count = -1;
+		goto out;
+	}
+	for( i = 0; i < shortest->count; i++ ) {
+		struct index_posting *posting = posting_at(shortest, i);
+		for( j = 0; j < nterms; j++ ) {
+			if( terms[j] != shortest && !term_contains(terms[j], posting->offset) ) {
+				break;
+			}
+		}
+		if( j == nterms ) {
+			result[count].offset = posting->offset;
+			result[count].length = posting->length;
+			count++;
+		}
+	}
+	atomic_fetch_add(&idx.matches, count);
+	*matches = result;
+out:
+	pthread_rwlock_unlock(&idx.lock);
+	return count;
+}
+
+void aesd_index_dump_stats( FILE *out ) {
+	if( !idx.enabled ) {
+		return;
+	}
+	pthread_rwlock_rdlock(&idx.lock);
+	fprintf(out, "index terms=%zu records=%zu postings=%llu buckets=%zu evicted=%llu resets=%llu"
+		" lookups=%llu matches=%llu\n",
+		idx.nterms, idx.rec_count, (unsigned long long)idx.postings, idx.nbuckets,
+		(unsigned long long)idx.evicted, (unsigned long long)idx.resets,
+		(unsigned long long)atomic_load(&idx.lookups), (unsigned long long)atomic_load(&idx.matches));
+	pthread_rwlock_unlock(&idx.lock);
+}
@@ -0,0 +1,46 @@
+/*
+ * aesd_index.h - Inverted token index over the stored packets
+ *
+ * A storage commit hook splits every record into tokens (runs of letters,
+ * digits and '_') and appends the record's location to the
+ * posting list of each distinct token. Postings are in commit order, so
+ * when the storage engine evicts its oldest records the matching postings
+ * are always at the front of their lists and are popped in O(1) each.
+ * A lookup walks only the posting lists of the query tokens.
+ *
+ * Matching is case sensitive, like grep in finder-app/finder.sh.
+ */
+
+#ifndef AESD_INDEX_H
+#define AESD_INDEX_H
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stddef.h>
+#include <stdbool.h>
+#include <sys/types.h>
+#include "aesd_storage.h"
+
+#define AESD_INDEX_MAX_TOKEN	64	/* Longer tokens are indexed by their first bytes */
+
+/* Location of one matching record in storage */
+struct aesd_index_match {
+	uint64_t offset;
+	uint32_t length;
+};
+
+/* Start indexing every record appended to @st */
+extern int aesd_index_init( struct aesd_storage *st );
+extern void aesd_index_destroy( void );
+extern bool aesd_index_enabled( void );
+
+/**
+ * aesd_index_lookup() - Find the records containing every token of @query
+ * Returns the number of matches stored in a malloc()ed array at *@matches,
+ * oldest first, or -1 on allocation failure.
+ */
+extern ssize_t aesd_index_lookup( const char *query, size_t query_len, struct aesd_index_match **matches );
+
+extern void aesd_index_dump_stats( FILE *out );
+
+#endif /* AESD_INDEX_H */
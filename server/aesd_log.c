@@ -0,0 +1,303 @@
+/*
+ * aesd_log.c - Asynchronous, rate limited logging for aesdsocket
+ *
+ * Every thread that logs gets a single-producer/single-consumer ring on
+ * first use. Rings are linked into a registry which the background thread
+ * walks every AESD_LOG_DRAIN_INTERVAL_MS. When a thread exits its ring is
+ * marked orphaned and freed by the background thread once drained.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <stdbool.h>
+#include <stdatomic.h>
+#include <pthread.h>
+#include <syslog.h>
+#include <time.h>
+#include <arpa/inet.h>
+#include "aesd_log.h"
+
+#define NSEC_PER_SEC	1000000000ULL
+#define NSEC_PER_MSEC	1000000ULL
+
+enum log_arg_kind {
+	LOG_ARG_ADDR,
+	LOG_ARG_ERRNO,
+	LOG_ARG_SIZE,
+};
+
+struct log_format {
+	int priority;
+	enum log_arg_kind arg_kind;
+	const char *format;
+	const char *name;	/* Used in stats output */
+};
+
+static const struct log_format log_formats[AESD_LOG_MSG_COUNT] = {
+	[AESD_LOG_ACCEPTED]	= { LOG_INFO, LOG_ARG_ADDR, "Accepted connection from %s", "accepted" },
+	[AESD_LOG_CLOSED]	= { LOG_INFO, LOG_ARG_ADDR, "Closed connection from %s", "closed" },
+	[AESD_LOG_ACCEPT_ERROR]	= { LOG_ERR, LOG_ARG_ERRNO, "Failed to accept connection: %s", "accept_error" },
+	[AESD_LOG_OPEN_ERROR]	= { LOG_ERR, LOG_ARG_ERRNO, "Failed to open file: %s", "open_error" },
+	[AESD_LOG_RECV_ERROR]	= { LOG_ERR, LOG_ARG_ERRNO, "Error receiving data: %s", "recv_error" },
+	[AESD_LOG_SEND_ERROR]	= { LOG_ERR, LOG_ARG_ERRNO, "Error sending data: %s", "send_error" },
+	[AESD_LOG_WRITE_ERROR]	= { LOG_ERR, LOG_ARG_ERRNO, "Error writing to file: %s", "write_error" },
+	[AESD_LOG_ALLOC_ERROR]	= { LOG_ERR, LOG_ARG_SIZE, "Failed to allocate %llu bytes", "alloc_error" },
+	[AESD_LOG_RATE_SHED]	= { LOG_WARNING, LOG_ARG_SIZE, "Rate limit exceeded, dropping %llu byte packet", "rate_shed" },
+	[AESD_LOG_SOCKOPT_ERROR] = { LOG_ERR, LOG_ARG_ERRNO, "Failed to set client socket option: %s", "sockopt_error" },
+	[AESD_LOG_READ_ONLY]	= { LOG_WARNING, LOG_ARG_SIZE, "Replica is read only, dropping %llu byte packet", "read_only" },
+	[AESD_LOG_PACKET_TOO_LARGE] = { LOG_WARNING, LOG_ARG_SIZE,
+		"Packet exceeds the size limit after %llu bytes, dropping connection", "packet_too_large" },
+};
+
+struct log_record {
+	uint64_t arg;
+	uint16_t msg;
+};
+
+struct log_ring {
+	_Atomic uint32_t head;		/* Written by the owning thread */
+	_Atomic uint32_t tail;		/* Written by the background thread */
+	_Atomic bool orphaned;		/* Owning thread has exited */
+	struct log_ring *next;
+	struct log_record records[AESD_LOG_RING_SIZE];
+};
+
+/* Per message type counters */
+struct log_counters {
+	_Atomic uint64_t queued;
+	_Atomic uint64_t emitted;
+	_Atomic uint64_t suppressed;	/* Over the per-type rate */
+	_Atomic uint64_t dropped;	/* Ring was full */
+};
+
+/* Per message type rate limiting state, only touched by the background thread */
+struct log_window {
+	uint64_t start_ns;
+	unsigned int count;
+	uint64_t pending_suppressed;
+};
+
+static pthread_mutex_t registry_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct log_ring *registry;
+static pthread_key_t ring_key;
+static __thread struct log_ring *thread_ring;
+
+static pthread_t log_thread;
+static _Atomic bool log_running;
+static unsigned int log_rate;
+static struct log_counters counters[AESD_LOG_MSG_COUNT];
+static struct log_window windows[AESD_LOG_MSG_COUNT];
+
+static uint64_t monotonic_ns( void ) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * NSEC_PER_SEC + ts.tv_nsec;
+}
+
+static void emit( uint16_t msg, uint64_t arg ) {
+	const struct log_format *fmt = &log_formats[msg];
+	char client_ip[INET_ADDRSTRLEN];
+	struct in_addr addr;
+
+	switch( fmt->arg_kind ) {
+	case LOG_ARG_ADDR:
+		addr.s_addr = (uint32_t)arg;
+		inet_ntop(AF_INET, &addr, client_ip, sizeof(client_ip));
+		syslog(fmt->priority, fmt->format, client_ip);
+		break;
+	case LOG_ARG_ERRNO:
+		syslog(fmt->priority, fmt->format, strerror((int)arg));
+		break;
+	case LOG_ARG_SIZE:
+		syslog(fmt->priority, fmt->format, (unsigned long long)arg);
+		break;
+	}
+	atomic_fetch_add_explicit(&counters[msg].emitted, 1, memory_order_relaxed);
+}
+
+/* Apply the per-type rate limit, then emit */
+static void emit_limited( uint16_t msg, uint64_t arg, uint64_t now ) {
+	struct log_window *window = &windows[msg];
+
+	if( now - window->start_ns >= NSEC_PER_SEC ) {
+		if( window->pending_suppressed > 0 ) {
+			syslog(LOG_WARNING, "Suppressed %llu '%s' log messages",
+				(unsigned long long)window->pending_suppressed, log_formats[msg].name);
+		}
+		window->start_ns = now;
+		window->count = 0;
+		window->pending_suppressed = 0;
+	}
+
+	if( log_rate != 0 && window->count >= log_rate ) {
+		window->pending_suppressed++;
+		atomic_fetch_add_explicit(&counters[msg].suppressed, 1, memory_order_relaxed);
+		return;
+	}
+	window->count++;
+	emit(msg, arg);
+}
+
+static void drain_ring( struct log_ring *ring, uint64_t now ) {
+	uint32_t tail = atomic_load_explicit(&ring->tail, memory_order_relaxed);
+	uint32_t head = atomic_load_explicit(&ring->head, memory_order_acquire);
+
+	while( tail != head ) {
+		struct log_record *record = &ring->records[tail & (AESD_LOG_RING_SIZE - 1)];
+		emit_limited(record->msg, record->arg, now);
+		tail++;
+	}
+	atomic_store_explicit(&ring->tail, tail, memory_order_release);
+}
+
+static void unlink_ring( struct log_ring *ring ) {
+	struct log_ring **link;
+
+	pthread_mutex_lock(&registry_lock);
+	for( link = &registry; *link != NULL; link = &(*link)->next ) {
+		if( *link == ring ) {
+			*link = ring->next;
+			break;
+		}
+	}
+	pthread_mutex_unlock(&registry_lock);
+	free(ring);
+}
+
+static void drain_all( void ) {
+	uint64_t now = monotonic_ns();
+	struct log_ring *ring, *next;
+
+	/* Rings are only ever inserted at the head, so the list after the head is stable */
+	pthread_mutex_lock(&registry_lock);
+	ring = registry;
+	pthread_mutex_unlock(&registry_lock);
+
+	for( ; ring != NULL; ring = next ) {
+		bool orphaned = atomic_load_explicit(&ring->orphaned, memory_order_acquire);
+
+		next = ring->next;
+		drain_ring(ring, now);
+		if( orphaned ) {
+			unlink_ring(ring);
+		}
+	}
+}
+
+static void *log_thread_func( void *arg ) {
+	struct timespec interval = { 0, AESD_LOG_DRAIN_INTERVAL_MS * NSEC_PER_MSEC };
+	(void)arg;
+
+	while( atomic_load(&log_running) ) {
+		drain_all();
+		nanosleep(&interval, NULL);
+	}
+	drain_all();
+	return NULL;
+}
+
+static void ring_destructor( void *arg ) {
+	struct log_ring *ring = arg;
+	atomic_store_explicit(&ring->orphaned, true, memory_order_release);
+}
+
+static struct log_ring *get_thread_ring( void ) {
+	struct log_ring *ring = thread_ring;
+
+	if( ring != NULL ) {
+		return ring;
+	}
+	ring = calloc(1, sizeof(*ring));
+	if( ring == NULL ) {
+		return NULL;
+	}
+	pthread_mutex_lock(&registry_lock);
+	ring->next = registry;
+	registry = ring;
+	pthread_mutex_unlock(&registry_lock);
+
+	pthread_setspecific(ring_key, ring);
+	thread_ring = ring;
+	return ring;
+}
+
+void aesd_log( enum aesd_log_msg msg, uint64_t arg ) {
+	struct log_ring *ring;
+	uint32_t head, tail;
+	int error = errno;	/* Callers may still report errno after logging it */
+
+	atomic_fetch_add_explicit(&counters[msg].queued, 1, memory_order_relaxed);
+
+	/* Before start or after stop just log synchronously */
+	if( !atomic_load_explicit(&log_running, memory_order_relaxed) ) {
+		emit(msg, arg);
+		errno = error;
+		return;
+	}
+
+	ring = get_thread_ring();
+	if( ring == NULL ) {
+		atomic_fetch_add_explicit(&counters[msg].dropped, 1, memory_order_relaxed);
+		errno = error;
+		return;
+	}
+
+	head = atomic_load_explicit(&ring->head, memory_order_relaxed);
+	tail = atomic_load_explicit(&ring->tail, memory_order_acquire);
+	if( head - tail >= AESD_LOG_RING_SIZE ) {
+		atomic_fetch_add_explicit(&counters[msg].dropped, 1, memory_order_relaxed);
+		return;
+	}
+	ring->records[head & (AESD_LOG_RING_SIZE - 1)].msg = msg;
+	ring->records[head & (AESD_LOG_RING_SIZE - 1)].arg = arg;
+	atomic_store_explicit(&ring->head, head + 1, memory_order_release);
+}
+
+int aesd_log_start( unsigned int rate_per_type ) {
+	if( pthread_key_create(&ring_key, ring_destructor) != 0 ) {
+		return -1;
+	}
+	log_rate = rate_per_type;
+	atomic_store(&log_running, true);
+	if( pthread_create(&log_thread, NULL, log_thread_func, NULL) != 0 ) {
+		atomic_store(&log_running, false);
+		pthread_key_delete(ring_key);
+		return -1;
+	}
+	return 0;
+}
+
+void aesd_log_stop( void ) {
+	struct log_ring *ring, *next;
+
+	if( !atomic_exchange(&log_running, false) ) {
+		return;
+	}
+	pthread_join(log_thread, NULL);
+
+	/* Remaining rings belong to threads that are still alive, such as main */
+	pthread_mutex_lock(&registry_lock);
+	for( ring = registry; ring != NULL; ring = next ) {
+		next = ring->next;
+		free(ring);
+	}
+	registry = NULL;
+	pthread_mutex_unlock(&registry_lock);
+	thread_ring = NULL;
+	pthread_key_delete(ring_key);
+}
+
+void aesd_log_dump_stats( FILE *out ) {
+	int msg;
+
+	fprintf(out, "log rate_per_type=%u\n", log_rate);
+	for( msg = 0; msg < AESD_LOG_MSG_COUNT; msg++ ) {
+		fprintf(out, "log %s queued=%llu emitted=%llu suppressed=%llu dropped=%llu\n",
+			log_formats[msg].name,
+			(unsigned long long)atomic_load(&counters[msg].queued),
+			(unsigned long long)atomic_load(&counters[msg].emitted),
+			(unsigned long long)atomic_load(&counters[msg].suppressed),
+			(unsigned long long)atomic_load(&counters[msg].dropped));
+	}
+}
@@ -0,0 +1,49 @@
+/*
+ * aesd_log.h - Asynchronous, rate limited logging for aesdsocket
+ *
+ * Hot path threads push small binary records into a ring owned by the
+ * calling thread; a background thread drains every ring, formats the
+ * records and forwards them to syslog. Formatting (inet_ntop, strerror,
+ * printf) and the syslog call itself therefore never run on the accept or
+ * connection threads, nor while a storage lock is held.
+ */
+
+#ifndef AESD_LOG_H
+#define AESD_LOG_H
+
+#include <stdint.h>
+#include <stdio.h>
+
+/* Message types, see the format table in aesd_log.c */
+enum aesd_log_msg {
+	AESD_LOG_ACCEPTED,	/* arg: IPv4 address in network byte order */
+	AESD_LOG_CLOSED,	/* arg: IPv4 address in network byte order */
+	AESD_LOG_ACCEPT_ERROR,	/* arg: errno */
+	AESD_LOG_OPEN_ERROR,	/* arg: errno */
+	AESD_LOG_RECV_ERROR,	/* arg: errno */
+	AESD_LOG_SEND_ERROR,	/* arg: errno */
+	AESD_LOG_WRITE_ERROR,	/* arg: errno */
+	AESD_LOG_ALLOC_ERROR,	/* arg: requested size */
+	AESD_LOG_RATE_SHED,	/* arg: packet size */
+	AESD_LOG_SOCKOPT_ERROR,	/* arg: errno */
+	AESD_LOG_READ_ONLY,	/* arg: packet size */
+	AESD_LOG_PACKET_TOO_LARGE, /* arg: bytes received without a newline */
+	AESD_LOG_MSG_COUNT
+};
+
+#define AESD_LOG_RING_SIZE		256	/* Records per thread, power of two */
+#define AESD_LOG_DEFAULT_RATE		100	/* Messages per second per type */
+#define AESD_LOG_DRAIN_INTERVAL_MS	10
+
+extern int aesd_log_start( unsigned int rate_per_type );
+
+/* Drain everything still queued and stop the background thread */
+extern void aesd_log_stop( void );
+
+/* Queue a message from any thread, never blocks and leaves errno alone */
+extern void aesd_log( enum aesd_log_msg msg, uint64_t arg );
+
+/* Write queued, emitted, suppressed and dropped counts per message type */
+extern void aesd_log_dump_stats( FILE *out );
+
+#endif /* AESD_LOG_H */
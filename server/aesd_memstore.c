@@ -0,0 +1,99 @@
+/*
+ * aesd_memstore.c - Bounded in-memory record storage for aesdsocket
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include "aesd_memstore.h"
+
+int aesd_memstore_init( struct aesd_memstore *store, size_t max_records, size_t max_bytes ) {
+	int rc;
+
+	memset(store, 0, sizeof(*store));
+	if( max_records == 0 ) {
+		max_records = AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED;
+	} else if( max_records > AESD_CIRCULAR_BUFFER_MAX_CAPACITY ) {
+		max_records = AESD_CIRCULAR_BUFFER_MAX_CAPACITY;
+	}
+	rc = aesd_circular_buffer_init_capacity(&store->ring, max_records);
+	if( rc < 0 ) {
+		errno = -rc;
+		return -1;
+	}
+	store->max_records = max_records;
+	store->max_bytes = max_bytes;
+	return 0;
+}
+
+static void evict_oldest( struct aesd_memstore *store ) {
+	struct aesd_buffer_entry *entry = aesd_circular_buffer_remove_entry(&store->ring);
+
+	if( entry == NULL ) {
+		return;
+	}
+	store->records--;
+	store->bytes -= entry->size;
+	store->evicted_records++;
+	store->evicted_bytes += entry->size;
+	free((char *)entry->buffptr);
+	entry->buffptr = NULL;
+	entry->size = 0;
+}
+
+void aesd_memstore_destroy( struct aesd_memstore *store ) {
+	while( store->records > 0 ) {
+		evict_oldest(store);
+	}
+	aesd_circular_buffer_destroy(&store->ring);
+}
+
+int aesd_memstore_append( struct aesd_memstore *store, const char *data, size_t length ) {
+	struct aesd_buffer_entry entry;
+	char *copy;
+
+	if( length == 0 ) {
+		return 0;
+	}
+	copy = malloc(length);
+	if( copy == NULL ) {
+		errno = ENOMEM;
+		return -1;
+	}
+	memcpy(copy, data, length);
+
+	/* A record larger than the whole budget is still kept, alone */
+	while( store->records > 0 && (store->records >= store->max_records ||
+			(store->max_bytes != 0 && store->bytes + length > store->max_bytes)) ) {
+		evict_oldest(store);
+	}
+
+	entry.buffptr = copy;
+	entry.size = length;
+	aesd_circular_buffer_add_entry(&store->ring, &entry);
+	store->records++;
+	store->bytes += length;
+	return 0;
+}
+
+ssize_t aesd_memstore_read( struct aesd_memstore *store, size_t offset, char *buffer, size_t length ) {
+	size_t copied = 0;
+
+	while( copied < length ) {
+		size_t entry_offset;
+		size_t chunk;
+		struct aesd_buffer_entry *entry = aesd_circular_buffer_find_entry_offset_for_fpos(&store->ring,
+				offset + copied, &entry_offset);
+
+		if( entry == NULL ) {
+			break;	/* End of data */
+		}
+		chunk = entry->size - entry_offset;
+		if( chunk > length - copied ) {
+			chunk = length - copied;
+		}
+		memcpy(buffer + copied, entry->buffptr + entry_offset, chunk);
+		copied += chunk;
+	}
+	return copied;
+}
@@ -0,0 +1,51 @@
+/*
+ * aesd_memstore.h - Bounded in-memory record storage for aesdsocket
+ *
+ * A userspace counterpart of the aesdchar driver: each committed packet is
+ * kept as one aesd_circular_buffer entry and read back through the same
+ * aesd_circular_buffer_find_entry_offset_for_fpos() lookup, without a
+ * kernel round trip. The oldest records are evicted once either the record
+ * count or the byte budget is exceeded.
+ */
+
+#ifndef AESD_MEMSTORE_H
+#define AESD_MEMSTORE_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+#include "../aesd-char-driver/aesd-circular-buffer.h"
+
+#define AESD_MEMSTORE_DEFAULT_MAX_BYTES	(1024 * 1024)
+
+/**
+ * struct aesd_memstore - Bounded record ring, locking is up to the caller
+ * @ring:            the records, buffptr is owned by the store
+ * @max_records:     record count limit, at most AESD_CIRCULAR_BUFFER_MAX_CAPACITY
+ * @max_bytes:       byte budget, 0 for no byte limit
+ * @records:         records currently held
+ * @bytes:           bytes currently held
+ * @evicted_records: records evicted since creation
+ * @evicted_bytes:   bytes evicted since creation
+ */
+struct aesd_memstore {
+	struct aesd_circular_buffer ring;
+	size_t max_records;
+	size_t max_bytes;
+	size_t records;
+	size_t bytes;
+	uint64_t evicted_records;
+	uint64_t evicted_bytes;
+};
+
+/* @max_records 0 keeps AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED records, the ring is sized up front */
+extern int aesd_memstore_init( struct aesd_memstore *store, size_t max_records, size_t max_bytes );
+extern void aesd_memstore_destroy( struct aesd_memstore *store );
+
+/* Copy @length bytes of @data into a new record, evicting the oldest ones as needed */
+extern int aesd_memstore_append( struct aesd_memstore *store, const char *data, size_t length );
+
+/* Copy up to @length bytes starting @offset bytes into the oldest record, 0 at the end */
+extern ssize_t aesd_memstore_read( struct aesd_memstore *store, size_t offset, char *buffer, size_t length );
+
+#endif /* AESD_MEMSTORE_H */
@@ -0,0 +1,537 @@
+/*
+ * aesd_pipeline.c - Receive, commit and reply stages
+ *
+ * Receive workers wait on their own epoll set with EPOLLONESHOT, so only
+ * one thread ever touches a connection at a time. Parked connections are
+ * kept in wake time order and the earliest one bounds the epoll timeout.
+ *
+ * Connection objects come from a slab and packets are received straight
+ * into pooled I/O buffers, which the reply stage reuses for its chunks, so
+ * a warmed up server does not malloc() per connection.
+ */
+
+#define _GNU_SOURCE
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <time.h>
+#include <syslog.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+#include "aesd_pipeline.h"
+#include "aesd_queue.h"
+#include "aesd_pool.h"
+#include "aesd_log.h"
+
+#define RECV_MAX_EVENTS		64
+#define CONN_EPOLL_EVENTS	(EPOLLIN | EPOLLRDHUP | EPOLLONESHOT)
+
+struct aesd_recv_worker {
+	pthread_t thread;
+	bool started;
+	int epfd;
+	int stopfd;		/* eventfd registered with a NULL pointer, written to stop */
+	pthread_mutex_t lock;	/* Protects @conns, the accept thread adds to it */
+	LIST_HEAD(, aesd_conn) conns;
+	size_t nconns;
+	TAILQ_HEAD(park_list, aesd_conn) parked;	/* Only touched by the worker thread */
+	_Atomic size_t nparked;
+	_Atomic uint64_t framed;
+	_Atomic uint64_t parks;
+	_Atomic uint64_t drops;
+	_Atomic uint64_t oversize;
+};
+
+static struct {
+	struct aesd_pipeline_config config;
+	const struct aesd_pipeline_ops *ops;
+	struct aesd_recv_worker *workers;
+	pthread_t *commit_threads;
+	pthread_t *reply_threads;
+	int commit_started;
+	int reply_started;
+	struct aesd_queue commit_queue;
+	struct aesd_queue reply_queue;
+	struct aesd_slab conns;
+	struct aesd_buffer_pool buffers;
+	atomic_uint next_worker;
+	atomic_uint next_conn_id;
+	atomic_bool running;
+	_Atomic uint64_t slow_readers;	/* Replies dropped after reply_timeout_ms */
+} pipeline;
+
+static uint64_t monotonic_ns( void ) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static void conn_release_packet( struct aesd_conn *conn ) {
+	if( conn->packet_pooled ) {
+		aesd_buffer_put(&pipeline.buffers, conn->packet);
+	} else {
+		free(conn->packet);
+	}
+	conn->packet = NULL;
+	conn->packet_pooled = false;
+}
+
+static void conn_free( struct aesd_conn *conn ) {
+	if( pipeline.ops->close != NULL ) {
+		pipeline.ops->close(conn);
+	}
+	close(conn->sockfd);
+	aesd_log(AESD_LOG_CLOSED, conn->addr);
+	conn_release_packet(conn);
+	aesd_slab_free(&pipeline.conns, conn);
+}
+
+/* Make room to receive more of the packet: a pooled buffer first, the heap for longer packets */
+static int conn_grow_packet( struct aesd_conn *conn ) {
+	size_t size;
+	char *packet;
+
+	if( conn->packet == NULL ) {
+		conn->packet = aesd_buffer_get(&pipeline.buffers);
+		if( conn->packet == NULL ) {
+			errno = ENOMEM;
+			return -1;
+		}
+		conn->packet_size = pipeline.buffers.buffer_size;
+		conn->packet_pooled = true;
+		return 0;
+	}
+	if( conn->packet_size >= pipeline.config.max_packet_size ) {
+		errno = EMSGSIZE;
+		return -1;
+	}
+	size = conn->packet_size * 2;
+	if( size > pipeline.config.max_packet_size ) {
+		size = pipeline.config.max_packet_size;
+	}
+	if( conn->packet_pooled ) {
+		packet = malloc(size);
+		if( packet != NULL ) {
+			memcpy(packet, conn->packet, conn->packet_len);
+			conn_release_packet(conn);
+		}
+	} else {
+		packet = realloc(conn->packet, size);
+	}
+	if( packet == NULL ) {
+		errno = ENOMEM;
+		return -1;
+	}
+	conn->packet = packet;
+	conn->packet_size = size;
+	return 0;
+}
+
+/* The connection leaves the receive stage */
+static void worker_release( struct aesd_recv_worker *worker, struct aesd_conn *conn ) {
+	pthread_mutex_lock(&worker->lock);
+	LIST_REMOVE(conn, link);
+	worker->nconns--;
+	pthread_mutex_unlock(&worker->lock);
+}
+
+static void worker_park( struct aesd_recv_worker *worker, struct aesd_conn *conn ) {
+	struct aesd_conn *next;
+
+	/* Delays are short and similar, so searching from the back is usually one step */
+	TAILQ_FOREACH_REVERSE(next, &worker->parked, park_list, park_link) {
+		if( next->wake_ns <= conn->wake_ns ) {
+			TAILQ_INSERT_AFTER(&worker->parked, next, conn, park_link);
+			goto parked;
+		}
+	}
+	TAILQ_INSERT_HEAD(&worker->parked, conn, park_link);
+parked:
+	atomic_fetch_add(&worker->nparked, 1);
+	atomic_fetch_add(&worker->parks, 1);
+}
+
+static void queue_or_close( struct aesd_queue *queue, struct aesd_conn *conn ) {
+	if( aesd_queue_push(queue, conn) < 0 ) {
+		conn_free(conn);	/* Shutting down */
+	}
+}
+
+/* Pass a framed packet on according to the server's decision */
+static void worker_dispatch( struct aesd_recv_worker *worker, struct aesd_conn *conn, bool parked ) {
+	uint64_t delay_ns = 0;
+
+	switch( pipeline.ops->admit(conn, parked, &delay_ns) ) {
+	case AESD_CONN_COMMIT:
+		worker_release(worker, conn);
+		queue_or_close(&pipeline.commit_queue, conn);
+		break;
+	case AESD_CONN_REPLY:
+		worker_release(worker, conn);
+		queue_or_close(&pipeline.reply_queue, conn);
+		break;
+	case AESD_CONN_PARK:
+		conn->wake_ns = monotonic_ns() + delay_ns;
+		worker_park(worker, conn);
+		break;
+	case AESD_CONN_DROP:
+		worker_release(worker, conn);
+		atomic_fetch_add(&worker->drops, 1);
+		conn_free(conn);
+		break;
+	}
+}
+
+/* Close a connection whose packet cannot be received whole, nothing of it is committed */
+static void worker_drop( struct aesd_recv_worker *worker, struct aesd_conn *conn ) {
+	epoll_ctl(worker->epfd, EPOLL_CTL_DEL, conn->sockfd, NULL);
+	worker_release(worker, conn);
+	atomic_fetch_add(&worker->drops, 1);
+	conn_free(conn);
+}
+
+/* Read what is available, dispatch once the packet is newline terminated or the peer is done */
+static void worker_receive( struct aesd_recv_worker *worker, struct aesd_conn *conn ) {
+	for( ;; ) {
+		char *newline;
+		ssize_t rc;
+
+		if( conn->packet_len == conn->packet_size && conn_grow_packet(conn) < 0 ) {
+			if( errno == EMSGSIZE ) {
+				aesd_log(AESD_LOG_PACKET_TOO_LARGE, conn->packet_len);
+				atomic_fetch_add(&worker->oversize, 1);
+			} else {
+				aesd_log(AESD_LOG_ALLOC_ERROR, conn->packet_size * 2);
+			}
+			worker_drop(worker, conn);
+			return;
+		}
+		rc = recv(conn->sockfd, conn->packet + conn->packet_len, conn->packet_size - conn->packet_len, 0);
+		if( rc < 0 ) {
+			if( errno == EINTR ) {
+				continue;
+			}
+			if( errno == EAGAIN || errno == EWOULDBLOCK ) {
+				struct epoll_event event = { .events = CONN_EPOLL_EVENTS, .data.ptr = conn };
+				if( epoll_ctl(worker->epfd, EPOLL_CTL_MOD, conn->sockfd, &event) == 0 ) {
+					return;
+				}
+			}
+			aesd_log(AESD_LOG_RECV_ERROR, errno);
+			worker_drop(worker, conn);
+			return;
+		}
+		if( rc == 0 ) {
+			break;
+		}
+
+		/* Anything after the newline is not part of the packet */
+		newline = memchr(conn->packet + conn->packet_len, '\n', rc);
+		if( newline != NULL ) {
+			conn->packet_len = newline - conn->packet + 1;
+			break;
+		}
+		conn->packet_len += rc;
+	}
+
+	epoll_ctl(worker->epfd, EPOLL_CTL_DEL, conn->sockfd, NULL);
+	atomic_fetch_add(&worker->framed, 1);
+	worker_dispatch(worker, conn, false);
+}
+
+static void *recv_thread_func( void *arg ) {
+	struct aesd_recv_worker *worker = arg;
+	struct epoll_event events[RECV_MAX_EVENTS];
+	struct aesd_conn *conn;
+
+	while( atomic_load(&pipeline.running) ) {
+		int timeout = -1, count, i;
+
+		conn = TAILQ_FIRST(&worker->parked);
+		if( conn != NULL ) {
+			uint64_t now = monotonic_ns();
+			timeout = conn->wake_ns <= now ? 0 : (int)((conn->wake_ns - now) / 1000000) + 1;
+		}
+
+		count = epoll_wait(worker->epfd, events, RECV_MAX_EVENTS, timeout);
+		if( count < 0 && errno != EINTR ) {
+			syslog(LOG_ERR, "epoll_wait failed: %s", strerror(errno));
+			break;
+		}
+		for( i = 0; i < count; i++ ) {
+			if( events[i].data.ptr != NULL ) {
+				worker_receive(worker, events[i].data.ptr);
+			}
+		}
+
+		/* Continue the parked connections whose delay has passed */
+		while( (conn = TAILQ_FIRST(&worker->parked)) != NULL && conn->wake_ns <= monotonic_ns() ) {
+			TAILQ_REMOVE(&worker->parked, conn, park_link);
+			atomic_fetch_sub(&worker->nparked, 1);
+			worker_dispatch(worker, conn, true);
+		}
+	}
+
+	/* Connections still being received or parked get no reply */
+	pthread_mutex_lock(&worker->lock);
+	while( (conn = LIST_FIRST(&worker->conns)) != NULL ) {
+		LIST_REMOVE(conn, link);
+		conn_free(conn);
+	}
+	worker->nconns = 0;
+	pthread_mutex_unlock(&worker->lock);
+	return NULL;
+}
+
+static void *commit_thread_func( void *arg ) {
+	struct aesd_conn *conn;
+	(void)arg;
+
+	while( (conn = aesd_queue_pop(&pipeline.commit_queue)) != NULL ) {
+		pipeline.ops->commit(conn);
+		queue_or_close(&pipeline.reply_queue, conn);
+	}
+	return NULL;
+}
+
+static void *reply_thread_func( void *arg ) {
+	char *buffer = NULL;
+	struct aesd_conn *conn;
+	(void)arg;
+
+	while( (conn = aesd_queue_pop(&pipeline.reply_queue)) != NULL ) {
+		/* Kept across replies once obtained, a failure is retried on the next reply */
+		if( buffer == NULL ) {
+			buffer = aesd_buffer_get(&pipeline.buffers);
+		}
+		if( buffer != NULL ) {
+			if( pipeline.ops->reply(conn, buffer, pipeline.buffers.buffer_size) < 0 && errno == ETIMEDOUT ) {
+				atomic_fetch_add(&pipeline.slow_readers, 1);
+			}
+		} else {
+			aesd_log(AESD_LOG_ALLOC_ERROR, pipeline.buffers.buffer_size);	/* Closed without a reply */
+		}
+		conn_free(conn);
+	}
+	if( buffer != NULL ) {
+		aesd_buffer_put(&pipeline.buffers, buffer);
+	}
+	return NULL;
+}
+
+static int start_worker( struct aesd_recv_worker *worker ) {
+	struct epoll_event event = { .events = EPOLLIN, .data.ptr = NULL };
+
+	worker->epfd = epoll_create1(EPOLL_CLOEXEC);
+	if( worker->epfd < 0 ) {
+		return -1;
+	}
+	worker->stopfd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+	if( worker->stopfd < 0 || epoll_ctl(worker->epfd, EPOLL_CTL_ADD, worker->stopfd, &event) < 0 ) {
+		return -1;
+	}
+	if( pthread_create(&worker->thread, NULL, recv_thread_func, worker) != 0 ) {
+		return -1;
+	}
+	worker->started = true;
+	return 0;
+}
+
+int aesd_pipeline_start( const struct aesd_pipeline_config *config, const struct aesd_pipeline_ops *ops ) {
+	int i;
+
+	pipeline.config = *config;
+	if( pipeline.config.recv_threads <= 0 ) {
+		pipeline.config.recv_threads = AESD_PIPELINE_DEFAULT_RECV_THREADS;
+	}
+	if( pipeline.config.commit_threads <= 0 ) {
+		pipeline.config.commit_threads = AESD_PIPELINE_DEFAULT_COMMIT_THREADS;
+	}
+	if( pipeline.config.reply_threads <= 0 ) {
+		pipeline.config.reply_threads = AESD_PIPELINE_DEFAULT_REPLY_THREADS;
+	}
+	if( pipeline.config.queue_depth == 0 ) {
+		pipeline.config.queue_depth = AESD_PIPELINE_DEFAULT_QUEUE_DEPTH;
+	}
+	if( pipeline.config.buffer_size == 0 ) {
+		pipeline.config.buffer_size = AESD_PIPELINE_DEFAULT_BUFFER_SIZE;
+	}
+	if( pipeline.config.reply_timeout_ms <= 0 ) {
+		pipeline.config.reply_timeout_ms = AESD_PIPELINE_DEFAULT_REPLY_TIMEOUT_MS;
+	}
+	if( pipeline.config.max_packet_size == 0 ) {
+		pipeline.config.max_packet_size = AESD_PIPELINE_DEFAULT_MAX_PACKET;
+	}
+	if( pipeline.config.max_packet_size < pipeline.config.buffer_size ) {
+		pipeline.config.max_packet_size = pipeline.config.buffer_size;
+	}
+	pipeline.ops = ops;
+	atomic_store(&pipeline.running, true);
+
+	pipeline.workers = calloc(pipeline.config.recv_threads, sizeof(*pipeline.workers));
+	pipeline.commit_threads = calloc(pipeline.config.commit_threads, sizeof(pthread_t));
+	pipeline.reply_threads = calloc(pipeline.config.reply_threads, sizeof(pthread_t));
+	if( !pipeline.workers || !pipeline.commit_threads || !pipeline.reply_threads ) {
+		return -1;
+	}
+	for( i = 0; i < pipeline.config.recv_threads; i++ ) {
+		struct aesd_recv_worker *worker = &pipeline.workers[i];
+		pthread_mutex_init(&worker->lock, NULL);
+		LIST_INIT(&worker->conns);
+		TAILQ_INIT(&worker->parked);
+		worker->epfd = -1;
+		worker->stopfd = -1;
+	}
+	/* Keep enough free buffers to refill both queues without touching malloc() */
+	if( aesd_slab_init(&pipeline.conns, "conn", sizeof(struct aesd_conn)) < 0 ||
+			aesd_buffer_pool_init(&pipeline.buffers, "io", pipeline.config.buffer_size,
+				2 * pipeline.config.queue_depth) < 0 ) {
+		return -1;
+	}
+	if( aesd_queue_init(&pipeline.commit_queue, "commit", pipeline.config.queue_depth) < 0 ||
+			aesd_queue_init(&pipeline.reply_queue, "reply", pipeline.config.queue_depth) < 0 ) {
+		return -1;
+	}
+
+	for( i = 0; i < pipeline.config.reply_threads; i++ ) {
+		if( pthread_create(&pipeline.reply_threads[i], NULL, reply_thread_func, NULL) != 0 ) {
+			return -1;
+		}
+		pipeline.reply_started++;
+	}
+	for( i = 0; i < pipeline.config.commit_threads; i++ ) {
+		if( pthread_create(&pipeline.commit_threads[i], NULL, commit_thread_func, NULL) != 0 ) {
+			return -1;
+		}
+		pipeline.commit_started++;
+	}
+	for( i = 0; i < pipeline.config.recv_threads; i++ ) {
+		if( start_worker(&pipeline.workers[i]) < 0 ) {
+			return -1;
+		}
+	}
+	return 0;
+}
+
+void aesd_pipeline_stop( void ) {
+	uint64_t one = 1;
+	int i;
+
+	atomic_store(&pipeline.running, false);
+	if( pipeline.workers != NULL ) {
+		for( i = 0; i < pipeline.config.recv_threads; i++ ) {
+			struct aesd_recv_worker *worker = &pipeline.workers[i];
+			if( worker->started ) {
+				if( write(worker->stopfd, &one, sizeof(one)) < 0 ) {
+					syslog(LOG_ERR, "Failed to wake receive worker: %s", strerror(errno));
+				}
+				pthread_join(worker->thread, NULL);
+			}
+			if( worker->stopfd >= 0 ) {
+				close(worker->stopfd);
+			}
+			if( worker->epfd >= 0 ) {
+				close(worker->epfd);
+			}
+			pthread_mutex_destroy(&worker->lock);
+		}
+	}
+
+	/* Let the later stages finish what was already received, in stage order */
+	if( pipeline.commit_queue.items != NULL ) {
+		aesd_queue_close(&pipeline.commit_queue);
+	}
+	for( i = 0; i < pipeline.commit_started; i++ ) {
+		pthread_join(pipeline.commit_threads[i], NULL);
+	}
+	if( pipeline.reply_queue.items != NULL ) {
+		aesd_queue_close(&pipeline.reply_queue);
+	}
+	for( i = 0; i < pipeline.reply_started; i++ ) {
+		pthread_join(pipeline.reply_threads[i], NULL);
+	}
+	aesd_queue_destroy(&pipeline.commit_queue);
+	aesd_queue_destroy(&pipeline.reply_queue);
+	aesd_buffer_pool_destroy(&pipeline.buffers);
+	aesd_slab_destroy(&pipeline.conns);
+
+	free(pipeline.workers);
+	free(pipeline.commit_threads);
+	free(pipeline.reply_threads);
+	pipeline.workers = NULL;
+	pipeline.commit_threads = NULL;
+	pipeline.reply_threads = NULL;
+	pipeline.commit_started = 0;
+	pipeline.reply_started = 0;
+}
+
+int aesd_pipeline_submit( int sockfd, uint32_t addr, void *client ) {
+	struct aesd_recv_worker *worker;
+	struct aesd_conn *conn = aesd_slab_alloc(&pipeline.conns);
+	struct epoll_event event;
+
+	if( conn == NULL ) {
+		return -1;
+	}
+	conn->sockfd = sockfd;
+	conn->addr = addr;
+	conn->client = client;
+	conn->id = atomic_fetch_add(&pipeline.next_conn_id, 1);
+	if( pipeline.ops->open != NULL ) {
+		pipeline.ops->open(conn);
+	}
+	worker = &pipeline.workers[atomic_fetch_add(&pipeline.next_worker, 1) % pipeline.config.recv_threads];
+	conn->worker = worker;
+
+	pthread_mutex_lock(&worker->lock);
+	LIST_INSERT_HEAD(&worker->conns, conn, link);
+	worker->nconns++;
+	pthread_mutex_unlock(&worker->lock);
+
+	/* From here on the worker owns the connection */
+	event.events = CONN_EPOLL_EVENTS;
+	event.data.ptr = conn;
+	if( epoll_ctl(worker->epfd, EPOLL_CTL_ADD, sockfd, &event) < 0 ) {
+		worker_release(worker, conn);
+		if( pipeline.ops->close != NULL ) {
+			pipeline.ops->close(conn);	/* The caller closes the socket */
+		}
+		aesd_slab_free(&pipeline.conns, conn);
+		return -1;
+	}
+	return 0;
+}
+
+void aesd_pipeline_dump_stats( FILE *out ) {
+	int i;
+
+	if( pipeline.workers == NULL ) {
+		return;
+	}
+	fprintf(out, "pipeline recv_threads=%d commit_threads=%d reply_threads=%d\n",
+		pipeline.config.recv_threads, pipeline.config.commit_threads, pipeline.config.reply_threads);
+	for( i = 0; i < pipeline.config.recv_threads; i++ ) {
+		struct aesd_recv_worker *worker = &pipeline.workers[i];
+		size_t nconns;
+
+		pthread_mutex_lock(&worker->lock);
+		nconns = worker->nconns;
+		pthread_mutex_unlock(&worker->lock);
+		fprintf(out, "pipeline recv worker=%d conns=%zu parked=%zu framed=%llu parks=%llu drops=%llu oversize=%llu\n",
+			i, nconns, atomic_load(&worker->nparked),
+			(unsigned long long)atomic_load(&worker->framed),
+			(unsigned long long)atomic_load(&worker->parks),
+			(unsigned long long)atomic_load(&worker->drops),
+			(unsigned long long)atomic_load(&worker->oversize));
+	}
+	fprintf(out, "pipeline reply timeout_ms=%d slow_readers=%llu\n", pipeline.config.reply_timeout_ms,
+		(unsigned long long)atomic_load(&pipeline.slow_readers));
+	aesd_queue_dump_stats(&pipeline.commit_queue, out);
+	aesd_queue_dump_stats(&pipeline.reply_queue, out);
+	aesd_slab_dump_stats(&pipeline.conns, out);
+	aesd_buffer_pool_dump_stats(&pipeline.buffers, out);
+}
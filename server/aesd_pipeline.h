@@ -0,0 +1,112 @@
+/*
+ * aesd_pipeline.h - Staged connection handling for aesdsocket
+ *
+ * A connection moves through three stages, each with its own threads,
+ * connected by bounded queues:
+ *
+ *   receive  epoll workers read and frame the packet, apply the rate limit
+ *            (over-limit connections are parked on a timer, not slept on)
+ *   commit   append the packet to storage
+ *   reply    stream the stored data back and close the connection
+ *
+ * The server decides what happens to a framed packet through
+ * struct aesd_pipeline_ops, the pipeline only moves connections along.
+ */
+
+#ifndef AESD_PIPELINE_H
+#define AESD_PIPELINE_H
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stddef.h>
+#include <stdbool.h>
+#include "queue.h"
+
+#define AESD_PIPELINE_DEFAULT_RECV_THREADS	2
+#define AESD_PIPELINE_DEFAULT_COMMIT_THREADS	1
+#define AESD_PIPELINE_DEFAULT_REPLY_THREADS	4
+#define AESD_PIPELINE_DEFAULT_QUEUE_DEPTH	1024
+#define AESD_PIPELINE_DEFAULT_BUFFER_SIZE	(16 * 1024)
+#define AESD_PIPELINE_DEFAULT_MAX_PACKET	(16 * 1024 * 1024)
+#define AESD_PIPELINE_DEFAULT_REPLY_TIMEOUT_MS	5000
+
+struct aesd_recv_worker;
+
+/* One client connection, owned by exactly one stage at a time */
+struct aesd_conn {
+	uint32_t id;			/* Sequence number in accept order */
+	int sockfd;
+	uint32_t addr;			/* IPv4 address in network byte order */
+	void *client;			/* Server private per-client state */
+	void *target;			/* Server private, set by admit for the later stages */
+	char *packet;			/* Packet accumulated up to and including the newline */
+	size_t packet_len;
+	size_t packet_size;		/* Allocated size of @packet */
+	bool packet_pooled;		/* @packet came from the I/O buffer pool */
+	uint64_t wake_ns;		/* When a parked connection may continue */
+	struct aesd_recv_worker *worker;
+	LIST_ENTRY(aesd_conn) link;	/* Connections held by the receive worker */
+	TAILQ_ENTRY(aesd_conn) park_link;
+};
+
+enum aesd_conn_action {
+	AESD_CONN_COMMIT,	/* Queue for commit, then reply */
+	AESD_CONN_REPLY,	/* Skip the commit stage */
+	AESD_CONN_PARK,		/* Retry admit after the returned delay */
+	AESD_CONN_DROP,		/* Close without a reply */
+};
+
+/**
+ * struct aesd_pipeline_ops - Server callbacks, one per stage
+ * @admit:  receive stage, decide what to do with a framed packet. For
+ *          AESD_CONN_PARK set *@delay_ns; a parked connection is admitted
+ *          again with @parked true once the delay passed
+ * @commit: commit stage, store the packet
+ * @reply:  reply stage, send the response; the pipeline closes the socket.
+ *          Returns -1 with errno set when the reply was cut short, ETIMEDOUT
+ *          for a client that stopped reading it
+ * @open:   the connection entered the pipeline (optional)
+ * @close:  the pipeline is about to close the connection (optional)
+ */
+struct aesd_pipeline_ops {
+	enum aesd_conn_action (*admit)( struct aesd_conn *conn, bool parked, uint64_t *delay_ns );
+	void (*commit)( struct aesd_conn *conn );
+	int (*reply)( struct aesd_conn *conn, char *buffer, size_t buffer_size );
+	void (*open)( struct aesd_conn *conn );
+	void (*close)( struct aesd_conn *conn );
+};
+
+/**
+ * struct aesd_pipeline_config - Stage sizing
+ * @recv_threads:   epoll workers framing packets
+ * @commit_threads: threads appending to storage
+ * @reply_threads:  threads streaming replies
+ * @queue_depth:    capacity of the commit and reply queues
+ * @buffer_size:    pooled I/O buffer size, used for receiving packets and as
+ *                  the reply chunk size; longer packets move to the heap
+ * @max_packet_size: longest packet received, the connection is dropped once a
+ *                  packet grows past it without a newline
+ * @reply_timeout_ms: longest wait for a client to take more of its reply, a
+ *                  slower reader is dropped so it cannot hold a reply thread
+ */
+struct aesd_pipeline_config {
+	int recv_threads;
+	int commit_threads;
+	int reply_threads;
+	size_t queue_depth;
+	size_t buffer_size;
+	size_t max_packet_size;
+	int reply_timeout_ms;
+};
+
+extern int aesd_pipeline_start( const struct aesd_pipeline_config *config, const struct aesd_pipeline_ops *ops );
+
+/* Stop receiving and finish the connections already past the receive stage */
+extern void aesd_pipeline_stop( void );
+
+/* Hand an accepted non-blocking socket to a receive worker */
+extern int aesd_pipeline_submit( int sockfd, uint32_t addr, void *client );
+
+extern void aesd_pipeline_dump_stats( FILE *out );
+
+#endif /* AESD_PIPELINE_H */
@@ -0,0 +1,277 @@
+/*
+ * aesd_pool.c - Object slab with per-thread magazines and I/O buffer pool
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include "aesd_pool.h"
+
+#define SLAB_CHUNK_OBJECTS	64
+#define SLAB_MAGAZINE_SIZE	32	/* Objects moved between a magazine and the depot at once */
+
+/* Free objects are linked through their first word */
+#define FREE_NEXT(object)	(*(void **)(object))
+
+struct slab_chunk {
+	struct slab_chunk *next;
+	max_align_t objects[];
+};
+
+struct slab_magazine {
+	struct aesd_slab *slab;
+	void *head;
+	size_t count;
+};
+
+/* Move up to @count objects from the list at *@from to the list at *@to */
+static size_t move_objects( void **from, void **to, size_t count ) {
+	size_t moved = 0;
+
+	while( moved < count && *from != NULL ) {
+		void *object = *from;
+		*from = FREE_NEXT(object);
+		FREE_NEXT(object) = *to;
+		*to = object;
+		moved++;
+	}
+	return moved;
+}
+
+/* Thread exit: hand the cached objects to the threads still running */
+static void magazine_release( void *arg ) {
+	struct slab_magazine *mag = arg;
+	struct aesd_slab *slab = mag->slab;
+
+	pthread_mutex_lock(&slab->lock);
+	slab->depot_count += move_objects(&mag->head, &slab->depot, mag->count);
+	pthread_mutex_unlock(&slab->lock);
+	free(mag);
+}
+
+static struct slab_magazine *magazine_get( struct aesd_slab *slab ) {
+	struct slab_magazine *mag = pthread_getspecific(slab->key);
+
+	if( mag == NULL ) {
+		mag = calloc(1, sizeof(*mag));
+		if( mag == NULL ) {
+			return NULL;
+		}
+		mag->slab = slab;
+		pthread_setspecific(slab->key, mag);
+	}
+	return mag;
+}
+
+/* Carve a new chunk into the depot, called with the slab lock held */
+static int slab_grow( struct aesd_slab *slab ) {
+	struct slab_chunk *chunk = malloc(sizeof(*chunk) + SLAB_CHUNK_OBJECTS * slab->object_size);
+	size_t i;
+
+	if( chunk == NULL ) {
+		return -1;
+	}
+	chunk->next = slab->chunks;
+	slab->chunks = chunk;
+	slab->nchunks++;
+	for( i = 0; i < SLAB_CHUNK_OBJECTS; i++ ) {
+		void *object = (char *)chunk->objects + i * slab->object_size;
+		FREE_NEXT(object) = slab->depot;
+		slab->depot = object;
+	}
+	slab->depot_count += SLAB_CHUNK_OBJECTS;
+	return 0;
+}
+
+int aesd_slab_init( struct aesd_slab *slab, const char *name, size_t object_size ) {
+	size_t align = sizeof(max_align_t);
+
+	memset(slab, 0, sizeof(*slab));
+	if( object_size < sizeof(void *) ) {
+		object_size = sizeof(void *);
+	}
+	slab->name = name;
+	slab->object_size = (object_size + align - 1) / align * align;
+	if( pthread_key_create(&slab->key, magazine_release) != 0 ) {
+		return -1;
+	}
+	pthread_mutex_init(&slab->lock, NULL);
+	return 0;
+}
+
+void aesd_slab_destroy( struct aesd_slab *slab ) {
+	struct slab_chunk *chunk;
+
+	if( slab->name == NULL ) {
+		return;
+	}
+	/* Other threads released their magazines on exit, this one still holds its own */
+	free(pthread_getspecific(slab->key));
+	pthread_setspecific(slab->key, NULL);
+	pthread_key_delete(slab->key);
+	while( (chunk = slab->chunks) != NULL ) {
+		slab->chunks = chunk->next;
+		free(chunk);
+	}
+	pthread_mutex_destroy(&slab->lock);
+	slab->name = NULL;
+}
+
+void *aesd_slab_alloc( struct aesd_slab *slab ) {
+	struct slab_magazine *mag = magazine_get(slab);
+	size_t in_use, high_water;
+	void *object;
+
+	if( mag == NULL ) {
+		return NULL;
+	}
+	if( mag->head == NULL ) {
+		pthread_mutex_lock(&slab->lock);
+		if( slab->depot == NULL ) {
+			atomic_fetch_add(&slab->misses, 1);
+			if( slab_grow(slab) < 0 ) {
+				pthread_mutex_unlock(&slab->lock);
+				return NULL;
+			}
+		}
+		mag->count = move_objects(&slab->depot, &mag->head, SLAB_MAGAZINE_SIZE);
+		slab->depot_count -= mag->count;
+		pthread_mutex_unlock(&slab->lock);
+	}
+	object = mag->head;
+	mag->head = FREE_NEXT(object);
+	mag->count--;
+	memset(object, 0, slab->object_size);
+
+	atomic_fetch_add(&slab->allocs, 1);
+	in_use = atomic_fetch_add(&slab->in_use, 1) + 1;
+	high_water = atomic_load(&slab->high_water);
+	while( in_use > high_water && !atomic_compare_exchange_weak(&slab->high_water, &high_water, in_use) ) {
+	}
+	return object;
+}
+
+void aesd_slab_free( struct aesd_slab *slab, void *object ) {
+	struct slab_magazine *mag = magazine_get(slab);
+
+	atomic_fetch_sub(&slab->in_use, 1);
+	if( mag == NULL ) {
+		/* No magazine for this thread, give the object straight to the depot */
+		pthread_mutex_lock(&slab->lock);
+		FREE_NEXT(object) = slab->depot;
+		slab->depot = object;
+		slab->depot_count++;
+		pthread_mutex_unlock(&slab->lock);
+		return;
+	}
+	FREE_NEXT(object) = mag->head;
+	mag->head = object;
+	mag->count++;
+	/* Threads that only free (the reply stage) pass their surplus back in batches */
+	if( mag->count >= 2 * SLAB_MAGAZINE_SIZE ) {
+		pthread_mutex_lock(&slab->lock);
+		slab->depot_count += move_objects(&mag->head, &slab->depot, SLAB_MAGAZINE_SIZE);
+		pthread_mutex_unlock(&slab->lock);
+		mag->count -= SLAB_MAGAZINE_SIZE;
+	}
+}
+
+void aesd_slab_dump_stats( struct aesd_slab *slab, FILE *out ) {
+	size_t nchunks, depot_count;
+
+	if( slab->name == NULL ) {
+		return;
+	}
+	pthread_mutex_lock(&slab->lock);
+	nchunks = slab->nchunks;
+	depot_count = slab->depot_count;
+	pthread_mutex_unlock(&slab->lock);
+	fprintf(out, "slab %s object_size=%zu in_use=%zu high_water=%zu allocs=%llu misses=%llu chunks=%zu depot=%zu\n",
+		slab->name, slab->object_size, atomic_load(&slab->in_use), atomic_load(&slab->high_water),
+		(unsigned long long)atomic_load(&slab->allocs), (unsigned long long)atomic_load(&slab->misses),
+		nchunks, depot_count);
+}
+
+int aesd_buffer_pool_init( struct aesd_buffer_pool *pool, const char *name,
+		size_t buffer_size, size_t max_cached ) {
+	size_t page_size = sysconf(_SC_PAGESIZE);
+
+	memset(pool, 0, sizeof(*pool));
+	if( buffer_size == 0 ) {
+		errno = EINVAL;
+		return -1;
+	}
+	pool->name = name;
+	pool->buffer_size = (buffer_size + page_size - 1) / page_size * page_size;
+	pool->max_cached = max_cached;
+	pthread_mutex_init(&pool->lock, NULL);
+	return 0;
+}
+
+void aesd_buffer_pool_destroy( struct aesd_buffer_pool *pool ) {
+	void *buffer;
+
+	if( pool->name == NULL ) {
+		return;
+	}
+	while( (buffer = pool->free_list) != NULL ) {
+		pool->free_list = FREE_NEXT(buffer);
+		free(buffer);
+	}
+	pool->cached = 0;
+	pthread_mutex_destroy(&pool->lock);
+	pool->name = NULL;
+}
+
+void *aesd_buffer_get( struct aesd_buffer_pool *pool ) {
+	void *buffer;
+
+	pthread_mutex_lock(&pool->lock);
+	pool->gets++;
+	buffer = pool->free_list;
+	if( buffer != NULL ) {
+		pool->free_list = FREE_NEXT(buffer);
+		pool->cached--;
+	} else {
+		pool->misses++;
+		pthread_mutex_unlock(&pool->lock);
+		if( posix_memalign(&buffer, sysconf(_SC_PAGESIZE), pool->buffer_size) != 0 ) {
+			return NULL;
+		}
+		pthread_mutex_lock(&pool->lock);
+	}
+	pool->in_use++;
+	if( pool->in_use > pool->high_water ) {
+		pool->high_water = pool->in_use;
+	}
+	pthread_mutex_unlock(&pool->lock);
+	return buffer;
+}
+
+void aesd_buffer_put( struct aesd_buffer_pool *pool, void *buffer ) {
+	pthread_mutex_lock(&pool->lock);
+	pool->in_use--;
+	if( pool->cached < pool->max_cached ) {
+		FREE_NEXT(buffer) = pool->free_list;
+		pool->free_list = buffer;
+		pool->cached++;
+		buffer = NULL;
+	} else {
+		pool->trims++;
+	}
+	pthread_mutex_unlock(&pool->lock);
+	free(buffer);
+}
+
+void aesd_buffer_pool_dump_stats( struct aesd_buffer_pool *pool, FILE *out ) {
+	if( pool->name == NULL ) {
+		return;
+	}
+	pthread_mutex_lock(&pool->lock);
+	fprintf(out, "bufpool %s buffer_size=%zu in_use=%zu high_water=%zu cached=%zu gets=%llu misses=%llu trims=%llu\n",
+		pool->name, pool->buffer_size, pool->in_use, pool->high_water, pool->cached,
+		(unsigned long long)pool->gets, (unsigned long long)pool->misses,
+		(unsigned long long)pool->trims);
+	pthread_mutex_unlock(&pool->lock);
+}
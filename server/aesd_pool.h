@@ -0,0 +1,76 @@
+/*
+ * aesd_pool.h - Object slab and I/O buffer pool for the connection path
+ *
+ * The slab hands out fixed size objects carved from larger chunks. Each
+ * thread keeps a small magazine of free objects, so allocating and freeing
+ * is a pointer pop or push without a lock; only a full or empty magazine
+ * exchanges a batch with the shared depot. Objects may be freed on another
+ * thread than the one that allocated them.
+ *
+ * The buffer pool recycles page aligned I/O buffers of one size behind a
+ * mutex, keeping up to a fixed number of free ones.
+ *
+ * Both only allocate until the working set is reached, after that the
+ * steady state runs without malloc().
+ */
+
+#ifndef AESD_POOL_H
+#define AESD_POOL_H
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stddef.h>
+#include <pthread.h>
+#include <stdatomic.h>
+
+struct aesd_slab {
+	const char *name;
+	size_t object_size;
+	pthread_key_t key;		/* The calling thread's magazine */
+	pthread_mutex_t lock;		/* Protects the depot and the chunk list */
+	void *depot;			/* Free objects shared between threads */
+	size_t depot_count;
+	void *chunks;			/* Chunks carved into objects, freed on destroy */
+	size_t nchunks;
+	/* Statistics */
+	_Atomic uint64_t allocs;
+	_Atomic uint64_t misses;	/* Allocations that needed a new chunk */
+	_Atomic size_t in_use;
+	_Atomic size_t high_water;
+};
+
+extern int aesd_slab_init( struct aesd_slab *slab, const char *name, size_t object_size );
+
+/* Every object must have been freed and every other thread using the slab exited */
+extern void aesd_slab_destroy( struct aesd_slab *slab );
+
+/* Zeroed object, NULL when out of memory */
+extern void *aesd_slab_alloc( struct aesd_slab *slab );
+extern void aesd_slab_free( struct aesd_slab *slab, void *object );
+extern void aesd_slab_dump_stats( struct aesd_slab *slab, FILE *out );
+
+struct aesd_buffer_pool {
+	const char *name;
+	size_t buffer_size;		/* Rounded up to whole pages */
+	size_t max_cached;
+	pthread_mutex_t lock;
+	void *free_list;
+	size_t cached;
+	/* Statistics, protected by @lock */
+	uint64_t gets;
+	uint64_t misses;		/* Gets that had to allocate */
+	uint64_t trims;			/* Puts freed because the cache was full */
+	size_t in_use;
+	size_t high_water;
+};
+
+extern int aesd_buffer_pool_init( struct aesd_buffer_pool *pool, const char *name,
+		size_t buffer_size, size_t max_cached );
+extern void aesd_buffer_pool_destroy( struct aesd_buffer_pool *pool );
+
+/* Page aligned buffer of pool->buffer_size bytes, contents undefined, NULL when out of memory */
+extern void *aesd_buffer_get( struct aesd_buffer_pool *pool );
+extern void aesd_buffer_put( struct aesd_buffer_pool *pool, void *buffer );
+extern void aesd_buffer_pool_dump_stats( struct aesd_buffer_pool *pool, FILE *out );
+
+#endif /* AESD_POOL_H */
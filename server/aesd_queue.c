@@ -0,0 +1,99 @@
+/*
+ * aesd_queue.c - Bounded blocking queue
+ */
+
+#include <stdlib.h>
+#include <errno.h>
+#include "aesd_queue.h"
+
+int aesd_queue_init( struct aesd_queue *queue, const char *name, size_t capacity ) {
+	queue->items = calloc(capacity, sizeof(*queue->items));
+	if( queue->items == NULL ) {
+		return -1;
+	}
+	queue->name = name;
+	queue->capacity = capacity;
+	queue->head = 0;
+	queue->count = 0;
+	queue->closed = false;
+	queue->pushes = 0;
+	queue->full_waits = 0;
+	queue->empty_waits = 0;
+	queue->max_depth = 0;
+	pthread_mutex_init(&queue->lock, NULL);
+	pthread_cond_init(&queue->not_empty, NULL);
+	pthread_cond_init(&queue->not_full, NULL);
+	return 0;
+}
+
+void aesd_queue_destroy( struct aesd_queue *queue ) {
+	if( queue->items == NULL ) {
+		return;
+	}
+	pthread_cond_destroy(&queue->not_full);
+	pthread_cond_destroy(&queue->not_empty);
+	pthread_mutex_destroy(&queue->lock);
+	free(queue->items);
+	queue->items = NULL;
+}
+
+int aesd_queue_push( struct aesd_queue *queue, void *item ) {
+	pthread_mutex_lock(&queue->lock);
+	if( queue->count == queue->capacity && !queue->closed ) {
+		queue->full_waits++;
+		while( queue->count == queue->capacity && !queue->closed ) {
+			pthread_cond_wait(&queue->not_full, &queue->lock);
+		}
+	}
+	if( queue->closed ) {
+		pthread_mutex_unlock(&queue->lock);
+		errno = EPIPE;
+		return -1;
+	}
+	queue->items[(queue->head + queue->count) % queue->capacity] = item;
+	queue->count++;
+	queue->pushes++;
+	if( queue->count > queue->max_depth ) {
+		queue->max_depth = queue->count;
+	}
+	pthread_cond_signal(&queue->not_empty);
+	pthread_mutex_unlock(&queue->lock);
+	return 0;
+}
+
+void *aesd_queue_pop( struct aesd_queue *queue ) {
+	void *item = NULL;
+
+	pthread_mutex_lock(&queue->lock);
+	if( queue->count == 0 && !queue->closed ) {
+		queue->empty_waits++;
+		while( queue->count == 0 && !queue->closed ) {
+			pthread_cond_wait(&queue->not_empty, &queue->lock);
+		}
+	}
+	if( queue->count > 0 ) {
+		item = queue->items[queue->head];
+		queue->head = (queue->head + 1) % queue->capacity;
+		queue->count--;
+		pthread_cond_signal(&queue->not_full);
+	}
+	pthread_mutex_unlock(&queue->lock);
+	return item;
+}
+
+void aesd_queue_close( struct aesd_queue *queue ) {
+	pthread_mutex_lock(&queue->lock);
+	queue->closed = true;
+	pthread_cond_broadcast(&queue->not_empty);
+	pthread_cond_broadcast(&queue->not_full);
+	pthread_mutex_unlock(&queue->lock);
+}
+
+void aesd_queue_dump_stats( struct aesd_queue *queue, FILE *out ) {
+	pthread_mutex_lock(&queue->lock);
+	fprintf(out, "queue %s depth=%zu capacity=%zu max_depth=%zu pushes=%llu full_waits=%llu empty_waits=%llu\n",
+		queue->name, queue->count, queue->capacity, queue->max_depth,
+		(unsigned long long)queue->pushes, (unsigned long long)queue->full_waits,
+		(unsigned long long)queue->empty_waits);
+	pthread_mutex_unlock(&queue->lock);
+}
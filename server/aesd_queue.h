@@ -0,0 +1,50 @@
+/*
+ * aesd_queue.h - Bounded blocking queue connecting the aesdsocket stages
+ *
+ * A fixed size ring of pointers behind one mutex. Producers block while the
+ * queue is full so a slow stage pushes back on the stage feeding it instead
+ * of letting work pile up unbounded. Depth and wait counters show which
+ * stage is the bottleneck.
+ */
+
+#ifndef AESD_QUEUE_H
+#define AESD_QUEUE_H
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <pthread.h>
+
+struct aesd_queue {
+	const char *name;
+	pthread_mutex_t lock;
+	pthread_cond_t not_empty;
+	pthread_cond_t not_full;
+	void **items;
+	size_t capacity;
+	size_t head;		/* Next item to pop */
+	size_t count;
+	bool closed;
+	/* Statistics, protected by @lock */
+	uint64_t pushes;
+	uint64_t full_waits;	/* Pushes that had to wait for room */
+	uint64_t empty_waits;	/* Pops that had to wait for work */
+	size_t max_depth;
+};
+
+extern int aesd_queue_init( struct aesd_queue *queue, const char *name, size_t capacity );
+extern void aesd_queue_destroy( struct aesd_queue *queue );
+
+/* Append @item, waiting for room. Fails with EPIPE once the queue is closed */
+extern int aesd_queue_push( struct aesd_queue *queue, void *item );
+
+/* Take the oldest item, waiting for one. NULL once the queue is closed and drained */
+extern void *aesd_queue_pop( struct aesd_queue *queue );
+
+/* Wake every waiter, pops still drain what is queued */
+extern void aesd_queue_close( struct aesd_queue *queue );
+
+extern void aesd_queue_dump_stats( struct aesd_queue *queue, FILE *out );
+
+#endif /* AESD_QUEUE_H */
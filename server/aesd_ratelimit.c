@@ -0,0 +1,267 @@
+/*
+ * aesd_ratelimit.c - Per-client and global token-bucket rate limiting
+ *
+ * See aesd_ratelimit.h for an overview.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <time.h>
+#include <arpa/inet.h>
+#include "aesd_ratelimit.h"
+
+#define NSEC_PER_SEC	1000000000ULL
+#define NSEC_PER_MSEC	1000000ULL
+#define RL_MAX_PROBES	64	/* Give up and use the overflow bucket after this many probes */
+#define RL_IDLE_NSEC	(10 * NSEC_PER_SEC)	/* Unused this long, a slot with full buckets can be reclaimed */
+
+static struct aesd_rl_config rl_config;
+static struct aesd_rl_client *rl_table;
+static size_t rl_mask;
+
+/* Clients that did not fit in the table share this bucket */
+static struct aesd_rl_client rl_overflow;
+
+/* Global buckets and counters */
+static struct aesd_gcra rl_global_pps;
+static struct aesd_gcra rl_global_bps;
+static _Atomic uint64_t rl_global_delayed;
+static _Atomic uint64_t rl_global_shed;
+static _Atomic uint64_t rl_reclaimed;		/* Idle slots handed to a new address */
+static _Atomic uint64_t rl_overflow_hits;	/* Lookups that fell back to rl_overflow */
+
+static uint64_t monotonic_ns( void ) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * NSEC_PER_SEC + ts.tv_nsec;
+}
+
+static size_t round_up_pow2( size_t value ) {
+	size_t result = 1;
+	while( result < value ) {
+		result <<= 1;
+	}
+	return result;
+}
+
+/* Nanoseconds worth of @rate consumed by @units, 0 when unlimited */
+static uint64_t gcra_cost( uint64_t rate, uint64_t units ) {
+	if( rate == 0 ) {
+		return 0;
+	}
+	return (units * NSEC_PER_SEC) / rate;
+}
+
+/**
+ * Try to consume @cost nanoseconds of @cell.
+ * @return the time in nanoseconds the caller has to wait for the charge to
+ * conform. The cell is only updated when that wait is no more than @max_wait,
+ * so a rejected packet does not consume tokens.
+ */
+static uint64_t gcra_charge( struct aesd_gcra *cell, uint64_t cost, uint64_t tau,
+		uint64_t now, uint64_t max_wait ) {
+	uint64_t tat = atomic_load_explicit(&cell->tat, memory_order_relaxed);
+	uint64_t new_tat, wait;
+
+	do {
+		new_tat = (tat > now ? tat : now) + cost;
+		wait = (new_tat - now > tau) ? new_tat - now - tau : 0;
+		if( wait > max_wait ) {
+			return wait;
+		}
+	} while( !atomic_compare_exchange_weak_explicit(&cell->tat, &tat, new_tat,
+				memory_order_relaxed, memory_order_relaxed) );
+
+	return wait;
+}
+
+/**
+ * Give back a charge gcra_charge() committed, for a packet another cell then shed.
+ * The tat may end up in the past, which gcra_charge() treats as an idle cell.
+ */
+static void gcra_refund( struct aesd_gcra *cell, uint64_t cost ) {
+	atomic_fetch_sub_explicit(&cell->tat, cost, memory_order_relaxed);
+}
+
+int aesd_rl_init( const struct aesd_rl_config *config ) {
+	size_t size;
+
+	rl_config = *config;
+	if( rl_config.table_size == 0 ) {
+		rl_config.table_size = AESD_RL_DEFAULT_TABLE_SIZE;
+	}
+	size = round_up_pow2(rl_config.table_size);
+
+	rl_table = calloc(size, sizeof(*rl_table));
+	if( rl_table == NULL ) {
+		return -1;
+	}
+	rl_mask = size - 1;
+	rl_config.table_size = size;
+	return 0;
+}
+
+void aesd_rl_destroy( void ) {
+	free(rl_table);
+	rl_table = NULL;
+}
+
+/* Idle long enough, and both buckets have refilled so a new owner starts from a full burst */
+static bool client_idle( struct aesd_rl_client *client, uint64_t now ) {
+	return atomic_load_explicit(&client->last_seen, memory_order_relaxed) + RL_IDLE_NSEC <= now &&
+		atomic_load_explicit(&client->pps.tat, memory_order_relaxed) <= now &&
+		atomic_load_explicit(&client->bps.tat, memory_order_relaxed) <= now;
+}
+
+/**
+ * Take over @client, last seen owned by @old_key, for @key.
+ * Only the CAS winner resets the counters. A lookup of the old address racing
+ * with it may still charge the slot once, the tat is left alone so such a
+ * charge or its refund stays consistent.
+ */
+static bool client_reclaim( struct aesd_rl_client *client, uint32_t old_key, uint32_t key, uint64_t now ) {
+	if( !atomic_compare_exchange_strong(&client->key, &old_key, key) ) {
+		return false;
+	}
+	atomic_store_explicit(&client->last_seen, now, memory_order_relaxed);
+	atomic_store_explicit(&client->packets, 0, memory_order_relaxed);
+	atomic_store_explicit(&client->bytes, 0, memory_order_relaxed);
+	atomic_store_explicit(&client->delayed, 0, memory_order_relaxed);
+	atomic_store_explicit(&client->shed, 0, memory_order_relaxed);
+	atomic_fetch_add_explicit(&rl_reclaimed, 1, memory_order_relaxed);
+	return true;
+}
+
+struct aesd_rl_client *aesd_rl_client_lookup( uint32_t addr ) {
+	uint32_t key = ntohl(addr) + 1;
+	/* Fibonacci hashing spreads sequential addresses across the table */
+	size_t slot = ((uint64_t)key * 0x9E3779B97F4A7C15ULL) >> 32;
+	struct aesd_rl_client *idle = NULL;
+	uint32_t idle_key = 0;
+	uint64_t now;
+	size_t probe;
+
+	if( rl_table == NULL || key == 0 ) {
+		atomic_fetch_add_explicit(&rl_overflow_hits, 1, memory_order_relaxed);
+		return &rl_overflow;
+	}
+
+	now = monotonic_ns();
+	for( probe = 0; probe < RL_MAX_PROBES; probe++ ) {
+		struct aesd_rl_client *client = &rl_table[(slot + probe) & rl_mask];
+		uint32_t current = atomic_load_explicit(&client->key, memory_order_acquire);
+
+		if( current == 0 ) {
+			uint32_t expected = 0;
+			if( atomic_compare_exchange_strong(&client->key, &expected, key) ) {
+				atomic_store_explicit(&client->last_seen, now, memory_order_relaxed);
+				return client;
+			}
+			current = expected;
+		}
+		if( current == key ) {
+			atomic_store_explicit(&client->last_seen, now, memory_order_relaxed);
+			return client;
+		}
+		if( idle == NULL && client_idle(client, now) ) {
+			idle = client;
+			idle_key = current;
+		}
+	}
+
+	/* Slots are never emptied, only handed over, so @key is not further along the run */
+	if( idle != NULL && client_reclaim(idle, idle_key, key, now) ) {
+		return idle;
+	}
+	atomic_fetch_add_explicit(&rl_overflow_hits, 1, memory_order_relaxed);
+	return &rl_overflow;
+}
+
+int64_t aesd_rl_charge( struct aesd_rl_client *client, uint32_t packets, size_t bytes ) {
+	uint64_t now = monotonic_ns();
+	uint64_t tau = (uint64_t)rl_config.burst_ms * NSEC_PER_MSEC;
+	uint64_t max_wait = 0;
+	uint64_t wait = 0, cell_wait;
+	struct {
+		struct aesd_gcra *cell;
+		uint64_t cost;
+	} cells[] = {
+		{ &client->pps, gcra_cost(rl_config.client_pps, packets) },
+		{ &client->bps, gcra_cost(rl_config.client_bps, bytes) },
+		{ &rl_global_pps, gcra_cost(rl_config.global_pps, packets) },
+		{ &rl_global_bps, gcra_cost(rl_config.global_bps, bytes) },
+	};
+	size_t i;
+
+	if( rl_config.policy == AESD_RL_DELAY ) {
+		max_wait = (uint64_t)rl_config.max_delay_ms * NSEC_PER_MSEC;
+	}
+
+	for( i = 0; i < sizeof(cells) / sizeof(cells[0]); i++ ) {
+		if( cells[i].cost == 0 ) {
+			continue;	/* Unlimited */
+		}
+		cell_wait = gcra_charge(cells[i].cell, cells[i].cost, tau, now, max_wait);
+		if( cell_wait > max_wait ) {
+			/* The cells before this one were charged, a shed packet must not use their budget */
+			while( i-- > 0 ) {
+				if( cells[i].cost != 0 ) {
+					gcra_refund(cells[i].cell, cells[i].cost);
+				}
+			}
+			atomic_fetch_add_explicit(&client->shed, 1, memory_order_relaxed);
+			atomic_fetch_add_explicit(&rl_global_shed, 1, memory_order_relaxed);
+			return -1;
+		}
+		if( cell_wait > wait ) {
+			wait = cell_wait;
+		}
+	}
+
+	atomic_fetch_add_explicit(&client->packets, packets, memory_order_relaxed);
+	atomic_fetch_add_explicit(&client->bytes, bytes, memory_order_relaxed);
+	if( wait > 0 ) {
+		atomic_fetch_add_explicit(&client->delayed, 1, memory_order_relaxed);
+		atomic_fetch_add_explicit(&rl_global_delayed, 1, memory_order_relaxed);
+	}
+	return (int64_t)wait;
+}
+
+static void dump_client( FILE *out, const char *name, struct aesd_rl_client *client ) {
+	fprintf(out, "client %s packets=%llu bytes=%llu delayed=%llu shed=%llu\n", name,
+		(unsigned long long)atomic_load(&client->packets),
+		(unsigned long long)atomic_load(&client->bytes),
+		(unsigned long long)atomic_load(&client->delayed),
+		(unsigned long long)atomic_load(&client->shed));
+}
+
+void aesd_rl_dump_stats( FILE *out ) {
+	size_t i;
+	char client_ip[INET_ADDRSTRLEN];
+
+	fprintf(out, "ratelimit policy=%s client_pps=%llu client_bps=%llu global_pps=%llu global_bps=%llu"
+		" delayed=%llu shed=%llu reclaimed=%llu overflow_hits=%llu\n",
+		rl_config.policy == AESD_RL_DELAY ? "delay" : "shed",
+		(unsigned long long)rl_config.client_pps, (unsigned long long)rl_config.client_bps,
+		(unsigned long long)rl_config.global_pps, (unsigned long long)rl_config.global_bps,
+		(unsigned long long)atomic_load(&rl_global_delayed),
+		(unsigned long long)atomic_load(&rl_global_shed),
+		(unsigned long long)atomic_load(&rl_reclaimed),
+		(unsigned long long)atomic_load(&rl_overflow_hits));
+
+	for( i = 0; rl_table != NULL && i <= rl_mask; i++ ) {
+		uint32_t key = atomic_load_explicit(&rl_table[i].key, memory_order_acquire);
+		struct in_addr addr;
+
+		if( key == 0 ) {
+			continue;
+		}
+		addr.s_addr = htonl(key - 1);
+		inet_ntop(AF_INET, &addr, client_ip, sizeof(client_ip));
+		dump_client(out, client_ip, &rl_table[i]);
+	}
+	if( atomic_load(&rl_overflow.packets) || atomic_load(&rl_overflow.shed) ) {
+		dump_client(out, "overflow", &rl_overflow);
+	}
+}
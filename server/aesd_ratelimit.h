@@ -0,0 +1,90 @@
+/*
+ * aesd_ratelimit.h - Per-client and global token-bucket rate limiting
+ *
+ * Buckets are implemented with the GCRA formulation of a token bucket: each
+ * limit is a single atomic "theoretical arrival time", so admission is a
+ * lock-free compare-and-swap instead of a mutex around a token counter.
+ * Per-client buckets live in a fixed-size open-addressed table keyed by the
+ * client IPv4 address. When a new client finds no free slot, it takes over
+ * the slot of a client that has been idle long enough for its buckets to
+ * refill, so the table does not fill up with addresses seen only once.
+ */
+
+#ifndef AESD_RATELIMIT_H
+#define AESD_RATELIMIT_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <stdatomic.h>
+
+/* What to do with a client that is over its limit */
+enum aesd_rl_policy {
+	AESD_RL_DELAY,	/* Sleep until tokens are available (up to max_delay_ms) */
+	AESD_RL_SHED,	/* Drop the packet and close the connection */
+};
+
+/**
+ * struct aesd_rl_config - Rate limit settings, a rate of 0 means unlimited
+ * @client_pps:   packets per second allowed for each source address
+ * @client_bps:   bytes per second allowed for each source address
+ * @global_pps:   packets per second allowed for the whole server
+ * @global_bps:   bytes per second allowed for the whole server
+ * @burst_ms:     burst tolerance, expressed as milliseconds worth of rate
+ * @max_delay_ms: longest delay imposed before a packet is shed instead
+ * @policy:       delay or shed over-limit packets
+ * @table_size:   number of per-client slots (rounded up to a power of two)
+ */
+struct aesd_rl_config {
+	uint64_t client_pps;
+	uint64_t client_bps;
+	uint64_t global_pps;
+	uint64_t global_bps;
+	uint32_t burst_ms;
+	uint32_t max_delay_ms;
+	enum aesd_rl_policy policy;
+	size_t table_size;
+};
+
+/* One GCRA cell, holds the theoretical arrival time in nanoseconds */
+struct aesd_gcra {
+	_Atomic uint64_t tat;
+};
+
+/* Per-client bucket and counters, one slot of the client table */
+struct aesd_rl_client {
+	_Atomic uint32_t key;		/* IPv4 address + 1, 0 marks a free slot */
+	_Atomic uint64_t last_seen;	/* Monotonic ns of the last lookup */
+	struct aesd_gcra pps;
+	struct aesd_gcra bps;
+	_Atomic uint64_t packets;	/* Packets admitted */
+	_Atomic uint64_t bytes;		/* Bytes admitted */
+	_Atomic uint64_t delayed;	/* Packets admitted after a delay */
+	_Atomic uint64_t shed;		/* Packets dropped for being over limit */
+};
+
+#define AESD_RL_DEFAULT_TABLE_SIZE	4096
+#define AESD_RL_DEFAULT_BURST_MS	1000
+#define AESD_RL_DEFAULT_MAX_DELAY_MS	2000
+
+extern int aesd_rl_init(const struct aesd_rl_config *config);
+extern void aesd_rl_destroy(void);
+
+/**
+ * Find (or lazily create) the bucket for an address in network byte order.
+ * An idle client's slot may be handed to another address, so look the
+ * bucket up again for each packet instead of keeping it.
+ */
+extern struct aesd_rl_client *aesd_rl_client_lookup(uint32_t addr);
+
+/**
+ * Charge @packets and @bytes to @client and to the global buckets.
+ * @return 0 when admitted immediately, a positive delay in nanoseconds the
+ * caller must wait before committing, or -1 when the packet must be shed.
+ */
+extern int64_t aesd_rl_charge(struct aesd_rl_client *client, uint32_t packets, size_t bytes);
+
+/* Write the global and per-client counters as text to @out */
+extern void aesd_rl_dump_stats(FILE *out);
+
+#endif /* AESD_RATELIMIT_H */
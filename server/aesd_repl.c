@@ -0,0 +1,802 @@
+/*
+ * aesd_repl.c - Primary to replica log replication between aesdsocket instances
+ *
+ * See aesd_repl.h for the protocol. On the primary a storage commit hook
+ * copies each record into the backlog ring, and one sender thread per
+ * replica streams from it. On the replica a single thread applies the
+ * stream to local storage, so the normal read/reply path serves it.
+ */
+
+#define _GNU_SOURCE
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <time.h>
+#include <syslog.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <endian.h>
+#include <netdb.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include "queue.h"
+#include "aesd_repl.h"
+
+#define NSEC_PER_SEC		1000000000ULL
+#define NSEC_PER_MSEC		1000000ULL
+#define REPL_BATCH_BYTES	(64 * 1024)
+#define REPL_HELLO_MAX		128
+#define REPL_HANDSHAKE_TIMEOUT	5	/* Seconds */
+#define REPL_ACK_INTERVAL	64	/* Records between replica acks */
+
+struct repl_frame_header {
+	uint8_t type;
+	uint8_t pad[3];
+	uint32_t length;
+	uint64_t seq;
+	uint64_t time_ns;
+};
+
+struct repl_record {
+	uint64_t seq;
+	uint64_t time_ns;
+	size_t length;
+	char *data;
+};
+
+/* Primary side catch-up backlog, filled by the storage commit hook */
+static struct {
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	struct repl_record *ring;
+	size_t mask;
+	uint64_t first_seq;	/* Oldest record still held */
+	uint64_t next_seq;	/* Sequence given to the next commit */
+	size_t bytes;
+	size_t max_bytes;
+	uint64_t end_offset;	/* Storage offset just past record next_seq - 1 */
+} backlog = {
+	.lock = PTHREAD_MUTEX_INITIALIZER,
+	.cond = PTHREAD_COND_INITIALIZER,
+};
+
+/* One connected replica, served by its own sender thread */
+struct repl_peer {
+	pthread_t thread;
+	int sockfd;
+	uint32_t addr;
+	_Atomic uint64_t sent_seq;
+	_Atomic uint64_t acked_seq;
+	_Atomic bool done;
+	uint8_t ack_buffer[8];
+	size_t ack_len;
+	LIST_ENTRY(repl_peer) link;
+};
+
+static LIST_HEAD(repl_peer_list, repl_peer) peers = LIST_HEAD_INITIALIZER(peers);
+static pthread_mutex_t peers_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static struct aesd_storage *repl_storage;
+static _Atomic bool repl_running;
+static uint64_t repl_epoch;
+static int listen_fd = -1;
+static pthread_t listen_thread;
+static bool listen_started;
+static _Atomic uint64_t primary_resyncs;
+
+/* Replica side state and statistics */
+static struct aesd_repl_config replica_config;
+static pthread_t replica_thread;
+static bool replica_started;
+static _Atomic int replica_fd = -1;
+static _Atomic uint64_t replica_applied_seq;
+static _Atomic uint64_t replica_primary_seq;
+static _Atomic uint64_t replica_applied;
+static _Atomic uint64_t replica_last_lag_ns;
+static _Atomic uint64_t replica_max_lag_ns;
+static _Atomic uint64_t replica_avg_lag_ns;
+static _Atomic uint64_t replica_reconnects;
+static _Atomic uint64_t replica_resyncs;
+static _Atomic bool replica_connected;
+
+static uint64_t realtime_ns( void ) {
+	struct timespec ts;
+	clock_gettime(CLOCK_REALTIME, &ts);
+	return (uint64_t)ts.tv_sec * NSEC_PER_SEC + ts.tv_nsec;
+}
+
+static size_t round_up_pow2( size_t value ) {
+	size_t result = 1;
+	while( result < value ) {
+		result <<= 1;
+	}
+	return result;
+}
+
+static int send_all( int sockfd, const void *buffer, size_t length ) {
+	const char *p = buffer;
+
+	while( length > 0 ) {
+		ssize_t rc = send(sockfd, p, length, MSG_NOSIGNAL);
+		if( rc < 0 ) {
+			if( errno == EINTR ) {
+				continue;
+			}
+			return -1;
+		}
+		p += rc;
+		length -= rc;
+	}
+	return 0;
+}
+
+static int recv_exact( int sockfd, void *buffer, size_t length ) {
+	char *p = buffer;
+
+	while( length > 0 ) {
+		ssize_t rc = recv(sockfd, p, length, 0);
+		if( rc == 0 ) {
+			errno = ECONNRESET;
+			return -1;
+		}
+		if( rc < 0 ) {
+			if( errno == EINTR ) {
+				continue;
+			}
+			return -1;
+		}
+		p += rc;
+		length -= rc;
+	}
+	return 0;
+}
+
+static void encode_header( char *out, uint8_t type, uint32_t length, uint64_t seq, uint64_t time_ns ) {
+	struct repl_frame_header header;
+
+	memset(&header, 0, sizeof(header));
+	header.type = type;
+	header.length = htobe32(length);
+	header.seq = htobe64(seq);
+	header.time_ns = htobe64(time_ns);
+	memcpy(out, &header, sizeof(header));
+}
+
+static int send_frame( int sockfd, uint8_t type, uint64_t seq, const char *payload, uint32_t length ) {
+	char header[sizeof(struct repl_frame_header)];
+
+	encode_header(header, type, length, seq, realtime_ns());
+	if( send_all(sockfd, header, sizeof(header)) < 0 ) {
+		return -1;
+	}
+	return length ? send_all(sockfd, payload, length) : 0;
+}
+
+/* ---- Primary ---------------------------------------------------------- */
+
+static void backlog_evict_oldest( void ) {
+	struct repl_record *record = &backlog.ring[backlog.first_seq & backlog.mask];
+
+	backlog.bytes -= record->length;
+	free(record->data);
+	record->data = NULL;
+	backlog.first_seq++;
+}
+
+/* Storage commit hook, runs under the storage lock so records arrive in commit order */
+static void publish_hook( struct aesd_storage *st, uint64_t offset, const char *data, size_t length, void *arg ) {
+	struct repl_record *record;
+	char *copy = malloc(length);
+	(void)st;
+	(void)arg;
+
+	pthread_mutex_lock(&backlog.lock);
+	if( copy == NULL ) {
+		/* Replicas can no longer catch up from the backlog, force a resync */
+		while( backlog.first_seq != backlog.next_seq ) {
+			backlog_evict_oldest();
+		}
+		backlog.next_seq++;
+		backlog.first_seq = backlog.next_seq;
+	} else {
+		while( backlog.first_seq != backlog.next_seq &&
+				(backlog.next_seq - backlog.first_seq > backlog.mask ||
+				 backlog.bytes + length > backlog.max_bytes) ) {
+			backlog_evict_oldest();
+		}
+		memcpy(copy, data, length);
+		record = &backlog.ring[backlog.next_seq & backlog.mask];
+		record->seq = backlog.next_seq;
+		record->time_ns = realtime_ns();
+		record->length = length;
+		record->data = copy;
+		backlog.bytes += length;
+		backlog.next_seq++;
+	}
+	backlog.end_offset = offset + length;
+	pthread_cond_broadcast(&backlog.cond);
+	pthread_mutex_unlock(&backlog.lock);
+}
+
+/* Collect any acks the replica sent without blocking */
+static int peer_read_acks( struct repl_peer *peer ) {
+	for( ;; ) {
+		ssize_t rc = recv(peer->sockfd, peer->ack_buffer + peer->ack_len,
+				sizeof(peer->ack_buffer) - peer->ack_len, MSG_DONTWAIT);
+		if( rc == 0 ) {
+			return -1;	/* Replica went away */
+		}
+		if( rc < 0 ) {
+			return (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR) ? 0 : -1;
+		}
+		peer->ack_len += rc;
+		if( peer->ack_len == sizeof(peer->ack_buffer) ) {
+			uint64_t seq;
+			memcpy(&seq, peer->ack_buffer, sizeof(seq));
+			atomic_store(&peer->acked_seq, be64toh(seq));
+			peer->ack_len = 0;
+		}
+	}
+}
+
+/* Send a RESET followed by the whole primary storage so the replica restarts from it */
+static int peer_send_snapshot( struct repl_peer *peer, char *buffer, uint64_t *cursor ) {
+	uint64_t snap_seq, snap_end, offset;
+
+	pthread_mutex_lock(&backlog.lock);
+	snap_seq = backlog.next_seq;
+	snap_end = backlog.end_offset;
+	pthread_mutex_unlock(&backlog.lock);
+
+	if( send_frame(peer->sockfd, AESD_REPL_RESET, snap_seq, NULL, 0) < 0 ) {
+		return -1;
+	}
+	offset = aesd_storage_start(repl_storage);
+	while( offset < snap_end ) {
+		size_t chunk = snap_end - offset < REPL_BATCH_BYTES ? snap_end - offset : REPL_BATCH_BYTES;
+		ssize_t rc = aesd_storage_read(repl_storage, offset, buffer, chunk);
+		if( rc <= 0 ) {
+			return -1;	/* Evicted or truncated under us, the replica reconnects and retries */
+		}
+		if( send_frame(peer->sockfd, AESD_REPL_DATA, 0, buffer, rc) < 0 ) {
+			return -1;
+		}
+		offset += rc;
+	}
+	atomic_fetch_add(&primary_resyncs, 1);
+	*cursor = snap_seq;
+	return 0;
+}
+
+static int peer_handshake( struct repl_peer *peer, uint64_t *cursor ) {
+	struct timeval timeout = { REPL_HANDSHAKE_TIMEOUT, 0 };
+	char line[REPL_HELLO_MAX];
+	unsigned long long epoch, next_seq;
+	size_t len = 0;
+
+	setsockopt(peer->sockfd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+	while( len < sizeof(line) - 1 ) {
+		if( recv_exact(peer->sockfd, &line[len], 1) < 0 ) {
+			return -1;
+		}
+		if( line[len++] == '\n' ) {
+			break;
+		}
+	}
+	line[len] = '\0';
+	timeout.tv_sec = 0;
+	setsockopt(peer->sockfd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+
+	if( sscanf(line, "AESDREPL %llu %llu", &epoch, &next_seq) != 2 ) {
+		return -1;
+	}
+	*cursor = (epoch == repl_epoch) ? next_seq : 0;
+	return send_frame(peer->sockfd, AESD_REPL_HELLO, repl_epoch, NULL, 0);
+}
+
+static void *peer_thread_func( void *arg ) {
+	struct repl_peer *peer = arg;
+	size_t capacity = REPL_BATCH_BYTES;
+	char *buffer = malloc(capacity);
+	uint64_t cursor = 0;
+
+	if( buffer == NULL || peer_handshake(peer, &cursor) < 0 ) {
+		goto out;
+	}
+
+	while( atomic_load(&repl_running) ) {
+		struct timespec deadline;
+		size_t used = 0;
+		uint64_t heartbeat_seq;
+		bool heartbeat = false;
+
+		pthread_mutex_lock(&backlog.lock);
+		if( cursor == 0 || cursor < backlog.first_seq || cursor > backlog.next_seq ) {
+			pthread_mutex_unlock(&backlog.lock);
+			if( peer_send_snapshot(peer, buffer, &cursor) < 0 ) {
+				break;
+			}
+			continue;
+		}
+
+		if( cursor == backlog.next_seq ) {
+			clock_gettime(CLOCK_REALTIME, &deadline);
+			deadline.tv_sec += AESD_REPL_HEARTBEAT_MS / 1000;
+			while( cursor == backlog.next_seq && atomic_load(&repl_running) ) {
+				if( pthread_cond_timedwait(&backlog.cond, &backlog.lock, &deadline) == ETIMEDOUT ) {
+					break;
+				}
+			}
+		}
+		if( cursor < backlog.first_seq ) {
+			pthread_mutex_unlock(&backlog.lock);
+			continue;	/* Fell out of the backlog while waiting */
+		}
+
+		/* Copy a batch of frames out so the send happens without the lock */
+		while( cursor < backlog.next_seq ) {
+			struct repl_record *record = &backlog.ring[cursor & backlog.mask];
+			size_t frame_len = sizeof(struct repl_frame_header) + record->length;
+
+			if( used + frame_len > capacity ) {
+				if( used > 0 ) {
+					break;
+				}
+				char *bigger = realloc(buffer, frame_len);
+				if( bigger == NULL ) {
+					break;
+				}
+				buffer = bigger;
+				capacity = frame_len;
+			}
+			encode_header(buffer + used, AESD_REPL_RECORD, record->length, record->seq, record->time_ns);
+			memcpy(buffer + used + sizeof(struct repl_frame_header), record->data, record->length);
+			used += frame_len;
+			cursor++;
+		}
+		if( used == 0 ) {
+			heartbeat = true;
+			heartbeat_seq = backlog.next_seq - 1;
+		}
+		pthread_mutex_unlock(&backlog.lock);
+
+		if( heartbeat ) {
+			if( send_frame(peer->sockfd, AESD_REPL_HEARTBEAT, heartbeat_seq, NULL, 0) < 0 ) {
+				break;
+			}
+		} else {
+			if( send_all(peer->sockfd, buffer, used) < 0 ) {
+				break;
+			}
+			atomic_store(&peer->sent_seq, cursor - 1);
+		}
+		if( peer_read_acks(peer) < 0 ) {
+			break;
+		}
+	}
+
+out:
+	free(buffer);
+	close(peer->sockfd);
+	atomic_store(&peer->done, true);
+	return NULL;
+}
+
+/* Join sender threads whose replica disconnected */
+static void reap_peers( bool all ) {
+	struct repl_peer *peer, *next;
+
+	pthread_mutex_lock(&peers_lock);
+	for( peer = LIST_FIRST(&peers); peer != NULL; peer = next ) {
+		next = LIST_NEXT(peer, link);
+		if( all ) {
+			shutdown(peer->sockfd, SHUT_RDWR);
+		}
+		if( all || atomic_load(&peer->done) ) {
+			pthread_join(peer->thread, NULL);
+			LIST_REMOVE(peer, link);
+			free(peer);
+		}
+	}
+	pthread_mutex_unlock(&peers_lock);
+}
+
+static void *listen_thread_func( void *arg ) {
+	(void)arg;
+
+	while( atomic_load(&repl_running) ) {
+		struct sockaddr_in addr;
+		socklen_t addr_len = sizeof(addr);
+		struct repl_peer *peer;
+		int sockfd = accept4(listen_fd, (struct sockaddr *)&addr, &addr_len, SOCK_CLOEXEC);
+
+		if( sockfd < 0 ) {
+			if( errno == EINTR || errno == ECONNABORTED ) {
+				continue;
+			}
+			break;	/* Listener shut down */
+		}
+		reap_peers(false);
+
+		peer = calloc(1, sizeof(*peer));
+		if( peer == NULL ) {
+			close(sockfd);
+			continue;
+		}
+		peer->sockfd = sockfd;
+		peer->addr = addr.sin_addr.s_addr;
+		pthread_mutex_lock(&peers_lock);
+		if( pthread_create(&peer->thread, NULL, peer_thread_func, peer) != 0 ) {
+			pthread_mutex_unlock(&peers_lock);
+			close(sockfd);
+			free(peer);
+			continue;
+		}
+		LIST_INSERT_HEAD(&peers, peer, link);
+		pthread_mutex_unlock(&peers_lock);
+		syslog(LOG_INFO, "Replica connected from %s", inet_ntoa(addr.sin_addr));
+	}
+	return NULL;
+}
+
+static int start_primary( const struct aesd_repl_config *config, struct aesd_storage *st ) {
+	struct sockaddr_in addr;
+	size_t records = round_up_pow2(config->backlog_records ? config->backlog_records
+			: AESD_REPL_DEFAULT_BACKLOG_RECORDS);
+	uint64_t size = aesd_storage_size(st);
+	struct timespec now;
+	int yes = 1;
+
+	if( size == UINT64_MAX ) {
+		syslog(LOG_ERR, "Replication needs a storage engine with a known size");
+		errno = ENOTSUP;
+		return -1;
+	}
+	backlog.ring = calloc(records, sizeof(*backlog.ring));
+	if( backlog.ring == NULL ) {
+		return -1;
+	}
+	backlog.mask = records - 1;
+	backlog.max_bytes = config->backlog_bytes ? config->backlog_bytes : AESD_REPL_DEFAULT_BACKLOG_BYTES;
+	backlog.first_seq = backlog.next_seq = 1;
+	backlog.end_offset = size;
+
+	/* A new epoch tells reconnecting replicas that sequence numbers restarted */
+	clock_gettime(CLOCK_REALTIME, &now);
+	repl_epoch = ((uint64_t)now.tv_sec << 20) ^ now.tv_nsec ^ ((uint64_t)getpid() << 40);
+	if( repl_epoch == 0 ) {
+		repl_epoch = 1;
+	}
+
+	if( aesd_storage_add_hook(st, publish_hook, NULL) < 0 ) {
+		return -1;
+	}
+
+	listen_fd = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+	if( listen_fd < 0 ) {
+		return -1;
+	}
+	setsockopt(listen_fd, SOL_SOCKET, SO_REUSEADDR, &yes, sizeof(yes));
+	memset(&addr, 0, sizeof(addr));
+	addr.sin_family = AF_INET;
+	addr.sin_addr.s_addr = INADDR_ANY;
+	addr.sin_port = htons(config->listen_port);
+	if( bind(listen_fd, (struct sockaddr *)&addr, sizeof(addr)) < 0 || listen(listen_fd, 16) < 0 ) {
+		return -1;
+	}
+	if( pthread_create(&listen_thread, NULL, listen_thread_func, NULL) != 0 ) {
+		return -1;
+	}
+	listen_started = true;
+	syslog(LOG_INFO, "Replication primary listening on port %d", config->listen_port);
+	return 0;
+}
+
+/* ---- Replica ---------------------------------------------------------- */
+
+static int connect_primary( void ) {
+	struct addrinfo hints, *result, *ai;
+	char port[16];
+	int sockfd = -1;
+
+	memset(&hints, 0, sizeof(hints));
+	hints.ai_family = AF_INET;
+	hints.ai_socktype = SOCK_STREAM;
+	snprintf(port, sizeof(port), "%d", replica_config.primary_port);
+	if( getaddrinfo(replica_config.primary_host, port, &hints, &result) != 0 ) {
+		return -1;
+	}
+	for( ai = result; ai != NULL; ai = ai->ai_next ) {
+		sockfd = socket(ai->ai_family, ai->ai_socktype | SOCK_CLOEXEC, ai->ai_protocol);
+		if( sockfd < 0 ) {
+			continue;
+		}
+		if( connect(sockfd, ai->ai_addr, ai->ai_addrlen) == 0 ) {
+			break;
+		}
+		close(sockfd);
+		sockfd = -1;
+	}
+	freeaddrinfo(result);
+	return sockfd;
+}
+
+static void replica_record_lag( uint64_t commit_ns ) {
+	uint64_t now = realtime_ns();
+	uint64_t lag = now > commit_ns ? now - commit_ns : 0;
+	uint64_t avg = atomic_load(&replica_avg_lag_ns);
+
+	atomic_store(&replica_last_lag_ns, lag);
+	if( lag > atomic_load(&replica_max_lag_ns) ) {
+		atomic_store(&replica_max_lag_ns, lag);
+	}
+	/* Exponentially weighted average over roughly the last 16 records */
+	atomic_store(&replica_avg_lag_ns, avg ? avg - avg / 16 + lag / 16 : lag);
+}
+
+/* Apply complete lines of snapshot data as individual records */
+static void replica_apply_snapshot( char *pending, size_t *pending_len, bool flush_all ) {
+	size_t start = 0;
+	char *newline;
+
+	while( (newline = memchr(pending + start, '\n', *pending_len - start)) != NULL ) {
+		size_t length = newline - (pending + start) + 1;
+		aesd_storage_append(repl_storage, pending + start, length);
+		start += length;
+	}
+	if( flush_all && start < *pending_len ) {
+		aesd_storage_append(repl_storage, pending + start, *pending_len - start);
+		start = *pending_len;
+	}
+	memmove(pending, pending + start, *pending_len - start);
+	*pending_len -= start;
+}
+
+static int replica_send_ack( int sockfd, uint64_t seq ) {
+	uint64_t wire = htobe64(seq);
+	return send_all(sockfd, &wire, sizeof(wire));
+}
+
+/* Follow one connection to the primary until it fails */
+static void replica_session( int sockfd, uint64_t *epoch, uint64_t *next_seq ) {
+	char hello[REPL_HELLO_MAX];
+	char *payload = NULL, *pending = NULL;
+	size_t payload_capacity = 0, pending_len = 0, pending_capacity = 0;
+	uint64_t unacked = 0;
+	uint64_t primary_epoch = 0;
+	uint64_t snapshot_seq = 0;	/* Set from a RESET until its snapshot is complete */
+
+	snprintf(hello, sizeof(hello), "AESDREPL %llu %llu\n", (unsigned long long)*epoch,
+		(unsigned long long)*next_seq);
+	if( send_all(sockfd, hello, strlen(hello)) < 0 ) {
+		return;
+	}
+
+	while( atomic_load(&repl_running) ) {
+		struct repl_frame_header header;
+		uint32_t length;
+		uint64_t seq, time_ns;
+
+		if( recv_exact(sockfd, &header, sizeof(header)) < 0 ) {
+			break;
+		}
+		length = be32toh(header.length);
+		seq = be64toh(header.seq);
+		time_ns = be64toh(header.time_ns);
+		if( length > payload_capacity ) {
+			char *bigger = realloc(payload, length);
+			if( bigger == NULL ) {
+				break;
+			}
+			payload = bigger;
+			payload_capacity = length;
+		}
+		if( length > 0 && recv_exact(sockfd, payload, length) < 0 ) {
+			break;
+		}
+
+		if( header.type != AESD_REPL_DATA && pending_len > 0 ) {
+			replica_apply_snapshot(pending, &pending_len, true);	/* Snapshot complete */
+		}
+		if( header.type != AESD_REPL_DATA && snapshot_seq != 0 ) {
+			/* Only now may a reconnect resume from the backlog instead of asking for a new snapshot */
+			*epoch = primary_epoch;
+			*next_seq = snapshot_seq;
+			atomic_store(&replica_applied_seq, snapshot_seq - 1);
+			snapshot_seq = 0;
+		}
+
+		switch( header.type ) {
+		case AESD_REPL_HELLO:
+			primary_epoch = seq;
+			atomic_store(&replica_connected, true);
+			break;
+		case AESD_REPL_RESET:
+			if( aesd_storage_reset(repl_storage) < 0 ) {
+				syslog(LOG_ERR, "Replica storage cannot be reset: %s", strerror(errno));
+				goto out;
+			}
+			/* A connection lost before the snapshot completes asks for a full snapshot again */
+			*next_seq = 0;
+			snapshot_seq = seq;
+			atomic_fetch_add(&replica_resyncs, 1);
+			break;
+		case AESD_REPL_DATA:
+			if( pending_len + length > pending_capacity ) {
+				char *bigger = realloc(pending, pending_len + length);
+				if( bigger == NULL ) {
+					goto out;
+				}
+				pending = bigger;
+				pending_capacity = pending_len + length;
+			}
+			memcpy(pending + pending_len, payload, length);
+			pending_len += length;
+			replica_apply_snapshot(pending, &pending_len, false);
+			break;
+		case AESD_REPL_RECORD:
+			if( seq != *next_seq ) {
+				syslog(LOG_ERR, "Replication gap, expected %llu got %llu",
+					(unsigned long long)*next_seq, (unsigned long long)seq);
+				goto out;
+			}
+			if( aesd_storage_append(repl_storage, payload, length) < 0 ) {
+				goto out;
+			}
+			(*next_seq)++;
+			atomic_store(&replica_applied_seq, seq);
+			atomic_fetch_add(&replica_applied, 1);
+			if( seq > atomic_load(&replica_primary_seq) ) {
+				atomic_store(&replica_primary_seq, seq);
+			}
+			replica_record_lag(time_ns);
+			if( ++unacked >= REPL_ACK_INTERVAL ) {
+				replica_send_ack(sockfd, seq);
+				unacked = 0;
+			}
+			break;
+		case AESD_REPL_HEARTBEAT:
+			atomic_store(&replica_primary_seq, seq);
+			replica_send_ack(sockfd, *next_seq - 1);
+			unacked = 0;
+			break;
+		default:
+			goto out;
+		}
+	}
+out:
+	free(payload);
+	free(pending);
+}
+
+static void *replica_thread_func( void *arg ) {
+	struct timespec backoff = { AESD_REPL_RECONNECT_MS / 1000, (AESD_REPL_RECONNECT_MS % 1000) * NSEC_PER_MSEC };
+	uint64_t epoch = 0, next_seq = 0;	/* next_seq 0 asks for a full snapshot */
+	(void)arg;
+
+	while( atomic_load(&repl_running) ) {
+		int sockfd = connect_primary();
+
+		if( sockfd >= 0 ) {
+			atomic_store(&replica_fd, sockfd);
+			replica_session(sockfd, &epoch, &next_seq);
+			atomic_store(&replica_fd, -1);
+			atomic_store(&replica_connected, false);
+			close(sockfd);
+		}
+		if( !atomic_load(&repl_running) ) {
+			break;
+		}
+		atomic_fetch_add(&replica_reconnects, 1);
+		nanosleep(&backoff, NULL);
+	}
+	return NULL;
+}
+
+/* ---- Public interface ------------------------------------------------- */
+
+int aesd_repl_start( const struct aesd_repl_config *config, struct aesd_storage *st ) {
+	repl_storage = st;
+	atomic_store(&repl_running, true);
+
+	if( config->listen_port > 0 && start_primary(config, st) < 0 ) {
+		return -1;
+	}
+	if( config->primary_host != NULL ) {
+		if( st->ops->reset == NULL ) {
+			syslog(LOG_ERR, "Replica storage engine %s cannot be reset", st->ops->name);
+			errno = ENOTSUP;
+			return -1;
+		}
+		replica_config = *config;
+		if( pthread_create(&replica_thread, NULL, replica_thread_func, NULL) != 0 ) {
+			return -1;
+		}
+		replica_started = true;
+	}
+	return 0;
+}
+
+void aesd_repl_stop( void ) {
+	size_t i;
+
+	atomic_store(&repl_running, false);
+	if( listen_started ) {
+		shutdown(listen_fd, SHUT_RDWR);
+		pthread_join(listen_thread, NULL);
+		listen_started = false;
+	}
+	if( listen_fd >= 0 ) {
+		close(listen_fd);
+		listen_fd = -1;
+	}
+	pthread_mutex_lock(&backlog.lock);
+	pthread_cond_broadcast(&backlog.cond);
+	pthread_mutex_unlock(&backlog.lock);
+	reap_peers(true);
+
+	if( replica_started ) {
+		shutdown(atomic_load(&replica_fd), SHUT_RDWR);
+		pthread_join(replica_thread, NULL);
+		replica_started = false;
+	}
+
+	if( backlog.ring != NULL ) {
+		for( i = 0; i <= backlog.mask; i++ ) {
+			free(backlog.ring[i].data);
+		}
+		free(backlog.ring);
+		backlog.ring = NULL;
+	}
+}
+
+bool aesd_repl_is_replica( void ) {
+	return replica_started;
+}
+
+void aesd_repl_dump_stats( FILE *out ) {
+	struct repl_peer *peer;
+
+	if( backlog.ring != NULL ) {
+		uint64_t last_seq;
+
+		pthread_mutex_lock(&backlog.lock);
+		last_seq = backlog.next_seq - 1;
+		fprintf(out, "repl primary epoch=%llu first_seq=%llu last_seq=%llu backlog_bytes=%zu resyncs=%llu\n",
+			(unsigned long long)repl_epoch, (unsigned long long)backlog.first_seq,
+			(unsigned long long)last_seq, backlog.bytes,
+			(unsigned long long)atomic_load(&primary_resyncs));
+		pthread_mutex_unlock(&backlog.lock);
+
+		pthread_mutex_lock(&peers_lock);
+		LIST_FOREACH(peer, &peers, link) {
+			struct in_addr addr = { .s_addr = peer->addr };
+			uint64_t acked = atomic_load(&peer->acked_seq);
+			fprintf(out, "repl replica %s sent_seq=%llu acked_seq=%llu lag_records=%llu%s\n",
+				inet_ntoa(addr), (unsigned long long)atomic_load(&peer->sent_seq),
+				(unsigned long long)acked, (unsigned long long)(last_seq > acked ? last_seq - acked : 0),
+				atomic_load(&peer->done) ? " disconnected" : "");
+		}
+		pthread_mutex_unlock(&peers_lock);
+	}
+
+	if( replica_started ) {
+		uint64_t applied = atomic_load(&replica_applied_seq);
+		uint64_t primary = atomic_load(&replica_primary_seq);
+
+		fprintf(out, "repl replica_of=%s:%d connected=%d applied_seq=%llu primary_seq=%llu lag_records=%llu"
+			" applied=%llu lag_last_us=%llu lag_avg_us=%llu lag_max_us=%llu reconnects=%llu resyncs=%llu\n",
+			replica_config.primary_host, replica_config.primary_port,
+			atomic_load(&replica_connected) ? 1 : 0,
+			(unsigned long long)applied, (unsigned long long)primary,
+			(unsigned long long)(primary > applied ? primary - applied : 0),
+			(unsigned long long)atomic_load(&replica_applied),
+			(unsigned long long)atomic_load(&replica_last_lag_ns) / 1000,
+			(unsigned long long)atomic_load(&replica_avg_lag_ns) / 1000,
+			(unsigned long long)atomic_load(&replica_max_lag_ns) / 1000,
+			(unsigned long long)atomic_load(&replica_reconnects),
+			(unsigned long long)atomic_load(&replica_resyncs));
+	}
+}
@@ -0,0 +1,63 @@
+/*
+ * aesd_repl.h - Primary to replica log replication between aesdsocket instances
+ *
+ * A primary keeps the most recently committed records, numbered with a
+ * sequence, in an in-memory backlog and streams them over TCP to every
+ * connected replica. A replica that reconnects asks for the sequence after
+ * the last one it applied and catches up from the backlog; when that is no
+ * longer possible (or the primary restarted) it receives a full snapshot of
+ * the primary's storage first.
+ *
+ * Wire format, all integers big endian. Replica to primary:
+ *   "AESDREPL <epoch> <next_seq>\n" once, then 8 byte acks of the last applied seq
+ * Primary to replica, a 24 byte header followed by @length payload bytes:
+ *   u8 type, u8 pad[3], u32 length, u64 seq, u64 commit time (CLOCK_REALTIME ns)
+ */
+
+#ifndef AESD_REPL_H
+#define AESD_REPL_H
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include "aesd_storage.h"
+
+#define AESD_REPL_DEFAULT_BACKLOG_RECORDS	65536
+#define AESD_REPL_DEFAULT_BACKLOG_BYTES		(16 * 1024 * 1024)
+#define AESD_REPL_HEARTBEAT_MS			1000
+#define AESD_REPL_RECONNECT_MS			1000
+
+enum aesd_repl_frame_type {
+	AESD_REPL_HELLO = 1,	/* seq: primary epoch */
+	AESD_REPL_RESET,	/* seq: first record following the snapshot */
+	AESD_REPL_DATA,		/* Snapshot bytes */
+	AESD_REPL_RECORD,	/* One committed record */
+	AESD_REPL_HEARTBEAT,	/* seq: newest committed record */
+};
+
+/**
+ * struct aesd_repl_config - Replication settings
+ * @listen_port:     accept replicas on this port (primary), 0 to disable
+ * @primary_host:    connect to this primary (replica), NULL to disable
+ * @primary_port:    replication port of the primary
+ * @backlog_records: records kept for catch-up, rounded up to a power of two
+ * @backlog_bytes:   byte budget of the catch-up backlog
+ */
+struct aesd_repl_config {
+	int listen_port;
+	const char *primary_host;
+	int primary_port;
+	size_t backlog_records;
+	size_t backlog_bytes;
+};
+
+/* Start the primary listener and/or replica thread for @st */
+extern int aesd_repl_start( const struct aesd_repl_config *config, struct aesd_storage *st );
+extern void aesd_repl_stop( void );
+
+/* True when running as a replica, clients must not write to local storage */
+extern bool aesd_repl_is_replica( void );
+
+extern void aesd_repl_dump_stats( FILE *out );
+
+#endif /* AESD_REPL_H */
@@ -0,0 +1,467 @@
+/*
+ * aesd_shm.c - Shared memory ingestion channel, server drain thread and client library
+ *
+ * The ring is a bounded multi-producer single-consumer queue: a producer
+ * claims position P by advancing head with a CAS once slot P's sequence
+ * reads P (free), fills it and stores P + 1. The server consumes the slot
+ * once its sequence reads P + 1 and hands it back by storing P + slots.
+ *
+ * A producer that dies between the CAS on head and publishing would block
+ * the server at its slot forever. Once a claimed slot stays unpublished for
+ * SHM_STALL_TIMEOUT_MS the server marks it abandoned with a CAS on its
+ * sequence and moves on. Producers skip an abandoned slot on later laps, so
+ * a producer that was only slow can still copy into it safely: its publish
+ * CAS then fails, it marks the slot released and the server frees it the
+ * next time it comes round. A slot still abandoned a lap and another
+ * timeout later is taken to belong to a dead producer and freed as well.
+ */
+
+#define _GNU_SOURCE
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <time.h>
+#include <limits.h>
+#include <syslog.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <linux/futex.h>
+#include "aesd_shm.h"
+
+#define SHM_IDLE_WAIT_MS	100	/* Server re-checks the stop flag this often when idle */
+#define SHM_SPACE_WAIT_MS	10
+#define SHM_SPIN_LIMIT		128	/* Polls of an empty ring before the server sleeps */
+#define SHM_CACHELINE		64
+#define SHM_STALL_TIMEOUT_MS	1000	/* Claimed but unpublished slots are given up after this */
+
+static struct {
+	struct aesd_shm_header *header;
+	size_t map_size;
+	char name[NAME_MAX];
+	aesd_shm_commit_fn commit;
+	pthread_t thread;
+	bool started;
+	atomic_bool running;
+	_Atomic uint64_t packets;
+	_Atomic uint64_t bytes;
+	_Atomic uint64_t sleeps;
+	_Atomic uint64_t max_batch;
+	_Atomic uint64_t skipped;	/* Slots abandoned after SHM_STALL_TIMEOUT_MS */
+	_Atomic uint64_t released;	/* Abandoned slots handed back by their late producer */
+	_Atomic uint64_t dead;		/* Abandoned slots freed without hearing from the producer */
+	uint64_t stall_position;	/* Drain thread only, UINT64_MAX when not stalled */
+	uint64_t stall_since_ms;
+	uint64_t *abandoned_ms;		/* Drain thread only, when each slot was abandoned */
+} shm_server;
+
+/* Shared futexes, the words live in a segment mapped by several processes */
+static int futex_wait( _Atomic uint32_t *word, uint32_t expected, int timeout_ms ) {
+	struct timespec timeout = { timeout_ms / 1000, (timeout_ms % 1000) * 1000000L };
+	return syscall(SYS_futex, word, FUTEX_WAIT, expected, &timeout, NULL, 0);
+}
+
+static void futex_wake( _Atomic uint32_t *word, int count ) {
+	syscall(SYS_futex, word, FUTEX_WAKE, count, NULL, NULL, 0);
+}
+
+static struct aesd_shm_slot *slot_at( struct aesd_shm_header *header, uint64_t position ) {
+	return (struct aesd_shm_slot *)((char *)header + header->data_offset +
+		(size_t)(position & (header->slots - 1)) * header->slot_stride);
+}
+
+static size_t round_up( size_t value, size_t align ) {
+	return (value + align - 1) / align * align;
+}
+
+static uint64_t monotonic_ms( void ) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+/* ---- Server ----------------------------------------------------------- */
+
+/* Called with the slot at @tail unpublished, true once it has been claimed for too long and was abandoned */
+static bool give_up_stalled( struct aesd_shm_header *header, uint64_t tail ) {
+	uint64_t expected = tail;
+	uint64_t now;
+
+	if( atomic_load_explicit(&header->head, memory_order_acquire) == tail ) {
+		shm_server.stall_position = UINT64_MAX;
+		return false;	/* Empty ring, not a stall */
+	}
+	now = monotonic_ms();
+	if( shm_server.stall_position != tail ) {
+		shm_server.stall_position = tail;
+		shm_server.stall_since_ms = now;
+		return false;
+	}
+	if( now - shm_server.stall_since_ms < SHM_STALL_TIMEOUT_MS ) {
+		return false;
+	}
+	/* Fails when the producer published after all, the caller then drains it */
+	if( !atomic_compare_exchange_strong(&slot_at(header, tail)->seq, &expected, tail | AESD_SHM_SEQ_ABANDONED) ) {
+		return false;
+	}
+	shm_server.stall_position = UINT64_MAX;
+	shm_server.abandoned_ms[tail & (header->slots - 1)] = now;
+	atomic_fetch_add_explicit(&shm_server.skipped, 1, memory_order_relaxed);
+	syslog(LOG_WARNING, "Shared memory slot %llu unpublished for %d ms, skipped",
+		(unsigned long long)tail, SHM_STALL_TIMEOUT_MS);
+	return true;
+}
+
+/**
+ * Step over position @tail of an abandoned slot, @seq as read from it. Producers skip such
+ * a slot, so nothing was written for @tail; false while no producer got that far yet.
+ * The slot is freed for its next lap once the late producer released it, or once it has
+ * stayed abandoned for a lap and another SHM_STALL_TIMEOUT_MS.
+ */
+static bool pass_abandoned( struct aesd_shm_header *header, uint64_t tail, uint64_t seq ) {
+	struct aesd_shm_slot *slot = slot_at(header, tail);
+	uint64_t *abandoned_ms = &shm_server.abandoned_ms[tail & (header->slots - 1)];
+
+	if( atomic_load_explicit(&header->head, memory_order_acquire) == tail ) {
+		return false;
+	}
+	if( seq & AESD_SHM_SEQ_RELEASED ) {
+		atomic_store_explicit(&slot->seq, tail + header->slots, memory_order_release);
+		atomic_fetch_add_explicit(&shm_server.released, 1, memory_order_relaxed);
+	} else if( monotonic_ms() - *abandoned_ms >= SHM_STALL_TIMEOUT_MS ) {
+		/* Fails when the late producer released it meanwhile, it is freed on the next lap */
+		if( atomic_compare_exchange_strong(&slot->seq, &seq, tail + header->slots) ) {
+			atomic_fetch_add_explicit(&shm_server.dead, 1, memory_order_relaxed);
+			syslog(LOG_WARNING, "Shared memory slot %llu still abandoned a lap later, producer taken as dead",
+				(unsigned long long)(seq & ~AESD_SHM_SEQ_ABANDONED));
+		}
+	}
+	return true;
+}
+
+/* Commit every published slot, returns the number drained */
+static uint64_t drain_ring( struct aesd_shm_header *header ) {
+	uint64_t start = atomic_load_explicit(&header->tail, memory_order_relaxed);
+	uint64_t tail = start;
+	uint64_t drained = 0;
+
+	for( ;; ) {
+		struct aesd_shm_slot *slot = slot_at(header, tail);
+		uint64_t seq = atomic_load_explicit(&slot->seq, memory_order_acquire);
+		uint32_t length;
+
+		if( seq & AESD_SHM_SEQ_ABANDONED ) {
+			if( !pass_abandoned(header, tail, seq) ) {
+				break;
+			}
+			tail++;
+			continue;
+		}
+		if( seq != tail + 1 ) {
+			if( seq == tail && give_up_stalled(header, tail) ) {
+				tail++;
+				continue;
+			}
+			break;
+		}
+		/* A corrupt length from a misbehaving producer must not read past the slot */
+		length = slot->length <= header->slot_size ? slot->length : header->slot_size;
+		shm_server.commit(slot->data, length);
+		atomic_fetch_add_explicit(&shm_server.bytes, length, memory_order_relaxed);
+		atomic_store_explicit(&slot->seq, tail + header->slots, memory_order_release);
+		tail++;
+		drained++;
+	}
+
+	if( tail != start ) {
+		atomic_store_explicit(&header->tail, tail, memory_order_release);
+		atomic_fetch_add_explicit(&shm_server.packets, drained, memory_order_relaxed);
+		if( drained > atomic_load_explicit(&shm_server.max_batch, memory_order_relaxed) ) {
+			atomic_store_explicit(&shm_server.max_batch, drained, memory_order_relaxed);
+		}
+		if( atomic_load(&header->space_waiters) ) {
+			atomic_fetch_add(&header->space_word, 1);
+			futex_wake(&header->space_word, INT_MAX);
+		}
+		if( atomic_load(&header->commit_waiters) ) {
+			atomic_fetch_add(&header->commit_word, 1);
+			futex_wake(&header->commit_word, INT_MAX);
+		}
+	}
+	return drained;
+}
+
+static void *drain_thread_func( void *arg ) {
+	struct aesd_shm_header *header = shm_server.header;
+	int idle = 0;
+	(void)arg;
+
+	while( atomic_load(&shm_server.running) ) {
+		uint32_t doorbell;
+
+		if( drain_ring(header) > 0 ) {
+			idle = 0;
+			continue;
+		}
+		if( ++idle < SHM_SPIN_LIMIT ) {
+			continue;
+		}
+
+		/* Announce the sleep, then re-check so a producer publishing meanwhile is not missed */
+		doorbell = atomic_load(&header->doorbell);
+		atomic_store(&header->consumer_sleeping, 1);
+		if( atomic_load(&slot_at(header, atomic_load(&header->tail))->seq) != atomic_load(&header->tail) + 1 ) {
+			atomic_fetch_add_explicit(&shm_server.sleeps, 1, memory_order_relaxed);
+			futex_wait(&header->doorbell, doorbell, SHM_IDLE_WAIT_MS);
+		}
+		atomic_store(&header->consumer_sleeping, 0);
+		idle = 0;
+	}
+	drain_ring(header);
+	return NULL;
+}
+
+int aesd_shm_start( const char *name, size_t slots, size_t slot_size, aesd_shm_commit_fn commit ) {
+	struct aesd_shm_header *header;
+	size_t stride, data_offset, map_size, i, count = 1;
+	int fd;
+
+	while( count < slots ) {
+		count <<= 1;
+	}
+	stride = round_up(sizeof(struct aesd_shm_slot) + slot_size, SHM_CACHELINE);
+	data_offset = round_up(sizeof(struct aesd_shm_header), SHM_CACHELINE);
+	map_size = data_offset + count * stride;
+	shm_server.abandoned_ms = calloc(count, sizeof(*shm_server.abandoned_ms));
+	if( shm_server.abandoned_ms == NULL ) {
+		return -1;
+	}
+
+	/* A segment left behind by a crashed server has stale positions, start fresh */
+	shm_unlink(name);
+	fd = shm_open(name, O_RDWR | O_CREAT | O_EXCL | O_CLOEXEC, 0660);
+	if( fd < 0 ) {
+		goto free_abandoned;
+	}
+	if( ftruncate(fd, map_size) < 0 ) {
+		close(fd);
+		goto unlink;
+	}
+	header = mmap(NULL, map_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	close(fd);
+	if( header == MAP_FAILED ) {
+		goto unlink;
+	}
+
+	header->slots = count;
+	header->slot_size = slot_size;
+	header->slot_stride = stride;
+	header->data_offset = data_offset;
+	for( i = 0; i < count; i++ ) {
+		atomic_store_explicit(&slot_at(header, i)->seq, i, memory_order_relaxed);
+	}
+	header->version = AESD_SHM_VERSION;
+	/* Clients check the magic last, publish it once the layout is complete */
+	atomic_thread_fence(memory_order_release);
+	header->magic = AESD_SHM_MAGIC;
+
+	shm_server.header = header;
+	shm_server.map_size = map_size;
+	shm_server.commit = commit;
+	shm_server.stall_position = UINT64_MAX;
+	snprintf(shm_server.name, sizeof(shm_server.name), "%s", name);
+	atomic_store(&shm_server.running, true);
+	if( pthread_create(&shm_server.thread, NULL, drain_thread_func, NULL) != 0 ) {
+		munmap(header, map_size);
+		shm_server.header = NULL;
+		goto unlink;
+	}
+	shm_server.started = true;
+	syslog(LOG_INFO, "Shared memory channel %s ready, %zu slots of %zu bytes", name, count, slot_size);
+	return 0;
+
+unlink:
+	shm_unlink(name);
+free_abandoned:
+	free(shm_server.abandoned_ms);
+	shm_server.abandoned_ms = NULL;
+	return -1;
+}
+
+void aesd_shm_stop( void ) {
+	if( !shm_server.started ) {
+		return;
+	}
+	atomic_store(&shm_server.running, false);
+	atomic_fetch_add(&shm_server.header->doorbell, 1);
+	futex_wake(&shm_server.header->doorbell, 1);
+	pthread_join(shm_server.thread, NULL);
+	shm_server.started = false;
+
+	shm_unlink(shm_server.name);
+	munmap(shm_server.header, shm_server.map_size);
+	shm_server.header = NULL;
+	free(shm_server.abandoned_ms);
+	shm_server.abandoned_ms = NULL;
+}
+
+void aesd_shm_dump_stats( FILE *out ) {
+	struct aesd_shm_header *header = shm_server.header;
+
+	if( header == NULL ) {
+		return;
+	}
+	fprintf(out, "shm name=%s slots=%u slot_size=%u depth=%llu packets=%llu bytes=%llu"
+		" sleeps=%llu max_batch=%llu full_waits=%llu skipped=%llu released=%llu dead=%llu\n",
+		shm_server.name, header->slots, header->slot_size,
+		(unsigned long long)(atomic_load(&header->head) - atomic_load(&header->tail)),
+		(unsigned long long)atomic_load(&shm_server.packets),
+		(unsigned long long)atomic_load(&shm_server.bytes),
+		(unsigned long long)atomic_load(&shm_server.sleeps),
+		(unsigned long long)atomic_load(&shm_server.max_batch),
+		(unsigned long long)atomic_load(&header->full_waits),
+		(unsigned long long)atomic_load(&shm_server.skipped),
+		(unsigned long long)atomic_load(&shm_server.released),
+		(unsigned long long)atomic_load(&shm_server.dead));
+}
+
+/* ---- Client library --------------------------------------------------- */
+
+int aesd_shm_client_open( struct aesd_shm_client *client, const char *name ) {
+	struct aesd_shm_header *header;
+	struct stat st;
+	int fd = shm_open(name, O_RDWR | O_CLOEXEC, 0);
+
+	if( fd < 0 ) {
+		return -1;
+	}
+	if( fstat(fd, &st) < 0 || (size_t)st.st_size < sizeof(*header) ) {
+		close(fd);
+		errno = EINVAL;
+		return -1;
+	}
+	header = mmap(NULL, st.st_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	close(fd);
+	if( header == MAP_FAILED ) {
+		return -1;
+	}
+	if( header->magic != AESD_SHM_MAGIC || header->version != AESD_SHM_VERSION ||
+			header->data_offset + (size_t)header->slots * header->slot_stride > (size_t)st.st_size ) {
+		munmap(header, st.st_size);
+		errno = EPROTO;
+		return -1;
+	}
+	atomic_thread_fence(memory_order_acquire);
+	client->header = header;
+	client->map_size = st.st_size;
+	return 0;
+}
+
+void aesd_shm_client_close( struct aesd_shm_client *client ) {
+	if( client->header != NULL ) {
+		munmap(client->header, client->map_size);
+		client->header = NULL;
+	}
+}
+
+static void wait_for_space( struct aesd_shm_header *header, uint64_t position ) {
+	uint32_t word = atomic_load(&header->space_word);
+
+	atomic_fetch_add(&header->space_waiters, 1);
+	if( atomic_load(&slot_at(header, position)->seq) != position ) {
+		futex_wait(&header->space_word, word, SHM_SPACE_WAIT_MS);
+	}
+	atomic_fetch_sub(&header->space_waiters, 1);
+}
+
+int64_t aesd_shm_send( struct aesd_shm_client *client, const void *data, size_t length ) {
+	struct aesd_shm_header *header = client->header;
+	struct aesd_shm_slot *slot;
+	uint64_t position, expected;
+
+	if( length > header->slot_size ) {
+		errno = EMSGSIZE;
+		return -1;
+	}
+
+	position = atomic_load_explicit(&header->head, memory_order_relaxed);
+	for( ;; ) {
+		uint64_t seq;
+		int64_t diff;
+
+		slot = slot_at(header, position);
+		seq = atomic_load_explicit(&slot->seq, memory_order_acquire);
+		if( seq & AESD_SHM_SEQ_ABANDONED ) {
+			/* Its late producer may still write it, leave the position empty */
+			atomic_compare_exchange_weak_explicit(&header->head, &position, position + 1,
+				memory_order_relaxed, memory_order_relaxed);
+			position = atomic_load_explicit(&header->head, memory_order_relaxed);
+			continue;
+		}
+		diff = (int64_t)(seq - position);
+		if( diff == 0 ) {
+			if( atomic_compare_exchange_weak_explicit(&header->head, &position, position + 1,
+					memory_order_relaxed, memory_order_relaxed) ) {
+				break;
+			}
+		} else if( diff < 0 ) {
+			/* The server has not consumed this slot from the previous lap yet */
+			atomic_fetch_add_explicit(&header->full_waits, 1, memory_order_relaxed);
+			wait_for_space(header, position);
+			position = atomic_load_explicit(&header->head, memory_order_relaxed);
+		} else {
+			position = atomic_load_explicit(&header->head, memory_order_relaxed);
+		}
+	}
+
+	memcpy(slot->data, data, length);
+	slot->length = length;
+	expected = position;
+	if( !atomic_compare_exchange_strong_explicit(&slot->seq, &expected, position + 1,
+			memory_order_release, memory_order_relaxed) ) {
+		/* Stalled past SHM_STALL_TIMEOUT_MS, the server abandoned the slot: hand it back */
+		if( expected == (position | AESD_SHM_SEQ_ABANDONED) ) {
+			atomic_compare_exchange_strong_explicit(&slot->seq, &expected, expected | AESD_SHM_SEQ_RELEASED,
+				memory_order_release, memory_order_relaxed);
+		}
+		errno = ETIMEDOUT;
+		return -1;
+	}
+
+	/* Pairs with the server's sleep announcement, one of the two sees the other */
+	atomic_thread_fence(memory_order_seq_cst);
+	if( atomic_load_explicit(&header->consumer_sleeping, memory_order_relaxed) ) {
+		atomic_fetch_add(&header->doorbell, 1);
+		futex_wake(&header->doorbell, 1);
+	}
+	return position;
+}
+
+int aesd_shm_wait_committed( struct aesd_shm_client *client, uint64_t position, int timeout_ms ) {
+	struct aesd_shm_header *header = client->header;
+	struct timespec start, now;
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	while( atomic_load_explicit(&header->tail, memory_order_acquire) <= position ) {
+		uint32_t word = atomic_load(&header->commit_word);
+		long elapsed_ms;
+
+		atomic_fetch_add(&header->commit_waiters, 1);
+		if( atomic_load(&header->tail) <= position ) {
+			futex_wait(&header->commit_word, word, SHM_SPACE_WAIT_MS);
+		}
+		atomic_fetch_sub(&header->commit_waiters, 1);
+
+		clock_gettime(CLOCK_MONOTONIC, &now);
+		elapsed_ms = (now.tv_sec - start.tv_sec) * 1000 + (now.tv_nsec - start.tv_nsec) / 1000000;
+		if( elapsed_ms >= timeout_ms && atomic_load(&header->tail) <= position ) {
+			errno = ETIMEDOUT;
+			return -1;
+		}
+	}
+	return 0;
+}
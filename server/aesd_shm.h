@@ -0,0 +1,101 @@
+/*
+ * aesd_shm.h - Shared memory ingestion channel for co-located producers
+ *
+ * aesdsocket creates a POSIX shared memory segment holding a ring of fixed
+ * size slots. Local producers map it and publish one packet per slot
+ * without a system call on the fast path; the server drains the ring into
+ * the same commit path as TCP packets. Slots are claimed with a CAS on the
+ * head position and published through a per-slot sequence, so any number
+ * of producer processes can write concurrently. Futexes on words in the
+ * segment wake the server when it sleeps on an empty ring and producers
+ * when they wait for space or for their packet to be committed.
+ *
+ * A producer that dies after claiming a slot and before publishing it
+ * cannot release the slot, so the server abandons a slot that stays
+ * claimed but unpublished for a timeout (skipped in the stats) and
+ * producers leave it alone on the following laps. A producer that was only
+ * stalled gets its packet dropped and hands the slot back (released). A slot
+ * still abandoned a lap and another timeout later is freed as belonging to a
+ * dead producer (dead); a producer stalled even longer can still overwrite
+ * that slot's next packet.
+ *
+ * The channel only carries writes, replies are still read over TCP.
+ */
+
+#ifndef AESD_SHM_H
+#define AESD_SHM_H
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stddef.h>
+#include <stdatomic.h>
+
+#define AESD_SHM_DEFAULT_NAME		"/aesdsocket"
+#define AESD_SHM_DEFAULT_SLOTS		4096
+#define AESD_SHM_DEFAULT_SLOT_SIZE	2048
+#define AESD_SHM_MAGIC			0x41455344	/* "AESD" */
+#define AESD_SHM_VERSION		2	/* 2: slots are published with a CAS, abandoned slots are skipped */
+
+/* Segment header, producer and consumer positions live on separate cache lines */
+struct aesd_shm_header {
+	uint32_t magic;
+	uint32_t version;
+	uint32_t slots;			/* Power of two */
+	uint32_t slot_size;		/* Payload bytes per slot */
+	uint32_t slot_stride;		/* Bytes between slot headers */
+	uint32_t data_offset;		/* Offset of slot 0 from the segment start */
+
+	_Alignas(64) _Atomic uint64_t head;	/* Next position a producer claims */
+	_Atomic uint32_t space_word;		/* Futex, bumped when the server frees slots */
+	_Atomic uint32_t space_waiters;
+	_Atomic uint64_t full_waits;		/* Producers that found the ring full */
+
+	_Alignas(64) _Atomic uint64_t tail;	/* Next position the server consumes */
+	_Atomic uint32_t doorbell;		/* Futex, bumped to wake a sleeping server */
+	_Atomic uint32_t consumer_sleeping;
+	_Atomic uint32_t commit_word;		/* Futex, bumped after a batch is committed */
+	_Atomic uint32_t commit_waiters;
+};
+
+/* Slot sequence of a position the server gave up on, RELEASED once its producer is done with it */
+#define AESD_SHM_SEQ_ABANDONED		(1ULL << 63)
+#define AESD_SHM_SEQ_RELEASED		(1ULL << 62)
+
+struct aesd_shm_slot {
+	_Atomic uint64_t seq;	/* position + 1 once published, position + slots once free, or ABANDONED | position */
+	uint32_t length;
+	uint32_t reserved;
+	char data[];
+};
+
+/* Producer side handle, see aesd_shm_client_open() */
+struct aesd_shm_client {
+	struct aesd_shm_header *header;
+	size_t map_size;
+};
+
+/* Called by the server for every drained packet, the data is only valid during the call */
+typedef void (*aesd_shm_commit_fn)( const char *data, size_t length );
+
+/* Server: create the segment @name and start the drain thread */
+extern int aesd_shm_start( const char *name, size_t slots, size_t slot_size, aesd_shm_commit_fn commit );
+extern void aesd_shm_stop( void );
+extern void aesd_shm_dump_stats( FILE *out );
+
+/* Client library */
+extern int aesd_shm_client_open( struct aesd_shm_client *client, const char *name );
+extern void aesd_shm_client_close( struct aesd_shm_client *client );
+
+/**
+ * aesd_shm_send() - Publish one packet
+ * Waits while the ring is full. Returns the position of the packet for
+ * aesd_shm_wait_committed(), or -1 with errno EMSGSIZE when @length does not
+ * fit in a slot or ETIMEDOUT when the server skipped the slot before it was
+ * published.
+ */
+extern int64_t aesd_shm_send( struct aesd_shm_client *client, const void *data, size_t length );
+
+/* Wait until the server committed the packet at @position, 0 on success, -1 with ETIMEDOUT */
+extern int aesd_shm_wait_committed( struct aesd_shm_client *client, uint64_t position, int timeout_ms );
+
+#endif /* AESD_SHM_H */
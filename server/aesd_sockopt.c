@@ -0,0 +1,66 @@
+/*
+ * aesd_sockopt.c - Tunable socket option profile for aesdsocket
+ */
+
+#include <errno.h>
+#include <string.h>
+#include <syslog.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include "aesd_sockopt.h"
+
+int aesd_sockopt_listener( int sockfd, const struct aesd_socket_profile *profile ) {
+	if( profile->defer_accept > 0 &&
+			setsockopt(sockfd, IPPROTO_TCP, TCP_DEFER_ACCEPT, &profile->defer_accept,
+				sizeof(profile->defer_accept)) < 0 ) {
+		syslog(LOG_ERR, "Failed to set TCP_DEFER_ACCEPT: %s", strerror(errno));
+		return -1;
+	}
+	if( profile->fastopen > 0 &&
+			setsockopt(sockfd, IPPROTO_TCP, TCP_FASTOPEN, &profile->fastopen,
+				sizeof(profile->fastopen)) < 0 ) {
+		syslog(LOG_ERR, "Failed to set TCP_FASTOPEN: %s", strerror(errno));
+		return -1;
+	}
+	return 0;
+}
+
+int aesd_sockopt_client( int sockfd, const struct aesd_socket_profile *profile ) {
+	int yes = 1;
+
+	if( profile->nodelay &&
+			setsockopt(sockfd, IPPROTO_TCP, TCP_NODELAY, &yes, sizeof(yes)) < 0 ) {
+		return -1;
+	}
+	if( profile->busy_poll > 0 &&
+			setsockopt(sockfd, SOL_SOCKET, SO_BUSY_POLL, &profile->busy_poll,
+				sizeof(profile->busy_poll)) < 0 ) {
+		return -1;
+	}
+	return 0;
+}
+
+void aesd_sockopt_cork( int sockfd, const struct aesd_socket_profile *profile, bool on ) {
+	int value = on;
+
+	if( profile->cork ) {
+		setsockopt(sockfd, IPPROTO_TCP, TCP_CORK, &value, sizeof(value));
+	}
+}
+
+int aesd_wait_socket( int sockfd, short events, int timeout_ms ) {
+	struct pollfd pfd = { .fd = sockfd, .events = events };
+	int rc;
+
+	do {
+		rc = poll(&pfd, 1, timeout_ms);
+	} while( rc < 0 && errno == EINTR );
+
+	if( rc == 0 ) {
+		errno = ETIMEDOUT;
+		return -1;
+	}
+	return rc < 0 ? -1 : 0;
+}
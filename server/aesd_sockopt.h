@@ -0,0 +1,48 @@
+/*
+ * aesd_sockopt.h - Tunable socket option profile for aesdsocket
+ *
+ * Every setting defaults to off (or the kernel default) so that each one
+ * can be enabled individually and measured with aesdbench.
+ */
+
+#ifndef AESD_SOCKOPT_H
+#define AESD_SOCKOPT_H
+
+#include <stdbool.h>
+
+#define AESD_DEFAULT_BACKLOG	4096
+
+/**
+ * struct aesd_socket_profile - Socket options applied by aesdsocket
+ * @backlog:      listen() backlog, capped by net.core.somaxconn
+ * @defer_accept: TCP_DEFER_ACCEPT seconds, wake accept() only once data arrived
+ * @fastopen:     TCP_FASTOPEN queue length for data carried in the SYN
+ * @nodelay:      set TCP_NODELAY on accepted sockets
+ * @cork:         wrap each reply in TCP_CORK so it leaves in full segments
+ * @busy_poll:    SO_BUSY_POLL microseconds on accepted sockets
+ */
+struct aesd_socket_profile {
+	int backlog;
+	int defer_accept;
+	int fastopen;
+	bool nodelay;
+	bool cork;
+	int busy_poll;
+};
+
+/* Apply the listener options, must be called before listen() */
+extern int aesd_sockopt_listener( int sockfd, const struct aesd_socket_profile *profile );
+
+/* Apply the per-connection options to an accepted socket */
+extern int aesd_sockopt_client( int sockfd, const struct aesd_socket_profile *profile );
+
+/* Start (@on true) or flush (@on false) a corked reply when the profile asks for it */
+extern void aesd_sockopt_cork( int sockfd, const struct aesd_socket_profile *profile, bool on );
+
+/**
+ * aesd_wait_socket() - Wait until @sockfd is ready for @events (POLLIN/POLLOUT)
+ * Retries on EINTR. Fails with ETIMEDOUT after @timeout_ms, -1 waits forever.
+ */
+extern int aesd_wait_socket( int sockfd, short events, int timeout_ms );
+
+#endif /* AESD_SOCKOPT_H */
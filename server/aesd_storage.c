@@ -0,0 +1,174 @@
+/*
+ * aesd_storage.c - Storage engine registry and locked dispatch
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include "aesd_storage.h"
+
+static const struct aesd_storage_ops *const engines[] = {
+	&aesd_storage_file_ops,
+	&aesd_storage_chardev_ops,
+	&aesd_storage_mem_ops,
+	&aesd_storage_framed_ops,
+};
+
+#define ENGINE_COUNT	(sizeof(engines) / sizeof(engines[0]))
+
+const struct aesd_storage_ops *aesd_storage_find( const char *name ) {
+	size_t i;
+
+	for( i = 0; i < ENGINE_COUNT; i++ ) {
+		if( strcmp(engines[i]->name, name) == 0 ) {
+			return engines[i];
+		}
+	}
+	return NULL;
+}
+
+void aesd_storage_list( FILE *out ) {
+	size_t i;
+
+	for( i = 0; i < ENGINE_COUNT; i++ ) {
+		fprintf(out, "%s%s", i ? ", " : "", engines[i]->name);
+	}
+}
+
+struct aesd_storage *aesd_storage_open( const struct aesd_storage_ops *ops,
+		const struct aesd_storage_params *params ) {
+	struct aesd_storage *st = calloc(1, sizeof(*st));
+
+	if( st == NULL ) {
+		return NULL;
+	}
+	st->ops = ops;
+	pthread_mutex_init(&st->lock, NULL);
+	if( ops->open(st, params) < 0 ) {
+		int saved_errno = errno;
+		pthread_mutex_destroy(&st->lock);
+		free(st);
+		errno = saved_errno;
+		return NULL;
+	}
+	return st;
+}
+
+void aesd_storage_close( struct aesd_storage *st ) {
+	if( st == NULL ) {
+		return;
+	}
+	st->ops->close(st);
+	pthread_mutex_destroy(&st->lock);
+	free(st);
+}
+
+int aesd_storage_add_hook( struct aesd_storage *st, aesd_storage_hook_fn fn, void *arg ) {
+	if( st->nhooks == AESD_STORAGE_MAX_HOOKS ) {
+		errno = ENOSPC;
+		return -1;
+	}
+	st->hooks[st->nhooks].fn = fn;
+	st->hooks[st->nhooks].arg = arg;
+	st->nhooks++;
+	return 0;
+}
+
+int aesd_storage_append( struct aesd_storage *st, const char *data, size_t length ) {
+	uint64_t offset;
+	int rc, i;
+
+	pthread_mutex_lock(&st->lock);
+	offset = st->ops->size(st);
+	rc = st->ops->append(st, data, length);
+	if( rc == 0 ) {
+		for( i = 0; i < st->nhooks; i++ ) {
+			st->hooks[i].fn(st, offset, data, length, st->hooks[i].arg);
+		}
+	}
+	pthread_mutex_unlock(&st->lock);
+	return rc;
+}
+
+ssize_t aesd_storage_read( struct aesd_storage *st, uint64_t offset, char *buffer, size_t length ) {
+	ssize_t rc;
+
+	pthread_mutex_lock(&st->lock);
+	rc = st->ops->read_range(st, offset, buffer, length);
+	pthread_mutex_unlock(&st->lock);
+	return rc;
+}
+
+uint64_t aesd_storage_start( struct aesd_storage *st ) {
+	uint64_t start;
+
+	pthread_mutex_lock(&st->lock);
+	start = st->ops->start(st);
+	pthread_mutex_unlock(&st->lock);
+	return start;
+}
+
+uint64_t aesd_storage_size( struct aesd_storage *st ) {
+	uint64_t size;
+
+	pthread_mutex_lock(&st->lock);
+	size = st->ops->size(st);
+	pthread_mutex_unlock(&st->lock);
+	return size;
+}
+
+int aesd_storage_reset( struct aesd_storage *st ) {
+	int rc;
+
+	if( st->ops->reset == NULL ) {
+		errno = ENOTSUP;
+		return -1;
+	}
+	pthread_mutex_lock(&st->lock);
+	rc = st->ops->reset(st);
+	pthread_mutex_unlock(&st->lock);
+	return rc;
+}
+
+int aesd_storage_seek_record( struct aesd_storage *st, uint32_t index, uint32_t offset, uint64_t *pos ) {
+	int rc;
+
+	if( st->ops->seek_record == NULL ) {
+		errno = ENOTSUP;
+		return -1;
+	}
+	pthread_mutex_lock(&st->lock);
+	rc = st->ops->seek_record(st, index, offset, pos);
+	pthread_mutex_unlock(&st->lock);
+	return rc;
+}
+
+int aesd_storage_flush( struct aesd_storage *st ) {
+	int rc = 0;
+
+	if( st->ops->flush == NULL ) {
+		return 0;
+	}
+	pthread_mutex_lock(&st->lock);
+	rc = st->ops->flush(st);
+	pthread_mutex_unlock(&st->lock);
+	return rc;
+}
+
+void aesd_storage_dump_stats( struct aesd_storage *st, FILE *out ) {
+	uint64_t size;
+
+	pthread_mutex_lock(&st->lock);
+	size = st->ops->size(st);
+	if( size == UINT64_MAX ) {
+		fprintf(out, "storage engine=%s start=%llu size=unknown\n", st->ops->name,
+			(unsigned long long)st->ops->start(st));
+	} else {
+		fprintf(out, "storage engine=%s start=%llu size=%llu\n", st->ops->name,
+			(unsigned long long)st->ops->start(st), (unsigned long long)size);
+	}
+	if( st->ops->dump_stats != NULL ) {
+		st->ops->dump_stats(st, out);
+	}
+	pthread_mutex_unlock(&st->lock);
+}
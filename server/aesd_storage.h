@@ -0,0 +1,122 @@
+/*
+ * aesd_storage.h - Pluggable storage engines for aesdsocket
+ *
+ * Every engine implements the same small set of operations and is selected
+ * by name at runtime, so the file, char device and in-memory backends can
+ * be compared on one binary.
+ *
+ * Offsets are logical byte offsets into everything ever appended. Engines
+ * that evict old data report the oldest offset still held through
+ * aesd_storage_start(); reading below it fails with ERANGE.
+ */
+
+#ifndef AESD_STORAGE_H
+#define AESD_STORAGE_H
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <sys/types.h>
+#include <pthread.h>
+
+#define AESD_FILE_PATH		"/var/tmp/aesdsocketdata"
+#define AESD_CHAR_DEVICE_PATH	"/dev/aesdchar"
+#define AESD_FRAMED_PATH	"/var/tmp/aesdsocketdata.framed"
+
+struct aesd_storage;
+
+/**
+ * struct aesd_storage_params - Engine settings, engines ignore what they don't use
+ * @path:            backing file or device
+ * @max_records:     record limit of bounded engines, 0 for the engine default
+ * @max_bytes:       byte budget of bounded engines, 0 for no byte limit
+ * @remove_on_close: delete @path when the engine is closed
+ */
+struct aesd_storage_params {
+	const char *path;
+	size_t max_records;
+	size_t max_bytes;
+	bool remove_on_close;
+};
+
+/**
+ * struct aesd_storage_ops - Storage engine vtable, called with the storage lock held
+ * @name:       name used to select the engine on the command line
+ * @timestamps: whether the periodic timestamp records should be appended
+ * @open:       set up st->priv from @params
+ * @append:     store @length bytes as one record
+ * @read_range: copy up to @length bytes from logical @offset, 0 at the end of data
+ * @start:      logical offset of the oldest byte still held
+ * @size:       logical offset one past the newest byte, UINT64_MAX if unknown
+ * @reset:      discard everything, logical offsets restart at 0 (optional)
+ * @seek_record: set *@pos to the logical offset of byte @offset of the @index-th
+ *              oldest record held, EINVAL if there is no such byte (optional)
+ * @flush:      make appended data durable (optional)
+ * @close:      release st->priv
+ * @dump_stats: write engine counters as text (optional)
+ */
+struct aesd_storage_ops {
+	const char *name;
+	bool timestamps;
+	int (*open)( struct aesd_storage *st, const struct aesd_storage_params *params );
+	int (*append)( struct aesd_storage *st, const char *data, size_t length );
+	ssize_t (*read_range)( struct aesd_storage *st, uint64_t offset, char *buffer, size_t length );
+	uint64_t (*start)( struct aesd_storage *st );
+	uint64_t (*size)( struct aesd_storage *st );
+	int (*reset)( struct aesd_storage *st );
+	int (*seek_record)( struct aesd_storage *st, uint32_t index, uint32_t offset, uint64_t *pos );
+	int (*flush)( struct aesd_storage *st );
+	void (*close)( struct aesd_storage *st );
+	void (*dump_stats)( struct aesd_storage *st, FILE *out );
+};
+
+/**
+ * Called with the storage lock held after every successful append, so hooks
+ * see records in commit order. @offset is the logical offset of the record,
+ * UINT64_MAX when the engine does not know its size.
+ */
+typedef void (*aesd_storage_hook_fn)( struct aesd_storage *st, uint64_t offset,
+		const char *data, size_t length, void *arg );
+
+#define AESD_STORAGE_MAX_HOOKS	4
+
+struct aesd_storage {
+	const struct aesd_storage_ops *ops;
+	pthread_mutex_t lock;	/* Serializes appends against reads */
+	void *priv;		/* Engine private data */
+	struct {
+		aesd_storage_hook_fn fn;
+		void *arg;
+	} hooks[AESD_STORAGE_MAX_HOOKS];
+	int nhooks;
+};
+
+extern const struct aesd_storage_ops aesd_storage_file_ops;
+extern const struct aesd_storage_ops aesd_storage_chardev_ops;
+extern const struct aesd_storage_ops aesd_storage_mem_ops;
+extern const struct aesd_storage_ops aesd_storage_framed_ops;
+
+/* Find an engine by name, NULL if unknown */
+extern const struct aesd_storage_ops *aesd_storage_find( const char *name );
+
+/* Write the comma separated list of engine names to @out */
+extern void aesd_storage_list( FILE *out );
+
+extern struct aesd_storage *aesd_storage_open( const struct aesd_storage_ops *ops,
+		const struct aesd_storage_params *params );
+extern void aesd_storage_close( struct aesd_storage *st );
+
+/* Register a commit hook, must be done before the storage is shared between threads */
+extern int aesd_storage_add_hook( struct aesd_storage *st, aesd_storage_hook_fn fn, void *arg );
+
+/* Locked wrappers around the engine operations */
+extern int aesd_storage_append( struct aesd_storage *st, const char *data, size_t length );
+extern ssize_t aesd_storage_read( struct aesd_storage *st, uint64_t offset, char *buffer, size_t length );
+extern uint64_t aesd_storage_start( struct aesd_storage *st );
+extern uint64_t aesd_storage_size( struct aesd_storage *st );
+extern int aesd_storage_reset( struct aesd_storage *st );
+extern int aesd_storage_seek_record( struct aesd_storage *st, uint32_t index, uint32_t offset, uint64_t *pos );
+extern int aesd_storage_flush( struct aesd_storage *st );
+extern void aesd_storage_dump_stats( struct aesd_storage *st, FILE *out );
+
+#endif /* AESD_STORAGE_H */
@@ -0,0 +1,188 @@
+/*
+ * aesd_storage_file.c - File and aesdchar device storage engines
+ *
+ * Both engines keep one descriptor open for the lifetime of the server.
+ * The file engine appends to a regular file and knows its size; the char
+ * device engine writes to /dev/aesdchar, where the driver keeps only the
+ * most recent commands, so its size is only known by reading to EOF.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <syslog.h>
+#include <sys/stat.h>
+#include "aesd_storage.h"
+#include "../aesd-char-driver/aesd_ioctl.h"
+
+struct fd_storage {
+	int fd;
+	char *path;
+	bool remove_on_close;
+	uint64_t size;		/* File engine only */
+	uint64_t appends;
+	uint64_t fsyncs;
+};
+
+static int fd_storage_open( struct aesd_storage *st, const struct aesd_storage_params *params,
+		const char *default_path, int flags ) {
+	struct fd_storage *fs = calloc(1, sizeof(*fs));
+	struct stat sb;
+
+	if( fs == NULL ) {
+		return -1;
+	}
+	fs->path = strdup(params->path ? params->path : default_path);
+	if( fs->path == NULL ) {
+		free(fs);
+		return -1;
+	}
+	fs->fd = open(fs->path, flags, 0644);
+	if( fs->fd < 0 ) {
+		int saved_errno = errno;
+		free(fs->path);
+		free(fs);
+		errno = saved_errno;
+		return -1;
+	}
+	if( fstat(fs->fd, &sb) == 0 && S_ISREG(sb.st_mode) ) {
+		fs->size = sb.st_size;
+	}
+	fs->remove_on_close = params->remove_on_close;
+	st->priv = fs;
+	return 0;
+}
+
+static int file_open( struct aesd_storage *st, const struct aesd_storage_params *params ) {
+	return fd_storage_open(st, params, AESD_FILE_PATH, O_CREAT|O_APPEND|O_RDWR|O_CLOEXEC);
+}
+
+static int chardev_open( struct aesd_storage *st, const struct aesd_storage_params *params ) {
+	return fd_storage_open(st, params, AESD_CHAR_DEVICE_PATH, O_RDWR|O_CLOEXEC);
+}
+
+static int fd_storage_append( struct aesd_storage *st, const char *data, size_t length ) {
+	struct fd_storage *fs = st->priv;
+	size_t written = 0;
+
+	while( written < length ) {
+		ssize_t rc = write(fs->fd, data + written, length - written);
+		if( rc < 0 ) {
+			if( errno == EINTR ) {
+				continue;
+			}
+			return -1;
+		}
+		written += rc;
+	}
+	fs->size += length;
+	fs->appends++;
+	return 0;
+}
+
+static ssize_t fd_storage_read_range( struct aesd_storage *st, uint64_t offset, char *buffer, size_t length ) {
+	struct fd_storage *fs = st->priv;
+	ssize_t rc;
+
+	do {
+		rc = pread(fs->fd, buffer, length, offset);
+	} while( rc < 0 && errno == EINTR );
+	return rc;
+}
+
+static uint64_t fd_storage_start( struct aesd_storage *st ) {
+	(void)st;
+	return 0;
+}
+
+static uint64_t file_size( struct aesd_storage *st ) {
+	struct fd_storage *fs = st->priv;
+	return fs->size;
+}
+
+static uint64_t chardev_size( struct aesd_storage *st ) {
+	(void)st;
+	return UINT64_MAX;	/* The driver evicts on its own, read to EOF instead */
+}
+
+/* The driver moves the descriptor's f_pos to the command, read it back with lseek() */
+static int chardev_seek_record( struct aesd_storage *st, uint32_t index, uint32_t offset, uint64_t *pos ) {
+	struct fd_storage *fs = st->priv;
+	struct aesd_seekto seekto = { .write_cmd = index, .write_cmd_offset = offset };
+	off_t rc;
+
+	if( ioctl(fs->fd, AESDCHAR_IOCSEEKTO, &seekto) < 0 ) {
+		return -1;
+	}
+	rc = lseek(fs->fd, 0, SEEK_CUR);
+	if( rc < 0 ) {
+		return -1;
+	}
+	*pos = rc;
+	return 0;
+}
+
+static int file_reset( struct aesd_storage *st ) {
+	struct fd_storage *fs = st->priv;
+
+	if( ftruncate(fs->fd, 0) < 0 ) {
+		return -1;
+	}
+	fs->size = 0;
+	return 0;
+}
+
+static int file_flush( struct aesd_storage *st ) {
+	struct fd_storage *fs = st->priv;
+
+	fs->fsyncs++;
+	return fdatasync(fs->fd);
+}
+
+static void fd_storage_close( struct aesd_storage *st ) {
+	struct fd_storage *fs = st->priv;
+
+	close(fs->fd);
+	if( fs->remove_on_close && remove(fs->path) != 0 ) {
+		syslog(LOG_ERR, "Failed to remove file: %s", strerror(errno));
+	}
+	free(fs->path);
+	free(fs);
+	st->priv = NULL;
+}
+
+static void fd_storage_dump_stats( struct aesd_storage *st, FILE *out ) {
+	struct fd_storage *fs = st->priv;
+
+	fprintf(out, "storage path=%s appends=%llu fsyncs=%llu\n", fs->path,
+		(unsigned long long)fs->appends, (unsigned long long)fs->fsyncs);
+}
+
+const struct aesd_storage_ops aesd_storage_file_ops = {
+	.name = "file",
+	.timestamps = true,
+	.open = file_open,
+	.append = fd_storage_append,
+	.read_range = fd_storage_read_range,
+	.start = fd_storage_start,
+	.size = file_size,
+	.reset = file_reset,
+	.flush = file_flush,
+	.close = fd_storage_close,
+	.dump_stats = fd_storage_dump_stats,
+};
+
+const struct aesd_storage_ops aesd_storage_chardev_ops = {
+	.name = "chardev",
+	.timestamps = false,	/* The driver only stores client commands */
+	.open = chardev_open,
+	.append = fd_storage_append,
+	.read_range = fd_storage_read_range,
+	.start = fd_storage_start,
+	.size = chardev_size,
+	.seek_record = chardev_seek_record,
+	.close = fd_storage_close,
+	.dump_stats = fd_storage_dump_stats,
+};
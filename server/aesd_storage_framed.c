@@ -0,0 +1,514 @@
+/*
+ * aesd_storage_framed.c - Record framed file storage engine
+ *
+ * Every record is written behind a header carrying its length, sequence
+ * number, commit time and a CRC32C of header and payload, so the file can
+ * be verified and cut back to its last intact record after a crash. Reads
+ * still return the plain payload bytes at logical offsets, exactly what
+ * the file engine would have stored.
+ *
+ * A sidecar "<path>.idx" holds a sparse index, one entry for every
+ * FRAMED_INDEX_INTERVAL records, mapping sequence number and logical
+ * offset to the header's file offset. Reads and the recovery scan start
+ * from the nearest entry instead of the beginning of the file.
+ */
+
+#define _GNU_SOURCE	/* asprintf() */
+#include <stdlib.h>
+#include <stddef.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <syslog.h>
+#include <time.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include "aesd_storage.h"
+#include "aesd_crc32c.h"
+
+#define FRAMED_FILE_MAGIC	"AESDFRM1"
+#define FRAMED_RECORD_MAGIC	0x44524352	/* "RCRD" */
+#define FRAMED_INDEX_SUFFIX	".idx"
+#define FRAMED_INDEX_INTERVAL	64		/* Records per sparse index entry */
+#define FRAMED_CACHE_SIZE	(64 * 1024)	/* Read-ahead over headers and small payloads */
+
+/* Start of the data file, lets open() refuse a file in another format */
+struct framed_file_header {
+	char magic[8];
+	uint32_t version;
+	uint32_t record_header_size;
+};
+
+/* In host byte order, the CRC covers the fields before it and then the payload */
+struct framed_record_header {
+	uint32_t magic;
+	uint32_t length;
+	uint64_t seq;
+	uint64_t time_ns;
+	uint32_t crc;
+	uint32_t reserved;
+};
+
+#define FRAMED_CRC_SPAN	offsetof(struct framed_record_header, crc)
+
+struct framed_index_entry {
+	uint64_t seq;
+	uint64_t logical;	/* Logical offset of the record's payload */
+	uint64_t physical;	/* File offset of the record's header */
+};
+
+struct framed_storage {
+	int fd;
+	int index_fd;
+	char *path;
+	char *index_path;
+	bool remove_on_close;
+	uint64_t logical_size;		/* Payload bytes stored */
+	uint64_t physical_size;		/* File size, headers included */
+	uint64_t next_seq;
+	struct framed_index_entry *index;
+	size_t index_count;
+	size_t index_capacity;
+	struct framed_index_entry cursor;	/* Where the last read stopped */
+	char *cache;
+	uint64_t cache_offset;
+	size_t cache_len;
+	uint64_t appends;
+	uint64_t fsyncs;
+	uint64_t recovered_records;
+	uint64_t truncated_bytes;
+	uint64_t crc_errors;
+};
+
+static int framed_pread( struct framed_storage *fs, void *buffer, size_t length, uint64_t offset ) {
+	size_t done = 0;
+
+	while( done < length ) {
+		ssize_t rc = pread(fs->fd, (char *)buffer + done, length - done, offset + done);
+		if( rc < 0 && errno == EINTR ) {
+			continue;
+		}
+		if( rc <= 0 ) {
+			if( rc == 0 ) {
+				errno = EIO;	/* Short file, a torn record */
+			}
+			return -1;
+		}
+		done += rc;
+	}
+	return 0;
+}
+
+/* Read through the cache, which turns a walk over small records into few large preads */
+static int framed_read( struct framed_storage *fs, void *buffer, size_t length, uint64_t offset ) {
+	if( offset < fs->cache_offset || offset + length > fs->cache_offset + fs->cache_len ) {
+		ssize_t rc;
+
+		if( length > FRAMED_CACHE_SIZE / 2 ) {
+			return framed_pread(fs, buffer, length, offset);
+		}
+		do {
+			rc = pread(fs->fd, fs->cache, FRAMED_CACHE_SIZE, offset);
+		} while( rc < 0 && errno == EINTR );
+		if( rc < 0 ) {
+			return -1;
+		}
+		fs->cache_offset = offset;
+		fs->cache_len = rc;
+		if( length > fs->cache_len ) {
+			errno = EIO;
+			return -1;
+		}
+	}
+	memcpy(buffer, fs->cache + (offset - fs->cache_offset), length);
+	return 0;
+}
+
+static uint32_t framed_crc( const struct framed_record_header *header, const void *data, size_t length ) {
+	return aesd_crc32c(aesd_crc32c(0, header, FRAMED_CRC_SPAN), data, length);
+}
+
+static int framed_index_add( struct framed_storage *fs, const struct framed_index_entry *entry, bool persist ) {
+	if( fs->index_count == fs->index_capacity ) {
+		size_t capacity = fs->index_capacity ? fs->index_capacity * 2 : 256;
+		struct framed_index_entry *index = realloc(fs->index, capacity * sizeof(*index));
+		if( index == NULL ) {
+			return -1;
+		}
+		fs->index = index;
+		fs->index_capacity = capacity;
+	}
+	fs->index[fs->index_count++] = *entry;
+	if( persist && write(fs->index_fd, entry, sizeof(*entry)) != sizeof(*entry) ) {
+		return -1;	/* Only costs a longer scan on the next open */
+	}
+	return 0;
+}
+
+/* Load the sidecar entries that still point at an intact header */
+static void framed_load_index( struct framed_storage *fs ) {
+	struct framed_index_entry entry;
+	struct framed_record_header header;
+
+	while( read(fs->index_fd, &entry, sizeof(entry)) == sizeof(entry) ) {
+		if( entry.physical + sizeof(header) > fs->physical_size || (fs->index_count > 0 &&
+				(entry.seq <= fs->index[fs->index_count - 1].seq ||
+				entry.logical < fs->index[fs->index_count - 1].logical)) ) {
+			break;
+		}
+		if( framed_index_add(fs, &entry, false) < 0 ) {
+			break;
+		}
+	}
+	/* A torn data file only loses its tail, so only the newest entries can be stale */
+	while( fs->index_count > 0 ) {
+		struct framed_index_entry *last = &fs->index[fs->index_count - 1];
+		if( framed_read(fs, &header, sizeof(header), last->physical) == 0 &&
+				header.magic == FRAMED_RECORD_MAGIC && header.seq == last->seq ) {
+			break;
+		}
+		fs->index_count--;
+	}
+	if( ftruncate(fs->index_fd, fs->index_count * sizeof(entry)) < 0 ) {
+		syslog(LOG_ERR, "Failed to truncate %s: %s", fs->index_path, strerror(errno));
+	}
+}
+
+/*
+ * Verify every record after the last index entry and cut the file back to
+ * the end of the last intact one.
+ */
+static int framed_recover( struct framed_storage *fs ) {
+	struct framed_index_entry pos = { 0, 0, sizeof(struct framed_file_header) };
+	struct framed_record_header header;
+	char *payload = NULL;
+	size_t payload_capacity = 0;
+
+	if( fs->index_count > 0 ) {
+		pos = fs->index[fs->index_count - 1];
+	}
+	while( pos.physical + sizeof(header) <= fs->physical_size ) {
+		if( framed_read(fs, &header, sizeof(header), pos.physical) < 0 ||
+				header.magic != FRAMED_RECORD_MAGIC || header.seq != pos.seq ||
+				header.length > fs->physical_size - pos.physical - sizeof(header) ) {
+			break;
+		}
+		if( header.length > payload_capacity ) {
+			char *grown = realloc(payload, header.length);
+			if( grown == NULL ) {
+				free(payload);
+				return -1;
+			}
+			payload = grown;
+			payload_capacity = header.length;
+		}
+		if( framed_read(fs, payload, header.length, pos.physical + sizeof(header)) < 0 ) {
+			break;
+		}
+		if( framed_crc(&header, payload, header.length) != header.crc ) {
+			fs->crc_errors++;
+			break;
+		}
+		if( pos.seq % FRAMED_INDEX_INTERVAL == 0 &&
+				(fs->index_count == 0 || fs->index[fs->index_count - 1].seq < pos.seq) ) {
+			framed_index_add(fs, &pos, true);
+		}
+		pos.seq++;
+		pos.logical += header.length;
+		pos.physical += sizeof(header) + header.length;
+		fs->recovered_records++;
+	}
+	free(payload);
+
+	if( pos.physical < fs->physical_size ) {
+		fs->truncated_bytes = fs->physical_size - pos.physical;
+		syslog(LOG_WARNING, "Truncating %llu bytes of torn or corrupt records from %s",
+			(unsigned long long)fs->truncated_bytes, fs->path);
+		if( ftruncate(fs->fd, pos.physical) < 0 ) {
+			return -1;
+		}
+		fs->physical_size = pos.physical;
+	}
+	fs->logical_size = pos.logical;
+	fs->next_seq = pos.seq;
+	fs->cursor = pos;
+	fs->cache_len = 0;
+	return 0;
+}
+
+static int framed_open_files( struct framed_storage *fs ) {
+	struct framed_file_header file_header;
+	struct stat sb;
+
+	fs->fd = open(fs->path, O_CREAT|O_APPEND|O_RDWR|O_CLOEXEC, 0644);
+	if( fs->fd < 0 || fstat(fs->fd, &sb) < 0 ) {
+		return -1;
+	}
+	if( sb.st_size == 0 ) {
+		memset(&file_header, 0, sizeof(file_header));
+		memcpy(file_header.magic, FRAMED_FILE_MAGIC, sizeof(file_header.magic));
+		file_header.version = 1;
+		file_header.record_header_size = sizeof(struct framed_record_header);
+		if( write(fs->fd, &file_header, sizeof(file_header)) != sizeof(file_header) ) {
+			return -1;
+		}
+		sb.st_size = sizeof(file_header);
+	} else if( framed_pread(fs, &file_header, sizeof(file_header), 0) < 0 ||
+			memcmp(file_header.magic, FRAMED_FILE_MAGIC, sizeof(file_header.magic)) != 0 ||
+			file_header.record_header_size != sizeof(struct framed_record_header) ) {
+		/* Never "recover" a plain data file down to nothing */
+		syslog(LOG_ERR, "%s is not a framed data file", fs->path);
+		errno = EINVAL;
+		return -1;
+	}
+	fs->physical_size = sb.st_size;
+
+	fs->index_fd = open(fs->index_path, O_CREAT|O_APPEND|O_RDWR|O_CLOEXEC, 0644);
+	if( fs->index_fd < 0 ) {
+		return -1;
+	}
+	framed_load_index(fs);
+	return framed_recover(fs);
+}
+
+static void framed_free( struct framed_storage *fs ) {
+	if( fs->fd >= 0 ) {
+		close(fs->fd);
+	}
+	if( fs->index_fd >= 0 ) {
+		close(fs->index_fd);
+	}
+	free(fs->path);
+	free(fs->index_path);
+	free(fs->index);
+	free(fs->cache);
+	free(fs);
+}
+
+static int framed_open( struct aesd_storage *st, const struct aesd_storage_params *params ) {
+	struct framed_storage *fs = calloc(1, sizeof(*fs));
+	const char *path = params->path ? params->path : AESD_FRAMED_PATH;
+
+	if( fs == NULL ) {
+		return -1;
+	}
+	fs->fd = -1;
+	fs->index_fd = -1;
+	fs->remove_on_close = params->remove_on_close;
+	fs->path = strdup(path);
+	fs->cache = malloc(FRAMED_CACHE_SIZE);
+	if( fs->path == NULL || fs->cache == NULL ||
+			asprintf(&fs->index_path, "%s" FRAMED_INDEX_SUFFIX, path) < 0 ) {
+		fs->index_path = NULL;
+		framed_free(fs);
+		return -1;
+	}
+	if( framed_open_files(fs) < 0 ) {
+		int saved_errno = errno;
+		framed_free(fs);
+		errno = saved_errno;
+		return -1;
+	}
+	if( fs->recovered_records > 0 ) {
+		syslog(LOG_INFO, "Opened %s: %llu records, %zu index entries, crc32c %s", fs->path,
+			(unsigned long long)fs->next_seq, fs->index_count, aesd_crc32c_impl());
+	}
+	st->priv = fs;
+	return 0;
+}
+
+static int framed_append( struct aesd_storage *st, const char *data, size_t length ) {
+	struct framed_storage *fs = st->priv;
+	struct framed_record_header header;
+	struct framed_index_entry entry = { fs->next_seq, fs->logical_size, fs->physical_size };
+	struct timespec now;
+	struct iovec iov[2];
+	size_t written = 0, total = sizeof(header) + length;
+
+	if( length > UINT32_MAX ) {
+		errno = EMSGSIZE;
+		return -1;
+	}
+	clock_gettime(CLOCK_REALTIME, &now);
+	memset(&header, 0, sizeof(header));
+	header.magic = FRAMED_RECORD_MAGIC;
+	header.length = length;
+	header.seq = fs->next_seq;
+	header.time_ns = (uint64_t)now.tv_sec * 1000000000ull + now.tv_nsec;
+	header.crc = framed_crc(&header, data, length);
+
+	while( written < total ) {
+		int iovcnt = 0;
+		ssize_t rc;
+
+		if( written < sizeof(header) ) {
+			iov[iovcnt].iov_base = (char *)&header + written;
+			iov[iovcnt++].iov_len = sizeof(header) - written;
+			iov[iovcnt].iov_base = (char *)data;
+			iov[iovcnt++].iov_len = length;
+		} else {
+			iov[iovcnt].iov_base = (char *)data + (written - sizeof(header));
+			iov[iovcnt++].iov_len = total - written;
+		}
+		rc = writev(fs->fd, iov, iovcnt);
+		if( rc < 0 ) {
+			int saved_errno = errno;
+			if( saved_errno == EINTR ) {
+				continue;
+			}
+			/* Don't leave a torn record for the next append to land behind */
+			if( written > 0 && ftruncate(fs->fd, fs->physical_size) < 0 ) {
+				syslog(LOG_ERR, "Failed to drop partial record: %s", strerror(errno));
+			}
+			fs->cache_len = 0;
+			errno = saved_errno;
+			return -1;
+		}
+		written += rc;
+	}
+	if( entry.seq % FRAMED_INDEX_INTERVAL == 0 ) {
+		framed_index_add(fs, &entry, true);
+	}
+	fs->next_seq++;
+	fs->logical_size += length;
+	fs->physical_size += total;
+	fs->appends++;
+	return 0;
+}
+
+/* Closest known record start at or before logical @offset */
+static struct framed_index_entry framed_seek( struct framed_storage *fs, uint64_t offset ) {
+	struct framed_index_entry pos = { 0, 0, sizeof(struct framed_file_header) };
+	size_t low = 0, high = fs->index_count;
+
+	while( low < high ) {
+		size_t mid = low + (high - low) / 2;
+		if( fs->index[mid].logical <= offset ) {
+			low = mid + 1;
+		} else {
+			high = mid;
+		}
+	}
+	if( low > 0 ) {
+		pos = fs->index[low - 1];
+	}
+	/* Sequential readers continue where they stopped */
+	if( fs->cursor.logical <= offset && fs->cursor.logical > pos.logical ) {
+		pos = fs->cursor;
+	}
+	return pos;
+}
+
+static ssize_t framed_read_range( struct aesd_storage *st, uint64_t offset, char *buffer, size_t length ) {
+	struct framed_storage *fs = st->priv;
+	struct framed_index_entry pos;
+	struct framed_record_header header;
+	size_t copied = 0;
+
+	if( offset >= fs->logical_size ) {
+		return 0;
+	}
+	pos = framed_seek(fs, offset);
+	while( copied < length && pos.logical < fs->logical_size ) {
+		uint64_t record_end;
+
+		if( framed_read(fs, &header, sizeof(header), pos.physical) < 0 ) {
+			return -1;
+		}
+		record_end = pos.logical + header.length;
+		if( offset < record_end ) {
+			size_t skip = offset - pos.logical;
+			size_t n = header.length - skip;
+
+			if( n > length - copied ) {
+				n = length - copied;
+			}
+			if( framed_read(fs, buffer + copied, n, pos.physical + sizeof(header) + skip) < 0 ) {
+				return -1;
+			}
+			copied += n;
+			offset += n;
+			if( offset < record_end ) {
+				break;	/* Buffer full inside this record */
+			}
+		}
+		pos.seq++;
+		pos.logical = record_end;
+		pos.physical += sizeof(header) + header.length;
+	}
+	fs->cursor = pos;
+	return copied;
+}
+
+static uint64_t framed_start( struct aesd_storage *st ) {
+	(void)st;
+	return 0;
+}
+
+static uint64_t framed_size( struct aesd_storage *st ) {
+	struct framed_storage *fs = st->priv;
+	return fs->logical_size;
+}
+
+static int framed_reset( struct aesd_storage *st ) {
+	struct framed_storage *fs = st->priv;
+	struct framed_index_entry start = { 0, 0, sizeof(struct framed_file_header) };
+
+	if( ftruncate(fs->fd, start.physical) < 0 || ftruncate(fs->index_fd, 0) < 0 ) {
+		return -1;
+	}
+	fs->physical_size = start.physical;
+	fs->logical_size = 0;
+	fs->next_seq = 0;
+	fs->index_count = 0;
+	fs->cursor = start;
+	fs->cache_len = 0;
+	return 0;
+}
+
+static int framed_flush( struct aesd_storage *st ) {
+	struct framed_storage *fs = st->priv;
+
+	fs->fsyncs++;
+	if( fdatasync(fs->fd) < 0 ) {
+		return -1;
+	}
+	return fdatasync(fs->index_fd);
+}
+
+static void framed_close( struct aesd_storage *st ) {
+	struct framed_storage *fs = st->priv;
+
+	if( fs->remove_on_close && (remove(fs->path) != 0 || remove(fs->index_path) != 0) ) {
+		syslog(LOG_ERR, "Failed to remove file: %s", strerror(errno));
+	}
+	framed_free(fs);
+	st->priv = NULL;
+}
+
+static void framed_dump_stats( struct aesd_storage *st, FILE *out ) {
+	struct framed_storage *fs = st->priv;
+
+	fprintf(out, "storage path=%s records=%llu bytes=%llu file_bytes=%llu index_entries=%zu appends=%llu "
+		"fsyncs=%llu recovered=%llu truncated_bytes=%llu crc_errors=%llu crc32c=%s\n",
+		fs->path, (unsigned long long)fs->next_seq, (unsigned long long)fs->logical_size,
+		(unsigned long long)fs->physical_size, fs->index_count, (unsigned long long)fs->appends,
+		(unsigned long long)fs->fsyncs, (unsigned long long)fs->recovered_records,
+		(unsigned long long)fs->truncated_bytes, (unsigned long long)fs->crc_errors,
+		aesd_crc32c_impl());
+}
+
+const struct aesd_storage_ops aesd_storage_framed_ops = {
+	.name = "framed",
+	.timestamps = true,
+	.open = framed_open,
+	.append = framed_append,
+	.read_range = framed_read_range,
+	.start = framed_start,
+	.size = framed_size,
+	.reset = framed_reset,
+	.flush = framed_flush,
+	.close = framed_close,
+	.dump_stats = framed_dump_stats,
+};
@@ -0,0 +1,101 @@
+/*
+ * aesd_storage_mem.c - Bounded in-memory storage engine
+ *
+ * Wraps struct aesd_memstore; logical offsets are translated by the number
+ * of bytes evicted so far.
+ */
+
+#include <stdlib.h>
+#include <errno.h>
+#include "aesd_storage.h"
+#include "aesd_memstore.h"
+
+static int mem_open( struct aesd_storage *st, const struct aesd_storage_params *params ) {
+	struct aesd_memstore *store = malloc(sizeof(*store));
+
+	if( store == NULL ) {
+		return -1;
+	}
+	if( aesd_memstore_init(store, params->max_records, params->max_bytes) < 0 ) {
+		free(store);
+		return -1;
+	}
+	st->priv = store;
+	return 0;
+}
+
+static int mem_append( struct aesd_storage *st, const char *data, size_t length ) {
+	return aesd_memstore_append(st->priv, data, length);
+}
+
+static ssize_t mem_read_range( struct aesd_storage *st, uint64_t offset, char *buffer, size_t length ) {
+	struct aesd_memstore *store = st->priv;
+
+	if( offset < store->evicted_bytes ) {
+		errno = ERANGE;
+		return -1;
+	}
+	return aesd_memstore_read(store, offset - store->evicted_bytes, buffer, length);
+}
+
+static uint64_t mem_start( struct aesd_storage *st ) {
+	struct aesd_memstore *store = st->priv;
+	return store->evicted_bytes;
+}
+
+static uint64_t mem_size( struct aesd_storage *st ) {
+	struct aesd_memstore *store = st->priv;
+	return store->evicted_bytes + store->bytes;
+}
+
+static int mem_reset( struct aesd_storage *st ) {
+	struct aesd_memstore *store = st->priv;
+	size_t max_records = store->max_records;
+	size_t max_bytes = store->max_bytes;
+
+	aesd_memstore_destroy(store);
+	return aesd_memstore_init(store, max_records, max_bytes);
+}
+
+static int mem_seek_record( struct aesd_storage *st, uint32_t index, uint32_t offset, uint64_t *pos ) {
+	struct aesd_memstore *store = st->priv;
+	struct aesd_buffer_entry *entry;
+	size_t record_start;
+
+	entry = aesd_circular_buffer_entry_at(&store->ring, index, &record_start);
+	if( entry == NULL || offset >= entry->size ) {
+		errno = EINVAL;
+		return -1;
+	}
+	*pos = store->evicted_bytes + record_start + offset;
+	return 0;
+}
+
+static void mem_close( struct aesd_storage *st ) {
+	aesd_memstore_destroy(st->priv);
+	free(st->priv);
+	st->priv = NULL;
+}
+
+static void mem_dump_stats( struct aesd_storage *st, FILE *out ) {
+	struct aesd_memstore *store = st->priv;
+
+	fprintf(out, "storage records=%zu bytes=%zu max_records=%zu max_bytes=%zu"
+		" evicted_records=%llu evicted_bytes=%llu\n",
+		store->records, store->bytes, store->max_records, store->max_bytes,
+		(unsigned long long)store->evicted_records, (unsigned long long)store->evicted_bytes);
+}
+
+const struct aesd_storage_ops aesd_storage_mem_ops = {
+	.name = "mem",
+	.timestamps = false,	/* Bounded like the driver, timestamp records would evict client commands */
+	.open = mem_open,
+	.append = mem_append,
+	.read_range = mem_read_range,
+	.start = mem_start,
+	.size = mem_size,
+	.reset = mem_reset,
+	.seek_record = mem_seek_record,
+	.close = mem_close,
+	.dump_stats = mem_dump_stats,
+};
@@ -0,0 +1,246 @@
+/*
+ * aesd_stream.c - Lazily created streams in a sharded hash map
+ */
+
+#define _GNU_SOURCE	/* asprintf() */
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#include <errno.h>
+#include <syslog.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include "aesd_stream.h"
+
+#define STREAM_SHARDS	16
+
+struct stream_shard {
+	pthread_rwlock_t lock;
+	struct aesd_stream **buckets;
+} __attribute__((aligned(64)));	/* Keep shard locks on separate cache lines */
+
+static struct {
+	bool enabled;
+	const struct aesd_storage_ops *ops;
+	struct aesd_storage_params params;
+	const char *base_path;		/* NULL for engines without a file */
+	size_t max_streams;
+	size_t nbuckets;		/* Per shard, a power of two */
+	struct stream_shard shards[STREAM_SHARDS];
+	_Atomic size_t count;
+	_Atomic uint64_t lookups;
+	_Atomic uint64_t rejected;
+} streams;
+
+static uint32_t stream_hash( const char *name, size_t len ) {
+	uint32_t hash = 2166136261u;
+	size_t i;
+
+	for( i = 0; i < len; i++ ) {
+		hash = (hash ^ (unsigned char)name[i]) * 16777619u;
+	}
+	return hash;
+}
+
+/* Names end up in file names, so keep them to a safe character set */
+static bool stream_name_valid( const char *name, size_t len ) {
+	size_t i;
+
+	if( len == 0 || len > AESD_STREAM_MAX_NAME || name[0] == '.' || name[0] == '-' ) {
+		return false;
+	}
+	for( i = 0; i < len; i++ ) {
+		if( !isalnum((unsigned char)name[i]) && name[i] != '_' && name[i] != '-' && name[i] != '.' ) {
+			return false;
+		}
+	}
+	return true;
+}
+
+static struct aesd_stream *shard_find( struct stream_shard *shard, uint32_t hash, const char *name, size_t len ) {
+	struct aesd_stream *stream;
+
+	for( stream = shard->buckets[(hash / STREAM_SHARDS) & (streams.nbuckets - 1)]; stream; stream = stream->next ) {
+		if( strncmp(stream->name, name, len) == 0 && stream->name[len] == '\0' ) {
+			return stream;
+		}
+	}
+	return NULL;
+}
+
+/* Called with the shard write lock held, only this shard waits for the engine to open */
+static struct aesd_stream *stream_create( struct stream_shard *shard, uint32_t hash, const char *name, size_t len ) {
+	struct aesd_storage_params params = streams.params;
+	struct aesd_stream *stream;
+	struct aesd_stream **bucket;
+	char *path = NULL;
+
+	if( atomic_fetch_add(&streams.count, 1) >= streams.max_streams ) {
+		atomic_fetch_sub(&streams.count, 1);
+		errno = ENOSPC;
+		return NULL;
+	}
+	stream = calloc(1, sizeof(*stream));
+	if( stream == NULL || (stream->name = strndup(name, len)) == NULL ) {
+		goto fail;
+	}
+	if( streams.base_path != NULL ) {
+		if( asprintf(&path, "%s.stream.%s", streams.base_path, stream->name) < 0 ) {
+			path = NULL;
+			goto fail;
+		}
+		params.path = path;
+	}
+	stream->storage = aesd_storage_open(streams.ops, &params);
+	free(path);
+	if( stream->storage == NULL ) {
+		goto fail;
+	}
+	bucket = &shard->buckets[(hash / STREAM_SHARDS) & (streams.nbuckets - 1)];
+	stream->next = *bucket;
+	*bucket = stream;
+	syslog(LOG_INFO, "Created stream %s", stream->name);
+	return stream;
+
+fail:
+	{
+		int saved_errno = errno;
+		if( stream != NULL ) {
+			free(stream->name);
+			free(stream);
+		}
+		atomic_fetch_sub(&streams.count, 1);
+		errno = saved_errno;
+	}
+	return NULL;
+}
+
+int aesd_streams_init( const struct aesd_storage_ops *ops, const struct aesd_storage_params *params,
+		size_t max_streams ) {
+	size_t i;
+
+	if( ops == &aesd_storage_chardev_ops ) {
+		errno = ENOTSUP;	/* There is only one device */
+		return -1;
+	}
+	streams.ops = ops;
+	streams.params = *params;
+	streams.max_streams = max_streams;
+	if( ops == &aesd_storage_file_ops ) {
+		streams.base_path = params->path ? params->path : AESD_FILE_PATH;
+	} else if( ops == &aesd_storage_framed_ops ) {
+		streams.base_path = params->path ? params->path : AESD_FRAMED_PATH;
+	}
+	/* Short chains at the stream limit, the map never needs to grow */
+	streams.nbuckets = 4;
+	while( streams.nbuckets * STREAM_SHARDS < max_streams ) {
+		streams.nbuckets *= 2;
+	}
+	for( i = 0; i < STREAM_SHARDS; i++ ) {
+		streams.shards[i].buckets = calloc(streams.nbuckets, sizeof(struct aesd_stream *));
+		if( streams.shards[i].buckets == NULL ) {
+			return -1;
+		}
+		pthread_rwlock_init(&streams.shards[i].lock, NULL);
+	}
+	streams.enabled = true;
+	return 0;
+}
+
+void aesd_streams_destroy( void ) {
+	size_t i, j;
+
+	if( !streams.enabled ) {
+		return;
+	}
+	for( i = 0; i < STREAM_SHARDS; i++ ) {
+		struct stream_shard *shard = &streams.shards[i];
+		for( j = 0; j < streams.nbuckets; j++ ) {
+			struct aesd_stream *stream, *next;
+			for( stream = shard->buckets[j]; stream; stream = next ) {
+				next = stream->next;
+				aesd_storage_close(stream->storage);
+				free(stream->name);
+				free(stream);
+			}
+		}
+		free(shard->buckets);
+		shard->buckets = NULL;
+		pthread_rwlock_destroy(&shard->lock);
+	}
+	atomic_store(&streams.count, 0);
+	streams.enabled = false;
+}
+
+/* Shared by the lookup and get paths, @create decides whether a missing stream is made */
+static struct aesd_stream *stream_lookup( const char *name, size_t name_len, bool create ) {
+	struct stream_shard *shard;
+	struct aesd_stream *stream;
+	uint32_t hash;
+
+	if( !streams.enabled || !stream_name_valid(name, name_len) ) {
+		atomic_fetch_add(&streams.rejected, 1);
+		errno = streams.enabled ? EINVAL : ENOTSUP;
+		return NULL;
+	}
+	atomic_fetch_add(&streams.lookups, 1);
+	hash = stream_hash(name, name_len);
+	shard = &streams.shards[hash % STREAM_SHARDS];
+
+	pthread_rwlock_rdlock(&shard->lock);
+	stream = shard_find(shard, hash, name, name_len);
+	pthread_rwlock_unlock(&shard->lock);
+	if( stream != NULL ) {
+		return stream;
+	}
+	if( !create ) {
+		errno = ENOENT;
+		return NULL;
+	}
+
+	/* Another thread may have created it between the two locks */
+	pthread_rwlock_wrlock(&shard->lock);
+	stream = shard_find(shard, hash, name, name_len);
+	if( stream == NULL ) {
+		stream = stream_create(shard, hash, name, name_len);
+	}
+	pthread_rwlock_unlock(&shard->lock);
+	if( stream == NULL ) {
+		atomic_fetch_add(&streams.rejected, 1);
+	}
+	return stream;
+}
+
+struct aesd_stream *aesd_stream_lookup( const char *name, size_t name_len ) {
+	return stream_lookup(name, name_len, false);
+}
+
+struct aesd_stream *aesd_stream_get( const char *name, size_t name_len ) {
+	return stream_lookup(name, name_len, true);
+}
+
+void aesd_streams_dump_stats( FILE *out ) {
+	size_t i, j;
+
+	if( !streams.enabled ) {
+		return;
+	}
+	fprintf(out, "streams count=%zu max=%zu engine=%s lookups=%llu rejected=%llu\n",
+		atomic_load(&streams.count), streams.max_streams, streams.ops->name,
+		(unsigned long long)atomic_load(&streams.lookups),
+		(unsigned long long)atomic_load(&streams.rejected));
+	for( i = 0; i < STREAM_SHARDS; i++ ) {
+		struct stream_shard *shard = &streams.shards[i];
+		pthread_rwlock_rdlock(&shard->lock);
+		for( j = 0; j < streams.nbuckets; j++ ) {
+			struct aesd_stream *stream;
+			for( stream = shard->buckets[j]; stream; stream = stream->next ) {
+				fprintf(out, "stream name=%s packets=%llu start=%llu size=%llu\n", stream->name,
+					(unsigned long long)atomic_load(&stream->packets),
+					(unsigned long long)aesd_storage_start(stream->storage),
+					(unsigned long long)aesd_storage_size(stream->storage));
+			}
+		}
+		pthread_rwlock_unlock(&shard->lock);
+	}
+}
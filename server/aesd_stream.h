@@ -0,0 +1,62 @@
+/*
+ * aesd_stream.h - Named streams with independent storage
+ *
+ * A packet starting with "stream:NAME:" is appended to stream NAME instead
+ * of the main log, and "stream:NAME\n" only reads it back. Each stream
+ * owns its own storage engine instance, so its lock, cache and retention
+ * are independent of every other stream and producers on different
+ * streams never contend.
+ *
+ * Streams are created by their first write and live until shutdown. They are found
+ * through a hash map split into shards, each behind its own rwlock, so
+ * lookups of existing streams only take a shared lock.
+ */
+
+#ifndef AESD_STREAM_H
+#define AESD_STREAM_H
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stddef.h>
+#include <stdatomic.h>
+#include "aesd_storage.h"
+
+#define AESD_STREAM_PREFIX		"stream:"
+#define AESD_STREAM_MAX_NAME		64	/* Letters, digits, '_', '-' and '.' but not leading */
+#define AESD_STREAM_DEFAULT_MAX		64
+#define AESD_STREAM_DEFAULT_ENGINE	"mem"
+
+struct aesd_stream {
+	char *name;
+	struct aesd_storage *storage;
+	_Atomic uint64_t packets;
+	struct aesd_stream *next;	/* Hash chain */
+};
+
+/**
+ * aesd_streams_init() - Allow up to @max_streams streams stored with engine @ops
+ * @params: engine settings shared by all streams. File backed engines
+ *          store stream NAME in "<path>.stream.NAME", using the engine's
+ *          default path when @params has none
+ */
+extern int aesd_streams_init( const struct aesd_storage_ops *ops, const struct aesd_storage_params *params,
+		size_t max_streams );
+extern void aesd_streams_destroy( void );
+
+/**
+ * aesd_stream_get() - Find stream @name, creating it on first use
+ * Returns NULL with errno EINVAL for a bad name, ENOSPC when the stream limit
+ * is reached, or the storage engine's error.
+ */
+extern struct aesd_stream *aesd_stream_get( const char *name, size_t name_len );
+
+/**
+ * aesd_stream_lookup() - Find stream @name without creating it
+ * Used by reads so they cannot use up the stream limit. Returns NULL with
+ * errno ENOENT when the stream does not exist, or as aesd_stream_get().
+ */
+extern struct aesd_stream *aesd_stream_lookup( const char *name, size_t name_len );
+
+extern void aesd_streams_dump_stats( FILE *out );
+
+#endif /* AESD_STREAM_H */
@@ -0,0 +1,310 @@
+/*
+ * aesd_timeindex.c - Sparse time to offset index over the stored data
+ *
+ * Entries made by the commit hook are exact: every record after an entry
+ * and before the next one was committed in the entry's second. Entries
+ * rebuilt from timestamp: records only bound the time from below, the
+ * records following one span up to the timestamp interval.
+ */
+
+#define _GNU_SOURCE	/* strptime() */
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <syslog.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <sys/stat.h>
+#include "aesd_timeindex.h"
+
+#define TIMESTAMP_PREFIX	"timestamp:"
+#define TIMESTAMP_FORMAT	"%A, %d-%b-%Y %H:%M:%S"	/* As written by timestamp_thread_func() */
+#define SCAN_CHUNK_SIZE		(64 * 1024)
+#define SCAN_LINE_MAX		128
+
+/* On disk entry of the sidecar file, in host byte order */
+struct time_entry_disk {
+	int64_t time;
+	uint64_t offset;	/* TIME_ENTRY_EXACT is set for exact entries */
+};
+
+/* Offsets never reach the top bit, a sidecar without the flag loads as rebuilt entries */
+#define TIME_ENTRY_EXACT	(1ULL << 63)
+
+struct time_entry {
+	int64_t time;
+	uint64_t offset;
+	bool exact;
+};
+
+static struct {
+	pthread_mutex_t lock;
+	bool enabled;
+	struct time_entry *entries;	/* Valid entries are [head, head + count) */
+	size_t head;
+	size_t count;
+	size_t capacity;
+	uint64_t next_offset;		/* Offset just past the newest record seen */
+	int sidecar_fd;
+	char *sidecar;
+	uint64_t loaded;
+	uint64_t rebuilt;
+	uint64_t lookups;
+	uint64_t write_errors;
+} tidx = {
+	.lock = PTHREAD_MUTEX_INITIALIZER,
+	.sidecar_fd = -1,
+};
+
+static struct time_entry *entry_at( size_t i ) {
+	return &tidx.entries[tidx.head + i];
+}
+
+static int add_entry( int64_t time, uint64_t offset, bool exact, bool persist ) {
+	if( tidx.count > 0 && entry_at(tidx.count - 1)->time >= time ) {
+		return 0;	/* Same second, or the clock stepped back */
+	}
+	if( tidx.head + tidx.count == tidx.capacity ) {
+		if( tidx.head > tidx.capacity / 2 ) {
+			memmove(tidx.entries, entry_at(0), tidx.count * sizeof(*tidx.entries));
+			tidx.head = 0;
+		} else {
+			size_t capacity = tidx.capacity ? tidx.capacity * 2 : 1024;
+			struct time_entry *entries = realloc(tidx.entries, capacity * sizeof(*entries));
+			if( entries == NULL ) {
+				return -1;
+			}
+			tidx.entries = entries;
+			tidx.capacity = capacity;
+		}
+	}
+	*entry_at(tidx.count) = (struct time_entry){ time, offset, exact };
+	tidx.count++;
+
+	if( persist && tidx.sidecar_fd >= 0 ) {
+		struct time_entry_disk disk = { time, offset | (exact ? TIME_ENTRY_EXACT : 0) };
+		if( write(tidx.sidecar_fd, &disk, sizeof(disk)) != sizeof(disk) ) {
+			tidx.write_errors++;
+		}
+	}
+	return 0;
+}
+
+/* Drop entries wholly before the oldest byte still stored, keep the one covering it */
+static void trim_entries( uint64_t start ) {
+	while( tidx.count > 1 && entry_at(1)->offset <= start ) {
+		tidx.head++;
+		tidx.count--;
+	}
+}
+
+static void clear_entries( void ) {
+	tidx.head = 0;
+	tidx.count = 0;
+	if( tidx.sidecar_fd >= 0 && ftruncate(tidx.sidecar_fd, 0) < 0 ) {
+		tidx.write_errors++;
+	}
+}
+
+/* Storage commit hook, runs under the storage lock */
+static void timeindex_hook( struct aesd_storage *st, uint64_t offset, const char *data, size_t length, void *arg ) {
+	(void)data;
+	(void)arg;
+
+	if( offset == UINT64_MAX ) {
+		return;
+	}
+	pthread_mutex_lock(&tidx.lock);
+	if( offset < tidx.next_offset ) {
+		clear_entries();	/* Storage was reset (replica resync) */
+	}
+	trim_entries(st->ops->start(st));
+	add_entry(time(NULL), offset, true, true);
+	tidx.next_offset = offset + length;
+	pthread_mutex_unlock(&tidx.lock);
+}
+
+/* Load the persisted entries that are consistent with @size bytes of data */
+static void load_sidecar( uint64_t size ) {
+	struct time_entry_disk disk;
+	off_t valid = 0;
+
+	while( read(tidx.sidecar_fd, &disk, sizeof(disk)) == sizeof(disk) ) {
+		bool exact = (disk.offset & TIME_ENTRY_EXACT) != 0;
+		uint64_t offset = disk.offset & ~TIME_ENTRY_EXACT;
+
+		if( offset > size || (tidx.count > 0 && (offset < entry_at(tidx.count - 1)->offset ||
+				disk.time <= entry_at(tidx.count - 1)->time)) ) {
+			break;
+		}
+		if( add_entry(disk.time, offset, exact, false) < 0 ) {
+			break;
+		}
+		valid += sizeof(disk);
+		tidx.loaded++;
+	}
+	/* Cut off a torn write or entries for data that never made it to the file */
+	if( ftruncate(tidx.sidecar_fd, valid) < 0 ) {
+		tidx.write_errors++;
+	}
+}
+
+static void scan_line( const char *line, size_t len, uint64_t offset ) {
+	char text[SCAN_LINE_MAX + 1];
+	struct tm tm;
+
+	if( len < strlen(TIMESTAMP_PREFIX) || memcmp(line, TIMESTAMP_PREFIX, strlen(TIMESTAMP_PREFIX)) != 0 ) {
+		return;
+	}
+	memcpy(text, line, len);
+	text[len] = '\0';
+	memset(&tm, 0, sizeof(tm));
+	if( strptime(text + strlen(TIMESTAMP_PREFIX), TIMESTAMP_FORMAT, &tm) == NULL ) {
+		return;
+	}
+	tm.tm_isdst = -1;	/* Written in local time */
+	if( tidx.count == 0 || entry_at(tidx.count - 1)->offset < offset ) {
+		size_t before = tidx.count;
+		add_entry(mktime(&tm), offset, false, true);
+		tidx.rebuilt += tidx.count - before;
+	}
+}
+
+/* Rebuild entries for [@from, @to) from the timestamp records */
+static void scan_data( struct aesd_storage *st, uint64_t from, uint64_t to ) {
+	char *chunk = malloc(SCAN_CHUNK_SIZE);
+	char line[SCAN_LINE_MAX];
+	size_t line_len = 0;
+	uint64_t line_offset = from, offset = from;
+	bool line_start = true;
+
+	if( chunk == NULL ) {
+		return;
+	}
+	while( offset < to ) {
+		size_t want = to - offset < SCAN_CHUNK_SIZE ? to - offset : SCAN_CHUNK_SIZE;
+		ssize_t rc = aesd_storage_read(st, offset, chunk, want);
+		size_t pos = 0;
+
+		if( rc <= 0 ) {
+			break;
+		}
+		while( pos < (size_t)rc ) {
+			char *newline = memchr(chunk + pos, '\n', rc - pos);
+			size_t end = newline ? (size_t)(newline - chunk) : (size_t)rc;
+
+			if( line_start ) {
+				line_offset = offset + pos;
+				line_len = 0;
+				line_start = false;
+			}
+			/* Only the head of a line is needed to recognise a timestamp */
+			if( line_len < sizeof(line) ) {
+				size_t copy = end - pos < sizeof(line) - line_len ? end - pos : sizeof(line) - line_len;
+				memcpy(line + line_len, chunk + pos, copy);
+				line_len += copy;
+			}
+			if( newline == NULL ) {
+				break;
+			}
+			scan_line(line, line_len, line_offset);
+			line_start = true;
+			pos = end + 1;
+		}
+		offset += rc;
+	}
+	free(chunk);
+}
+
+int aesd_timeindex_init( struct aesd_storage *st, const char *sidecar ) {
+	uint64_t size = aesd_storage_size(st);
+	uint64_t scan_from = aesd_storage_start(st);
+
+	if( size == UINT64_MAX ) {
+		errno = ENOTSUP;
+		return -1;
+	}
+	if( sidecar != NULL ) {
+		tidx.sidecar = strdup(sidecar);
+		tidx.sidecar_fd = open(sidecar, O_RDWR | O_CREAT | O_APPEND | O_CLOEXEC, 0644);
+		if( tidx.sidecar == NULL || tidx.sidecar_fd < 0 ) {
+			return -1;
+		}
+		load_sidecar(size);
+		if( tidx.count > 0 ) {
+			scan_from = entry_at(tidx.count - 1)->offset;
+		}
+	}
+	scan_data(st, scan_from, size);
+	trim_entries(aesd_storage_start(st));
+	tidx.next_offset = size;
+	if( aesd_storage_add_hook(st, timeindex_hook, NULL) < 0 ) {
+		return -1;
+	}
+	tidx.enabled = true;
+	if( tidx.loaded || tidx.rebuilt ) {
+		syslog(LOG_INFO, "Time index restored, %llu entries loaded and %llu rebuilt",
+			(unsigned long long)tidx.loaded, (unsigned long long)tidx.rebuilt);
+	}
+	return 0;
+}
+
+void aesd_timeindex_destroy( void ) {
+	pthread_mutex_lock(&tidx.lock);
+	if( tidx.sidecar_fd >= 0 ) {
+		close(tidx.sidecar_fd);
+		tidx.sidecar_fd = -1;
+	}
+	free(tidx.sidecar);
+	free(tidx.entries);
+	tidx.sidecar = NULL;
+	tidx.entries = NULL;
+	tidx.head = tidx.count = tidx.capacity = 0;
+	tidx.enabled = false;
+	pthread_mutex_unlock(&tidx.lock);
+}
+
+uint64_t aesd_timeindex_lookup( time_t since ) {
+	size_t low = 0, high, i;
+	uint64_t offset;
+
+	pthread_mutex_lock(&tidx.lock);
+	tidx.lookups++;
+	high = tidx.count;
+	/* Find the first entry later than @since */
+	while( low < high ) {
+		size_t mid = low + (high - low) / 2;
+		if( entry_at(mid)->time <= since ) {
+			low = mid + 1;
+		} else {
+			high = mid;
+		}
+	}
+	if( low == 0 ) {
+		offset = 0;	/* Everything indexed is newer, the caller clamps to the oldest byte */
+	} else {
+		struct time_entry *entry = entry_at(low - 1);
+		i = low;
+		if( entry->time == since || !entry->exact ) {
+			offset = entry->offset;
+		} else {
+			/* Everything up to the next entry was committed before @since */
+			offset = i < tidx.count ? entry_at(i)->offset : tidx.next_offset;
+		}
+	}
+	pthread_mutex_unlock(&tidx.lock);
+	return offset;
+}
+
+void aesd_timeindex_dump_stats( FILE *out ) {
+	pthread_mutex_lock(&tidx.lock);
+	if( tidx.enabled ) {
+		fprintf(out, "timeindex entries=%zu loaded=%llu rebuilt=%llu lookups=%llu write_errors=%llu sidecar=%s\n",
+			tidx.count, (unsigned long long)tidx.loaded, (unsigned long long)tidx.rebuilt,
+			(unsigned long long)tidx.lookups, (unsigned long long)tidx.write_errors,
+			tidx.sidecar ? tidx.sidecar : "none");
+	}
+	pthread_mutex_unlock(&tidx.lock);
+}
@@ -0,0 +1,39 @@
+/*
+ * aesd_timeindex.h - Sparse time to offset index over the stored data
+ *
+ * A storage commit hook records the offset of the first record committed in
+ * every second, so "everything since T" starts at a binary search instead
+ * of a scan. With a kept data file the entries are also appended to a
+ * sidecar file next to it. On restart the sidecar is loaded, checked
+ * against the data, and whatever it is missing is rebuilt by scanning
+ * the data for the timestamp: records.
+ */
+
+#ifndef AESD_TIMEINDEX_H
+#define AESD_TIMEINDEX_H
+
+#include <stdio.h>
+#include <stdint.h>
+#include <time.h>
+#include "aesd_storage.h"
+
+#define AESD_TIMEINDEX_SUFFIX	".tidx"
+
+/**
+ * aesd_timeindex_init() - Index records appended to @st
+ * @sidecar: file persisting the entries, NULL to keep them in memory only
+ */
+extern int aesd_timeindex_init( struct aesd_storage *st, const char *sidecar );
+extern void aesd_timeindex_destroy( void );
+
+/**
+ * aesd_timeindex_lookup() - Offset to read from for the data committed since @since
+ * Resolves to the newest entry not later than @since, so nothing committed
+ * at or after @since is missed; up to one entry interval (a second, or ten
+ * for entries rebuilt from timestamp records) of older data may precede it.
+ */
+extern uint64_t aesd_timeindex_lookup( time_t since );
+
+extern void aesd_timeindex_dump_stats( FILE *out );
+
+#endif /* AESD_TIMEINDEX_H */
@@ -0,0 +1,232 @@
+/*
+ * aesd_udp.c - UDP ingestion shards
+ *
+ * Kernel side drops (socket receive buffer overflows) are read from the
+ * SO_RXQ_OVFL control message, which carries the socket's running drop
+ * count with every datagram.
+ */
+
+#define _GNU_SOURCE
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <syslog.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdatomic.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include "aesd_udp.h"
+
+#define UDP_POLL_TIMEOUT_MS	200	/* Shards re-check the stop flag this often when idle */
+#define UDP_CMSG_SIZE		CMSG_SPACE(sizeof(uint32_t))
+
+struct udp_shard {
+	pthread_t thread;
+	int sockfd;
+	bool started;
+	/* Statistics, only written by the shard thread */
+	_Atomic uint64_t datagrams;
+	_Atomic uint64_t bytes;
+	_Atomic uint64_t batches;
+	_Atomic uint64_t max_batch;
+	_Atomic uint64_t truncated;
+	_Atomic uint64_t unterminated;
+	_Atomic uint64_t kernel_drops;
+};
+
+static struct aesd_udp_config udp_config;
+static aesd_udp_commit_fn udp_commit;
+static struct udp_shard *shards;
+static atomic_bool udp_running;
+
+static int open_shard_socket( int port ) {
+	struct sockaddr_in addr;
+	struct timeval timeout = { 0, UDP_POLL_TIMEOUT_MS * 1000 };
+	int yes = 1;
+	int sockfd = socket(AF_INET, SOCK_DGRAM | SOCK_CLOEXEC, 0);
+
+	if( sockfd < 0 ) {
+		return -1;
+	}
+	if( setsockopt(sockfd, SOL_SOCKET, SO_REUSEPORT, &yes, sizeof(yes)) < 0 ||
+			setsockopt(sockfd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout)) < 0 ) {
+		close(sockfd);
+		return -1;
+	}
+	if( setsockopt(sockfd, SOL_SOCKET, SO_RXQ_OVFL, &yes, sizeof(yes)) < 0 ) {
+		syslog(LOG_WARNING, "SO_RXQ_OVFL unavailable, UDP kernel drops are not counted");
+	}
+
+	memset(&addr, 0, sizeof(addr));
+	addr.sin_family = AF_INET;
+	addr.sin_addr.s_addr = INADDR_ANY;
+	addr.sin_port = htons(port);
+	if( bind(sockfd, (struct sockaddr *)&addr, sizeof(addr)) < 0 ) {
+		close(sockfd);
+		return -1;
+	}
+	return sockfd;
+}
+
+static void *shard_thread_func( void *arg ) {
+	struct udp_shard *shard = arg;
+	int batch = udp_config.batch;
+	size_t max_size = udp_config.max_size;
+	struct mmsghdr *msgs = calloc(batch, sizeof(*msgs));
+	struct iovec *iovs = calloc(batch, sizeof(*iovs));
+	struct sockaddr_in *addrs = calloc(batch, sizeof(*addrs));
+	char *cmsgs = calloc(batch, UDP_CMSG_SIZE);
+	char *buffers = malloc(batch * max_size);
+	int i;
+
+	if( !msgs || !iovs || !addrs || !cmsgs || !buffers ) {
+		syslog(LOG_ERR, "Failed to allocate UDP receive buffers");
+		goto out;
+	}
+	for( i = 0; i < batch; i++ ) {
+		iovs[i].iov_base = buffers + i * max_size;
+		iovs[i].iov_len = max_size;
+	}
+
+	while( atomic_load(&udp_running) ) {
+		int count;
+
+		/* msg_namelen and msg_controllen are value-result, reset them every call */
+		for( i = 0; i < batch; i++ ) {
+			msgs[i].msg_hdr.msg_name = &addrs[i];
+			msgs[i].msg_hdr.msg_namelen = sizeof(addrs[i]);
+			msgs[i].msg_hdr.msg_iov = &iovs[i];
+			msgs[i].msg_hdr.msg_iovlen = 1;
+			msgs[i].msg_hdr.msg_control = cmsgs + i * UDP_CMSG_SIZE;
+			msgs[i].msg_hdr.msg_controllen = UDP_CMSG_SIZE;
+			msgs[i].msg_hdr.msg_flags = 0;
+		}
+
+		/* Block for the first datagram only, then take whatever else is queued */
+		count = recvmmsg(shard->sockfd, msgs, batch, MSG_WAITFORONE, NULL);
+		if( count < 0 ) {
+			if( errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR ) {
+				continue;
+			}
+			syslog(LOG_ERR, "UDP receive failed: %s", strerror(errno));
+			break;
+		}
+
+		atomic_fetch_add_explicit(&shard->batches, 1, memory_order_relaxed);
+		if( (uint64_t)count > atomic_load_explicit(&shard->max_batch, memory_order_relaxed) ) {
+			atomic_store_explicit(&shard->max_batch, count, memory_order_relaxed);
+		}
+
+		for( i = 0; i < count; i++ ) {
+			struct msghdr *hdr = &msgs[i].msg_hdr;
+			const char *data = iovs[i].iov_base;
+			size_t length = msgs[i].msg_len;
+			struct cmsghdr *cmsg;
+
+			for( cmsg = CMSG_FIRSTHDR(hdr); cmsg != NULL; cmsg = CMSG_NXTHDR(hdr, cmsg) ) {
+				if( cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SO_RXQ_OVFL ) {
+					uint32_t drops;
+					memcpy(&drops, CMSG_DATA(cmsg), sizeof(drops));
+					atomic_store_explicit(&shard->kernel_drops, drops, memory_order_relaxed);
+				}
+			}
+			if( hdr->msg_flags & MSG_TRUNC ) {
+				atomic_fetch_add_explicit(&shard->truncated, 1, memory_order_relaxed);
+				continue;
+			}
+			if( length == 0 || data[length - 1] != '\n' ) {
+				atomic_fetch_add_explicit(&shard->unterminated, 1, memory_order_relaxed);
+				continue;
+			}
+			udp_commit(addrs[i].sin_addr.s_addr, data, length);
+			atomic_fetch_add_explicit(&shard->datagrams, 1, memory_order_relaxed);
+			atomic_fetch_add_explicit(&shard->bytes, length, memory_order_relaxed);
+		}
+	}
+
+out:
+	free(msgs);
+	free(iovs);
+	free(addrs);
+	free(cmsgs);
+	free(buffers);
+	return NULL;
+}
+
+int aesd_udp_start( const struct aesd_udp_config *config, aesd_udp_commit_fn commit ) {
+	int i;
+
+	udp_config = *config;
+	if( udp_config.shards <= 0 ) {
+		udp_config.shards = AESD_UDP_DEFAULT_SHARDS;
+	}
+	if( udp_config.batch <= 0 ) {
+		udp_config.batch = AESD_UDP_DEFAULT_BATCH;
+	}
+	if( udp_config.max_size == 0 ) {
+		udp_config.max_size = AESD_UDP_DEFAULT_MAX_SIZE;
+	}
+	udp_commit = commit;
+
+	shards = calloc(udp_config.shards, sizeof(*shards));
+	if( shards == NULL ) {
+		return -1;
+	}
+	for( i = 0; i < udp_config.shards; i++ ) {
+		shards[i].sockfd = -1;
+	}
+	atomic_store(&udp_running, true);
+	for( i = 0; i < udp_config.shards; i++ ) {
+		shards[i].sockfd = open_shard_socket(udp_config.port);
+		if( shards[i].sockfd < 0 ) {
+			return -1;
+		}
+		if( pthread_create(&shards[i].thread, NULL, shard_thread_func, &shards[i]) != 0 ) {
+			return -1;
+		}
+		shards[i].started = true;
+	}
+	syslog(LOG_INFO, "UDP listening on port %d with %d shards", udp_config.port, udp_config.shards);
+	return 0;
+}
+
+void aesd_udp_stop( void ) {
+	int i;
+
+	if( shards == NULL ) {
+		return;
+	}
+	atomic_store(&udp_running, false);
+	for( i = 0; i < udp_config.shards; i++ ) {
+		if( shards[i].started ) {
+			pthread_join(shards[i].thread, NULL);
+		}
+		if( shards[i].sockfd >= 0 ) {
+			close(shards[i].sockfd);
+		}
+	}
+	free(shards);
+	shards = NULL;
+}
+
+void aesd_udp_dump_stats( FILE *out ) {
+	int i;
+
+	if( shards == NULL ) {
+		return;
+	}
+	for( i = 0; i < udp_config.shards; i++ ) {
+		struct udp_shard *shard = &shards[i];
+		fprintf(out, "udp shard=%d datagrams=%llu bytes=%llu batches=%llu max_batch=%llu"
+			" truncated=%llu unterminated=%llu kernel_drops=%llu\n", i,
+			(unsigned long long)atomic_load(&shard->datagrams),
+			(unsigned long long)atomic_load(&shard->bytes),
+			(unsigned long long)atomic_load(&shard->batches),
+			(unsigned long long)atomic_load(&shard->max_batch),
+			(unsigned long long)atomic_load(&shard->truncated),
+			(unsigned long long)atomic_load(&shard->unterminated),
+			(unsigned long long)atomic_load(&shard->kernel_drops));
+	}
+}
@@ -0,0 +1,41 @@
+/*
+ * aesd_udp.h - UDP ingestion for fire-and-forget producers
+ *
+ * Every datagram is one newline terminated packet, committed without a
+ * reply. Each shard owns a socket bound with SO_REUSEPORT so the kernel
+ * spreads senders over the shards, and receives in batches with recvmmsg().
+ */
+
+#ifndef AESD_UDP_H
+#define AESD_UDP_H
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stddef.h>
+
+#define AESD_UDP_DEFAULT_SHARDS		1
+#define AESD_UDP_DEFAULT_BATCH		64
+#define AESD_UDP_DEFAULT_MAX_SIZE	4096
+
+/**
+ * struct aesd_udp_config - UDP listener settings
+ * @port:     UDP port, 0 to disable
+ * @shards:   sockets/threads sharing the port through SO_REUSEPORT
+ * @batch:    datagrams received per recvmmsg() call
+ * @max_size: largest datagram accepted, longer ones are counted as truncated
+ */
+struct aesd_udp_config {
+	int port;
+	int shards;
+	int batch;
+	size_t max_size;
+};
+
+/* Called from the shard threads for every accepted datagram, @addr in network byte order */
+typedef void (*aesd_udp_commit_fn)( uint32_t addr, const char *data, size_t length );
+
+extern int aesd_udp_start( const struct aesd_udp_config *config, aesd_udp_commit_fn commit );
+extern void aesd_udp_stop( void );
+extern void aesd_udp_dump_stats( FILE *out );
+
+#endif /* AESD_UDP_H */
@@ -0,0 +1,402 @@
+/*
+ * aesdbench.c - Load generator and latency benchmark for aesdsocket
+ *
+ * Each worker thread opens a connection per request, sends one newline
+ * terminated packet and reads the reply until the server closes the
+ * connection. Connection setup, first reply byte and full request latency
+ * are reported as percentiles so socket profiles can be compared run to run.
+ *
+ * With -S the packets go through the shared memory channel instead, and
+ * the latency is measured until the server reports the packet committed,
+ * to compare local ingestion against loopback TCP. With -U the packets are
+ * fire-and-forget UDP datagrams; afterwards the server's UDP counters are
+ * fetched over TCP so received packets per second and losses can be
+ * compared against the TCP path.
+ */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <getopt.h>
+#include <pthread.h>
+#include <time.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+#include "aesd_shm.h"
+
+#define DEFAULT_PORT		9000
+#define DEFAULT_REQUESTS	1000
+#define DEFAULT_CONCURRENCY	1
+#define DEFAULT_PAYLOAD		64
+#define REPLY_BUFFER_SIZE	65536
+#define SHM_COMMIT_TIMEOUT_MS	5000
+
+struct bench_config {
+	const char *host;
+	int port;
+	long requests;
+	int concurrency;
+	size_t payload;
+	bool fastopen;
+	bool discard_reply;	/* Close right after the first reply byte */
+	const char *shm_name;	/* Send over this shared memory segment instead of TCP */
+	int udp_port;		/* Send datagrams to this port instead of TCP, 0 for TCP */
+};
+
+/* Latency samples in nanoseconds, one slot per request */
+struct bench_samples {
+	uint64_t *connect_ns;
+	uint64_t *first_byte_ns;
+	uint64_t *total_ns;
+	long count;
+};
+
+struct bench_worker {
+	pthread_t thread;
+	const struct bench_config *config;
+	struct bench_samples *samples;
+	long first;		/* First sample slot owned by this worker */
+	long count;
+	long errors;
+	uint64_t reply_bytes;
+	struct aesd_shm_client shm;
+	int udp_sockfd;
+};
+
+static uint64_t monotonic_ns( void ) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static int run_request( struct bench_worker *worker, const char *payload, char *reply, long slot ) {
+	const struct bench_config *config = worker->config;
+	struct sockaddr_in addr;
+	uint64_t start, connected, sent;
+	ssize_t rc;
+	bool first = true;
+	int sockfd;
+
+	memset(&addr, 0, sizeof(addr));
+	addr.sin_family = AF_INET;
+	addr.sin_port = htons(config->port);
+	inet_pton(AF_INET, config->host, &addr.sin_addr);
+
+	sockfd = socket(AF_INET, SOCK_STREAM, 0);
+	if( sockfd < 0 ) {
+		return -1;
+	}
+
+	start = monotonic_ns();
+	if( config->fastopen ) {
+		/* The payload rides in the SYN, connect() and send() are one call */
+		rc = sendto(sockfd, payload, config->payload, MSG_FASTOPEN,
+			(struct sockaddr *)&addr, sizeof(addr));
+		connected = monotonic_ns();
+		if( rc != (ssize_t)config->payload ) {
+			goto fail;
+		}
+	} else {
+		if( connect(sockfd, (struct sockaddr *)&addr, sizeof(addr)) < 0 ) {
+			goto fail;
+		}
+		connected = monotonic_ns();
+		if( send(sockfd, payload, config->payload, MSG_NOSIGNAL) != (ssize_t)config->payload ) {
+			goto fail;
+		}
+	}
+	sent = monotonic_ns();
+
+	while( (rc = recv(sockfd, reply, REPLY_BUFFER_SIZE, 0)) > 0 ) {
+		worker->reply_bytes += rc;
+		if( first ) {
+			worker->samples->first_byte_ns[slot] = monotonic_ns() - sent;
+			first = false;
+			if( config->discard_reply ) {
+				break;
+			}
+		}
+	}
+	if( rc < 0 || first ) {
+		goto fail;
+	}
+
+	worker->samples->connect_ns[slot] = connected - start;
+	worker->samples->total_ns[slot] = monotonic_ns() - start;
+	close(sockfd);
+	return 0;
+
+fail:
+	close(sockfd);
+	return -1;
+}
+
+/* Publish one packet over shared memory and wait for the server to commit it */
+static int run_shm_request( struct bench_worker *worker, const char *payload, long slot ) {
+	uint64_t start = monotonic_ns(), sent;
+	int64_t position = aesd_shm_send(&worker->shm, payload, worker->config->payload);
+
+	if( position < 0 ) {
+		return -1;
+	}
+	sent = monotonic_ns();
+	if( aesd_shm_wait_committed(&worker->shm, position, SHM_COMMIT_TIMEOUT_MS) < 0 ) {
+		return -1;
+	}
+	worker->samples->connect_ns[slot] = sent - start;
+	worker->samples->first_byte_ns[slot] = monotonic_ns() - sent;
+	worker->samples->total_ns[slot] = monotonic_ns() - start;
+	return 0;
+}
+
+/* Send one datagram, there is no reply to wait for */
+static int run_udp_request( struct bench_worker *worker, const char *payload, long slot ) {
+	uint64_t start = monotonic_ns();
+
+	if( send(worker->udp_sockfd, payload, worker->config->payload, 0) != (ssize_t)worker->config->payload ) {
+		return -1;
+	}
+	worker->samples->total_ns[slot] = monotonic_ns() - start;
+	return 0;
+}
+
+static int open_udp_socket( const struct bench_config *config ) {
+	struct sockaddr_in addr;
+	int sockfd = socket(AF_INET, SOCK_DGRAM, 0);
+
+	if( sockfd < 0 ) {
+		return -1;
+	}
+	memset(&addr, 0, sizeof(addr));
+	addr.sin_family = AF_INET;
+	addr.sin_port = htons(config->udp_port);
+	inet_pton(AF_INET, config->host, &addr.sin_addr);
+	if( connect(sockfd, (struct sockaddr *)&addr, sizeof(addr)) < 0 ) {
+		close(sockfd);
+		return -1;
+	}
+	return sockfd;
+}
+
+static void *worker_func( void *arg ) {
+	struct bench_worker *worker = arg;
+	char *payload = malloc(worker->config->payload);
+	char *reply = malloc(REPLY_BUFFER_SIZE);
+	long i, slot = worker->first;
+
+	if( payload == NULL || reply == NULL ) {
+		worker->errors = worker->count;
+		goto out;
+	}
+	memset(payload, 'a', worker->config->payload);
+	payload[worker->config->payload - 1] = '\n';
+	if( worker->config->shm_name != NULL &&
+			aesd_shm_client_open(&worker->shm, worker->config->shm_name) < 0 ) {
+		perror(worker->config->shm_name);
+		worker->errors = worker->count;
+		worker->count = 0;
+		goto out;
+	}
+
+	worker->udp_sockfd = -1;
+	if( worker->config->udp_port > 0 && (worker->udp_sockfd = open_udp_socket(worker->config)) < 0 ) {
+		perror("udp socket");
+		worker->errors = worker->count;
+		worker->count = 0;
+		goto out;
+	}
+
+	for( i = 0; i < worker->count; i++ ) {
+		int rc;
+
+		if( worker->config->shm_name != NULL ) {
+			rc = run_shm_request(worker, payload, slot);
+		} else if( worker->udp_sockfd >= 0 ) {
+			rc = run_udp_request(worker, payload, slot);
+		} else {
+			rc = run_request(worker, payload, reply, slot);
+		}
+		if( rc < 0 ) {
+			worker->errors++;
+			continue;
+		}
+		slot++;
+	}
+	worker->count = slot - worker->first;	/* Only successful samples */
+	aesd_shm_client_close(&worker->shm);
+	if( worker->udp_sockfd >= 0 ) {
+		close(worker->udp_sockfd);
+	}
+
+out:
+	free(payload);
+	free(reply);
+	return NULL;
+}
+
+static int compare_u64( const void *a, const void *b ) {
+	uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+	return (x > y) - (x < y);
+}
+
+static void report( const char *name, uint64_t *samples, long count ) {
+	if( count == 0 ) {
+		printf("%-12s no samples\n", name);
+		return;
+	}
+	qsort(samples, count, sizeof(*samples), compare_u64);
+	printf("%-12s min %8.1f  p50 %8.1f  p90 %8.1f  p99 %8.1f  max %8.1f us\n", name,
+		samples[0] / 1e3, samples[count / 2] / 1e3, samples[count * 9 / 10] / 1e3,
+		samples[count * 99 / 100] / 1e3, samples[count - 1] / 1e3);
+}
+
+/* Pack the successful samples of every worker to the front of the arrays */
+static long compact_samples( struct bench_samples *samples, struct bench_worker *workers, int nworkers ) {
+	long out = 0;
+	int w;
+
+	for( w = 0; w < nworkers; w++ ) {
+		size_t bytes = workers[w].count * sizeof(uint64_t);
+		memmove(&samples->connect_ns[out], &samples->connect_ns[workers[w].first], bytes);
+		memmove(&samples->first_byte_ns[out], &samples->first_byte_ns[workers[w].first], bytes);
+		memmove(&samples->total_ns[out], &samples->total_ns[workers[w].first], bytes);
+		out += workers[w].count;
+	}
+	return out;
+}
+
+/* Print the server's UDP counters, fetched with the stats command over TCP */
+static void report_udp_server( const struct bench_config *config ) {
+	static const char command[] = "AESDSOCKET_STATS\n";
+	struct sockaddr_in addr;
+	char line[512];
+	FILE *in;
+	int sockfd = socket(AF_INET, SOCK_STREAM, 0);
+
+	if( sockfd < 0 ) {
+		return;
+	}
+	memset(&addr, 0, sizeof(addr));
+	addr.sin_family = AF_INET;
+	addr.sin_port = htons(config->port);
+	inet_pton(AF_INET, config->host, &addr.sin_addr);
+	if( connect(sockfd, (struct sockaddr *)&addr, sizeof(addr)) < 0 ||
+			send(sockfd, command, strlen(command), MSG_NOSIGNAL) < 0 ||
+			(in = fdopen(sockfd, "r")) == NULL ) {
+		close(sockfd);
+		return;
+	}
+	while( fgets(line, sizeof(line), in) != NULL ) {
+		if( strncmp(line, "udp ", 4) == 0 ) {
+			printf("server %s", line);
+		}
+	}
+	fclose(in);
+}
+
+static void usage( const char *progname ) {
+	fprintf(stderr,
+		"Usage: %s [options]\n"
+		"  -H HOST   server address (default 127.0.0.1)\n"
+		"  -p PORT   server port (default %d)\n"
+		"  -n N      number of requests (default %d)\n"
+		"  -c N      concurrent connections (default %d)\n"
+		"  -s BYTES  packet size including the newline (default %d)\n"
+		"  -F        send the packet in the SYN with TCP Fast Open\n"
+		"  -1        stop reading after the first reply byte\n"
+		"  -S NAME   send over the aesdsocket --shm segment NAME, timing until commit\n"
+		"  -U PORT   send fire-and-forget datagrams to the aesdsocket --udp-port PORT\n",
+		progname, DEFAULT_PORT, DEFAULT_REQUESTS, DEFAULT_CONCURRENCY, DEFAULT_PAYLOAD);
+}
+
+int main( int argc, char **argv ) {
+	struct bench_config config = {
+		.host = "127.0.0.1",
+		.port = DEFAULT_PORT,
+		.requests = DEFAULT_REQUESTS,
+		.concurrency = DEFAULT_CONCURRENCY,
+		.payload = DEFAULT_PAYLOAD,
+	};
+	struct bench_samples samples;
+	struct bench_worker *workers;
+	long errors = 0, per_worker, count;
+	uint64_t reply_bytes = 0, start, elapsed;
+	int opt, w;
+
+	while( (opt = getopt(argc, argv, "H:p:n:c:s:F1S:U:")) != -1 ) {
+		switch( opt ) {
+		case 'H': config.host = optarg; break;
+		case 'p': config.port = atoi(optarg); break;
+		case 'n': config.requests = atol(optarg); break;
+		case 'c': config.concurrency = atoi(optarg); break;
+		case 's': config.payload = strtoul(optarg, NULL, 0); break;
+		case 'F': config.fastopen = true; break;
+		case '1': config.discard_reply = true; break;
+		case 'S': config.shm_name = optarg; break;
+		case 'U': config.udp_port = atoi(optarg); break;
+		default:
+			usage(argv[0]);
+			return 1;
+		}
+	}
+	if( config.requests <= 0 || config.concurrency <= 0 || config.payload == 0 ) {
+		usage(argv[0]);
+		return 1;
+	}
+
+	samples.count = config.requests;
+	samples.connect_ns = calloc(config.requests, sizeof(uint64_t));
+	samples.first_byte_ns = calloc(config.requests, sizeof(uint64_t));
+	samples.total_ns = calloc(config.requests, sizeof(uint64_t));
+	workers = calloc(config.concurrency, sizeof(*workers));
+	if( !samples.connect_ns || !samples.first_byte_ns || !samples.total_ns || !workers ) {
+		fprintf(stderr, "Out of memory\n");
+		return 1;
+	}
+
+	per_worker = config.requests / config.concurrency;
+	start = monotonic_ns();
+	for( w = 0; w < config.concurrency; w++ ) {
+		workers[w].config = &config;
+		workers[w].samples = &samples;
+		workers[w].first = w * per_worker;
+		workers[w].count = (w == config.concurrency - 1) ? config.requests - w * per_worker : per_worker;
+		pthread_create(&workers[w].thread, NULL, worker_func, &workers[w]);
+	}
+	for( w = 0; w < config.concurrency; w++ ) {
+		pthread_join(workers[w].thread, NULL);
+		errors += workers[w].errors;
+		reply_bytes += workers[w].reply_bytes;
+	}
+	elapsed = monotonic_ns() - start;
+
+	count = compact_samples(&samples, workers, config.concurrency);
+	printf("requests %ld  errors %ld  concurrency %d  payload %zu%s\n", count, errors,
+		config.concurrency, config.payload,
+		config.shm_name ? "  shm" : config.udp_port ? "  udp" : config.fastopen ? "  fastopen" : "");
+	printf("throughput %.1f req/s  reply %.1f MB/s\n", count / (elapsed / 1e9),
+		reply_bytes / (elapsed / 1e9) / 1e6);
+	if( config.udp_port ) {
+		/* Sending a datagram says nothing about delivery, the server counters do */
+		report("send", samples.total_ns, count);
+		report_udp_server(&config);
+	} else {
+		/* Over shared memory "connect" is the enqueue and "first-byte" the wait for the commit */
+		report(config.shm_name ? "enqueue" : "connect", samples.connect_ns, count);
+		report(config.shm_name ? "commit" : "first-byte", samples.first_byte_ns, count);
+		report("total", samples.total_ns, count);
+	}
+
+	free(samples.connect_ns);
+	free(samples.first_byte_ns);
+	free(samples.total_ns);
+	free(workers);
+	return errors ? 2 : 0;
+}
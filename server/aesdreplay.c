@@ -0,0 +1,575 @@
+/*
+ * aesdreplay.c - Replay an aesdsocket --capture trace against a server
+ *
+ * Every captured connection is reopened at its original offset from the
+ * start of the trace divided by the speed factor, and its packet is sent
+ * at the captured packet time with a synthetic payload of the captured
+ * size, so the original concurrency and arrival pattern are reproduced.
+ * At max speed (-x 0) the timings are ignored and connections are
+ * started as fast as the trace's peak concurrency (or -c) allows.
+ *
+ * Read only packets (the stats, search and since commands) are replayed
+ * as empty requests, which read back the whole log, since the trace does
+ * not keep packet contents.
+ *
+ * Results can be saved with -o and compared against a saved run with -b.
+ * All connections are driven by one thread through epoll, so the tool
+ * itself adds little jitter to the schedule.
+ */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <time.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include "aesd_capture.h"
+
+#define DEFAULT_PORT		9000
+#define REPLAY_MAX_EVENTS	256
+#define REPLY_BUFFER_SIZE	65536
+
+enum replay_state {
+	REPLAY_PENDING,		/* Not started yet */
+	REPLAY_CONNECTING,
+	REPLAY_WAITING,		/* Connected, the packet is not due yet */
+	REPLAY_SENDING,
+	REPLAY_READING,
+	REPLAY_DONE,
+};
+
+struct replay_conn {
+	/* From the trace */
+	uint64_t open_ns;
+	uint64_t packet_ns;
+	uint64_t close_ns;
+	uint32_t length;
+	enum aesd_capture_type kind;	/* 0 when the connection never framed a packet */
+	bool opened;
+	/* Replay state */
+	enum replay_state state;
+	int sockfd;
+	size_t sent;
+	bool first_byte;
+	bool error;
+	uint64_t start_ns;
+	uint64_t connected_ns;
+	uint64_t send_ns;
+	uint64_t first_byte_ns;
+	uint64_t done_ns;
+	uint64_t lag_ns;
+	struct replay_conn *next_waiting;
+};
+
+struct replay_config {
+	const char *trace;
+	const char *host;
+	int port;
+	double speed;		/* 0 for as fast as possible */
+	int concurrency;	/* Limit at max speed, 0 for the trace's peak */
+	const char *output;
+	const char *baseline;
+};
+
+/* Summary metrics, written by -o and compared by -b */
+struct replay_metric {
+	const char *name;
+	double value;
+};
+
+static uint64_t monotonic_ns( void ) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static void usage( const char *progname ) {
+	fprintf(stderr,
+		"Usage: %s -t TRACE [options]\n"
+		"  -t FILE   trace written by aesdsocket --capture FILE\n"
+		"  -H HOST   server address (default 127.0.0.1)\n"
+		"  -p PORT   server port (default %d)\n"
+		"  -x SPEED  time scale, 1 = original timing, 2 = twice as fast, 0 = max speed (default 1)\n"
+		"  -c N      concurrent connections at max speed (default: the trace's peak)\n"
+		"  -o FILE   save the summary metrics to FILE\n"
+		"  -b FILE   compare against the metrics saved from an earlier run\n",
+		progname, DEFAULT_PORT);
+}
+
+/* Load the trace into one entry per connection, ordered by open time */
+static struct replay_conn *load_trace( const char *path, size_t *count, int *peak ) {
+	struct aesd_capture_header header;
+	struct aesd_capture_event event;
+	struct replay_conn *by_id = NULL, *conns;
+	size_t capacity = 0, n = 0, i;
+	int concurrent = 0;
+	FILE *in = fopen(path, "rb");
+
+	if( in == NULL ) {
+		perror(path);
+		return NULL;
+	}
+	if( fread(&header, sizeof(header), 1, in) != 1 ||
+			memcmp(header.magic, AESD_CAPTURE_MAGIC, sizeof(header.magic)) != 0 ) {
+		fprintf(stderr, "%s is not an aesdsocket capture\n", path);
+		fclose(in);
+		return NULL;
+	}
+	while( fread(&event, sizeof(event), 1, in) == 1 ) {
+		enum aesd_capture_type type = event.type_length >> AESD_CAPTURE_TYPE_SHIFT;
+		struct replay_conn *conn;
+
+		if( event.conn >= capacity ) {
+			size_t grown = capacity ? capacity : 1024;
+			while( grown <= event.conn ) {
+				grown *= 2;
+			}
+			conn = realloc(by_id, grown * sizeof(*by_id));
+			if( conn == NULL ) {
+				free(by_id);
+				fclose(in);
+				return NULL;
+			}
+			memset(conn + capacity, 0, (grown - capacity) * sizeof(*conn));
+			by_id = conn;
+			capacity = grown;
+		}
+		conn = &by_id[event.conn];
+		switch( type ) {
+		case AESD_CAPTURE_OPEN:
+			conn->opened = true;
+			conn->open_ns = event.time_ns;
+			conn->close_ns = UINT64_MAX;
+			break;
+		case AESD_CAPTURE_PACKET:
+		case AESD_CAPTURE_COMMAND:
+			conn->kind = type;
+			conn->packet_ns = event.time_ns;
+			conn->length = event.type_length & AESD_CAPTURE_LENGTH_MASK;
+			break;
+		case AESD_CAPTURE_CLOSE:
+			conn->close_ns = event.time_ns;
+			break;
+		}
+	}
+	fclose(in);
+
+	/* Ids are handed out in accept order, so this is also open time order */
+	conns = calloc(capacity ? capacity : 1, sizeof(*conns));
+	if( conns == NULL ) {
+		free(by_id);
+		return NULL;
+	}
+	for( i = 0; i < capacity; i++ ) {
+		if( by_id[i].opened && by_id[i].kind != 0 ) {
+			conns[n++] = by_id[i];
+		}
+	}
+	free(by_id);
+
+	/* Peak concurrency: connections opened before a connection's open time and not yet closed */
+	*peak = 0;
+	for( i = 0; i < n; i++ ) {
+		size_t j;
+		concurrent = 1;
+		for( j = i; j-- > 0 && i - j < 4096; ) {
+			if( conns[j].close_ns > conns[i].open_ns ) {
+				concurrent++;
+			}
+		}
+		if( concurrent > *peak ) {
+			*peak = concurrent;
+		}
+	}
+	*count = n;
+	return conns;
+}
+
+static int start_conn( struct replay_conn *conn, int epfd, const struct sockaddr_in *addr ) {
+	struct epoll_event event = { .events = EPOLLOUT, .data.ptr = conn };
+
+	conn->start_ns = monotonic_ns();
+	conn->sockfd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+	if( conn->sockfd < 0 ) {
+		return -1;
+	}
+	if( connect(conn->sockfd, (const struct sockaddr *)addr, sizeof(*addr)) < 0 && errno != EINPROGRESS ) {
+		return -1;
+	}
+	conn->state = REPLAY_CONNECTING;
+	return epoll_ctl(epfd, EPOLL_CTL_ADD, conn->sockfd, &event);
+}
+
+static void finish_conn( struct replay_conn *conn, bool error ) {
+	conn->error = error;
+	conn->done_ns = monotonic_ns();
+	conn->state = REPLAY_DONE;
+	if( conn->sockfd >= 0 ) {
+		close(conn->sockfd);	/* Also removes it from the epoll set */
+		conn->sockfd = -1;
+	}
+}
+
+/* Send the synthetic packet: 'x' bytes ending in a newline, or nothing for a read */
+static void send_packet( struct replay_conn *conn, int epfd, const char *payload ) {
+	struct epoll_event event = { .events = EPOLLIN, .data.ptr = conn };
+	size_t length = conn->kind == AESD_CAPTURE_PACKET ? conn->length : 0;
+
+	if( conn->state != REPLAY_SENDING ) {
+		conn->state = REPLAY_SENDING;
+		conn->send_ns = monotonic_ns();
+	}
+	while( conn->sent < length ) {
+		size_t chunk = length - conn->sent;
+		ssize_t rc;
+
+		if( chunk > REPLY_BUFFER_SIZE ) {
+			chunk = REPLY_BUFFER_SIZE;
+		}
+		/* Only the final chunk takes the newline at the end of the payload */
+		rc = send(conn->sockfd, conn->sent + chunk == length ? payload + REPLY_BUFFER_SIZE + 1 - chunk : payload,
+			chunk, MSG_NOSIGNAL);
+		if( rc < 0 ) {
+			if( errno == EAGAIN ) {
+				event.events = EPOLLOUT;
+				epoll_ctl(epfd, EPOLL_CTL_MOD, conn->sockfd, &event);
+				return;
+			}
+			finish_conn(conn, true);
+			return;
+		}
+		conn->sent += rc;
+	}
+	if( length == 0 ) {
+		shutdown(conn->sockfd, SHUT_WR);
+	}
+	conn->state = REPLAY_READING;
+	epoll_ctl(epfd, EPOLL_CTL_MOD, conn->sockfd, &event);
+}
+
+/* Read and discard the reply, the server closes the connection when it is complete */
+static void read_reply( struct replay_conn *conn, char *buffer, uint64_t *reply_bytes ) {
+	for( ;; ) {
+		ssize_t rc = recv(conn->sockfd, buffer, REPLY_BUFFER_SIZE, 0);
+		if( rc > 0 ) {
+			if( !conn->first_byte ) {
+				conn->first_byte = true;
+				conn->first_byte_ns = monotonic_ns();
+			}
+			*reply_bytes += rc;
+			continue;
+		}
+		if( rc < 0 && errno == EAGAIN ) {
+			return;
+		}
+		if( rc < 0 && errno == EINTR ) {
+			continue;
+		}
+		finish_conn(conn, rc < 0);
+		return;
+	}
+}
+
+static int compare_u64( const void *a, const void *b ) {
+	uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+	return (x > y) - (x < y);
+}
+
+static double percentile_us( uint64_t *samples, size_t count, int pct ) {
+	if( count == 0 ) {
+		return 0;
+	}
+	return samples[pct == 100 ? count - 1 : count * pct / 100] / 1e3;
+}
+
+static void report( const char *name, uint64_t *samples, size_t count ) {
+	if( count == 0 ) {
+		printf("%-12s no samples\n", name);
+		return;
+	}
+	qsort(samples, count, sizeof(*samples), compare_u64);
+	printf("%-12s min %8.1f  p50 %8.1f  p90 %8.1f  p99 %8.1f  max %8.1f us\n", name,
+		samples[0] / 1e3, percentile_us(samples, count, 50), percentile_us(samples, count, 90),
+		percentile_us(samples, count, 99), percentile_us(samples, count, 100));
+}
+
+static int save_metrics( const char *path, const struct replay_metric *metrics, size_t count ) {
+	FILE *out = fopen(path, "w");
+	size_t i;
+
+	if( out == NULL ) {
+		perror(path);
+		return -1;
+	}
+	for( i = 0; i < count; i++ ) {
+		fprintf(out, "%s %.3f\n", metrics[i].name, metrics[i].value);
+	}
+	return fclose(out);
+}
+
+/* Print every metric of this run next to the same metric of the baseline run */
+static void compare_metrics( const char *path, const struct replay_metric *metrics, size_t count ) {
+	char name[64];
+	double value;
+	size_t i;
+	FILE *in = fopen(path, "r");
+
+	if( in == NULL ) {
+		perror(path);
+		return;
+	}
+	printf("%-20s %14s %14s %9s\n", "metric", "baseline", "this run", "delta");
+	while( fscanf(in, "%63s %lf", name, &value) == 2 ) {
+		for( i = 0; i < count; i++ ) {
+			if( strcmp(metrics[i].name, name) == 0 ) {
+				printf("%-20s %14.1f %14.1f %+8.1f%%\n", name, value, metrics[i].value,
+					value != 0 ? (metrics[i].value - value) / value * 100 : 0.0);
+			}
+		}
+	}
+	fclose(in);
+}
+
+int main( int argc, char **argv ) {
+	struct replay_config config = {
+		.host = "127.0.0.1",
+		.port = DEFAULT_PORT,
+		.speed = 1,
+	};
+	struct epoll_event events[REPLAY_MAX_EVENTS];
+	struct sockaddr_in addr;
+	struct replay_conn *conns, *waiting = NULL;
+	uint64_t *connect_ns, *first_byte_ns, *total_ns, *lag_ns;
+	uint64_t start, elapsed, trace_ns, reply_bytes = 0;
+	size_t count, next = 0, done = 0, samples = 0, i;
+	long errors = 0;
+	int opt, epfd, peak, active = 0, limit;
+	char *payload, *buffer;
+
+	while( (opt = getopt(argc, argv, "t:H:p:x:c:o:b:")) != -1 ) {
+		switch( opt ) {
+		case 't': config.trace = optarg; break;
+		case 'H': config.host = optarg; break;
+		case 'p': config.port = atoi(optarg); break;
+		case 'x': config.speed = atof(optarg); break;
+		case 'c': config.concurrency = atoi(optarg); break;
+		case 'o': config.output = optarg; break;
+		case 'b': config.baseline = optarg; break;
+		default:
+			usage(argv[0]);
+			return 1;
+		}
+	}
+	if( config.trace == NULL || config.speed < 0 ) {
+		usage(argv[0]);
+		return 1;
+	}
+	memset(&addr, 0, sizeof(addr));
+	addr.sin_family = AF_INET;
+	addr.sin_port = htons(config.port);
+	if( inet_pton(AF_INET, config.host, &addr.sin_addr) != 1 ) {
+		fprintf(stderr, "Invalid address %s\n", config.host);
+		return 1;
+	}
+
+	conns = load_trace(config.trace, &count, &peak);
+	if( conns == NULL ) {
+		return 1;
+	}
+	if( count == 0 ) {
+		fprintf(stderr, "%s holds no connections\n", config.trace);
+		return 1;
+	}
+	trace_ns = conns[count - 1].packet_ns - conns[0].open_ns;
+	limit = config.concurrency > 0 ? config.concurrency : peak;
+	printf("trace %zu connections over %.3f s, peak concurrency %d\n", count, trace_ns / 1e9, peak);
+
+	/* REPLY_BUFFER_SIZE bytes of 'x' followed by the newline */
+	payload = malloc(REPLY_BUFFER_SIZE + 1);
+	buffer = malloc(REPLY_BUFFER_SIZE);
+	epfd = epoll_create1(EPOLL_CLOEXEC);
+	if( payload == NULL || buffer == NULL || epfd < 0 ) {
+		fprintf(stderr, "Out of memory\n");
+		return 1;
+	}
+	memset(payload, 'x', REPLY_BUFFER_SIZE);
+	payload[REPLY_BUFFER_SIZE] = '\n';
+	/* Replay times relative to the first connection */
+	for( i = count; i-- > 0; ) {
+		conns[i].sockfd = -1;
+		conns[i].packet_ns -= conns[0].open_ns;
+		conns[i].open_ns -= conns[0].open_ns;
+	}
+
+	start = monotonic_ns();
+	while( done < count ) {
+		uint64_t now = monotonic_ns();
+		uint64_t wake = UINT64_MAX;
+		struct replay_conn **link;
+		int timeout, nevents, e;
+
+		/* Start the connections that are due */
+		while( next < count ) {
+			struct replay_conn *conn = &conns[next];
+			uint64_t due = start + (config.speed > 0 ? (uint64_t)(conn->open_ns / config.speed) : 0);
+
+			if( config.speed > 0 ? due > now : active >= limit ) {
+				if( config.speed > 0 ) {
+					wake = due;
+				}
+				break;
+			}
+			conn->lag_ns = now - due;
+			next++;
+			active++;
+			if( start_conn(conn, epfd, &addr) < 0 ) {
+				finish_conn(conn, true);
+				active--;
+				done++;
+			}
+		}
+
+		/* Send the packets that are due on connections already open */
+		for( link = &waiting; *link != NULL; ) {
+			struct replay_conn *conn = *link;
+			uint64_t due = start + (config.speed > 0 ? (uint64_t)(conn->packet_ns / config.speed) : 0);
+
+			if( due <= now ) {
+				*link = conn->next_waiting;
+				send_packet(conn, epfd, payload);
+				if( conn->state == REPLAY_DONE ) {
+					active--;
+					done++;
+				}
+			} else {
+				if( due < wake ) {
+					wake = due;
+				}
+				link = &conn->next_waiting;
+			}
+		}
+		if( done == count ) {
+			break;
+		}
+
+		timeout = wake == UINT64_MAX ? -1 : wake <= now ? 0 : (int)((wake - now + 999999) / 1000000);
+		nevents = epoll_wait(epfd, events, REPLAY_MAX_EVENTS, timeout);
+		if( nevents < 0 && errno != EINTR ) {
+			perror("epoll_wait");
+			return 1;
+		}
+		for( e = 0; e < nevents; e++ ) {
+			struct replay_conn *conn = events[e].data.ptr;
+
+			switch( conn->state ) {
+			case REPLAY_CONNECTING: {
+				int err = 0;
+				socklen_t len = sizeof(err);
+				struct epoll_event idle = { .events = 0, .data.ptr = conn };
+
+				if( getsockopt(conn->sockfd, SOL_SOCKET, SO_ERROR, &err, &len) < 0 || err != 0 ) {
+					finish_conn(conn, true);
+					break;
+				}
+				conn->connected_ns = monotonic_ns();
+				conn->state = REPLAY_WAITING;
+				epoll_ctl(epfd, EPOLL_CTL_MOD, conn->sockfd, &idle);
+				conn->next_waiting = waiting;
+				waiting = conn;
+				break;
+			}
+			case REPLAY_SENDING:
+				send_packet(conn, epfd, payload);
+				break;
+			case REPLAY_READING:
+				read_reply(conn, buffer, &reply_bytes);
+				break;
+			default:
+				break;
+			}
+			if( conn->state == REPLAY_DONE ) {
+				active--;
+				done++;
+			}
+		}
+	}
+	elapsed = monotonic_ns() - start;
+
+	connect_ns = calloc(count, sizeof(uint64_t));
+	first_byte_ns = calloc(count, sizeof(uint64_t));
+	total_ns = calloc(count, sizeof(uint64_t));
+	lag_ns = calloc(count, sizeof(uint64_t));
+	if( !connect_ns || !first_byte_ns || !total_ns || !lag_ns ) {
+		fprintf(stderr, "Out of memory\n");
+		return 1;
+	}
+	for( i = 0; i < count; i++ ) {
+		struct replay_conn *conn = &conns[i];
+		if( conn->error || conn->send_ns == 0 ) {
+			errors++;
+			continue;
+		}
+		connect_ns[samples] = conn->connected_ns - conn->start_ns;
+		first_byte_ns[samples] = (conn->first_byte ? conn->first_byte_ns : conn->done_ns) - conn->send_ns;
+		total_ns[samples] = conn->done_ns - conn->send_ns;
+		lag_ns[samples] = conn->lag_ns;
+		samples++;
+	}
+
+	printf("replayed %zu  errors %ld\n", samples, errors);
+	if( config.speed > 0 ) {
+		printf("schedule %.2fx  trace %.3f s  replay %.3f s\n", config.speed, trace_ns / 1e9, elapsed / 1e9);
+	} else {
+		printf("max speed, concurrency %d  replay %.3f s\n", limit, elapsed / 1e9);
+	}
+	printf("throughput %.1f req/s  reply %.1f MB/s\n", samples / (elapsed / 1e9),
+		reply_bytes / (elapsed / 1e9) / 1e6);
+	report("connect", connect_ns, samples);
+	report("first-byte", first_byte_ns, samples);
+	report("total", total_ns, samples);
+	if( config.speed > 0 ) {
+		/* How late connections started against the schedule, large values mean the replay fell behind */
+		report("start-lag", lag_ns, samples);
+	}
+
+	{
+		struct replay_metric metrics[] = {
+			{ "requests", samples },
+			{ "errors", errors },
+			{ "throughput_rps", samples / (elapsed / 1e9) },
+			{ "reply_mbps", reply_bytes / (elapsed / 1e9) / 1e6 },
+			{ "first_byte_p50_us", percentile_us(first_byte_ns, samples, 50) },
+			{ "first_byte_p99_us", percentile_us(first_byte_ns, samples, 99) },
+			{ "total_p50_us", percentile_us(total_ns, samples, 50) },
+			{ "total_p90_us", percentile_us(total_ns, samples, 90) },
+			{ "total_p99_us", percentile_us(total_ns, samples, 99) },
+			{ "total_max_us", percentile_us(total_ns, samples, 100) },
+		};
+		size_t nmetrics = sizeof(metrics) / sizeof(metrics[0]);
+
+		if( config.baseline != NULL ) {
+			compare_metrics(config.baseline, metrics, nmetrics);
+		}
+		if( config.output != NULL && save_metrics(config.output, metrics, nmetrics) < 0 ) {
+			return 1;
+		}
+	}
+
+	close(epfd);
+	free(connect_ns);
+	free(first_byte_ns);
+	free(total_ns);
+	free(lag_ns);
+	free(payload);
+	free(buffer);
+	free(conns);
+	return errors ? 2 : 0;
+}
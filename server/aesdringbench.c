@@ -0,0 +1,151 @@
+/*
+ * aesdringbench.c - Offset lookup benchmark for the aesd circular buffer
+ *
+ * Fills a buffer of each capacity with records of random sizes and times
+ * random aesd_circular_buffer_find_entry_offset_for_fpos() lookups against
+ * a linear walk that sums entry sizes from the oldest entry, which is how
+ * the lookup worked before the cumulative offset index. Every lookup's
+ * result is checked against the walk.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+#include "../aesd-char-driver/aesd-circular-buffer.h"
+
+#define DEFAULT_MAX_CAPACITY	1000000
+#define DEFAULT_LOOKUPS		1000000
+#define DEFAULT_MAX_RECORD	128
+/* The walk is O(n), so it gets fewer lookups at large capacities */
+#define LINEAR_BUDGET		(200 * 1000 * 1000)
+
+static uint64_t monotonic_ns( void ) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static struct aesd_buffer_entry *linear_find( struct aesd_circular_buffer *buffer, size_t char_offset,
+		size_t *entry_offset ) {
+	size_t current = 0;
+	uint32_t i = buffer->out_offs;
+	uint32_t n;
+
+	for( n = 0; n < buffer->count; n++ ) {
+		if( char_offset < current + buffer->entry[i].size ) {
+			*entry_offset = char_offset - current;
+			return &buffer->entry[i];
+		}
+		current += buffer->entry[i].size;
+		i = (i + 1) & buffer->mask;
+	}
+	return NULL;
+}
+
+static void usage( const char *progname ) {
+	fprintf(stderr,
+		"Usage: %s [-m MAX_CAPACITY] [-n LOOKUPS] [-s MAX_RECORD]\n"
+		"  -m N   largest capacity, capacities go from 10 up by 10x (default %d)\n"
+		"  -n N   indexed lookups per capacity (default %d)\n"
+		"  -s N   records are 1 to N bytes (default %d)\n",
+		progname, DEFAULT_MAX_CAPACITY, DEFAULT_LOOKUPS, DEFAULT_MAX_RECORD);
+}
+
+int main( int argc, char **argv ) {
+	uint32_t max_capacity = DEFAULT_MAX_CAPACITY;
+	long lookups = DEFAULT_LOOKUPS;
+	size_t max_record = DEFAULT_MAX_RECORD;
+	uint32_t capacity;
+	size_t *offsets;
+	int opt;
+
+	while( (opt = getopt(argc, argv, "m:n:s:")) != -1 ) {
+		switch( opt ) {
+		case 'm': max_capacity = strtoul(optarg, NULL, 0); break;
+		case 'n': lookups = atol(optarg); break;
+		case 's': max_record = strtoul(optarg, NULL, 0); break;
+		default:
+			usage(argv[0]);
+			return 1;
+		}
+	}
+	if( max_capacity == 0 || max_capacity > AESD_CIRCULAR_BUFFER_MAX_CAPACITY || lookups <= 0 || max_record == 0 ) {
+		usage(argv[0]);
+		return 1;
+	}
+	offsets = malloc(lookups * sizeof(*offsets));
+	if( offsets == NULL ) {
+		fprintf(stderr, "Out of memory\n");
+		return 1;
+	}
+	srand(1);
+
+	printf("%10s %14s %14s %14s %9s\n", "capacity", "bytes", "linear ns", "indexed ns", "speedup");
+	for( capacity = 10; capacity <= max_capacity; capacity = capacity > max_capacity / 10 &&
+			capacity != max_capacity ? max_capacity : capacity * 10 ) {
+		struct aesd_circular_buffer buffer;
+		uint64_t start, linear_ns, indexed_ns;
+		long linear_lookups = LINEAR_BUDGET / capacity;
+		size_t total, entry_offset, expected_offset;
+		volatile uintptr_t sink = 0;
+		long i, mismatches = 0;
+
+		if( aesd_circular_buffer_init_capacity(&buffer, capacity) < 0 ) {
+			fprintf(stderr, "Cannot allocate capacity %u\n", capacity);
+			return 1;
+		}
+		/* Fill twice over so the ring has wrapped and evicted, as it would in use */
+		for( i = 0; i < 2L * capacity; i++ ) {
+			struct aesd_buffer_entry entry = { .buffptr = NULL, .size = 1 + rand() % max_record };
+			aesd_circular_buffer_add_entry(&buffer, &entry);
+		}
+		total = aesd_circular_buffer_size(&buffer);
+		for( i = 0; i < lookups; i++ ) {
+			offsets[i] = ((size_t)rand() * RAND_MAX + rand()) % total;
+		}
+		if( linear_lookups > lookups ) {
+			linear_lookups = lookups;
+		} else if( linear_lookups < 100 ) {
+			linear_lookups = 100;
+		}
+
+		start = monotonic_ns();
+		for( i = 0; i < linear_lookups; i++ ) {
+			sink += (uintptr_t)linear_find(&buffer, offsets[i], &entry_offset) + entry_offset;
+		}
+		linear_ns = monotonic_ns() - start;
+
+		start = monotonic_ns();
+		for( i = 0; i < lookups; i++ ) {
+			sink += (uintptr_t)aesd_circular_buffer_find_entry_offset_for_fpos(&buffer, offsets[i],
+				&entry_offset) + entry_offset;
+		}
+		indexed_ns = monotonic_ns() - start;
+
+		for( i = 0; i < linear_lookups; i++ ) {
+			if( aesd_circular_buffer_find_entry_offset_for_fpos(&buffer, offsets[i], &entry_offset) !=
+					linear_find(&buffer, offsets[i], &expected_offset) || entry_offset != expected_offset ) {
+				mismatches++;
+			}
+		}
+		if( aesd_circular_buffer_find_entry_offset_for_fpos(&buffer, total, &entry_offset) != NULL ) {
+			mismatches++;
+		}
+
+		printf("%10u %14zu %14.1f %14.1f %8.1fx\n", capacity, total, (double)linear_ns / linear_lookups,
+			(double)indexed_ns / lookups, ((double)linear_ns / linear_lookups) / ((double)indexed_ns / lookups));
+		if( mismatches ) {
+			fprintf(stderr, "%ld lookups disagree with the linear walk at capacity %u\n", mismatches, capacity);
+			return 1;
+		}
+		aesd_circular_buffer_destroy(&buffer);
+		if( capacity == max_capacity ) {
+			break;
+		}
+	}
+	free(offsets);
+	return 0;
+}
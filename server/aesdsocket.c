@@ -1,3 +1,4 @@
+#define _GNU_SOURCE	/* accept4() */
 #include <stdio.h>
 #include <stdlib.h>
 #include <unistd.h>
@@ -18,161 +19,542 @@
 #include <stdbool.h>
 #include <sys/time.h>
 #include <time.h>
+#include <getopt.h>
+#include <poll.h>
+#include "aesd_ratelimit.h"
+#include "aesd_log.h"
+#include "aesd_sockopt.h"
+#include "aesd_memstore.h"
+#include "aesd_storage.h"
+#include "aesd_repl.h"
+#include "aesd_shm.h"
+#include "aesd_udp.h"
+#include "aesd_pipeline.h"
+#include "aesd_index.h"
+#include "aesd_timeindex.h"
+#include "aesd_stream.h"
+#include "aesd_capture.h"
 
-#define PORT 9000	/* The port users will be connecting to */
-#define BACKLOG	10	/* How many pending connection the queue will hold */
+#define DEFAULT_PORT 9000	/* The port users will be connecting to */
 
 /*Default to 1 if not specified by Makefile */
 #ifndef USE_AESD_CHAR_DEVICE
 #define USE_AESD_CHAR_DEVICE	1
 #endif 
 
+/* The build flag only picks the default engine, --storage selects another one at runtime */
 #if USE_AESD_CHAR_DEVICE
-#define FILE_PATH	"/dev/aesdchar"
+#define DEFAULT_STORAGE_ENGINE	"chardev"
 #else
-#define FILE_PATH	"/var/tmp/aesdsocketdata"
+#define DEFAULT_STORAGE_ENGINE	"file"
 #endif 
 
-#define RECV_BUFFER_SIZE	512
-#define SEND_BUFFER_SIZE	512
+/* A packet matching this exactly returns server statistics instead of being stored */
+#define STATS_COMMAND	"AESDSOCKET_STATS\n"
+
+/* "AESDSOCKET_SEARCH:term ...\n" returns the stored packets containing every term */
+#define SEARCH_COMMAND	"AESDSOCKET_SEARCH:"
+
+/* "AESDSOCKET_SINCE:T\n" returns the packets stored since T, in seconds since the epoch */
+#define SINCE_COMMAND	"AESDSOCKET_SINCE:"
+
+/* "AESDCHAR_IOCSEEKTO:X,Y\n" returns the data from byte Y of the X-th oldest record held */
+#define SEEKTO_COMMAND	"AESDCHAR_IOCSEEKTO:"
 
 int server_sockfd = -1;
-bool app_run = 1; 	/* Flag to communicate program completion */
+volatile sig_atomic_t app_run = 1; 	/* Flag to communicate program completion */
+volatile sig_atomic_t caught_signal = 0;	/* Signal that requested the exit */
+
+/*Storage engine holding the packets, it serializes writes with its own lock */
+struct aesd_storage *storage;
+const char *storage_engine = DEFAULT_STORAGE_ENGINE;
+struct aesd_storage_params storage_params = {
+	.max_bytes = AESD_MEMSTORE_DEFAULT_MAX_BYTES,
+	.remove_on_close = true,
+};
+
+/*Client port, changed with -p so several instances can run on one host */
+int server_port = DEFAULT_PORT;
+
+/*Replication settings, see aesd_repl.h */
+struct aesd_repl_config repl_config = {
+	.backlog_records = AESD_REPL_DEFAULT_BACKLOG_RECORDS,
+	.backlog_bytes = AESD_REPL_DEFAULT_BACKLOG_BYTES,
+};
+
+/*Shared memory ingestion channel, disabled unless --shm is given */
+const char *shm_name = NULL;
+size_t shm_slots = AESD_SHM_DEFAULT_SLOTS;
+size_t shm_slot_size = AESD_SHM_DEFAULT_SLOT_SIZE;
+
+/*UDP ingestion, disabled unless --udp-port is given */
+struct aesd_udp_config udp_config = {
+	.shards = AESD_UDP_DEFAULT_SHARDS,
+	.batch = AESD_UDP_DEFAULT_BATCH,
+	.max_size = AESD_UDP_DEFAULT_MAX_SIZE,
+};
+
+/*Maintain the token index behind the search command */
+bool index_enabled = true;
+
+/*Streams selected with the "stream:NAME:" prefix, see aesd_stream.h */
+const char *stream_engine = AESD_STREAM_DEFAULT_ENGINE;
+size_t max_streams = AESD_STREAM_DEFAULT_MAX;
+
+/*Record connection and packet timings for aesdreplay, disabled unless --capture is given */
+const char *capture_path = NULL;
 
-/*Mutex for synchronizing file writes */
-pthread_mutex_t file_mutex = PTHREAD_MUTEX_INITIALIZER;
+/*Persist the time index next to the data file, only when the file outlives the server */
+char *timeindex_sidecar = NULL;
 
 /*Global declaration for Timestamp thread*/
 pthread_t timestamp_thread;
+bool timestamp_thread_started = false;
 
-/*Linked list structure for Managing threads*/
-struct thread_node_data {
-	pthread_t thread_id;
-	bool thread_work_completion;
-	int client_sockfd;
-	SLIST_ENTRY(thread_node_data) conn_node; /*Manage threads with linked list*/
+/*Socket options, see aesd_sockopt.h */
+struct aesd_socket_profile socket_profile = {
+	.backlog = AESD_DEFAULT_BACKLOG,
 };
 
-/*Declare and initalize the head of linked list*/
-SLIST_HEAD(thread_list, thread_node_data)thread_list_head = SLIST_HEAD_INITIALIZER(thread_list_head);
+/*Log messages of each type forwarded to syslog per second, 0 for unlimited */
+unsigned int log_rate = AESD_LOG_DEFAULT_RATE;
+
+/*Rate limiting configuration, everything unlimited by default */
+struct aesd_rl_config rl_config = {
+	.burst_ms = AESD_RL_DEFAULT_BURST_MS,
+	.max_delay_ms = AESD_RL_DEFAULT_MAX_DELAY_MS,
+	.policy = AESD_RL_DELAY,
+	.table_size = AESD_RL_DEFAULT_TABLE_SIZE,
+};
+
+/*Thread counts and queue depth of the connection stages, see aesd_pipeline.h */
+struct aesd_pipeline_config pipeline_config = {
+	.recv_threads = AESD_PIPELINE_DEFAULT_RECV_THREADS,
+	.commit_threads = AESD_PIPELINE_DEFAULT_COMMIT_THREADS,
+	.reply_threads = AESD_PIPELINE_DEFAULT_REPLY_THREADS,
+	.queue_depth = AESD_PIPELINE_DEFAULT_QUEUE_DEPTH,
+	.buffer_size = AESD_PIPELINE_DEFAULT_BUFFER_SIZE,
+	.max_packet_size = AESD_PIPELINE_DEFAULT_MAX_PACKET,
+	.reply_timeout_ms = AESD_PIPELINE_DEFAULT_REPLY_TIMEOUT_MS,
+};
 
 /*Function Prototypes*/
-void free_client_threads( void );
 void free_resources( void );
 void signal_handler ( int signal );
-void *process_connection_thread( void *arg);
 void deamon_mode_run( void );
+void usage( const char *progname );
+int parse_options( int argc, char **argv, int *daemon_mode );
 void *timestamp_thread_func();
+int send_all( int sockfd, const char *buffer, size_t length );
+int send_stats( int sockfd );
+int send_search( int sockfd, const char *query, size_t query_len, char *buffer, size_t buffer_size );
+void commit_packet( struct aesd_storage *st, const char *packet, size_t packet_len );
+bool admit_packet( struct aesd_rl_client *rl_client, size_t packet_len );
+void ingest_packet( struct aesd_rl_client *rl_client, const char *packet, size_t packet_len );
+void shm_commit_packet( const char *packet, size_t packet_len );
+void udp_commit_packet( uint32_t addr, const char *packet, size_t packet_len );
+int send_stored_data( int sockfd, struct aesd_storage *st, uint64_t from, char *buffer, size_t buffer_size );
+bool is_stats_command( const char *packet, size_t packet_len );
+bool is_search_command( const char *packet, size_t packet_len );
+bool is_since_command( const char *packet, size_t packet_len );
+bool is_seekto_command( const char *packet, size_t packet_len );
+const char *kept_data_path( void );
+bool parse_stream_packet( const char *packet, size_t packet_len, const char **name, size_t *name_len, size_t *payload );
+enum aesd_conn_action conn_admit( struct aesd_conn *conn, bool parked, uint64_t *delay_ns );
+void conn_commit( struct aesd_conn *conn );
+int conn_reply( struct aesd_conn *conn, char *buffer, size_t buffer_size );
+void conn_open( struct aesd_conn *conn );
+void conn_close( struct aesd_conn *conn );
 
-void free_client_threads() {
-	/*Loop and close all client threads for cleanup*/
-	struct thread_node_data* thread_data;
-	while( !SLIST_EMPTY( &thread_list_head )) {
-		thread_data = SLIST_FIRST(&thread_list_head);
-		thread_data->thread_work_completion = true;
-		pthread_join(thread_data->thread_id, NULL);
-		SLIST_REMOVE_HEAD(&thread_list_head, conn_node);
-	}
-	pthread_mutex_destroy(&file_mutex);
-}
-
+/*Connection stage callbacks */
+const struct aesd_pipeline_ops pipeline_ops = {
+	.admit = conn_admit,
+	.commit = conn_commit,
+	.reply = conn_reply,
+	.open = conn_open,
+	.close = conn_close,
+};
 
 void free_resources () {
-	free_client_threads();
+	/* Finish the connections that already reached the commit or reply stage */
+	aesd_pipeline_stop();
+	aesd_capture_stop();
+
 	/*Clean up  and close the server socket */
 	if( server_sockfd != -1) {
 		close(server_sockfd);
 		server_sockfd = -1; /* Reset Value */
 	}
 
-	/* Clean up and remove the file */
-	#ifndef USE_AESD_CHAR_DEVICE
-	if( remove(FILE_PATH) != 0 ){
-		syslog(LOG_ERR, "Failed to remove file: %s", strerror(errno));
+	if( timestamp_thread_started ) {
+		pthread_cancel(timestamp_thread);
+		pthread_join(timestamp_thread, NULL);
+		timestamp_thread_started = false;
 	}
-	#endif 
 
-	pthread_cancel(timestamp_thread);
-	pthread_join(timestamp_thread, NULL);
+	/* Drain what local producers already published before storage goes away */
+	aesd_shm_stop();
+	aesd_udp_stop();
+
+	/* Replication reads storage from its own threads */
+	aesd_repl_stop();
+
+	/* Close the storage engine, the file engine removes its file */
+	aesd_storage_close(storage);
+	storage = NULL;
+	aesd_index_destroy();
+	aesd_streams_destroy();
+	aesd_timeindex_destroy();
+	free(timeindex_sidecar);
+	timeindex_sidecar = NULL;
+
+	aesd_rl_destroy();
+
+	/* Flush queued log records before closing the log */
+	aesd_log_stop();
 
 	/*Close the log */
 	closelog();
 }
 
-/* Signal Handler */
+/* Signal Handler, only async-signal-safe work here: main() cleans up once accept() is interrupted */
 void signal_handler( int signal ) {
 	if( signal == SIGINT || signal == SIGTERM ){
-		syslog(LOG_INFO, "Caught signal %d, exiting", signal);
-
+		caught_signal = signal;
 		app_run = false;
 
 		/* Shutdown the socket */
 		if ( server_sockfd >= 0 ) {
 			shutdown(server_sockfd, SHUT_RDWR);
 		}
+	}
+}
 
-		free_resources();
-		exit(0);
+/* Send the whole buffer, retrying on short writes and waiting up to the reply timeout for socket space */
+int send_all( int sockfd, const char *buffer, size_t length ) {
+	while( length > 0 ) {
+		ssize_t bytes_sent = send(sockfd, buffer, length, MSG_NOSIGNAL);
+		if( bytes_sent < 0 ) {
+			if( errno == EAGAIN || errno == EWOULDBLOCK ) {
+				if( aesd_wait_socket(sockfd, POLLOUT, pipeline_config.reply_timeout_ms) < 0 ) {
+					return -1;
+				}
+				continue;
+			}
+			if( errno == EINTR ) {
+				continue;
+			}
+			return -1;
+		}
+		buffer += bytes_sent;
+		length -= bytes_sent;
 	}
+	return 0;
 }
 
-void *process_connection_thread( void *arg) {
-	struct thread_node_data *tdata = arg;
-	int client_sockfd = tdata->client_sockfd;
-	char recv_buffer[RECV_BUFFER_SIZE] = {0};
-	ssize_t bytes_received = 0;
-
-	/* Open file in append mode */
-	int local_aesd_fd = open(FILE_PATH, O_CREAT|O_APPEND|O_RDWR , 0644);
-	if ( local_aesd_fd <  0 ){
-		syslog(LOG_ERR, "Failed to open file: %s", strerror(errno));
-		close(client_sockfd);
-		return NULL;
-	} 
+/* Reply with the server statistics as text, -1 if the reply was cut short */
+int send_stats( int sockfd ) {
+	char *stats = NULL;
+	size_t stats_len = 0;
+	FILE *out = open_memstream(&stats, &stats_len);
+	int rc;
+
+	if( out == NULL ) {
+		syslog(LOG_ERR, "Failed to allocate stats buffer: %s", strerror(errno));
+		return -1;
+	}
+	aesd_rl_dump_stats(out);
+	aesd_log_dump_stats(out);
+	aesd_pipeline_dump_stats(out);
+	aesd_index_dump_stats(out);
+	aesd_timeindex_dump_stats(out);
+	aesd_streams_dump_stats(out);
+	aesd_capture_dump_stats(out);
+	aesd_storage_dump_stats(storage, out);
+	aesd_repl_dump_stats(out);
+	aesd_shm_dump_stats(out);
+	aesd_udp_dump_stats(out);
+	fclose(out);
+
+	rc = send_all(sockfd, stats, stats_len);
+	if( rc < 0 ) {
+		aesd_log(AESD_LOG_SEND_ERROR, errno);
+	}
+	free(stats);
+	return rc;
+}
 
-	/* Receive data from client */
-	while ( (bytes_received = recv(client_sockfd, recv_buffer, RECV_BUFFER_SIZE - 1, 0)) > 0) {
-		recv_buffer[bytes_received] = '\0'; /* Null termination of the received data */
+/* Reply with the stored packets matching @query, looked up in the token index */
+int send_search( int sockfd, const char *query, size_t query_len, char *buffer, size_t buffer_size ) {
+	static const char disabled[] = "ERROR search index disabled\n";
+	struct aesd_index_match *matches;
+	ssize_t count, i;
 
-		/* Find newline character */
-		char *newline = strchr(recv_buffer, '\n');
-		pthread_mutex_lock(&file_mutex);
+	if( !aesd_index_enabled() ) {
+		return send_all(sockfd, disabled, strlen(disabled));
+	}
+	count = aesd_index_lookup(query, query_len, &matches);
+	if( count < 0 ) {
+		aesd_log(AESD_LOG_ALLOC_ERROR, 0);
+		return -1;
+	}
+	for( i = 0; i < count; i++ ) {
+		uint64_t offset = matches[i].offset;
+		size_t remaining = matches[i].length;
 
-		if( newline ){
-			/* Write data upto and including the newline to the file */
-			if ( write( local_aesd_fd, recv_buffer, newline-recv_buffer+1) < 0){
-				syslog(LOG_ERR, "Error writing to file: %s", strerror(errno));
+		/* Records evicted since the lookup fail with ERANGE and are skipped */
+		while( remaining > 0 ) {
+			ssize_t bytes_read = aesd_storage_read(storage, offset, buffer,
+					remaining < buffer_size ? remaining : buffer_size);
+			if( bytes_read <= 0 ) {
+				break;
 			}
-			pthread_mutex_unlock(&file_mutex);
-			break;
-		} else {
-			/* Write the entire buffer if no newline is found */
-			if ( write(local_aesd_fd, recv_buffer, bytes_received)<0) {
-				syslog(LOG_ERR, "Error writing to file: %s", strerror(errno));
+			if( send_all(sockfd, buffer, bytes_read) < 0 ) {
+				aesd_log(AESD_LOG_SEND_ERROR, errno);
+				free(matches);	/* free() leaves errno alone */
+				return -1;
 			}
-			pthread_mutex_unlock(&file_mutex);
+			offset += bytes_read;
+			remaining -= bytes_read;
 		}
 	}
-	if( bytes_received < 0 ){
-		syslog(LOG_ERR, "Error receiving data: %s", strerror(errno));
+	free(matches);
+	return 0;
+}
+
+/* Append a complete packet to storage in one go so packets from different clients never interleave */
+void commit_packet( struct aesd_storage *st, const char *packet, size_t packet_len ) {
+	if( aesd_storage_append(st, packet, packet_len) < 0 ) {
+		aesd_log(AESD_LOG_WRITE_ERROR, errno);
+	}
+}
+
+/* Apply the per-client and global limits, false if the packet must be dropped */
+bool admit_packet( struct aesd_rl_client *rl_client, size_t packet_len ) {
+	int64_t delay_ns = aesd_rl_charge(rl_client, 1, packet_len);
+
+	if( delay_ns < 0 ) {
+		aesd_log(AESD_LOG_RATE_SHED, packet_len);
+		return false;
 	}
-	/* Send contents back to the client */
-	lseek(local_aesd_fd, 0, SEEK_SET); /* Seek to the start of the file */
-	while(( bytes_received = read(local_aesd_fd, recv_buffer, RECV_BUFFER_SIZE)) > 0){
-		if( send(client_sockfd, recv_buffer, bytes_received, 0) < 0) {
-			syslog(LOG_ERR, "Error sending data: %s", strerror(errno));
-			break;
+	if( delay_ns > 0 ) {
+		struct timespec delay = { delay_ns / 1000000000LL, delay_ns % 1000000000LL };
+		while( nanosleep(&delay, &delay) < 0 && errno == EINTR );
+	}
+	return true;
+}
+
+/* Commit a packet from a transport without replies, same rules as a TCP packet */
+void ingest_packet( struct aesd_rl_client *rl_client, const char *packet, size_t packet_len ) {
+	if( aesd_repl_is_replica() ) {
+		aesd_log(AESD_LOG_READ_ONLY, packet_len);
+		return;
+	}
+	/* A delay here stalls the receiving thread, which pushes back on the producers */
+	if( admit_packet(rl_client, packet_len) ) {
+		commit_packet(storage, packet, packet_len);
+	}
+}
+
+void shm_commit_packet( const char *packet, size_t packet_len ) {
+	/* Local producers share the loopback bucket */
+	ingest_packet(aesd_rl_client_lookup(htonl(INADDR_LOOPBACK)), packet, packet_len);
+}
+
+void udp_commit_packet( uint32_t addr, const char *packet, size_t packet_len ) {
+	ingest_packet(aesd_rl_client_lookup(addr), packet, packet_len);
+}
+
+/* Stream @st from offset @from to the client, one chunk per storage lock hold, -1 if cut short */
+int send_stored_data( int sockfd, struct aesd_storage *st, uint64_t from, char *buffer, size_t buffer_size ) {
+	uint64_t offset = aesd_storage_start(st);
+	ssize_t bytes_read;
+
+	if( from > offset ) {
+		offset = from;
+	}
+
+	for( ;; ) {
+		bytes_read = aesd_storage_read(st, offset, buffer, buffer_size);
+		if( bytes_read < 0 && errno == ERANGE ) {
+			/* The data was evicted while we were sending, continue from the oldest record */
+			offset = aesd_storage_start(st);
+			continue;
+		}
+		if( bytes_read <= 0 ) {
+			return 0;
+		}
+		offset += bytes_read;
+		if( send_all(sockfd, buffer, bytes_read) < 0) {
+			aesd_log(AESD_LOG_SEND_ERROR, errno);
+			return -1;
 		}
 	}
+}
+
+bool is_stats_command( const char *packet, size_t packet_len ) {
+	return packet_len == strlen(STATS_COMMAND) && memcmp(packet, STATS_COMMAND, packet_len) == 0;
+}
 
-	close(local_aesd_fd);
-	close(client_sockfd);
+bool is_search_command( const char *packet, size_t packet_len ) {
+	return packet_len >= strlen(SEARCH_COMMAND) && memcmp(packet, SEARCH_COMMAND, strlen(SEARCH_COMMAND)) == 0;
+}
+
+bool is_since_command( const char *packet, size_t packet_len ) {
+	return packet_len >= strlen(SINCE_COMMAND) && memcmp(packet, SINCE_COMMAND, strlen(SINCE_COMMAND)) == 0;
+}
 
-	tdata->thread_work_completion = true; /* Mark the thread as completed */
+bool is_seekto_command( const char *packet, size_t packet_len ) {
+	return packet_len >= strlen(SEEKTO_COMMAND) && memcmp(packet, SEEKTO_COMMAND, strlen(SEEKTO_COMMAND)) == 0;
+}
 
+/* Data file that outlives the server, NULL when the engine keeps none */
+const char *kept_data_path( void ) {
+	if( storage_params.remove_on_close ) {
+		return NULL;
+	}
+	if( strcmp(storage_engine, "file") == 0 ) {
+		return storage_params.path ? storage_params.path : AESD_FILE_PATH;
+	}
+	if( strcmp(storage_engine, "framed") == 0 ) {
+		return storage_params.path ? storage_params.path : AESD_FRAMED_PATH;
+	}
 	return NULL;
 }
 
+/* "stream:NAME:payload" appends to stream NAME, "stream:NAME\n" only reads it */
+bool parse_stream_packet( const char *packet, size_t packet_len, const char **name, size_t *name_len, size_t *payload ) {
+	const char *end = packet + packet_len, *p;
+
+	if( packet_len < strlen(AESD_STREAM_PREFIX) || memcmp(packet, AESD_STREAM_PREFIX, strlen(AESD_STREAM_PREFIX)) != 0 ) {
+		return false;
+	}
+	*name = packet + strlen(AESD_STREAM_PREFIX);
+	for( p = *name; p < end && *p != ':' && *p != '\n'; p++ ) {
+	}
+	*name_len = p - *name;
+	*payload = p < end && *p == ':' ? (size_t)(p + 1 - packet) : packet_len;
+	return true;
+}
+
+/* Receive stage: apply the per-client and global limits before the packet reaches storage */
+enum aesd_conn_action conn_admit( struct aesd_conn *conn, bool parked, uint64_t *delay_ns ) {
+	const char *name;
+	size_t name_len, payload;
+	bool read_only;
+	int64_t delay;
+
+	if( parked ) {
+		return AESD_CONN_COMMIT;	/* Already charged, the delay has passed */
+	}
+	if( parse_stream_packet(conn->packet, conn->packet_len, &name, &name_len, &payload) ) {
+		/* Resolved once here, the later stages use conn->target. Reads never create a stream */
+		read_only = payload == conn->packet_len;
+		conn->target = read_only ? aesd_stream_lookup(name, name_len) : aesd_stream_get(name, name_len);
+		read_only = read_only || conn->target == NULL;
+	} else {
+		read_only = conn->packet_len == 0 || is_stats_command(conn->packet, conn->packet_len) ||
+			is_search_command(conn->packet, conn->packet_len) || is_since_command(conn->packet, conn->packet_len) ||
+			is_seekto_command(conn->packet, conn->packet_len);
+	}
+	aesd_capture_event(read_only ? AESD_CAPTURE_COMMAND : AESD_CAPTURE_PACKET, conn->id, conn->packet_len);
+	if( read_only ) {
+		return AESD_CONN_REPLY;
+	}
+	/* Looked up at charge time, the slot of a client that was idle may have been handed over */
+	conn->client = aesd_rl_client_lookup(conn->addr);
+	delay = aesd_rl_charge(conn->client, 1, conn->packet_len);
+	if( delay < 0 ) {
+		aesd_log(AESD_LOG_RATE_SHED, conn->packet_len);
+		return AESD_CONN_DROP;
+	}
+	if( delay > 0 ) {
+		*delay_ns = delay;
+		return AESD_CONN_PARK;
+	}
+	return AESD_CONN_COMMIT;
+}
+
+/* Commit stage: replicas only take writes from the primary, clients still get the replicated data back */
+void conn_commit( struct aesd_conn *conn ) {
+	struct aesd_stream *stream = conn->target;
+	const char *name;
+	size_t name_len, payload;
+
+	if( aesd_repl_is_replica() ) {
+		aesd_log(AESD_LOG_READ_ONLY, conn->packet_len);
+	} else if( stream != NULL ) {
+		parse_stream_packet(conn->packet, conn->packet_len, &name, &name_len, &payload);
+		commit_packet(stream->storage, conn->packet + payload, conn->packet_len - payload);
+		atomic_fetch_add(&stream->packets, 1);
+	} else {
+		commit_packet(storage, conn->packet, conn->packet_len);
+	}
+}
+
+/* Reply stage: send contents back to the client, -1 if the reply was cut short */
+int conn_reply( struct aesd_conn *conn, char *buffer, size_t buffer_size ) {
+	static const char unavailable[] = "ERROR stream unavailable\n";
+	static const char invalid_seek[] = "ERROR invalid seek\n";
+	struct aesd_storage *st = storage;
+	struct aesd_stream *stream = conn->target;
+	const char *name;
+	size_t name_len, payload;
+	uint64_t from = 0;
+	int rc;
+
+	if( parse_stream_packet(conn->packet, conn->packet_len, &name, &name_len, &payload) ) {
+		if( stream == NULL ) {
+			rc = send_all(conn->sockfd, unavailable, strlen(unavailable));
+			if( rc < 0 ) {
+				aesd_log(AESD_LOG_SEND_ERROR, errno);
+			}
+			return rc;
+		}
+		st = stream->storage;
+	} else if( is_stats_command(conn->packet, conn->packet_len) ) {
+		return send_stats(conn->sockfd);
+	}
+	if( is_search_command(conn->packet, conn->packet_len) ) {
+		return send_search(conn->sockfd, conn->packet + strlen(SEARCH_COMMAND),
+			conn->packet_len - strlen(SEARCH_COMMAND), buffer, buffer_size);
+	}
+	if( is_since_command(conn->packet, conn->packet_len) ) {
+		/* The packet is newline terminated, so strtoll() stops before the end */
+		time_t since = strtoll(conn->packet + strlen(SINCE_COMMAND), NULL, 10);
+		from = aesd_timeindex_lookup(since);
+	}
+	if( is_seekto_command(conn->packet, conn->packet_len) ) {
+		unsigned int write_cmd, write_cmd_offset;
+
+		/* The engine resolves the record, the driver through its ioctl */
+		if( sscanf(conn->packet + strlen(SEEKTO_COMMAND), "%u,%u", &write_cmd, &write_cmd_offset) != 2 ||
+				aesd_storage_seek_record(st, write_cmd, write_cmd_offset, &from) < 0 ) {
+			rc = send_all(conn->sockfd, invalid_seek, strlen(invalid_seek));
+			if( rc < 0 ) {
+				aesd_log(AESD_LOG_SEND_ERROR, errno);
+			}
+			return rc;
+		}
+	}
+	aesd_sockopt_cork(conn->sockfd, &socket_profile, true);
+	rc = send_stored_data(conn->sockfd, st, from, buffer, buffer_size);
+	if( rc < 0 ) {
+		return rc;	/* Uncorking a socket we are giving up on would only flush into a full buffer */
+	}
+	aesd_sockopt_cork(conn->sockfd, &socket_profile, false);
+	return 0;
+}
+
+/* Connection boundaries for the traffic capture */
+void conn_open( struct aesd_conn *conn ) {
+	aesd_capture_event(AESD_CAPTURE_OPEN, conn->id, 0);
+}
+
+void conn_close( struct aesd_conn *conn ) {
+	aesd_capture_event(AESD_CAPTURE_CLOSE, conn->id, 0);
+}
+
 void *timestamp_thread_func() {
 	struct timespec next_timestamp;
 	clock_gettime(CLOCK_REALTIME, &next_timestamp); /* Get the current timestamp */
@@ -192,20 +574,10 @@ void *timestamp_thread_func() {
 		/*Format time stamp  string  */
 		strftime(formatted_timestamp, sizeof(formatted_timestamp), "timestamp:%A, %d-%b-%Y %H:%M:%S %Z\n", time_struct);
 
-		/*Synchronize file access with the mutex */
-		pthread_mutex_lock(&file_mutex);
-
-		/*Append timestamp to the log file */
-		FILE *log_file = fopen(FILE_PATH, "a");
-		if( log_file ){
-			fputs(formatted_timestamp, log_file); /* Write the formatted timestamp */
-			fflush(log_file);	/* Force write to disk */
-			fclose(log_file);
-		} else {
-			syslog(LOG_ERR, "Unable to open log file for writing timestamp: %s", strerror(errno));
+		/*Append timestamp to storage, the engine serializes it with client packets */
+		if( aesd_storage_append(storage, formatted_timestamp, strlen(formatted_timestamp)) < 0 ) {
+			syslog(LOG_ERR, "Unable to write timestamp: %s", strerror(errno));
 		}
-		/*Unlock the mutex once file operations are complete */
-		pthread_mutex_unlock(&file_mutex);
 	}
 
 	return NULL;
@@ -247,24 +619,384 @@ void deamon_mode_run() {
 	openlog(NULL, LOG_CONS|LOG_PID|LOG_NDELAY, LOG_DAEMON);
 }
 
+void usage( const char *progname ) {
+	fprintf(stderr,
+		"Usage: %s [-d] [options]\n"
+		"  -d                     run as a daemon\n"
+		"  -p, --port PORT        client port (default %d)\n"
+		"  --client-pps N         packets per second allowed per client address\n"
+		"  --client-bps N         bytes per second allowed per client address\n"
+		"  --global-pps N         packets per second allowed for all clients\n"
+		"  --global-bps N         bytes per second allowed for all clients\n"
+		"  --rate-burst-ms N      burst tolerance in milliseconds of rate (default %d)\n"
+		"  --rate-policy P        'delay' or 'shed' over-limit packets (default delay)\n"
+		"  --rate-max-delay-ms N  shed packets that would wait longer than this (default %d)\n"
+		"  --log-rate N           syslog messages per second per message type, 0 = unlimited (default %d)\n"
+		"  --backlog N            listen() backlog (default %d)\n"
+		"  --defer-accept SECS    TCP_DEFER_ACCEPT, only accept connections once data arrived\n"
+		"  --fastopen QLEN        TCP_FASTOPEN queue length\n"
+		"  --nodelay              set TCP_NODELAY on client sockets\n"
+		"  --cork                 cork replies with TCP_CORK so they leave in full segments\n"
+		"  --busy-poll USEC       SO_BUSY_POLL on client sockets\n"
+		"  -s, --storage ENGINE   storage engine (default %s), one of: ",
+		progname, DEFAULT_PORT, AESD_RL_DEFAULT_BURST_MS, AESD_RL_DEFAULT_MAX_DELAY_MS, AESD_LOG_DEFAULT_RATE,
+		AESD_DEFAULT_BACKLOG, DEFAULT_STORAGE_ENGINE);
+	aesd_storage_list(stderr);
+	fprintf(stderr, "\n"
+		"  --data-path PATH       file or device used by the file, framed and chardev engines\n"
+		"  --mem-max-records N    records kept by the mem engine, at most %d (default %d)\n"
+		"  --mem-max-bytes N      bytes kept by the mem engine, 0 = no byte limit (default %d)\n"
+		"  --repl-listen PORT     act as replication primary, accepting replicas on PORT\n"
+		"  --replica-of HOST:PORT act as read-only replica of the primary at HOST:PORT\n"
+		"  --repl-backlog-records N records kept for replica catch-up (default %d)\n"
+		"  --repl-backlog-bytes N bytes kept for replica catch-up (default %d)\n"
+		"  --shm NAME             accept packets from local producers on shared memory segment NAME\n"
+		"  --shm-slots N          packets the shared memory ring holds (default %d)\n"
+		"  --shm-slot-size N      largest packet accepted over shared memory (default %d)\n"
+		"  --udp-port PORT        accept newline terminated datagrams on UDP PORT, without replies\n"
+		"  --udp-shards N         UDP sockets sharing the port with SO_REUSEPORT (default %d)\n"
+		"  --udp-batch N          datagrams received per recvmmsg() call (default %d)\n"
+		"  --udp-max-size N       largest datagram accepted (default %d)\n"
+		"  --recv-threads N       threads receiving and framing packets (default %d)\n"
+		"  --commit-threads N     threads appending packets to storage (default %d)\n"
+		"  --reply-threads N      threads sending replies (default %d)\n"
+		"  --reply-timeout-ms N   drop clients that take no reply data for N ms (default %d)\n"
+		"  --queue-depth N        capacity of the commit and reply queues (default %d)\n"
+		"  --io-buffer-size N     pooled receive and reply buffer size (default %d)\n"
+		"  --max-packet-size N    drop connections sending a longer packet (default %d)\n"
+		"  --stream-storage ENGINE storage engine of the " AESD_STREAM_PREFIX "NAME: streams (default %s)\n"
+		"  --max-streams N        streams clients may create, 0 disables streams (default %d)\n"
+		"  --capture FILE         record connection and packet timings to FILE for aesdreplay\n"
+		"  --no-index             do not maintain the token index, disables " SEARCH_COMMAND "\n"
+		"  --keep-data            keep the data file and its time index on exit, and reuse them on start\n",
+		AESD_CIRCULAR_BUFFER_MAX_CAPACITY, AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED,
+		AESD_MEMSTORE_DEFAULT_MAX_BYTES, AESD_REPL_DEFAULT_BACKLOG_RECORDS,
+		AESD_REPL_DEFAULT_BACKLOG_BYTES, AESD_SHM_DEFAULT_SLOTS, AESD_SHM_DEFAULT_SLOT_SIZE,
+		AESD_UDP_DEFAULT_SHARDS, AESD_UDP_DEFAULT_BATCH, AESD_UDP_DEFAULT_MAX_SIZE,
+		AESD_PIPELINE_DEFAULT_RECV_THREADS, AESD_PIPELINE_DEFAULT_COMMIT_THREADS,
+		AESD_PIPELINE_DEFAULT_REPLY_THREADS, AESD_PIPELINE_DEFAULT_REPLY_TIMEOUT_MS, AESD_PIPELINE_DEFAULT_QUEUE_DEPTH,
+		AESD_PIPELINE_DEFAULT_BUFFER_SIZE, AESD_PIPELINE_DEFAULT_MAX_PACKET, AESD_STREAM_DEFAULT_ENGINE, AESD_STREAM_DEFAULT_MAX);
+}
+
+int parse_options( int argc, char **argv, int *daemon_mode ) {
+	enum {
+		OPT_CLIENT_PPS = 256,
+		OPT_CLIENT_BPS,
+		OPT_GLOBAL_PPS,
+		OPT_GLOBAL_BPS,
+		OPT_RATE_BURST,
+		OPT_RATE_POLICY,
+		OPT_RATE_MAX_DELAY,
+		OPT_LOG_RATE,
+		OPT_BACKLOG,
+		OPT_DEFER_ACCEPT,
+		OPT_FASTOPEN,
+		OPT_NODELAY,
+		OPT_CORK,
+		OPT_BUSY_POLL,
+		OPT_DATA_PATH,
+		OPT_MEM_MAX_RECORDS,
+		OPT_MEM_MAX_BYTES,
+		OPT_REPL_LISTEN,
+		OPT_REPLICA_OF,
+		OPT_REPL_BACKLOG_RECORDS,
+		OPT_REPL_BACKLOG_BYTES,
+		OPT_SHM,
+		OPT_SHM_SLOTS,
+		OPT_SHM_SLOT_SIZE,
+		OPT_UDP_PORT,
+		OPT_UDP_SHARDS,
+		OPT_UDP_BATCH,
+		OPT_UDP_MAX_SIZE,
+		OPT_RECV_THREADS,
+		OPT_COMMIT_THREADS,
+		OPT_REPLY_THREADS,
+		OPT_REPLY_TIMEOUT_MS,
+		OPT_QUEUE_DEPTH,
+		OPT_IO_BUFFER_SIZE,
+		OPT_MAX_PACKET_SIZE,
+		OPT_STREAM_STORAGE,
+		OPT_MAX_STREAMS,
+		OPT_CAPTURE,
+		OPT_NO_INDEX,
+		OPT_KEEP_DATA,
+	};
+	static const struct option long_options[] = {
+		{ "client-pps", required_argument, NULL, OPT_CLIENT_PPS },
+		{ "client-bps", required_argument, NULL, OPT_CLIENT_BPS },
+		{ "global-pps", required_argument, NULL, OPT_GLOBAL_PPS },
+		{ "global-bps", required_argument, NULL, OPT_GLOBAL_BPS },
+		{ "rate-burst-ms", required_argument, NULL, OPT_RATE_BURST },
+		{ "rate-policy", required_argument, NULL, OPT_RATE_POLICY },
+		{ "rate-max-delay-ms", required_argument, NULL, OPT_RATE_MAX_DELAY },
+		{ "log-rate", required_argument, NULL, OPT_LOG_RATE },
+		{ "backlog", required_argument, NULL, OPT_BACKLOG },
+		{ "defer-accept", required_argument, NULL, OPT_DEFER_ACCEPT },
+		{ "fastopen", required_argument, NULL, OPT_FASTOPEN },
+		{ "nodelay", no_argument, NULL, OPT_NODELAY },
+		{ "cork", no_argument, NULL, OPT_CORK },
+		{ "busy-poll", required_argument, NULL, OPT_BUSY_POLL },
+		{ "storage", required_argument, NULL, 's' },
+		{ "data-path", required_argument, NULL, OPT_DATA_PATH },
+		{ "mem-max-records", required_argument, NULL, OPT_MEM_MAX_RECORDS },
+		{ "mem-max-bytes", required_argument, NULL, OPT_MEM_MAX_BYTES },
+		{ "port", required_argument, NULL, 'p' },
+		{ "repl-listen", required_argument, NULL, OPT_REPL_LISTEN },
+		{ "replica-of", required_argument, NULL, OPT_REPLICA_OF },
+		{ "repl-backlog-records", required_argument, NULL, OPT_REPL_BACKLOG_RECORDS },
+		{ "repl-backlog-bytes", required_argument, NULL, OPT_REPL_BACKLOG_BYTES },
+		{ "shm", required_argument, NULL, OPT_SHM },
+		{ "shm-slots", required_argument, NULL, OPT_SHM_SLOTS },
+		{ "shm-slot-size", required_argument, NULL, OPT_SHM_SLOT_SIZE },
+		{ "udp-port", required_argument, NULL, OPT_UDP_PORT },
+		{ "udp-shards", required_argument, NULL, OPT_UDP_SHARDS },
+		{ "udp-batch", required_argument, NULL, OPT_UDP_BATCH },
+		{ "udp-max-size", required_argument, NULL, OPT_UDP_MAX_SIZE },
+		{ "recv-threads", required_argument, NULL, OPT_RECV_THREADS },
+		{ "commit-threads", required_argument, NULL, OPT_COMMIT_THREADS },
+		{ "reply-threads", required_argument, NULL, OPT_REPLY_THREADS },
+		{ "reply-timeout-ms", required_argument, NULL, OPT_REPLY_TIMEOUT_MS },
+		{ "queue-depth", required_argument, NULL, OPT_QUEUE_DEPTH },
+		{ "io-buffer-size", required_argument, NULL, OPT_IO_BUFFER_SIZE },
+		{ "max-packet-size", required_argument, NULL, OPT_MAX_PACKET_SIZE },
+		{ "stream-storage", required_argument, NULL, OPT_STREAM_STORAGE },
+		{ "max-streams", required_argument, NULL, OPT_MAX_STREAMS },
+		{ "capture", required_argument, NULL, OPT_CAPTURE },
+		{ "no-index", no_argument, NULL, OPT_NO_INDEX },
+		{ "keep-data", no_argument, NULL, OPT_KEEP_DATA },
+		{ NULL, 0, NULL, 0 },
+	};
+	char *colon;
+	int opt;
+
+	while( (opt = getopt_long(argc, argv, "dp:s:", long_options, NULL)) != -1 ) {
+		switch( opt ) {
+		case 'd':
+			*daemon_mode = 1;
+			break;
+		case OPT_CLIENT_PPS:
+			rl_config.client_pps = strtoull(optarg, NULL, 0);
+			break;
+		case OPT_CLIENT_BPS:
+			rl_config.client_bps = strtoull(optarg, NULL, 0);
+			break;
+		case OPT_GLOBAL_PPS:
+			rl_config.global_pps = strtoull(optarg, NULL, 0);
+			break;
+		case OPT_GLOBAL_BPS:
+			rl_config.global_bps = strtoull(optarg, NULL, 0);
+			break;
+		case OPT_RATE_BURST:
+			rl_config.burst_ms = strtoul(optarg, NULL, 0);
+			break;
+		case OPT_RATE_POLICY:
+			if( strcmp(optarg, "delay") == 0 ) {
+				rl_config.policy = AESD_RL_DELAY;
+			} else if( strcmp(optarg, "shed") == 0 ) {
+				rl_config.policy = AESD_RL_SHED;
+			} else {
+				usage(argv[0]);
+				return -1;
+			}
+			break;
+		case OPT_RATE_MAX_DELAY:
+			rl_config.max_delay_ms = strtoul(optarg, NULL, 0);
+			break;
+		case OPT_LOG_RATE:
+			log_rate = strtoul(optarg, NULL, 0);
+			break;
+		case OPT_BACKLOG:
+			socket_profile.backlog = atoi(optarg);
+			break;
+		case OPT_DEFER_ACCEPT:
+			socket_profile.defer_accept = atoi(optarg);
+			break;
+		case OPT_FASTOPEN:
+			socket_profile.fastopen = atoi(optarg);
+			break;
+		case OPT_NODELAY:
+			socket_profile.nodelay = true;
+			break;
+		case OPT_CORK:
+			socket_profile.cork = true;
+			break;
+		case OPT_BUSY_POLL:
+			socket_profile.busy_poll = atoi(optarg);
+			break;
+		case 's':
+			storage_engine = optarg;
+			break;
+		case OPT_DATA_PATH:
+			storage_params.path = optarg;
+			break;
+		case OPT_MEM_MAX_RECORDS:
+			storage_params.max_records = strtoul(optarg, NULL, 0);
+			break;
+		case OPT_MEM_MAX_BYTES:
+			storage_params.max_bytes = strtoul(optarg, NULL, 0);
+			break;
+		case 'p':
+			server_port = atoi(optarg);
+			break;
+		case OPT_REPL_LISTEN:
+			repl_config.listen_port = atoi(optarg);
+			break;
+		case OPT_REPLICA_OF:
+			colon = strrchr(optarg, ':');
+			if( colon == NULL ) {
+				usage(argv[0]);
+				return -1;
+			}
+			*colon = '\0';
+			repl_config.primary_host = optarg;
+			repl_config.primary_port = atoi(colon + 1);
+			break;
+		case OPT_REPL_BACKLOG_RECORDS:
+			repl_config.backlog_records = strtoul(optarg, NULL, 0);
+			break;
+		case OPT_REPL_BACKLOG_BYTES:
+			repl_config.backlog_bytes = strtoul(optarg, NULL, 0);
+			break;
+		case OPT_SHM:
+			shm_name = optarg;
+			break;
+		case OPT_SHM_SLOTS:
+			shm_slots = strtoul(optarg, NULL, 0);
+			break;
+		case OPT_SHM_SLOT_SIZE:
+			shm_slot_size = strtoul(optarg, NULL, 0);
+			break;
+		case OPT_UDP_PORT:
+			udp_config.port = atoi(optarg);
+			break;
+		case OPT_UDP_SHARDS:
+			udp_config.shards = atoi(optarg);
+			break;
+		case OPT_UDP_BATCH:
+			udp_config.batch = atoi(optarg);
+			break;
+		case OPT_UDP_MAX_SIZE:
+			udp_config.max_size = strtoul(optarg, NULL, 0);
+			break;
+		case OPT_RECV_THREADS:
+			pipeline_config.recv_threads = atoi(optarg);
+			break;
+		case OPT_COMMIT_THREADS:
+			pipeline_config.commit_threads = atoi(optarg);
+			break;
+		case OPT_REPLY_THREADS:
+			pipeline_config.reply_threads = atoi(optarg);
+			break;
+		case OPT_REPLY_TIMEOUT_MS:
+			pipeline_config.reply_timeout_ms = atoi(optarg);
+			break;
+		case OPT_QUEUE_DEPTH:
+			pipeline_config.queue_depth = strtoul(optarg, NULL, 0);
+			break;
+		case OPT_IO_BUFFER_SIZE:
+			pipeline_config.buffer_size = strtoul(optarg, NULL, 0);
+			break;
+		case OPT_MAX_PACKET_SIZE:
+			pipeline_config.max_packet_size = strtoul(optarg, NULL, 0);
+			break;
+		case OPT_STREAM_STORAGE:
+			stream_engine = optarg;
+			break;
+		case OPT_MAX_STREAMS:
+			max_streams = strtoul(optarg, NULL, 0);
+			break;
+		case OPT_CAPTURE:
+			capture_path = optarg;
+			break;
+		case OPT_NO_INDEX:
+			index_enabled = false;
+			break;
+		case OPT_KEEP_DATA:
+			storage_params.remove_on_close = false;
+			break;
+		default:
+			usage(argv[0]);
+			return -1;
+		}
+	}
+	return 0;
+}
+
 int main( int argc, char **argv)
 {
 	struct sockaddr_in server_addr, client_addr;
 	socklen_t client_addr_size;
 	int daemon_mode = 0;
+	const struct aesd_storage_ops *storage_ops;
 
 	/* Open syslog */
 	openlog("aesdsocket", LOG_PID|LOG_CONS, LOG_USER);
 	syslog(LOG_INFO, "Starting the aesdsocket program ");
 
-	/* Check the daemon mode */
-	if ( argc > 1 && strcmp(argv[1], "-d") == 0) {
-		daemon_mode = 1;
+	/* Check the daemon mode and tuning options */
+	if( parse_options(argc, argv, &daemon_mode) < 0 ) {
+		return -1;
+	}
+
+	if( aesd_rl_init(&rl_config) < 0 ) {
+		syslog(LOG_ERR, "Failed to allocate rate limit table");
+		return -1;
+	}
+
+	if( capture_path != NULL && aesd_capture_start(capture_path) < 0 ) {
+		syslog(LOG_ERR, "Failed to open capture file %s: %s", capture_path, strerror(errno));
+		return -1;
+	}
+
+	/* Open the storage engine before daemonizing so relative paths still resolve */
+	storage_ops = aesd_storage_find(storage_engine);
+	if( storage_ops == NULL ) {
+		fprintf(stderr, "Unknown storage engine '%s'\n", storage_engine);
+		usage(argv[0]);
+		return -1;
+	}
+	storage = aesd_storage_open(storage_ops, &storage_params);
+	if( storage == NULL ) {
+		syslog(LOG_ERR, "Failed to open %s storage: %s", storage_engine, strerror(errno));
+		return -1;
+	}
+	syslog(LOG_INFO, "Using %s storage", storage_engine);
+
+	/* The char device does not report offsets, so its records cannot be indexed */
+	if( index_enabled && storage->ops->size(storage) != UINT64_MAX && aesd_index_init(storage) < 0 ) {
+		syslog(LOG_ERR, "Failed to set up the search index: %s", strerror(errno));
+		aesd_storage_close(storage);
+		return -1;
+	}
+
+	/* A removed data file takes its history with it, so only a kept one gets a sidecar */
+	if( kept_data_path() != NULL &&
+			asprintf(&timeindex_sidecar, "%s" AESD_TIMEINDEX_SUFFIX, kept_data_path()) < 0 ) {
+		timeindex_sidecar = NULL;
+	}
+	if( storage->ops->size(storage) != UINT64_MAX && aesd_timeindex_init(storage, timeindex_sidecar) < 0 ) {
+		syslog(LOG_ERR, "Failed to set up the time index: %s", strerror(errno));
+		aesd_storage_close(storage);
+		return -1;
 	}
 
-	/* Register the Signal Handlers */
-	signal( SIGINT, signal_handler);
-	signal(SIGTERM, signal_handler);
+	/* Streams share the engine settings, file backed ones live next to the main data file */
+	if( max_streams > 0 ) {
+		const struct aesd_storage_ops *stream_ops = aesd_storage_find(stream_engine);
+		if( stream_ops == NULL || aesd_streams_init(stream_ops, &storage_params, max_streams) < 0 ) {
+			fprintf(stderr, "Cannot keep streams in '%s' storage\n", stream_engine);
+			aesd_storage_close(storage);
+			return -1;
+		}
+	}
+
+	/* Register the Signal Handlers without SA_RESTART so accept() returns on a signal */
+	struct sigaction action;
+	memset(&action, 0, sizeof(action));
+	action.sa_handler = signal_handler;
+	sigemptyset(&action.sa_mask);
+	sigaction(SIGINT, &action, NULL);
+	sigaction(SIGTERM, &action, NULL);
 
 	/* Create Socket */
 	server_sockfd = socket(AF_INET, SOCK_STREAM, 0);
@@ -281,11 +1013,11 @@ int main( int argc, char **argv)
 		return -1;
 	}
 
-	/* Bind Socket to Port 9000 */
+	/* Bind Socket to the client port */
 	memset(&server_addr, 0, sizeof(server_addr));
 	server_addr.sin_family = AF_INET;
 	server_addr.sin_addr.s_addr = INADDR_ANY;
-	server_addr.sin_port = htons(PORT);
+	server_addr.sin_port = htons(server_port);
 
 	if( bind(server_sockfd, (struct sockaddr*)&server_addr, sizeof(server_addr)) != 0) {
 		syslog(LOG_ERR, "Failed to bind socket: %s", strerror(errno));
@@ -298,60 +1030,95 @@ int main( int argc, char **argv)
 		deamon_mode_run();
 	}
 
-	#ifndef USE_AESD_CHAR_DEVICE
-	if (pthread_create(&timestamp_thread, NULL, timestamp_thread_func, NULL ) != 0){
-		syslog(LOG_ERR, "Failed to create timestamp thread: %s", strerror(errno));
+	/* Threads do not survive fork(), so start the logger after daemonizing */
+	if( aesd_log_start(log_rate) < 0 ) {
+		syslog(LOG_ERR, "Failed to start logging thread");
 		free_resources();
-		return -1
+		return -1;
+	}
+
+	if( (repl_config.listen_port > 0 || repl_config.primary_host != NULL) &&
+			aesd_repl_start(&repl_config, storage) < 0 ) {
+		syslog(LOG_ERR, "Failed to start replication: %s", strerror(errno));
+		free_resources();
+		return -1;
+	}
+
+	if( shm_name != NULL ) {
+		if( aesd_shm_start(shm_name, shm_slots, shm_slot_size, shm_commit_packet) < 0 ) {
+			syslog(LOG_ERR, "Failed to create shared memory channel %s: %s", shm_name, strerror(errno));
+			free_resources();
+			return -1;
+		}
+	}
+
+	if( udp_config.port > 0 && aesd_udp_start(&udp_config, udp_commit_packet) < 0 ) {
+		syslog(LOG_ERR, "Failed to start UDP listener: %s", strerror(errno));
+		free_resources();
+		return -1;
+	}
+
+	/* Timestamps are only appended by engines that store more than client commands,
+	 * a replica gets the primary's timestamps through replication */
+	if( storage->ops->timestamps && !aesd_repl_is_replica() ) {
+		if (pthread_create(&timestamp_thread, NULL, timestamp_thread_func, NULL ) != 0){
+			syslog(LOG_ERR, "Failed to create timestamp thread: %s", strerror(errno));
+			free_resources();
+			return -1;
+		}
+		timestamp_thread_started = true;
+	}
+
+	if( aesd_pipeline_start(&pipeline_config, &pipeline_ops) < 0 ) {
+		syslog(LOG_ERR, "Failed to start connection stages: %s", strerror(errno));
+		free_resources();
+		return -1;
+	}
+
+	if( aesd_sockopt_listener(server_sockfd, &socket_profile) < 0 ) {
+		free_resources();
+		return -1;
 	}
-	#endif
 
 	/*Listen to incoming connections */
-	if (listen (server_sockfd, BACKLOG) < 0 ) {
+	if (listen (server_sockfd, socket_profile.backlog) < 0 ) {
 		syslog( LOG_ERR, " Failed to listen to socket: %s", strerror(errno));
 		close(server_sockfd);
 		return -1;
 	}
 
-	syslog(LOG_INFO, "Sever listening to port %d", PORT);
+	syslog(LOG_INFO, "Sever listening to port %d", server_port);
 
 	while(app_run)
 	{
 		client_addr_size = sizeof(client_addr);
-		int client_sockfd = accept(server_sockfd, (struct sockaddr*)&client_addr, &client_addr_size);
+		int client_sockfd = accept4(server_sockfd, (struct sockaddr*)&client_addr, &client_addr_size,
+				SOCK_NONBLOCK|SOCK_CLOEXEC);
 		if( client_sockfd < 0 ){
-			syslog(LOG_ERR, "Failed to accept connection: %s", strerror(errno));
+			if( app_run ) {
+				aesd_log(AESD_LOG_ACCEPT_ERROR, errno);
+			}
 			continue;
 		}
 
-		/* Log the accepted connection*/
-		char client_ip[INET_ADDRSTRLEN];
-		inet_ntop(AF_INET, &client_addr.sin_addr, client_ip, INET_ADDRSTRLEN);
-		syslog(LOG_INFO, "Accepted connection from %s", client_ip);
+		/* Log the accepted connection, formatting happens on the logging thread */
+		aesd_log(AESD_LOG_ACCEPTED, client_addr.sin_addr.s_addr);
 
-		/* Allocate memory to thread data */
-		struct thread_node_data *node = malloc( sizeof(struct thread_node_data));
-		if( node == NULL ){
-			syslog(LOG_ERR, "Failed to allocate memory from thread data ");
-			close(client_sockfd);
-			continue;
+		if( aesd_sockopt_client(client_sockfd, &socket_profile) < 0 ) {
+			aesd_log(AESD_LOG_SOCKOPT_ERROR, errno);
 		}
 
-		node->thread_work_completion = false;
-		node->client_sockfd = client_sockfd;
-
-		SLIST_INSERT_HEAD(&thread_list_head, node, conn_node );
-
-		/* Create a new thread to handle the connection */
-		if( pthread_create(&node->thread_id, NULL, process_connection_thread, (void*)node) != 0) {
-			syslog(LOG_ERR, "Failed to create thread: %s", strerror(errno));
+		/* Hand the connection to a receive worker */
+		if( aesd_pipeline_submit(client_sockfd, client_addr.sin_addr.s_addr, NULL) < 0 ) {
+			aesd_log(AESD_LOG_ALLOC_ERROR, sizeof(struct aesd_conn));
 			close(client_sockfd);
-			free(node);
 			continue;
 		}
 	}
-	/*Cleanup (Unreachable due to infinite loop unless something causes exit out the loop like signal handling, break condition
-	or program termination)*/
+	/*Cleanup once a signal has interrupted the accept loop */
+	if( caught_signal ) {
+		syslog(LOG_INFO, "Caught signal %d, exiting", caught_signal);
+	}
 	free_resources();
 
 	return 0;
@@ -0,0 +1,188 @@
+/*
+ * aesdwritebench.c - Partial write accumulation benchmark for the aesd driver
+ *
+ * Writes commands of each size in pieces of each size and times the two ways
+ * the driver has accumulated them until the newline:
+ *
+ *   krealloc  grow one buffer on every piece and memchr() the whole of it for
+ *             the newline, as aesd_write() did.  Growth is modelled on kmalloc
+ *             size classes (powers of two, whole pages above 8 KiB) with a copy
+ *             on every class change, as krealloc() does
+ *   chunks    append to the aesd-partial-write.c chunk list, scan only the new
+ *             piece, then copy the command out once at the newline
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+#include "../aesd-char-driver/aesd-partial-write.h"
+
+#define DEFAULT_MAX_COMMAND	(256 * 1024)
+#define DEFAULT_BYTES		(4 * 1024 * 1024)
+#define KMALLOC_MAX_CACHE	8192
+#define MODEL_PAGE_SIZE		4096
+/* krealloc scans are O(n^2) in the number of pieces, they get fewer repeats */
+#define KREALLOC_BUDGET		(2000LL * 1000 * 1000)
+
+static const size_t piece_sizes[] = { 1, 64, 4096 };
+
+static uint64_t monotonic_ns( void ) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/* What ksize() would report for a kmalloc() of size bytes */
+static size_t kmalloc_class( size_t size ) {
+	size_t class = 8;
+
+	if( size > KMALLOC_MAX_CACHE ) {
+		class = MODEL_PAGE_SIZE;
+	}
+	while( class < size ) {
+		class <<= 1;
+	}
+	return class;
+}
+
+static int run_krealloc( const char *command, size_t size, size_t piece ) {
+	char *buf = NULL;
+	size_t len = 0, capacity = 0, n;
+
+	while( len < size ) {
+		n = size - len < piece ? size - len : piece;
+		if( len + n > capacity ) {
+			char *grown;
+			capacity = kmalloc_class(len + n);
+			grown = malloc(capacity);
+			if( grown == NULL ) {
+				free(buf);
+				return -1;
+			}
+			memcpy(grown, buf, len);
+			free(buf);
+			buf = grown;
+		}
+		memcpy(buf + len, command + len, n);
+		len += n;
+		if( memchr(buf, '\n', len) != NULL ) {
+			break;
+		}
+	}
+	/* The buffer itself became the entry, evicted later */
+	free(buf);
+	return 0;
+}
+
+static int run_chunks( const char *command, size_t size, size_t piece ) {
+	struct aesd_partial_write partial;
+	size_t done = 0, n;
+	char *entry;
+
+	aesd_partial_write_init(&partial);
+	while( done < size ) {
+		n = size - done < piece ? size - done : piece;
+		if( memchr(command + done, '\n', n) != NULL ) {
+			entry = malloc(partial.len + n);
+			if( entry == NULL ) {
+				break;
+			}
+			aesd_partial_write_copy(&partial, entry);
+			memcpy(entry + partial.len, command + done, n);
+			aesd_partial_write_reset(&partial);
+			free(entry);
+			return 0;
+		}
+		if( aesd_partial_write_append(&partial, command + done, n) < 0 ) {
+			break;
+		}
+		done += n;
+	}
+	aesd_partial_write_reset(&partial);
+	return -1;
+}
+
+static void usage( const char *progname ) {
+	fprintf(stderr,
+		"Usage: %s [-m MAX_COMMAND] [-b BYTES]\n"
+		"  -m N   largest command, sizes go from 4096 up by 4x (default %d)\n"
+		"  -b N   bytes written per size and piece size, as whole commands (default %d)\n",
+		progname, DEFAULT_MAX_COMMAND, DEFAULT_BYTES);
+}
+
+int main( int argc, char **argv ) {
+	size_t max_command = DEFAULT_MAX_COMMAND;
+	size_t bytes = DEFAULT_BYTES;
+	size_t size, p;
+	char *command;
+	int opt;
+
+	while( (opt = getopt(argc, argv, "m:b:")) != -1 ) {
+		switch( opt ) {
+		case 'm': max_command = strtoul(optarg, NULL, 0); break;
+		case 'b': bytes = strtoul(optarg, NULL, 0); break;
+		default:
+			usage(argv[0]);
+			return 1;
+		}
+	}
+	if( max_command < 4096 || bytes == 0 ) {
+		usage(argv[0]);
+		return 1;
+	}
+	command = malloc(max_command);
+	if( command == NULL ) {
+		fprintf(stderr, "Out of memory\n");
+		return 1;
+	}
+
+	printf("%10s %6s %8s %16s %16s %9s\n", "command", "piece", "repeats", "krealloc us/cmd", "chunks us/cmd",
+		"speedup");
+	for( size = 4096; size <= max_command; size *= 4 ) {
+		memset(command, 'a', size - 1);
+		command[size - 1] = '\n';
+		for( p = 0; p < sizeof(piece_sizes) / sizeof(piece_sizes[0]); p++ ) {
+			size_t piece = piece_sizes[p];
+			long long pieces = (size + piece - 1) / piece;
+			long repeats = bytes / size ? bytes / size : 1;
+			long krealloc_repeats = KREALLOC_BUDGET / (pieces * (long long)size / 2 + 1);
+			uint64_t start, krealloc_ns, chunks_ns;
+			double krealloc_us, chunks_us;
+			long i;
+
+			if( krealloc_repeats > repeats ) {
+				krealloc_repeats = repeats;
+			} else if( krealloc_repeats < 1 ) {
+				krealloc_repeats = 1;
+			}
+
+			start = monotonic_ns();
+			for( i = 0; i < krealloc_repeats; i++ ) {
+				if( run_krealloc(command, size, piece) < 0 ) {
+					fprintf(stderr, "Out of memory\n");
+					return 1;
+				}
+			}
+			krealloc_ns = monotonic_ns() - start;
+
+			start = monotonic_ns();
+			for( i = 0; i < repeats; i++ ) {
+				if( run_chunks(command, size, piece) < 0 ) {
+					fprintf(stderr, "Out of memory\n");
+					return 1;
+				}
+			}
+			chunks_ns = monotonic_ns() - start;
+
+			krealloc_us = krealloc_ns / 1000.0 / krealloc_repeats;
+			chunks_us = chunks_ns / 1000.0 / repeats;
+			printf("%10zu %6zu %8ld %16.1f %16.1f %8.1fx\n", size, piece, repeats, krealloc_us, chunks_us,
+				krealloc_us / chunks_us);
+		}
+	}
+	free(command);
+	return 0;
+}
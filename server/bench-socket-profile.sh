@@ -0,0 +1,32 @@
+#!/bin/bash
+# Compare connection setup latency of aesdsocket socket option profiles.
+# Starts the server once per profile with the file storage engine and runs
+# aesdbench against it. Usage: ./bench-socket-profile.sh [aesdbench options]
+
+cd `dirname $0`
+BENCH_OPTS=${@:--n 2000 -c 8}
+
+run_profile() {
+	local name=$1
+	shift
+	rm -f /var/tmp/aesdsocketdata
+	./aesdsocket -s file "$@" &
+	local pid=$!
+	sleep 0.5
+	echo "=== ${name}: aesdsocket $*"
+	if [ "$name" = "fastopen" ]; then
+		./aesdbench -F ${BENCH_OPTS}
+	else
+		./aesdbench ${BENCH_OPTS}
+	fi
+	kill -TERM $pid
+	wait $pid
+}
+
+run_profile baseline
+run_profile nodelay --nodelay
+run_profile cork --nodelay --cork
+run_profile defer-accept --defer-accept 1
+run_profile fastopen --fastopen 256
+run_profile busy-poll --busy-poll 50
+run_profile all --nodelay --cork --defer-accept 1 --fastopen 256 --busy-poll 50